@@ -753,7 +753,7 @@ CREATE TABLE IF NOT EXISTS `mapreg` (
   `index` int(11) unsigned NOT NULL default '0',
   `value` varchar(255) NOT NULL,
   PRIMARY KEY (`varname`,`index`)
-) ENGINE=MyISAM;
+) ENGINE=InnoDB;
 
 --
 -- Table `market` for market shop persistency
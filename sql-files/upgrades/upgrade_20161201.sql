@@ -0,0 +1 @@
+ALTER TABLE `mapreg` ENGINE = InnoDB;
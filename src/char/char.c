@@ -1997,6 +1997,9 @@ int char_loadName(uint32 char_id, char* name){
 int char_search_mapserver(unsigned short map, uint32 ip, uint16 port){
 	int i, j;
 
+	if( ip == (uint32)-1 && port == (uint16)-1 && (i = chmapif_map_owner(map)) >= 0 )
+		return i; // moved at runtime
+
 	for(i = 0; i < ARRAYLENGTH(map_server); i++)
 	{
 		if (map_server[i].fd > 0
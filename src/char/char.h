@@ -173,6 +173,9 @@ struct mmo_map_server {
 	uint16 port;
 	int users;
 	unsigned short map[MAX_MAP_PER_SERVER];
+	int lag_avg, lag_max; // main loop lag in ms, from the last load report
+	unsigned short load_map[MAP_LOAD_TOP]; // busiest maps of the last load report
+	int load_users[MAP_LOAD_TOP];
 };
 extern struct mmo_map_server map_server[MAX_MAP_SERVERS];
 
@@ -6,8 +6,10 @@
 #include "../common/timer.h"
 #include "../common/ers.h"
 #include "../common/cli.h"
+#include "../common/mapindex.h"
 #include "char.h"
 #include "char_cnslif.h"
+#include "char_mapif.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -84,12 +86,37 @@ int cnslif_parse(const char* buf)
 	else if( strcmpi("ers_report", type) == 0 ){
 		ers_report();
 	}
+	else if( strcmpi("mapload", type) == 0 ){
+		chmapif_show_load();
+	}
+	else if( strcmpi("movemap", type) == 0 ){
+		char mapname[MAP_NAME_LENGTH_EXT];
+		int id;
+
+		if( n != 2 || sscanf(command, "%15s %d", mapname, &id) < 2 )
+			ShowError("Usage: movemap:<map name> <map-server id>\n");
+		else if( !chmapif_movemap(mapindex_name2id(mapname), id) )
+			ShowError("movemap: Map-server %d is not connected or does not have map '%s' loaded.\n", id, mapname);
+		else
+			ShowStatus("Map '%s' moved to map-server %d.\n", mapname, id);
+	}
+	else if( strcmpi("linkstats", type) == 0 ){
+		if( n == 2 && strcmpi("on", command) == 0 )
+			socket_link_stats(true);
+		else if( n == 2 && strcmpi("off", command) == 0 )
+			socket_link_stats(false);
+		else
+			socket_link_report(20);
+	}
 	else if( strcmpi("help", type) == 0 ){
 		ShowInfo("Available commands:\n");
 		ShowInfo("\t server:shutdown => Stops the server.\n");
 		ShowInfo("\t server:alive => Checks if the server is running.\n");
 		ShowInfo("\t server:reloadconf => Reload config file: \"%s\"\n", CHAR_CONF_NAME);
 		ShowInfo("\t ers_report => Displays database usage.\n");
+		ShowInfo("\t linkstats:<on|off|show> => Controls and shows the server link statistics.\n");
+		ShowInfo("\t mapload => Shows the load of the map-servers.\n");
+		ShowInfo("\t movemap:<map name> <map-server id> => Moves a map to another map-server that has it loaded too.\n");
 	}
 
 	return 0;
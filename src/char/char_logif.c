@@ -291,6 +291,87 @@ int chlogif_parse_ackconnect(int fd, struct char_session_data* sd){
 		chlogif_on_ready();
 	}
 	RFIFOSKIP(fd,3);
+	if( !chlogif_shm_request(fd, 0) && socket_frame_enabled() )
+		chlogif_frame_request(fd, 0);
+	return 1;
+}
+
+/**
+ * HA 0x2744
+ * <cmd>.W <stage>.B <key>.L <name>.32B
+ * Offers the login-server to move the link to shared memory, when it runs on this host (interserver_shm).
+ * stage 0: offer, stage 1: the char-server sends through the shared memory from now on
+ * @return true if the offer was sent
+ */
+bool chlogif_shm_request(int fd, uint8 stage) {
+	char name[SHM_NAME_LENGTH];
+	uint32 key = 0;
+
+	memset(name, 0, sizeof(name));
+	if( stage == 0 && (!socket_shm_local(fd) || !socket_shm_create(fd, name, &key)) )
+		return false;
+
+	WFIFOHEAD(fd,39);
+	WFIFOW(fd,0) = 0x2744;
+	WFIFOB(fd,2) = stage;
+	WFIFOL(fd,3) = key;
+	memcpy(WFIFOP(fd,7), name, SHM_NAME_LENGTH);
+	WFIFOSET(fd,39);
+	return true;
+}
+
+/**
+ * AH 0x2745
+ * <cmd>.W <result>.B
+ * Answer of the login-server to the shared memory offer, 0 accepted, 1 refused.
+ * When accepted, the login-server sends through the shared memory from now on.
+ * Otherwise fall back to frames.
+ */
+int chlogif_parse_shmack(int fd) {
+	uint8 result;
+
+	if (RFIFOREST(fd) < 3)
+		return 0;
+	result = RFIFOB(fd,2);
+	RFIFOSKIP(fd,3);
+	if( result == 0 ) {
+		socket_shm_recv(fd);
+		chlogif_shm_request(fd, 1);
+		socket_shm_send(fd);
+		ShowInfo("Link to the login-server uses shared memory now.\n");
+	} else {
+		socket_shm_close(fd);
+		if( socket_frame_enabled() )
+			chlogif_frame_request(fd, 0);
+	}
+	return 1;
+}
+
+/**
+ * HA 0x2746
+ * <cmd>.W <stage>.B
+ * Asks the login-server to switch the link to frames (interserver_framing).
+ * stage 0: request, stage 1: the char-server sends frames from now on
+ */
+void chlogif_frame_request(int fd, uint8 stage) {
+	WFIFOHEAD(fd,3);
+	WFIFOW(fd,0) = 0x2746;
+	WFIFOB(fd,2) = stage;
+	WFIFOSET(fd,3);
+}
+
+/**
+ * AH 0x2747
+ * <cmd>.W
+ * The login-server sends frames from now on, switch both directions.
+ * Everything after this packet in the read fifo is framed already.
+ */
+int chlogif_parse_frameack(int fd) {
+	RFIFOSKIP(fd,2);
+	socket_frame_recv(fd);
+	chlogif_frame_request(fd, 1);
+	socket_frame_send(fd);
+	ShowInfo("Link to the login-server is framed now.\n");
 	return 1;
 }
 
@@ -750,6 +831,8 @@ int chlogif_parse(int fd) {
 			case 0x2734: next = chlogif_parse_askkick(fd,sd); break;
 			case 0x2735: next = chlogif_parse_updip(fd,sd); break;
 			case 0x2743: next = chlogif_parse_vipack(fd); break;
+			case 0x2745: next = chlogif_parse_shmack(fd); break;
+			case 0x2747: next = chlogif_parse_frameack(fd); break;
 			default:
 				ShowError("Unknown packet 0x%04x received from login-server, disconnecting.\n", command);
 				set_eof(fd);
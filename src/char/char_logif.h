@@ -44,6 +44,10 @@ int chlogif_parse_askkick(int fd, struct char_session_data* sd);
 int chlogif_parse_updip(int fd, struct char_session_data* sd);
 
 int chlogif_parse_vipack(int fd);
+bool chlogif_shm_request(int fd, uint8 stage);
+int chlogif_parse_shmack(int fd);
+void chlogif_frame_request(int fd, uint8 stage);
+int chlogif_parse_frameack(int fd);
 int chlogif_reqvipdata(uint32 aid, uint8 flag, int32 timediff, int mapfd);
 int chlogif_req_accinfo(int fd, int u_fd, int u_aid, int u_group, int account_id, int8 type);
 
@@ -12,6 +12,8 @@
 #include "../common/malloc.h"
 #include "../common/showmsg.h"
 #include "../common/strlib.h"
+#include "../common/mapindex.h"
+#include "../common/interpacket.h"
 #include "inter.h"
 #include "char.h"
 #include "char_logif.h"
@@ -19,6 +21,8 @@
 
 #include <stdlib.h>
 
+static DBMap* map_owner_db; // int mapindex -> map-serv id + 1, maps moved at runtime (chmapif_movemap)
+
 /**
  * Packet send to all map-servers, attach to ourself
  * @param buf: packet to send in form of an array buffer
@@ -265,10 +269,159 @@ int chmapif_parse_getmapname(int fd, int id){
 	chmapif_send_misc(fd);
 	chmapif_send_fame_list(fd); //Send fame list.
 	chmapif_send_maps(fd, id, j, mapbuf);
+	chmapif_send_handoffs(); // the map lists override the maps moved at runtime
 
 	return 1;
 }
 
+/**
+ * HZ 0x2b32
+ * <cmd>.W <map index>.W <ip>.L <port>.W
+ * Tells all map-servers which map-server serves a map from now on.
+ * @param mapindex: map moved
+ * @param id: id of map-serv that serves it
+ */
+static void chmapif_send_handoff(unsigned short mapindex, int id){
+	unsigned char buf[10];
+
+	WBUFW(buf,0) = 0x2b32;
+	WBUFW(buf,2) = mapindex;
+	WBUFL(buf,4) = htonl(map_server[id].ip);
+	WBUFW(buf,8) = htons(map_server[id].port);
+	chmapif_sendall(buf, 10);
+}
+
+/**
+ * Sends all the maps moved at runtime to the map-servers again.
+ */
+void chmapif_send_handoffs(void){
+	DBIterator* iter = db_iterator(map_owner_db);
+	DBKey key;
+	DBData* data;
+
+	for( data = iter->first(iter,&key); dbi_exists(iter); data = iter->next(iter,&key) )
+		chmapif_send_handoff((unsigned short)key.i, db_data2i(data) - 1);
+	dbi_destroy(iter);
+}
+
+/**
+ * Whether a map-server has a map loaded.
+ */
+static bool chmapif_has_map(int id, unsigned short mapindex){
+	int i;
+
+	if( map_server[id].fd <= 0 )
+		return false;
+	ARR_FIND(0, ARRAYLENGTH(map_server[id].map), i, map_server[id].map[i] == mapindex);
+	return ( i < ARRAYLENGTH(map_server[id].map) );
+}
+
+/**
+ * Map-server that serves a map moved at runtime.
+ * @return id of map-serv, -1 if the map was not moved
+ */
+int chmapif_map_owner(unsigned short mapindex){
+	return idb_iget(map_owner_db, mapindex) - 1;
+}
+
+/**
+ * Moves a map to another map-server at runtime. That map-server must have it loaded too,
+ * the one that served it so far hands its players over through the change-map-server flow.
+ * @param mapindex: map to move
+ * @param id: id of map-serv to move it to
+ * @return false if the map-server is not connected or does not have the map loaded
+ */
+bool chmapif_movemap(unsigned short mapindex, int id){
+	if( mapindex == 0 || id < 0 || id >= ARRAYLENGTH(map_server) || !chmapif_has_map(id, mapindex) )
+		return false;
+	idb_iput(map_owner_db, mapindex, id + 1);
+	chmapif_send_handoff(mapindex, id);
+	return true;
+}
+
+/**
+ * Gives the maps moved to a map-server that went away to another one that has them loaded.
+ * @param id: id of map-serv
+ */
+static void chmapif_handoff_drop(int id){
+	DBIterator* iter = db_iterator(map_owner_db);
+	DBKey key;
+	DBData* data;
+
+	for( data = iter->first(iter,&key); dbi_exists(iter); data = iter->next(iter,&key) ) {
+		unsigned short mapindex = (unsigned short)key.i;
+		int i;
+
+		if( db_data2i(data) - 1 != id )
+			continue;
+		iter->remove(iter, NULL);
+		ARR_FIND(0, ARRAYLENGTH(map_server), i, i != id && chmapif_has_map(i, mapindex));
+		if( i < ARRAYLENGTH(map_server) ) {
+			ShowStatus("Map '%s' is served by map-server %d again.\n", mapindex_id2name(mapindex), i);
+			chmapif_send_handoff(mapindex, i);
+		}
+	}
+	dbi_destroy(iter);
+}
+
+/**
+ * ZH 0x2b33
+ * <cmd>.W <len>.W <lag avg>.W <lag max>.W <count>.B { <map index>.W <users>.W }*count
+ * Load report of a map-server, sent every 10 seconds.
+ * @param fd: wich fd to parse from
+ * @param id: id of map-serv
+ * @return : 0 not enough data received, 1 success
+ */
+int chmapif_parse_load(int fd, int id){
+	int i, count;
+
+	if (RFIFOREST(fd) < 4 || RFIFOREST(fd) < RFIFOW(fd,2))
+		return 0;
+
+	map_server[id].lag_avg = RFIFOW(fd,4);
+	map_server[id].lag_max = RFIFOW(fd,6);
+	count = min(RFIFOB(fd,8), MAP_LOAD_TOP);
+	memset(map_server[id].load_map, 0, sizeof(map_server[id].load_map));
+	memset(map_server[id].load_users, 0, sizeof(map_server[id].load_users));
+	for( i = 0; i < count && 13+i*4 <= RFIFOW(fd,2); i++ ) {
+		map_server[id].load_map[i] = RFIFOW(fd,9+i*4);
+		map_server[id].load_users[i] = RFIFOW(fd,11+i*4);
+	}
+	RFIFOSKIP(fd,RFIFOW(fd,2));
+	return 1;
+}
+
+/**
+ * Shows the load of the map-servers and the maps moved at runtime on the console.
+ */
+void chmapif_show_load(void){
+	DBIterator* iter;
+	DBKey key;
+	DBData* data;
+	int id;
+
+	for( id = 0; id < ARRAYLENGTH(map_server); id++ ) {
+		char buf[256];
+		int i, maps, len = 0;
+
+		if( map_server[id].fd <= 0 )
+			continue;
+		ARR_FIND(0, ARRAYLENGTH(map_server[id].map), maps, map_server[id].map[maps] == 0);
+		ShowInfo("Map-server %d (%d.%d.%d.%d:%d): %d users, %d maps, lag %dms avg, %dms max\n",
+			id, CONVIP(map_server[id].ip), map_server[id].port, map_server[id].users, maps, map_server[id].lag_avg, map_server[id].lag_max);
+		buf[0] = '\0';
+		for( i = 0; i < MAP_LOAD_TOP && map_server[id].load_map[i]; i++ )
+			len += safesnprintf(buf + len, sizeof(buf) - len, " %s (%d)", mapindex_id2name(map_server[id].load_map[i]), map_server[id].load_users[i]);
+		if( len )
+			ShowInfo("  busiest maps:%s\n", buf);
+	}
+
+	iter = db_iterator(map_owner_db);
+	for( data = iter->first(iter,&key); dbi_exists(iter); data = iter->next(iter,&key) )
+		ShowInfo("Map '%s' moved to map-server %d.\n", mapindex_id2name((unsigned short)key.i), db_data2i(data) - 1);
+	dbi_destroy(iter);
+}
+
 /**
  * Map-serv requesting to send the list of sc_data the player has saved
  * @author [Skotlex]
@@ -1273,6 +1426,72 @@ int chmapif_parse_reqcharunban(int fd){
 	return 1;
 }
 
+/**
+ * Switch of the link to frames, requested by the map-server (interserver_framing).
+ * ZH 0x2b29
+ * <cmd>.W <stage>.B
+ * HZ 0x2b2c
+ * <cmd>.W
+ * stage 0: request, answered when framing is on here too; stage 1: the map-server sends frames from now on
+ */
+int chmapif_parse_frame(int fd){
+	uint8 stage;
+
+	if (RFIFOREST(fd) < 3)
+		return 0;
+	stage = RFIFOB(fd,2);
+	RFIFOSKIP(fd,3);
+
+	if( stage == 0 ) {
+		if( socket_frame_enabled() ) {
+			WFIFOHEAD(fd,2);
+			WFIFOW(fd,0) = 0x2b2c;
+			WFIFOSET(fd,2);
+			socket_frame_send(fd);
+		}
+	} else
+		socket_frame_recv(fd);
+	return 1;
+}
+
+/**
+ * Offer of the map-server to move the link to shared memory (interserver_shm).
+ * ZH 0x2b30
+ * <cmd>.W <stage>.B <key>.L <name>.32B
+ * HZ 0x2b31
+ * <cmd>.W <result>.B
+ * stage 0: offer, answered with result 0 when accepted or 1 when refused;
+ * stage 1: the map-server sends through the shared memory from now on
+ */
+int chmapif_parse_shm(int fd){
+	uint8 stage;
+
+	if (RFIFOREST(fd) < 39)
+		return 0;
+	stage = RFIFOB(fd,2);
+
+	if( stage == 0 ) {
+		char name[SHM_NAME_LENGTH];
+		uint32 key = RFIFOL(fd,3);
+		bool ok;
+
+		safestrncpy(name, RFIFOCP(fd,7), sizeof(name));
+		RFIFOSKIP(fd,39);
+		ok = ( socket_shm_local(fd) && socket_shm_open(fd, name, key) );
+		WFIFOHEAD(fd,3);
+		WFIFOW(fd,0) = 0x2b31;
+		WFIFOB(fd,2) = ok ? 0 : 1;
+		WFIFOSET(fd,3);
+		if( ok )
+			socket_shm_send(fd);
+	} else {
+		RFIFOSKIP(fd,39);
+		socket_shm_recv(fd);
+		ShowInfo("Link to the map-server (connection #%d) uses shared memory now.\n", fd);
+	}
+	return 1;
+}
+
 /**
  * ZA 0x2b2d
  * <cmd>.W <char_id>.L
@@ -1407,6 +1626,29 @@ void chmapif_connectack(int fd, uint8 errCode){
  * @param fd: file descriptor to parse, (link to map-serv)
  * @return 0=invalid server,marked for disconnection,unknow packet; 1=success
  */
+/**
+ * Checks that a parse function consumed as many bytes as chmapif_recv_packet_length gives for its packet.
+ * The table is shared with the replay tool, this keeps it from drifting from the parse functions unnoticed.
+ * @param fd: fd of the map-server
+ * @param cmd: packet that was parsed
+ * @param pos: position of the packet in the read fifo
+ */
+static void chmapif_check_length(int fd, uint16 cmd, size_t pos){
+	size_t used;
+	int len;
+
+	if( !session_isActive(fd) || session[fd]->rdata_pos < pos ) // closed, or the fifo was switched or flushed
+		return;
+	if( cmd < 0x2af8 || cmd >= 0x2af8 + ARRAYLENGTH(chmapif_recv_packet_length) )
+		return;
+	used = session[fd]->rdata_pos - pos;
+	len = chmapif_recv_packet_length[cmd - 0x2af8];
+	if( len == -1 && used >= 4 )
+		len = RBUFW(session[fd]->rdata, pos + 2);
+	if( (size_t)len != used )
+		ShowWarning("chmapif_parse: Packet 0x%04x used %d bytes, but chmapif_recv_packet_length gives %d. Please update src/common/interpacket.h.\n", cmd, (int)used, len);
+}
+
 int chmapif_parse(int fd){
 	int id; //mapserv id
 
@@ -1427,7 +1669,9 @@ int chmapif_parse(int fd){
 
 	while(RFIFOREST(fd) >= 2){
 		int next=1;
-		switch(RFIFOW(fd,0)){
+		uint16 cmd = RFIFOW(fd,0);
+		size_t pos = session[fd]->rdata_pos;
+		switch(cmd){
 			case GEPARD_M2C_BLOCK_REQ: next=chmapif_parse_gepard_block(fd); break;
 			case GEPARD_M2C_UNBLOCK_REQ: next=chmapif_parse_gepard_unblock(fd); break;
 			case 0x2afa: next=chmapif_parse_getmapname(fd,id); break;
@@ -1455,6 +1699,9 @@ int chmapif_parse(int fd){
 			case 0x2b23: next=chmapif_parse_keepalive(fd); break;
 			case 0x2b26: next=chmapif_parse_reqauth(fd,id); break;
 			case 0x2b28: next=chmapif_parse_reqcharban(fd); break; //charban
+			case 0x2b29: next=chmapif_parse_frame(fd); break; //switch to frames
+			case 0x2b30: next=chmapif_parse_shm(fd); break; //switch to shared memory
+			case 0x2b33: next=chmapif_parse_load(fd,id); break; //load report
 			case 0x2b2a: next=chmapif_parse_reqcharunban(fd); break; //charunban
 			//case 0x2b2c: /*free*/; break;
 			case 0x2b2d: next=chmapif_bonus_script_get(fd); break; //Load data
@@ -1472,6 +1719,7 @@ int chmapif_parse(int fd){
 			}
 		} // switch
 		if(next==0) return 0; //avoid processing rest of packet
+		chmapif_check_length(fd, cmd, pos);
 	} // while
 	return 1;
 }
@@ -1510,6 +1758,7 @@ void do_init_chmapif(void){
 	int i;
 	for( i = 0; i < ARRAYLENGTH(map_server); ++i )
 		chmapif_server_init(i);
+	map_owner_db = idb_alloc(DB_OPT_BASE);
 }
 
 /**
@@ -1538,6 +1787,7 @@ void chmapif_server_reset(int id){
 	if( SQL_ERROR == Sql_Query(sql_handle, "DELETE FROM `%s` WHERE `index`='%d'", schema_config.ragsrvinfo_db, map_server[id].fd) )
 		Sql_ShowDebug(sql_handle);
 	online_char_db->foreach(online_char_db,char_db_setoffline,id); //Tag relevant chars as 'in disconnected' server.
+	chmapif_handoff_drop(id);
 	chmapif_server_destroy(id);
 	chmapif_server_init(id);
 }
@@ -1561,6 +1811,7 @@ void do_final_chmapif(void){
 	int i;
 	for( i = 0; i < ARRAYLENGTH(map_server); ++i )
 		chmapif_server_destroy(i);
+	db_destroy(map_owner_db);
 }
 
 
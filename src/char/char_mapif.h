@@ -49,6 +49,13 @@ int chmapif_parse_updmapip(int fd, int id);
 int chmapif_vipack(int mapfd, uint32 aid, uint32 vip_time, uint32 groupid, uint8 flag);
 int chmapif_parse_reqcharban(int fd);
 int chmapif_parse_reqcharunban(int fd);
+int chmapif_parse_frame(int fd);
+int chmapif_parse_shm(int fd);
+int chmapif_parse_load(int fd, int id);
+void chmapif_send_handoffs(void);
+int chmapif_map_owner(unsigned short mapindex);
+bool chmapif_movemap(unsigned short mapindex, int id);
+void chmapif_show_load(void);
 int chmapif_bonus_script_get(int fd);
 int chmapif_bonus_script_save(int fd);
 
@@ -10,6 +10,7 @@
 #include "ers.h"
 #include "socket.h"
 #include "timer.h"
+#include "perf.h"
 #include "thread.h"
 #include "mempool.h"
 #include "sql.h"
@@ -358,18 +359,24 @@ int main (int argc, char **argv)
 #endif
 
 	timer_init();
+	perf_init();
 	socket_init();
 
 	do_init(argc,argv);
 
 	// Main runtime cycle
 	while (runflag != CORE_ST_STOP) { 
-		int next = do_timer(gettick_nocache());
+		int next;
+
+		perf_tick();
+		next = do_timer(gettick_nocache());
+		perf_mark(PERF_TIMER);
 		do_sockets(next);
 	}
 
 	do_final();
 
+	perf_final();
 	timer_final();
 	socket_final();
 	db_final();
@@ -0,0 +1,39 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _INTERPACKET_H_
+#define _INTERPACKET_H_
+
+#include "mmo.h" // NAME_LENGTH
+
+/// Lengths of the packets the char-server receives from the map-server, -1 is variable, 0 unused.
+/// Shared by the char-server and the replay tool (src/tool/replay.c), which stands in for it.
+
+/// 0x2af8-0x2b33, handled by chmapif_parse (char/char_mapif.c), which checks them against its parse functions.
+static const int chmapif_recv_packet_length[] = {
+	60, 0,-1, 0,10, 0, 4,-1,	// 2af8-2aff
+	 0,-1,19, 0, 0,39, 0,10,	// 2b00-2b07
+	 6, 0,10, 0,86, 0,44, 0,	// 2b08-2b0f
+	11,10, 0, 6, 0,-1,14,10,	// 2b10-2b17
+	 2,10, 2, 0,-1, 0, 0, 0,	// 2b18-2b1f
+	 0, 0, 0, 2, 0, 0,20, 0,	// 2b20-2b27
+	10+NAME_LENGTH, 3, 6+NAME_LENGTH, 0, 0, 6,-1, 0,	// 2b28-2b2f
+	39, 0, 0,-1,				// 2b30-2b33
+};
+
+/// 0x3000-, handled by inter_parse_frommap (char/inter.c).
+static const int inter_recv_packet_length[] = {
+	-1,-1, 7,-1, -1,13,36, (2+4+4+4+1+NAME_LENGTH),  0,-1, 0, 0,  0, 0,  0, 0,	// 3000-
+	 6,-1, 0, 0,  0, 0, 0, 0, 10,-1, 0, 0,  0, 0,  0, 0,	// 3010-
+	-1,10,-1,14, 15+NAME_LENGTH,19, 6,-1, 14,14, 6, 0,  0, 0,  0, 0,	// 3020- Party
+	-1, 6,-1,-1, 55,19, 6,-1, 14,-1,-1,-1, 18,19,186,-1,	// 3030-
+	-1, 9, 0, 0,  0, 0, 0, 0,  7, 6,10,10, 10,-1,  0, 0,	// 3040-
+	-1,-1,10,10,  0,-1,12, 0,  0, 0, 0, 0,  0, 0,  0, 0,	// 3050-  Auction System [Zephyrus]
+	 6,-1, 0, 0,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0,  0, 0,	// 3060-  Quest system [Kevin] [Inkfish]
+	-1,10, 6,-1,  0, 0, 0, 0,  0, 0, 0, 0, -1,10,  6,-1,	// 3070-  Mercenary packets [Zephyrus], Elemental packets [pakpil]
+	48,14,-1, 6,  0, 0, 0, 0,  0, 0,13,-1,  0, 0,  0, 0,	// 3080-  Pet System, Storage
+	-1,10,-1, 6,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0,  0, 0,	// 3090-  Homunculus packets [albator]
+	 2,-1, 6, 6,  0, 0, 0, 0,  0, 0, 0, 0,  0, 0,  0, 0,	// 30A0-  Clan packets
+};
+
+#endif /* _INTERPACKET_H_ */
@@ -4,6 +4,9 @@
 #include "malloc.h"
 #include "core.h"
 #include "showmsg.h"
+#ifndef MINICORE
+#include "mutex.h"
+#endif
 
 #include <stdlib.h>
 #include <string.h>
@@ -221,7 +224,20 @@ static size_t hash2size( unsigned short hash )
 	}
 }
 
-void* _mmalloc(size_t size, const char *file, int line, const char *func )
+#ifndef MINICORE
+/* Lock serializing the memory manager once other threads are running */
+static ramutex memmgr_mutex = NULL;
+static bool memmgr_threadsafe = false;
+#define MEMMGR_LOCK() if( memmgr_threadsafe ) ramutex_lock(memmgr_mutex)
+#define MEMMGR_UNLOCK() if( memmgr_threadsafe ) ramutex_unlock(memmgr_mutex)
+#else
+#define MEMMGR_LOCK()
+#define MEMMGR_UNLOCK()
+#endif
+
+static void memmgr_free(void *ptr, const char *file, int line, const char *func);
+
+static void* memmgr_malloc(size_t size, const char *file, int line, const char *func )
 {
 	struct block *block;
 	short size_hash = size2hash( size );
@@ -340,20 +356,24 @@ void* _mrealloc(void *memblock, size_t size, const char *file, int line, const c
 		return _mmalloc(size,file,line,func);
 	}
 
+	MEMMGR_LOCK();
+
 	old_size = ((struct unit_head *)((char *)memblock - sizeof(struct unit_head) + sizeof(long)))->size;
 	if( old_size == 0 ) {
 		old_size = ((struct unit_head_large *)((char *)memblock - sizeof(struct unit_head_large) + sizeof(long)))->size;
 	}
 	if(old_size > size) {
 		// Size reduction - return> as it is (negligence)
+		MEMMGR_UNLOCK();
 		return memblock;
 	}  else {
 		// Size Large
-		void *p = _mmalloc(size,file,line,func);
+		void *p = memmgr_malloc(size,file,line,func);
 		if(p != NULL) {
 			memcpy(p,memblock,old_size);
 		}
-		_mfree(memblock,file,line,func);
+		memmgr_free(memblock,file,line,func);
+		MEMMGR_UNLOCK();
 		return p;
 	}
 }
@@ -370,7 +390,7 @@ char* _mstrdup(const char *p, const char *file, int line, const char *func )
 	}
 }
 
-void _mfree(void *ptr, const char *file, int line, const char *func )
+static void memmgr_free(void *ptr, const char *file, int line, const char *func )
 {
 	struct unit_head *head;
 
@@ -441,6 +461,22 @@ void _mfree(void *ptr, const char *file, int line, const char *func )
 	}
 }
 
+void* _mmalloc(size_t size, const char *file, int line, const char *func )
+{
+	void *p;
+	MEMMGR_LOCK();
+	p = memmgr_malloc(size,file,line,func);
+	MEMMGR_UNLOCK();
+	return p;
+}
+
+void _mfree(void *ptr, const char *file, int line, const char *func )
+{
+	MEMMGR_LOCK();
+	memmgr_free(ptr,file,line,func);
+	MEMMGR_UNLOCK();
+}
+
 /* Allocating blocks */
 static struct block* block_malloc(unsigned short hash)
 {
@@ -662,6 +698,19 @@ static void memmgr_init (void)
  */
 
 
+/// Serializes the memory manager so it can be used from several threads.
+/// Called before a thread is spawned; there is no way back until malloc_final.
+void malloc_set_threadsafe(void)
+{
+#if defined(USE_MEMMGR) && !defined(MINICORE)
+	if( memmgr_threadsafe )
+		return;
+	memmgr_mutex = ramutex_create();
+	memmgr_threadsafe = true;
+#endif
+}
+
+
 /// Tests the memory for errors and memory leaks.
 void malloc_memory_check(void)
 {
@@ -693,6 +742,13 @@ size_t malloc_usage (void)
 void malloc_final (void)
 {
 #ifdef USE_MEMMGR
+#ifndef MINICORE
+	if( memmgr_threadsafe ) {// all threads are gone by now
+		memmgr_threadsafe = false;
+		ramutex_destroy(memmgr_mutex);
+		memmgr_mutex = NULL;
+	}
+#endif
 	memmgr_final ();
 #endif
 	MEMORY_CHECK();
@@ -88,5 +88,6 @@ bool malloc_verify_ptr(void* ptr);
 size_t malloc_usage (void);
 void malloc_init (void);
 void malloc_final (void);
+void malloc_set_threadsafe (void);
 
 #endif /* _MALLOC_H_ */
@@ -0,0 +1,33 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _PACKETTRACE_H_
+#define _PACKETTRACE_H_
+
+/// Packet trace files, written by the map-server when 'packet_capture' is set
+/// in map_athena.conf and played back by the replay tool (src/tool/replay.c).
+///
+/// Header: <magic>.8B <version>.L <packet_ver>.L <charstatus size>.L <storage size>.L <start time>.L
+/// Record: <tick>.L <session>.L <type>.B <length>.L <data>.?B
+///
+/// tick is the time in ms since the capture started and session numbers the
+/// client connections of the capture, starting at 1. The struct sizes in the
+/// header let the replay tool refuse a trace written by a different build.
+/// All values are little endian, as in the packets themselves.
+
+#define PTRACE_MAGIC "RATRACE"
+#define PTRACE_VERSION 2
+#define PTRACE_HEADER_SIZE 28
+#define PTRACE_RECORD_SIZE 13
+#define PTRACE_ID_FIELDS 2 // fields of a client packet that can hold the id of its player
+
+enum e_ptrace_record {
+	PTRACE_OPEN = 0, ///< Client connected, no data
+	PTRACE_AUTH,     ///< Character data from the char-server: <group id>.L <struct mmo_charstatus>
+	PTRACE_STORAGE,  ///< Inventory or cart from the char-server: <type>.B <struct s_storage>
+	PTRACE_RECV,     ///< Client packet, as dispatched by clif_parse: <id field offset>.W*PTRACE_ID_FIELDS <packet>.?B (offset 0 = unused)
+	PTRACE_SEND,     ///< Server packet: <packet id>.W <length>.L
+	PTRACE_CLOSE,    ///< Connection closed, no data
+};
+
+#endif /* _PACKETTRACE_H_ */
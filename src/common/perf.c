@@ -0,0 +1,498 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#include "cbasetypes.h"
+#include "db.h"
+#include "malloc.h"
+#include "showmsg.h"
+#include "strlib.h"
+#include "thread.h"
+#include "timer.h"
+#include "perf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// Main loop instrumentation.
+/// Every cycle of the main loop is split in phases (see e_perf_phase), the
+/// last PERF_WINDOW cycles are kept for the percentiles. Timer functions,
+/// client packets and SQL queries of the main thread are accounted on their
+/// own, they overlap with the phase they run in.
+
+#define PERF_WINDOW 4096 // Cycles kept for the percentiles
+#define PERF_SLOWEST 10 // Slowest cycles kept since the last reset
+
+enum e_perf_item {
+	PERF_ITEM_NONE = 0,
+	PERF_ITEM_TIMER,
+	PERF_ITEM_PACKET,
+};
+
+struct perf_sample {
+	uint32 usec[PERF_PHASE_MAX];
+	uint32 busy; // Sum of the phases but PERF_WAIT
+	uint32 sql;
+	uint32 sql_count;
+	uint32 top_usec; // Most expensive timer call or packet of the cycle
+	uint8 top_type; // enum e_perf_item
+	int64 top_key;
+	time_t time;
+};
+
+struct perf_entry {
+	uint32 count;
+	uint32 max_usec;
+	uint64 usec;
+};
+
+bool perf_enabled = false;
+
+static struct {
+	struct perf_sample* window; // Ring of the last PERF_WINDOW cycles
+	unsigned int window_pos;
+	unsigned int window_count;
+	struct perf_sample current;
+	struct perf_sample slowest[PERF_SLOWEST]; // Sorted, slowest first
+	int slowest_count;
+	uint64 mark; // End of the last phase, 0 at the start of a measurement
+	uint64 ticks; // Cycles since the last reset
+	uint64 sql_usec;
+	uint64 sql_count;
+	time_t started;
+	DBMap* timers; // int64 TimerFunc -> struct perf_entry*
+	DBMap* packets; // int cmd -> struct perf_entry*
+	int main_tid;
+	int slow_tick; // Cycles of at least this many ms are reported on the console
+	int dump_interval;
+	int dump_tid;
+	char dump_file[256];
+} perf;
+
+static const char* perf_phase_name[PERF_PHASE_MAX] = { "timer", "send", "wait", "recv", "parse", "other" };
+
+/// Accounts the time since the last mark to phase.
+void perf_mark(enum e_perf_phase phase)
+{
+	uint64 now;
+
+	if( !perf_enabled )
+		return;
+	now = gettick_usec();
+	if( perf.mark )
+		perf.current.usec[phase] += (uint32)(now - perf.mark);
+	perf.mark = now;
+}
+
+/// Remembers the most expensive item of the current cycle.
+static void perf_top(enum e_perf_item type, int64 key, uint32 usec)
+{
+	if( usec > perf.current.top_usec ) {
+		perf.current.top_usec = usec;
+		perf.current.top_type = type;
+		perf.current.top_key = key;
+	}
+}
+
+static void perf_account(struct perf_entry* e, uint32 usec)
+{
+	e->count++;
+	e->usec += usec;
+	if( usec > e->max_usec )
+		e->max_usec = usec;
+}
+
+/// Closes the cycle in progress and starts the next one, called at the top of the main loop.
+void perf_tick(void)
+{
+	struct perf_sample* s;
+	int i;
+
+	if( !perf_enabled )
+		return;
+
+	if( !perf.mark ) { // First cycle of this measurement
+		memset(&perf.current, 0, sizeof(perf.current));
+		perf.mark = gettick_usec();
+		return;
+	}
+	perf_mark(PERF_OTHER);
+
+	s = &perf.current;
+	s->busy = 0;
+	for( i = 0; i < PERF_PHASE_MAX; i++ ) {
+		if( i != PERF_WAIT )
+			s->busy += s->usec[i];
+	}
+	s->time = time(NULL);
+
+	memcpy(&perf.window[perf.window_pos], s, sizeof(*s));
+	perf.window_pos = (perf.window_pos+1)%PERF_WINDOW;
+	if( perf.window_count < PERF_WINDOW )
+		perf.window_count++;
+	perf.ticks++;
+
+	ARR_FIND(0, perf.slowest_count, i, s->busy > perf.slowest[i].busy);
+	if( i < PERF_SLOWEST ) {
+		if( perf.slowest_count < PERF_SLOWEST )
+			perf.slowest_count++;
+		memmove(&perf.slowest[i+1], &perf.slowest[i], sizeof(perf.slowest[0])*(perf.slowest_count-1-i));
+		memcpy(&perf.slowest[i], s, sizeof(*s));
+	}
+
+	if( perf.slow_tick && s->busy >= (uint32)perf.slow_tick*1000 ) {
+		char top[64];
+
+		if( s->top_type == PERF_ITEM_TIMER )
+			safesnprintf(top, sizeof(top), "timer %s", search_timer_func_list((TimerFunc)(intptr_t)s->top_key));
+		else if( s->top_type == PERF_ITEM_PACKET )
+			safesnprintf(top, sizeof(top), "packet 0x%04x", (unsigned int)s->top_key);
+		else
+			safestrncpy(top, "none", sizeof(top));
+		ShowWarning("Slow tick: %.1fms (timer %.1f, send %.1f, recv %.1f, parse %.1f, other %.1f, sql %.1f in %u queries), slowest: %s %.1fms\n",
+			s->busy/1000., s->usec[PERF_TIMER]/1000., s->usec[PERF_SEND]/1000., s->usec[PERF_RECV]/1000., s->usec[PERF_PARSE]/1000., s->usec[PERF_OTHER]/1000.,
+			s->sql/1000., s->sql_count, top, s->top_usec/1000.);
+	}
+
+	memset(&perf.current, 0, sizeof(perf.current));
+}
+
+/// Accounts a call of a timer function that started at start.
+void perf_timer(TimerFunc func, uint64 start)
+{
+	struct perf_entry* e;
+	uint32 usec;
+
+	if( !perf_enabled || !start )
+		return;
+	usec = (uint32)(gettick_usec() - start);
+	if( (e = (struct perf_entry*)i64db_get(perf.timers, (int64)(intptr_t)func)) == NULL ) {
+		CREATE(e, struct perf_entry, 1);
+		i64db_put(perf.timers, (int64)(intptr_t)func, e);
+	}
+	perf_account(e, usec);
+	perf_top(PERF_ITEM_TIMER, (int64)(intptr_t)func, usec);
+}
+
+/// Accounts the processing of a client packet that started at start.
+void perf_packet(uint16 cmd, uint64 start)
+{
+	struct perf_entry* e;
+	uint32 usec;
+
+	if( !perf_enabled || !start )
+		return;
+	usec = (uint32)(gettick_usec() - start);
+	if( (e = (struct perf_entry*)idb_get(perf.packets, cmd)) == NULL ) {
+		CREATE(e, struct perf_entry, 1);
+		idb_put(perf.packets, cmd, e);
+	}
+	perf_account(e, usec);
+	perf_top(PERF_ITEM_PACKET, cmd, usec);
+}
+
+/// Accounts a SQL query that started at start. Queries of other threads are ignored.
+void perf_sql(uint64 start)
+{
+	uint32 usec;
+
+	if( !perf_enabled || !start || rathread_get_tid() != perf.main_tid )
+		return;
+	usec = (uint32)(gettick_usec() - start);
+	perf.current.sql += usec;
+	perf.current.sql_count++;
+	perf.sql_usec += usec;
+	perf.sql_count++;
+}
+
+/// Turns the stats on or off, the collected data is kept.
+void perf_enable(bool enable)
+{
+	if( enable && perf.window == NULL )
+		CREATE(perf.window, struct perf_sample, PERF_WINDOW);
+	if( enable && !perf_enabled && !perf.started )
+		perf.started = time(NULL);
+	perf.mark = 0; // The cycle in progress is not complete
+	perf_enabled = enable;
+}
+
+/// Clears the collected data.
+void perf_reset(void)
+{
+	perf.window_pos = perf.window_count = 0;
+	perf.slowest_count = 0;
+	perf.ticks = 0;
+	perf.sql_usec = perf.sql_count = 0;
+	perf.mark = 0;
+	perf.started = perf_enabled ? time(NULL) : 0;
+	db_clear(perf.timers);
+	db_clear(perf.packets);
+}
+
+/// Sets the busy time in ms from which a cycle is reported on the console (0 = never).
+void perf_set_slow_tick(int ms)
+{
+	perf.slow_tick = max(ms, 0);
+}
+
+/// Percentile p (0-100) of a sorted array of n values.
+static uint32 perf_percentile(const uint32* sorted, unsigned int n, int p)
+{
+	if( n == 0 )
+		return 0;
+	return sorted[min(n-1, (n*p)/100)];
+}
+
+static int perf_cmp_uint32(const void* a, const void* b)
+{
+	uint32 x = *(const uint32*)a, y = *(const uint32*)b;
+	return ( x < y ) ? -1 : ( x > y );
+}
+
+struct perf_stat {
+	uint32 p50, p90, p99, max;
+	uint64 total;
+};
+
+/// Computes the percentiles of a phase over the window, PERF_PHASE_MAX for the busy time.
+static void perf_window_stat(uint32* buf, int phase, struct perf_stat* stat)
+{
+	unsigned int i, n = perf.window_count;
+
+	memset(stat, 0, sizeof(*stat));
+	for( i = 0; i < n; i++ ) {
+		buf[i] = ( phase == PERF_PHASE_MAX ) ? perf.window[i].busy : perf.window[i].usec[phase];
+		stat->total += buf[i];
+	}
+	qsort(buf, n, sizeof(buf[0]), perf_cmp_uint32);
+	stat->p50 = perf_percentile(buf, n, 50);
+	stat->p90 = perf_percentile(buf, n, 90);
+	stat->p99 = perf_percentile(buf, n, 99);
+	stat->max = n ? buf[n-1] : 0;
+}
+
+struct perf_top_entry {
+	int64 key;
+	struct perf_entry* e;
+};
+
+static int perf_cmp_top(const void* a, const void* b)
+{
+	uint64 x = ((const struct perf_top_entry*)a)->e->usec, y = ((const struct perf_top_entry*)b)->e->usec;
+	return ( x > y ) ? -1 : ( x < y );
+}
+
+/// Returns the entries of db sorted by total time, the most expensive first.
+static struct perf_top_entry* perf_sorted(DBMap* db, int* count)
+{
+	struct perf_top_entry* list;
+	DBIterator* iter;
+	DBKey key;
+	struct perf_entry* e;
+	int n = 0;
+
+	list = (struct perf_top_entry*)aMalloc(sizeof(list[0])*max(db_size(db), 1));
+	iter = db_iterator(db);
+	for( e = (struct perf_entry*)db_data2ptr(iter->first(iter, &key)); dbi_exists(iter); e = (struct perf_entry*)db_data2ptr(iter->next(iter, &key)) ) {
+		list[n].key = ( db == perf.timers ) ? key.i64 : key.i;
+		list[n].e = e;
+		n++;
+	}
+	dbi_destroy(iter);
+	qsort(list, n, sizeof(list[0]), perf_cmp_top);
+	*count = n;
+	return list;
+}
+
+static const char* perf_item_name(enum e_perf_item type, int64 key, char* buf, size_t size)
+{
+	if( type == PERF_ITEM_TIMER )
+		safestrncpy(buf, search_timer_func_list((TimerFunc)(intptr_t)key), size);
+	else if( type == PERF_ITEM_PACKET )
+		safesnprintf(buf, size, "0x%04x", (unsigned int)key);
+	else
+		safestrncpy(buf, "none", size);
+	return buf;
+}
+
+/// Default formats of the perf_show lines, see enum e_perf_line.
+static const char* const perf_show_lines[PERF_LINE_MAX] = {
+	"Performance stats are on, %u ticks measured, the last %u used for percentiles.",
+	"Performance stats are off, %u ticks measured, the last %u used for percentiles.",
+	"busy  : p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms (%.1f%% of the time)",
+	"%-6s: p50 %.2fms p90 %.2fms p99 %.2fms max %.2fms",
+	"sql   : %u queries on the main thread, %.1fms in total",
+	"timer %s: %u calls, %.1fms total, max %.2fms",
+	"packet %s: %u calls, %.1fms total, max %.2fms",
+	"slow tick %s: %.1fms (timer %.1f send %.1f recv %.1f parse %.1f sql %.1f), slowest %s %.1fms",
+};
+
+/// Shows a summary, one line at a time through func, with the top most expensive timers and packets.
+/// @param lines: formats of the lines (PERF_LINE_MAX entries), NULL for the defaults
+void perf_show(PerfShowFunc func, int fd, int top, const char* const* lines)
+{
+	char line[256], name[64], timestr[24];
+	struct perf_stat stat, wait;
+	struct perf_top_entry* list;
+	uint32* buf;
+	int i, n;
+
+	if( lines == NULL )
+		lines = perf_show_lines;
+
+	safesnprintf(line, sizeof(line), lines[perf_enabled ? PERF_LINE_ON : PERF_LINE_OFF], (unsigned int)perf.ticks, perf.window_count);
+	func(fd, line);
+	if( perf.window_count == 0 )
+		return;
+
+	buf = (uint32*)aMalloc(sizeof(buf[0])*perf.window_count);
+	perf_window_stat(buf, PERF_WAIT, &wait);
+	perf_window_stat(buf, PERF_PHASE_MAX, &stat);
+	safesnprintf(line, sizeof(line), lines[PERF_LINE_BUSY],
+		stat.p50/1000., stat.p90/1000., stat.p99/1000., stat.max/1000., stat.total ? 100.*stat.total/(stat.total+wait.total) : 0.);
+	func(fd, line);
+	for( i = 0; i < PERF_PHASE_MAX; i++ ) {
+		if( i == PERF_WAIT )
+			continue;
+		perf_window_stat(buf, i, &stat);
+		safesnprintf(line, sizeof(line), lines[PERF_LINE_PHASE],
+			perf_phase_name[i], stat.p50/1000., stat.p90/1000., stat.p99/1000., stat.max/1000.);
+		func(fd, line);
+	}
+	aFree(buf);
+	safesnprintf(line, sizeof(line), lines[PERF_LINE_SQL], (unsigned int)perf.sql_count, perf.sql_usec/1000.);
+	func(fd, line);
+
+	list = perf_sorted(perf.timers, &n);
+	for( i = 0; i < n && i < top; i++ ) {
+		const struct perf_entry* e = list[i].e;
+		safesnprintf(line, sizeof(line), lines[PERF_LINE_TIMER],
+			perf_item_name(PERF_ITEM_TIMER, list[i].key, name, sizeof(name)), e->count, e->usec/1000., e->max_usec/1000.);
+		func(fd, line);
+	}
+	aFree(list);
+
+	list = perf_sorted(perf.packets, &n);
+	for( i = 0; i < n && i < top; i++ ) {
+		const struct perf_entry* e = list[i].e;
+		safesnprintf(line, sizeof(line), lines[PERF_LINE_PACKET],
+			perf_item_name(PERF_ITEM_PACKET, list[i].key, name, sizeof(name)), e->count, e->usec/1000., e->max_usec/1000.);
+		func(fd, line);
+	}
+	aFree(list);
+
+	for( i = 0; i < perf.slowest_count && i < top; i++ ) {
+		const struct perf_sample* s = &perf.slowest[i];
+		timestamp2string(timestr, sizeof(timestr), s->time, "%H:%M:%S");
+		safesnprintf(line, sizeof(line), lines[PERF_LINE_SLOW],
+			timestr, s->busy/1000., s->usec[PERF_TIMER]/1000., s->usec[PERF_SEND]/1000., s->usec[PERF_RECV]/1000., s->usec[PERF_PARSE]/1000., s->sql/1000.,
+			perf_item_name((enum e_perf_item)s->top_type, s->top_key, name, sizeof(name)), s->top_usec/1000.);
+		func(fd, line);
+	}
+}
+
+/// Writes all the collected data to file in key=value lines, for monitoring tools.
+/// Times are in microseconds. Returns the number of lines written or -1 on error.
+int perf_dump(const char* file)
+{
+	struct perf_stat stat;
+	struct perf_top_entry* list;
+	char name[64];
+	uint32* buf;
+	FILE* fp;
+	int i, n, lines = 0;
+
+	if( file == NULL || file[0] == '\0' )
+		file = perf.dump_file;
+	if( (fp = fopen(file, "w")) == NULL ) {
+		ShowError("perf_dump: Could not open '%s' for writing.\n", file);
+		return -1;
+	}
+
+	fprintf(fp, "stats enabled=%d time=%lu started=%lu ticks=%"PRIu64" window=%u sql_count=%"PRIu64" sql_us=%"PRIu64"\n",
+		perf_enabled ? 1 : 0, (unsigned long)time(NULL), (unsigned long)perf.started, perf.ticks, perf.window_count, perf.sql_count, perf.sql_usec);
+	lines++;
+
+	buf = (uint32*)aMalloc(sizeof(buf[0])*max(perf.window_count, 1));
+	for( i = 0; i <= PERF_PHASE_MAX; i++ ) {
+		perf_window_stat(buf, i, &stat);
+		fprintf(fp, "phase name=%s p50_us=%u p90_us=%u p99_us=%u max_us=%u total_us=%"PRIu64"\n",
+			( i == PERF_PHASE_MAX ) ? "busy" : perf_phase_name[i], stat.p50, stat.p90, stat.p99, stat.max, stat.total);
+		lines++;
+	}
+	aFree(buf);
+
+	list = perf_sorted(perf.timers, &n);
+	for( i = 0; i < n; i++ ) {
+		perf_item_name(PERF_ITEM_TIMER, list[i].key, name, sizeof(name));
+		fprintf(fp, "timer name=%s count=%u total_us=%"PRIu64" max_us=%u\n",
+			( strchr(name, ' ') != NULL ) ? "unknown" : name, list[i].e->count, list[i].e->usec, list[i].e->max_usec);
+		lines++;
+	}
+	aFree(list);
+
+	list = perf_sorted(perf.packets, &n);
+	for( i = 0; i < n; i++ ) {
+		fprintf(fp, "packet cmd=%s count=%u total_us=%"PRIu64" max_us=%u\n",
+			perf_item_name(PERF_ITEM_PACKET, list[i].key, name, sizeof(name)), list[i].e->count, list[i].e->usec, list[i].e->max_usec);
+		lines++;
+	}
+	aFree(list);
+
+	for( i = 0; i < perf.slowest_count; i++ ) {
+		const struct perf_sample* s = &perf.slowest[i];
+		perf_item_name((enum e_perf_item)s->top_type, s->top_key, name, sizeof(name));
+		fprintf(fp, "slow time=%lu busy_us=%u timer_us=%u send_us=%u recv_us=%u parse_us=%u other_us=%u sql_us=%u sql_count=%u top=%s top_us=%u\n",
+			(unsigned long)s->time, s->busy, s->usec[PERF_TIMER], s->usec[PERF_SEND], s->usec[PERF_RECV], s->usec[PERF_PARSE], s->usec[PERF_OTHER],
+			s->sql, s->sql_count, ( strchr(name, ' ') != NULL ) ? "unknown" : name, s->top_usec);
+		lines++;
+	}
+
+	fclose(fp);
+	return lines;
+}
+
+static int perf_dump_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	if( perf_enabled )
+		perf_dump(NULL);
+	return 0;
+}
+
+/// Sets the interval in seconds of the periodic dump (0 = off).
+void perf_set_dump_interval(int interval)
+{
+	perf.dump_interval = max(interval, 0);
+	if( perf.dump_tid != INVALID_TIMER ) {
+		delete_timer(perf.dump_tid, perf_dump_timer);
+		perf.dump_tid = INVALID_TIMER;
+	}
+	if( perf.dump_interval )
+		perf.dump_tid = add_timer_interval(gettick() + perf.dump_interval*1000, perf_dump_timer, 0, 0, perf.dump_interval*1000);
+}
+
+/// Sets the file of the periodic dump, also used by perf_dump when no file is given.
+void perf_set_dump_file(const char* file)
+{
+	safestrncpy(perf.dump_file, file, sizeof(perf.dump_file));
+}
+
+void perf_init(void)
+{
+	memset(&perf, 0, sizeof(perf));
+	perf.timers = i64db_alloc(DB_OPT_RELEASE_DATA);
+	perf.packets = idb_alloc(DB_OPT_RELEASE_DATA);
+	perf.main_tid = rathread_get_tid();
+	perf.dump_tid = INVALID_TIMER;
+	safestrncpy(perf.dump_file, "log/perf.txt", sizeof(perf.dump_file));
+	add_timer_func_list(perf_dump_timer, "perf_dump_timer");
+}
+
+void perf_final(void)
+{
+	perf_enabled = false;
+	if( perf.window )
+		aFree(perf.window);
+	db_destroy(perf.timers);
+	db_destroy(perf.packets);
+}
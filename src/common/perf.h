@@ -0,0 +1,60 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+#ifndef _PERF_H_
+#define _PERF_H_
+
+#include "cbasetypes.h"
+#include "timer.h"
+
+/// Phases of one cycle of the main loop (do_timer + do_sockets).
+/// The busy time of a tick is the sum of all phases but PERF_WAIT.
+enum e_perf_phase {
+	PERF_TIMER = 0, ///< Expired timers
+	PERF_SEND,      ///< Presend, queued packets and sending the write fifos
+	PERF_WAIT,      ///< Waiting for network events (idle)
+	PERF_RECV,      ///< Reading from the sockets
+	PERF_PARSE,     ///< Parsing the received data
+	PERF_OTHER,     ///< The rest of the loop
+	PERF_PHASE_MAX
+};
+
+/// Lines shown by perf_show, each one a printf format with these arguments.
+/// Times are in milliseconds.
+enum e_perf_line {
+	PERF_LINE_ON = 0, ///< Header while enabled: ticks measured, ticks in the percentile window
+	PERF_LINE_OFF,    ///< Header while disabled: same arguments
+	PERF_LINE_BUSY,   ///< p50, p90, p99, max of the busy time, busy percentage
+	PERF_LINE_PHASE,  ///< phase name, p50, p90, p99, max
+	PERF_LINE_SQL,    ///< main thread queries, total time
+	PERF_LINE_TIMER,  ///< timer name, calls, total time, max
+	PERF_LINE_PACKET, ///< packet name, calls, total time, max
+	PERF_LINE_SLOW,   ///< clock time, busy, timer, send, recv, parse, sql, slowest item name, its time
+	PERF_LINE_MAX
+};
+
+typedef void (*PerfShowFunc)(int fd, const char* line);
+
+extern bool perf_enabled;
+
+/// Start of a measured call, 0 when the stats are off.
+#define perf_start() ( perf_enabled ? gettick_usec() : 0 )
+
+void perf_tick(void);
+void perf_mark(enum e_perf_phase phase);
+void perf_timer(TimerFunc func, uint64 start);
+void perf_packet(uint16 cmd, uint64 start);
+void perf_sql(uint64 start);
+
+void perf_enable(bool enable);
+void perf_reset(void);
+void perf_set_slow_tick(int ms);
+void perf_set_dump_interval(int interval);
+void perf_set_dump_file(const char* file);
+void perf_show(PerfShowFunc func, int fd, int top, const char* const* lines);
+int perf_dump(const char* file);
+
+void perf_init(void);
+void perf_final(void);
+
+#endif /* _PERF_H_ */
@@ -7,9 +7,13 @@
 #include "malloc.h"
 #include "showmsg.h"
 #include "strlib.h"
+#include "atomic.h"
+#include "perf.h"
+#include "random.h"
 #include "socket.h"
 
 #include <stdlib.h>
+#include <zlib.h>
 
 #ifdef WIN32
 	#include "winapi.h"
@@ -32,6 +36,8 @@
 	#ifdef HAVE_SETRLIMIT
 	#include <sys/resource.h>
 	#endif
+	#include <sys/mman.h>
+	#include <fcntl.h>
 #endif
 
 /////////////////////////////////////////////////////////////////////
@@ -222,6 +228,7 @@ static size_t socket_max_client_packet = USHRT_MAX;
 // Data I/O statistics
 static size_t socket_data_i = 0, socket_data_ci = 0, socket_data_qi = 0;
 static size_t socket_data_o = 0, socket_data_co = 0, socket_data_qo = 0;
+static size_t socket_data_m = 0; // bytes moved to compact the fifos
 static time_t socket_data_last_tick = 0;
 #endif
 
@@ -245,6 +252,14 @@ uint32 send_shortlist_set[(FD_SETSIZE+31)/32];// to know if specific fd's are al
 
 static int create_session(int fd, RecvFunc func_recv, SendFunc func_send, ParseFunc func_parse);
 
+/// Framing of a server link, see socket_frame_send and socket_frame_recv.
+struct socket_frame {
+	bool send, recv;
+	size_t wenc; // end of the framed data in the write fifo, the data after it is not framed yet
+	uint8* rbuf; // received frames, not unpacked to the read fifo yet
+	size_t rbuf_len, rbuf_size;
+};
+
 #ifndef MINICORE
 	int ip_rules = 1;
 	static int connect_check(uint32 ip);
@@ -272,6 +287,22 @@ void set_defaultparse(ParseFunc defaultparse)
 	default_func_parse = defaultparse;
 }
 
+/// Called before the buffered data is sent, to let the server queue the packets it held back
+PresendFunc presend_func = NULL;
+
+void set_presend(PresendFunc presend)
+{
+	presend_func = presend;
+}
+
+/// Called for every packet queued to a client, before it is encrypted
+SendHookFunc sendhook_func = NULL;
+
+void set_sendhook(SendHookFunc sendhook)
+{
+	sendhook_func = sendhook;
+}
+
 
 /*======================================
  *	CORE : Socket options
@@ -388,16 +419,16 @@ int send_from_fifo(int fd)
 	if( session[fd]->wdata_size == 0 )
 		return 0; // nothing to send
 
-	len = sSend(fd, (const char *) session[fd]->wdata, (int)session[fd]->wdata_size, MSG_NOSIGNAL);
+	len = sSend(fd, (const char *) session[fd]->wdata + session[fd]->wdata_pos, (int)(session[fd]->wdata_size - session[fd]->wdata_pos), MSG_NOSIGNAL);
 
 	if( len == SOCKET_ERROR )
 	{//An exception has occured
 		if( sErrno != S_EWOULDBLOCK ) {
 			//ShowDebug("send_from_fifo: %s, ending connection #%d\n", error_msg(), fd);
 #ifdef SHOW_SERVER_STATS
-			socket_data_qo -= session[fd]->wdata_size;
+			socket_data_qo -= session[fd]->wdata_size - session[fd]->wdata_pos;
 #endif
-			session[fd]->wdata_size = 0; //Clear the send queue as we can't send anymore. [Skotlex]
+			session[fd]->wdata_size = session[fd]->wdata_pos = 0; //Clear the send queue as we can't send anymore. [Skotlex]
 			set_eof(fd);
 		}
 		return 0;
@@ -406,11 +437,10 @@ int send_from_fifo(int fd)
 	if( len > 0 )
 	{
 		// some data could not be transferred?
-		// shift unsent data to the beginning of the queue
-		if( (size_t)len < session[fd]->wdata_size )
-			memmove(session[fd]->wdata, session[fd]->wdata + len, session[fd]->wdata_size - len);
-
-		session[fd]->wdata_size -= len;
+		// leave it in place, the fifo is only compacted when it runs out of room
+		session[fd]->wdata_pos += len;
+		if( session[fd]->wdata_pos == session[fd]->wdata_size )
+			session[fd]->wdata_size = session[fd]->wdata_pos = 0;
 #ifdef SHOW_SERVER_STATS
 		socket_data_o += len;
 		socket_data_qo -= len;
@@ -438,6 +468,663 @@ void flush_fifos(void)
 		flush_fifo(i);
 }
 
+/*======================================
+ *	CORE : Framed server links
+ *--------------------------------------*/
+// Once both ends of a server link agreed on it, everything queued on the link
+// between two sends goes out as frames of up to FRAME_MAX_RAW bytes:
+//   <wire length>.L <raw length>.L <flags>.B <data>.?B
+// Frames are not aligned to packets. Large frames are compressed with zlib,
+// the receiving end unpacks them to the read fifo, so the parse functions are
+// unaffected. The write fifo already gathers all packets of a cycle into one
+// send(), framing adds the compression of the bulky ones (auth data, storage,
+// guild and party updates) on top of that.
+#define FRAME_HEADER_SIZE 9
+#define FRAME_MAX_RAW (FIFOSIZE_SERVERLINK/4)
+#define FRAME_ZLIB 0x1
+
+static bool frame_enabled = true;
+static int frame_compress = 2048; // minimum size of a frame to compress it, 0 = never
+static uint8* frame_buf = NULL; // frames being built
+static size_t frame_buf_size = 0;
+
+// Link statistics (interserver_stats)
+struct link_stat {
+	uint16 cmd;
+	uint32 count;
+	uint64 bytes;
+};
+static DBMap* link_stats = NULL; // int cmd -> struct link_stat*
+static uint64 link_frames, link_frames_zlib, link_raw, link_wire;
+static time_t link_stats_start;
+
+static void frame_unpack(int fd);
+
+/// Counts a packet sent on a server link.
+static void socket_link_count(uint16 cmd, size_t len)
+{
+	struct link_stat* stat = (struct link_stat*)idb_get(link_stats, cmd);
+
+	if( stat == NULL ) {
+		CREATE(stat, struct link_stat, 1);
+		stat->cmd = cmd;
+		idb_put(link_stats, cmd, stat);
+	}
+	stat->count++;
+	stat->bytes += len;
+}
+
+/// Turns the statistics of the server links on or off, and resets them.
+void socket_link_stats(bool enable)
+{
+	if( link_stats ) {
+		db_destroy(link_stats);
+		link_stats = NULL;
+	}
+	if( enable )
+		link_stats = idb_alloc(DB_OPT_RELEASE_DATA);
+	link_frames = link_frames_zlib = link_raw = link_wire = 0;
+	link_stats_start = time(NULL);
+}
+
+static int link_stat_compare(const void* a, const void* b)
+{
+	const struct link_stat* sa = *(const struct link_stat**)a;
+	const struct link_stat* sb = *(const struct link_stat**)b;
+
+	if( sa->bytes != sb->bytes )
+		return ( sa->bytes < sb->bytes ) ? 1 : -1;
+	return sa->cmd - sb->cmd;
+}
+
+/// Shows the statistics of the server links, the top packets by volume first.
+void socket_link_report(int top)
+{
+	DBIterator* iter;
+	struct link_stat** list;
+	struct link_stat* stat;
+	int count, i;
+	double secs;
+
+	if( link_stats == NULL ) {
+		ShowInfo("Server link statistics are off (interserver_stats in conf/packet_athena.conf).\n");
+		return;
+	}
+
+	secs = (double)max(time(NULL) - link_stats_start, 1);
+	ShowInfo("Server links, %.0f seconds: %"PRIu64" frames (%"PRIu64" compressed), %.1f kB queued, %.1f kB sent (%.1f%%).\n",
+		secs, link_frames, link_frames_zlib, link_raw/1024., link_wire/1024., link_raw ? 100.*link_wire/link_raw : 100.);
+
+	count = db_size(link_stats);
+	if( count == 0 )
+		return;
+	CREATE(list, struct link_stat*, count);
+	i = 0;
+	iter = db_iterator(link_stats);
+	for( stat = (struct link_stat*)dbi_first(iter); dbi_exists(iter); stat = (struct link_stat*)dbi_next(iter) )
+		list[i++] = stat;
+	dbi_destroy(iter);
+	qsort(list, count, sizeof(list[0]), link_stat_compare);
+
+	if( top <= 0 || top > count )
+		top = count;
+	for( i = 0; i < top; i++ )
+		ShowInfo("  0x%04x: %8u packets, %10.1f kB, %8.2f kB/s\n", list[i]->cmd, list[i]->count, list[i]->bytes/1024., list[i]->bytes/1024./secs);
+	aFree(list);
+}
+
+/// Whether server links switch to frames (interserver_framing).
+bool socket_frame_enabled(void)
+{
+	return frame_enabled;
+}
+
+static struct socket_frame* socket_frame_get(int fd)
+{
+	if( session[fd]->frame == NULL )
+		CREATE(session[fd]->frame, struct socket_frame, 1);
+	return session[fd]->frame;
+}
+
+/// Replaces the data queued after the framed part of the write fifo by frames.
+static void frame_pack(int fd)
+{
+	struct socket_data* s = session[fd];
+	struct socket_frame* f = s->frame;
+	size_t len = s->wdata_size - f->wenc;
+	size_t need = len + (len / FRAME_MAX_RAW + 1) * FRAME_HEADER_SIZE; // all frames stored as is
+	size_t pos, raw, out = 0;
+
+	if( frame_buf_size < need ) {
+		frame_buf_size = need;
+		RECREATE(frame_buf, uint8, frame_buf_size);
+	}
+
+	for( pos = 0; pos < len; pos += raw ) {
+		const uint8* src = s->wdata + f->wenc + pos;
+		uint8* frame = frame_buf + out;
+		size_t wire;
+		uint8 flags = 0;
+
+		raw = min(len - pos, FRAME_MAX_RAW);
+		wire = raw;
+		if( frame_compress && raw >= (size_t)frame_compress ) {
+			uLongf zlen = (uLongf)(raw - 1); // only keep it if it got smaller
+			if( compress2(frame + FRAME_HEADER_SIZE, &zlen, src, (uLong)raw, Z_BEST_SPEED) == Z_OK ) {
+				wire = zlen;
+				flags |= FRAME_ZLIB;
+				link_frames_zlib++;
+			}
+		}
+		if( !(flags&FRAME_ZLIB) )
+			memcpy(frame + FRAME_HEADER_SIZE, src, raw);
+		WBUFL(frame,0) = (uint32)wire;
+		WBUFL(frame,4) = (uint32)raw;
+		WBUFB(frame,8) = flags;
+		out += FRAME_HEADER_SIZE + wire;
+		link_frames++;
+	}
+	link_raw += len;
+	link_wire += out;
+
+	s->wdata_size = f->wenc;
+	WFIFOHEAD(fd, out); // might compact the fifo, which moves wenc
+	memcpy(s->wdata + s->wdata_size, frame_buf, out);
+	s->wdata_size += out;
+	f->wenc = s->wdata_size;
+#ifdef SHOW_SERVER_STATS
+	socket_data_qo += out;
+	socket_data_qo -= len;
+#endif
+}
+
+static int send_framed(int fd)
+{
+	struct socket_data* s;
+
+	if( !session_isValid(fd) )
+		return -1;
+
+	s = session[fd];
+	if( s->wdata_size > s->frame->wenc )
+		frame_pack(fd);
+	send_from_fifo(fd);
+	if( s->wdata_size == 0 )
+		s->frame->wenc = 0;
+	return 0;
+}
+
+/// Unpacks the complete frames received so far to the read fifo,
+/// as long as there is room for them.
+static void frame_unpack(int fd)
+{
+	struct socket_data* s = session[fd];
+	struct socket_frame* f = s->frame;
+	size_t pos = 0;
+
+	while( f->rbuf_len - pos >= FRAME_HEADER_SIZE ) {
+		const uint8* frame = f->rbuf + pos;
+		uint32 wire = RBUFL(frame,0);
+		uint32 raw = RBUFL(frame,4);
+		uint8 flags = RBUFB(frame,8);
+
+		if( wire > FRAME_MAX_RAW || raw > FRAME_MAX_RAW || (!(flags&FRAME_ZLIB) && wire != raw) ) {
+			ShowError("frame_unpack: Invalid frame (%u/%u bytes, flags %d) on connection #%d, closing.\n", wire, raw, flags, fd);
+			f->rbuf_len = 0;
+			set_eof(fd);
+			return;
+		}
+		if( f->rbuf_len - pos < FRAME_HEADER_SIZE + wire )
+			break; // incomplete
+		if( s->max_rdata - (s->rdata_size - s->rdata_pos) < raw )
+			break; // wait until the parse function made room
+		if( s->max_rdata - s->rdata_size < raw ) {
+			s->rdata_size -= s->rdata_pos;
+			memmove(s->rdata, s->rdata + s->rdata_pos, s->rdata_size);
+			s->rdata_pos = 0;
+		}
+
+		if( flags&FRAME_ZLIB ) {
+			uLongf dlen = raw;
+			if( uncompress(s->rdata + s->rdata_size, &dlen, frame + FRAME_HEADER_SIZE, wire) != Z_OK || dlen != raw ) {
+				ShowError("frame_unpack: Corrupt frame (%u/%u bytes) on connection #%d, closing.\n", wire, raw, fd);
+				f->rbuf_len = 0;
+				set_eof(fd);
+				return;
+			}
+		} else
+			memcpy(s->rdata + s->rdata_size, frame + FRAME_HEADER_SIZE, raw);
+		s->rdata_size += raw;
+		pos += FRAME_HEADER_SIZE + wire;
+	}
+
+	if( pos ) {
+		memmove(f->rbuf, f->rbuf + pos, f->rbuf_len - pos);
+		f->rbuf_len -= pos;
+	}
+}
+
+static int recv_framed(int fd)
+{
+	struct socket_data* s;
+	struct socket_frame* f;
+	int len;
+
+	if( !session_isActive(fd) )
+		return -1;
+
+	s = session[fd];
+	f = s->frame;
+	if( f->rbuf_len >= 2*FIFOSIZE_SERVERLINK )
+		return 0; // the read fifo is full, leave the rest to the socket buffers
+	if( f->rbuf_size - f->rbuf_len < FRAME_MAX_RAW + FRAME_HEADER_SIZE ) {
+		f->rbuf_size = f->rbuf_len + FRAME_MAX_RAW + FRAME_HEADER_SIZE;
+		RECREATE(f->rbuf, uint8, f->rbuf_size);
+	}
+
+	len = sRecv(fd, (char *) f->rbuf + f->rbuf_len, (int)(f->rbuf_size - f->rbuf_len), 0);
+
+	if( len == SOCKET_ERROR )
+	{//An exception has occured
+		if( sErrno != S_EWOULDBLOCK )
+			set_eof(fd);
+		return 0;
+	}
+
+	if( len == 0 )
+	{//Normal connection end.
+		set_eof(fd);
+		return 0;
+	}
+
+	f->rbuf_len += len;
+	s->rdata_tick = last_tick;
+#ifdef SHOW_SERVER_STATS
+	socket_data_i += len;
+#endif
+	frame_unpack(fd);
+	return 0;
+}
+
+/// Sends the data queued from now on in frames. The data queued before
+/// (like the packet telling the other end to switch) is sent as is.
+void socket_frame_send(int fd)
+{
+	struct socket_frame* f;
+
+	if( !session_isValid(fd) )
+		return;
+
+	if( session[fd]->shm )
+		return; // uses the shared memory
+	f = socket_frame_get(fd);
+	if( f->send )
+		return;
+	f->send = true;
+	f->wenc = session[fd]->wdata_size;
+	session[fd]->func_send = send_framed;
+}
+
+/// Reads frames from now on. Everything after the current position of the read fifo
+/// is taken as frames, so it must be called right after skipping the packet that
+/// announced the switch.
+void socket_frame_recv(int fd)
+{
+	struct socket_data* s;
+	struct socket_frame* f;
+	size_t rest;
+
+	if( !session_isValid(fd) )
+		return;
+
+	s = session[fd];
+	if( s->shm )
+		return; // uses the shared memory
+	f = socket_frame_get(fd);
+	if( f->recv )
+		return;
+	f->recv = true;
+
+	if( s->max_rdata < FIFOSIZE_SERVERLINK )
+		realloc_fifo(fd, FIFOSIZE_SERVERLINK, (unsigned int)s->max_wdata);
+
+	rest = s->rdata_size - s->rdata_pos;
+	f->rbuf_size = rest + FRAME_MAX_RAW + FRAME_HEADER_SIZE;
+	CREATE(f->rbuf, uint8, f->rbuf_size);
+	memcpy(f->rbuf, s->rdata + s->rdata_pos, rest);
+	f->rbuf_len = rest;
+	s->rdata_size = s->rdata_pos;
+	s->func_recv = recv_framed;
+	frame_unpack(fd);
+}
+
+/*======================================
+ *	CORE : Shared memory server links
+ *--------------------------------------*/
+// Servers on the same host can move the data of their link to two rings in a
+// shared memory segment, one per direction. The TCP connection stays open:
+// a byte on it wakes the other end up when data was put into an empty ring,
+// and its closing still tells when the other server went away.
+// The segment is created by the side that connected (socket_shm_create) and
+// unlinked as soon as the other side mapped it (socket_shm_open), or when the
+// link closes, so nothing is left in /dev/shm after a crash of the other end.
+#ifndef WIN32
+#define SHM_MAGIC 0x4d485352 // "RSHM"
+#define SHM_RING_SIZE (4*FIFOSIZE_SERVERLINK) // power of two
+
+struct shm_ring {
+	volatile int32 head; // bytes written so far (wraps)
+	volatile int32 tail; // bytes read so far (wraps)
+	uint8 pad[56]; // keep the two ends on their own cache line
+};
+
+struct shm_header {
+	uint32 magic;
+	uint32 key;
+	uint8 pad[56];
+	struct shm_ring ring[2]; // 0: creator -> opener, 1: opener -> creator
+};
+
+struct socket_shm {
+	struct shm_header* hdr;
+	struct shm_ring* wctl; // ring we write to
+	struct shm_ring* rctl; // ring we read from
+	uint8* wring;
+	uint8* rring;
+	char name[SHM_NAME_LENGTH];
+	bool linked; // name still exists, only for the creator
+	bool send, recv;
+	size_t wtcp; // bytes at the start of the write fifo that still go over TCP
+};
+
+static bool shm_enabled = false;
+static uint32 shm_count = 0;
+
+static void shm_unpack(int fd);
+
+/// Whether the link could use shared memory: it is enabled (interserver_shm)
+/// and the other end is on this host.
+bool socket_shm_local(int fd)
+{
+	uint32 ip;
+	int i;
+
+	if( !shm_enabled || !session_isValid(fd) )
+		return false;
+	ip = session[fd]->client_addr;
+	if( (ip>>24) == 127 )
+		return true;
+	ARR_FIND(0, naddr_, i, addr_[i] == ip);
+	return ( i < naddr_ );
+}
+
+static bool shm_map(int fd, int shm_fd, bool creator)
+{
+	struct socket_shm* sh = session[fd]->shm;
+	size_t size = sizeof(struct shm_header) + 2*SHM_RING_SIZE;
+	void* mem;
+
+	if( creator && ftruncate(shm_fd, size) != 0 ) {
+		ShowError("socket_shm: Cannot size shared memory '%s': %s\n", sh->name, strerror(errno));
+		return false;
+	}
+	mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, shm_fd, 0);
+	if( mem == MAP_FAILED ) {
+		ShowError("socket_shm: Cannot map shared memory '%s': %s\n", sh->name, strerror(errno));
+		return false;
+	}
+	sh->hdr = (struct shm_header*)mem;
+	sh->wctl = &sh->hdr->ring[creator ? 0 : 1];
+	sh->rctl = &sh->hdr->ring[creator ? 1 : 0];
+	sh->wring = (uint8*)mem + sizeof(struct shm_header) + (creator ? 0 : SHM_RING_SIZE);
+	sh->rring = (uint8*)mem + sizeof(struct shm_header) + (creator ? SHM_RING_SIZE : 0);
+	return true;
+}
+
+static void shm_close(int fd)
+{
+	struct socket_shm* sh = session[fd]->shm;
+
+	if( sh->hdr )
+		munmap(sh->hdr, sizeof(struct shm_header) + 2*SHM_RING_SIZE);
+	if( sh->linked )
+		shm_unlink(sh->name);
+	aFree(sh);
+	session[fd]->shm = NULL;
+}
+
+/// Creates the shared memory of a link, its name and key go to the other end.
+bool socket_shm_create(int fd, char* name, uint32* key)
+{
+	struct socket_shm* sh;
+	int shm_fd;
+
+	if( !session_isValid(fd) || session[fd]->shm || session[fd]->frame )
+		return false;
+
+	CREATE(sh, struct socket_shm, 1);
+	session[fd]->shm = sh;
+	safesnprintf(sh->name, sizeof(sh->name), "/rathena-%d-%u", (int)getpid(), ++shm_count);
+	shm_fd = shm_open(sh->name, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if( shm_fd < 0 ) {
+		ShowError("socket_shm: Cannot create shared memory '%s': %s\n", sh->name, strerror(errno));
+		shm_close(fd);
+		return false;
+	}
+	sh->linked = true;
+	if( !shm_map(fd, shm_fd, true) ) {
+		close(shm_fd);
+		shm_close(fd);
+		return false;
+	}
+	close(shm_fd);
+
+	sh->hdr->key = *key = rnd();
+	sh->hdr->magic = SHM_MAGIC;
+	safestrncpy(name, sh->name, SHM_NAME_LENGTH);
+	return true;
+}
+
+/// Maps the shared memory created by the other end of the link.
+bool socket_shm_open(int fd, const char* name, uint32 key)
+{
+	struct socket_shm* sh;
+	int shm_fd;
+
+	if( !session_isValid(fd) || session[fd]->shm || session[fd]->frame )
+		return false;
+
+	CREATE(sh, struct socket_shm, 1);
+	session[fd]->shm = sh;
+	safestrncpy(sh->name, name, sizeof(sh->name));
+	shm_fd = shm_open(sh->name, O_RDWR, 0600);
+	if( shm_fd < 0 ) {
+		ShowWarning("socket_shm: Cannot open shared memory '%s' of connection #%d: %s\n", sh->name, fd, strerror(errno));
+		shm_close(fd);
+		return false;
+	}
+	if( !shm_map(fd, shm_fd, false) ) {
+		close(shm_fd);
+		shm_close(fd);
+		return false;
+	}
+	close(shm_fd);
+	shm_unlink(sh->name); // both ends have it mapped, the name is not needed anymore
+
+	if( sh->hdr->magic != SHM_MAGIC || sh->hdr->key != key ) {
+		ShowWarning("socket_shm: Shared memory '%s' of connection #%d does not belong to it.\n", sh->name, fd);
+		shm_close(fd);
+		return false;
+	}
+	return true;
+}
+
+/// Copies the data of the write fifo to the ring, as much as fits.
+static int send_shm(int fd)
+{
+	struct socket_data* s;
+	struct socket_shm* sh;
+	uint32 head, tail, len, pos, part;
+
+	if( !session_isValid(fd) )
+		return -1;
+
+	s = session[fd];
+	sh = s->shm;
+	if( sh->wtcp ) {// data queued before the switch, the other end still reads it from TCP
+		int n = sSend(fd, (const char *) s->wdata + s->wdata_pos, (int)sh->wtcp, MSG_NOSIGNAL);
+		if( n == SOCKET_ERROR ) {
+			if( sErrno != S_EWOULDBLOCK ) {
+				s->wdata_size = s->wdata_pos = 0;
+				sh->wtcp = 0;
+				set_eof(fd);
+			}
+			return 0;
+		}
+		s->wdata_pos += n;
+		sh->wtcp -= n;
+		if( sh->wtcp )
+			return 0;
+	}
+	if( s->wdata_size == s->wdata_pos ) {
+		s->wdata_size = s->wdata_pos = 0;
+		return 0;
+	}
+
+	head = (uint32)sh->wctl->head;
+	tail = (uint32)InterlockedCompareExchange(&sh->wctl->tail, 0, 0);
+	len = (uint32)min(s->wdata_size - s->wdata_pos, SHM_RING_SIZE - (head - tail));
+	if( len == 0 )
+		return 0; // the ring is full, try again next cycle
+
+	pos = head & (SHM_RING_SIZE - 1);
+	part = min(len, SHM_RING_SIZE - pos);
+	memcpy(sh->wring + pos, s->wdata + s->wdata_pos, part);
+	memcpy(sh->wring, s->wdata + s->wdata_pos + part, len - part);
+	InterlockedExchange(&sh->wctl->head, (int32)(head + len));
+
+	s->wdata_pos += len;
+	if( s->wdata_pos == s->wdata_size )
+		s->wdata_size = s->wdata_pos = 0;
+#ifdef SHOW_SERVER_STATS
+	socket_data_o += len;
+	socket_data_qo -= len;
+#endif
+
+	// the reader might sleep if it had taken everything, wake it up
+	if( (uint32)InterlockedCompareExchange(&sh->wctl->tail, 0, 0) == head )
+		sSend(fd, "", 1, MSG_NOSIGNAL);
+	return 0;
+}
+
+/// Copies the data of the ring to the read fifo, as much as fits.
+static void shm_unpack(int fd)
+{
+	struct socket_data* s = session[fd];
+	struct socket_shm* sh = s->shm;
+
+	for(;;) {
+		uint32 tail = (uint32)sh->rctl->tail;
+		uint32 head = (uint32)InterlockedCompareExchange(&sh->rctl->head, 0, 0);
+		uint32 len, pos, part;
+
+		if( head == tail )
+			break;
+		if( s->max_rdata - s->rdata_size < head - tail && s->rdata_pos ) {
+			s->rdata_size -= s->rdata_pos;
+			memmove(s->rdata, s->rdata + s->rdata_pos, s->rdata_size);
+			s->rdata_pos = 0;
+		}
+		len = (uint32)min(head - tail, s->max_rdata - s->rdata_size);
+		if( len == 0 )
+			break; // wait until the parse function made room
+
+		pos = tail & (SHM_RING_SIZE - 1);
+		part = min(len, SHM_RING_SIZE - pos);
+		memcpy(s->rdata + s->rdata_size, sh->rring + pos, part);
+		memcpy(s->rdata + s->rdata_size + part, sh->rring, len - part);
+		s->rdata_size += len;
+		s->rdata_tick = last_tick;
+		InterlockedExchange(&sh->rctl->tail, (int32)(tail + len));
+#ifdef SHOW_SERVER_STATS
+		socket_data_i += len;
+		socket_data_qi += len;
+#endif
+	}
+}
+
+/// Reads the wake up bytes of the TCP connection, then the ring.
+static int recv_shm(int fd)
+{
+	char buf[256];
+	int len;
+
+	if( !session_isActive(fd) )
+		return -1;
+
+	len = sRecv(fd, buf, sizeof(buf), 0);
+	if( len == SOCKET_ERROR ) {
+		if( sErrno != S_EWOULDBLOCK )
+			set_eof(fd);
+		return 0;
+	}
+	if( len == 0 ) {
+		set_eof(fd);
+		return 0;
+	}
+	shm_unpack(fd);
+	return 0;
+}
+
+/// Drops the shared memory of a link the other end refused.
+void socket_shm_close(int fd)
+{
+	if( session_isValid(fd) && session[fd]->shm && !session[fd]->shm->send && !session[fd]->shm->recv )
+		shm_close(fd);
+}
+
+/// Sends the data queued from now on through the shared memory. The data queued
+/// before (like the packet telling the other end to switch) still goes over TCP.
+void socket_shm_send(int fd)
+{
+	struct socket_shm* sh;
+
+	if( !session_isValid(fd) || (sh = session[fd]->shm) == NULL || sh->send )
+		return;
+	sh->send = true;
+	sh->wtcp = session[fd]->wdata_size - session[fd]->wdata_pos;
+	session[fd]->func_send = send_shm;
+}
+
+/// Reads from the shared memory from now on. Must be called right after skipping the packet
+/// that announced the switch, the rest of the read fifo are wake up bytes.
+void socket_shm_recv(int fd)
+{
+	struct socket_data* s;
+	struct socket_shm* sh;
+
+	if( !session_isValid(fd) || (sh = session[fd]->shm) == NULL || sh->recv )
+		return;
+	s = session[fd];
+	sh->recv = true;
+	if( s->max_rdata < FIFOSIZE_SERVERLINK )
+		realloc_fifo(fd, FIFOSIZE_SERVERLINK, (unsigned int)s->max_wdata);
+#ifdef SHOW_SERVER_STATS
+	socket_data_qi -= s->rdata_size - s->rdata_pos;
+#endif
+	s->rdata_size = s->rdata_pos;
+	s->func_recv = recv_shm;
+	shm_unpack(fd);
+}
+#else
+bool socket_shm_local(int fd) { return false; }
+bool socket_shm_create(int fd, char* name, uint32* key) { return false; }
+bool socket_shm_open(int fd, const char* name, uint32 key) { return false; }
+void socket_shm_close(int fd) {}
+void socket_shm_send(int fd) {}
+void socket_shm_recv(int fd) {}
+#endif
+
 /*======================================
  *	CORE : Connection functions
  *--------------------------------------*/
@@ -671,7 +1358,15 @@ static void delete_session(int fd)
 	{
 #ifdef SHOW_SERVER_STATS
 		socket_data_qi -= session[fd]->rdata_size - session[fd]->rdata_pos;
-		socket_data_qo -= session[fd]->wdata_size;
+		socket_data_qo -= session[fd]->wdata_size - session[fd]->wdata_pos;
+#endif
+		if( session[fd]->frame ) {
+			aFree(session[fd]->frame->rbuf);
+			aFree(session[fd]->frame);
+		}
+#ifndef WIN32
+		if( session[fd]->shm )
+			shm_close(fd);
 #endif
 		aFree(session[fd]->rdata);
 		aFree(session[fd]->wdata);
@@ -681,11 +1376,30 @@ static void delete_session(int fd)
 	}
 }
 
+/// Moves the unsent data of the write fifo to its start.
+/// Only done when the fifo runs out of room at its end, instead of after every send.
+static void wfifo_compact(struct socket_data* s)
+{
+	if( s->wdata_pos == 0 )
+		return;
+	memmove(s->wdata, s->wdata + s->wdata_pos, s->wdata_size - s->wdata_pos);
+#ifdef SHOW_SERVER_STATS
+	socket_data_m += s->wdata_size - s->wdata_pos;
+#endif
+	if( s->frame )
+		s->frame->wenc -= s->wdata_pos;
+	s->wdata_size -= s->wdata_pos;
+	s->wdata_pos = 0;
+}
+
 int realloc_fifo(int fd, unsigned int rfifo_size, unsigned int wfifo_size)
 {
 	if( !session_isValid(fd) )
 		return 0;
 
+	RFIFOFLUSH(fd);
+	wfifo_compact(session[fd]);
+
 	if( session[fd]->max_rdata != rfifo_size && session[fd]->rdata_size < rfifo_size) {
 		RECREATE(session[fd]->rdata, unsigned char, rfifo_size);
 		session[fd]->max_rdata  = rfifo_size;
@@ -705,6 +1419,9 @@ int realloc_writefifo(int fd, size_t addition)
 	if( !session_isValid(fd) ) // might not happen
 		return 0;
 
+	if( session[fd]->wdata_size + addition > session[fd]->max_wdata )
+		wfifo_compact(session[fd]); // reuse the room of the data already sent first
+
 	if( session[fd]->wdata_size + addition  > session[fd]->max_wdata )
 	{	// grow rule; grow in multiples of WFIFO_SIZE
 		newsize = WFIFO_SIZE;
@@ -747,6 +1464,26 @@ int RFIFOSKIP(int fd, size_t len)
 	return 0;
 }
 
+/// discard the processed data of the RFIFO
+/// The remaining data is only moved to the start of the buffer once half of it
+/// is used up, the parsers read the packets in place until then.
+int RFIFOFLUSH(int fd)
+{
+	struct socket_data *s = session[fd];
+
+	if( s->rdata_size == s->rdata_pos ) {
+		s->rdata_size = s->rdata_pos = 0;
+	} else if( s->rdata_pos > 0 && s->max_rdata - s->rdata_size < s->max_rdata / 2 ) {
+		s->rdata_size -= s->rdata_pos;
+		memmove(s->rdata, s->rdata + s->rdata_pos, s->rdata_size);
+#ifdef SHOW_SERVER_STATS
+		socket_data_m += s->rdata_size;
+#endif
+		s->rdata_pos = 0;
+	}
+	return 0;
+}
+
 /// advance the WFIFO cursor (marking 'len' bytes for sending)
 int WFIFOSET(int fd, size_t len)
 {
@@ -789,13 +1526,17 @@ int WFIFOSET(int fd, size_t len)
 			return 0;
 		}
 
-		if( s->wdata_size+len > WFIFO_MAX ) {// reached maximum write fifo size
+		if( s->wdata_size-s->wdata_pos+len > WFIFO_MAX ) {// reached maximum write fifo size
 			ShowError("WFIFOSET: Maximum write buffer size for client connection %d exceeded, most likely caused by packet 0x%04x (len=%u, ip=%lu.%lu.%lu.%lu).\n", fd, WFIFOW(fd,0), len, CONVIP(s->client_addr));
 			set_eof(fd);
 			return 0;
 		}
 
+		if( sendhook_func )
+			sendhook_func(fd, s->wdata + s->wdata_size, len);
 	}
+	else if( link_stats )
+		socket_link_count(WFIFOW(fd,0), len);
 	// Gepard Shield
 	if (is_gepard_active == true)
 	{
@@ -807,7 +1548,7 @@ int WFIFOSET(int fd, size_t len)
 	socket_data_qo += len;
 #endif
 	//If the interserver has 200% of its normal size full, flush the data.
-	if( s->flag.server && s->wdata_size >= 2*FIFOSIZE_SERVERLINK )
+	if( s->flag.server && s->wdata_size-s->wdata_pos >= 2*FIFOSIZE_SERVERLINK )
 		flush_fifo(fd);
 
 	// always keep a WFIFO_SIZE reserve in the buffer
@@ -832,6 +1573,8 @@ int do_sockets(int next)
 
 	// PRESEND Timers are executed before do_sendrecv and can send packets and/or set sessions to eof.
 	// Send remaining data and process client-side disconnects here.
+	if( presend_func )
+		presend_func();
 #ifdef SEND_SHORTLIST
 	send_shortlist_do_sends();
 #else
@@ -844,6 +1587,7 @@ int do_sockets(int next)
 			session[i]->func_send(i);
 	}
 #endif
+	perf_mark(PERF_SEND);
 
 	// can timeout until the next tick
 	timeout.tv_sec  = next/1000;
@@ -851,6 +1595,7 @@ int do_sockets(int next)
 
 	memcpy(&rfd, &readfds, sizeof(rfd));
 	ret = sSelect(fd_max, &rfd, NULL, NULL, &timeout);
+	perf_mark(PERF_WAIT);
 
 	if( ret == SOCKET_ERROR )
 	{
@@ -883,8 +1628,11 @@ int do_sockets(int next)
 		}
 	}
 #endif
+	perf_mark(PERF_RECV);
 
 	// POSTSEND Send remaining data and handle eof sessions.
+	if( presend_func )
+		presend_func();
 #ifdef SEND_SHORTLIST
 	send_shortlist_do_sends();
 #else
@@ -902,6 +1650,7 @@ int do_sockets(int next)
 		}
 	}
 #endif
+	perf_mark(PERF_SEND);
 
 	// parse input data on each socket
 	for(i = 1; i < fd_max; i++)
@@ -919,25 +1668,33 @@ int do_sockets(int next)
 			}
 		}
 
+		if( session[i]->frame && session[i]->frame->rbuf_len )
+			frame_unpack(i); // frames that did not fit into the read fifo last time
+#ifndef WIN32
+		if( session[i]->shm && session[i]->shm->recv )
+			shm_unpack(i); // data that did not fit into the read fifo, or a missed wake up
+#endif
+
 		session[i]->func_parse(i);
 
 		if(!session[i])
 			continue;
 
 		// after parse, check client's RFIFO size to know if there is an invalid packet (too big and not parsed)
-		if (session[i]->rdata_size == RFIFO_SIZE && session[i]->max_rdata == RFIFO_SIZE) {
+		if (session[i]->rdata_size - session[i]->rdata_pos == RFIFO_SIZE && session[i]->max_rdata == RFIFO_SIZE) {
 			set_eof(i);
 			continue;
 		}
 		RFIFOFLUSH(i);
 	}
+	perf_mark(PERF_PARSE);
 
 #ifdef SHOW_SERVER_STATS
 	if (last_tick != socket_data_last_tick)
 	{
 		char buf[1024];
 		
-		sprintf(buf, "In: %.03f kB/s (%.03f kB/s, Q: %.03f kB) | Out: %.03f kB/s (%.03f kB/s, Q: %.03f kB) | RAM: %.03f MB", socket_data_i/1024., socket_data_ci/1024., socket_data_qi/1024., socket_data_o/1024., socket_data_co/1024., socket_data_qo/1024., malloc_usage()/1024.);
+		sprintf(buf, "In: %.03f kB/s (%.03f kB/s, Q: %.03f kB) | Out: %.03f kB/s (%.03f kB/s, Q: %.03f kB) | Moved: %.03f kB/s | RAM: %.03f MB", socket_data_i/1024., socket_data_ci/1024., socket_data_qi/1024., socket_data_o/1024., socket_data_co/1024., socket_data_qo/1024., socket_data_m/1024., malloc_usage()/1024.);
 #ifdef _WIN32
 		SetConsoleTitle(buf);
 #else
@@ -946,6 +1703,7 @@ int do_sockets(int next)
 		socket_data_last_tick = last_tick;
 		socket_data_i = socket_data_ci = 0;
 		socket_data_o = socket_data_co = 0;
+		socket_data_m = 0;
 	}
 #endif
 
@@ -1245,6 +2003,18 @@ int socket_config_read(const char* cfgName)
 		else if (!strcmpi(w1,"debug"))
 			access_debug = config_switch(w2);
 #endif
+		else if (!strcmpi(w1, "interserver_framing"))
+			frame_enabled = (config_switch(w2) != 0);
+		else if (!strcmpi(w1, "interserver_compress"))
+			frame_compress = max(atoi(w2), 0);
+		else if (!strcmpi(w1, "interserver_shm"))
+#ifndef WIN32
+			shm_enabled = (config_switch(w2) != 0);
+#else
+			;
+#endif
+		else if (!strcmpi(w1, "interserver_stats"))
+			socket_link_stats(config_switch(w2) != 0);
 		else if (!strcmpi(w1, "import"))
 			socket_config_read(w2);
 		else
@@ -1281,6 +2051,11 @@ void socket_final(void)
 		if(session[i])
 			do_close(i);
 
+	socket_link_stats(false);
+	aFree(frame_buf);
+	frame_buf = NULL;
+	frame_buf_size = 0;
+
 	// session[0]
 	aFree(session[0]->rdata);
 	aFree(session[0]->wdata);
@@ -2017,22 +2792,43 @@ void gepard_init(int fd, uint16 server_type)
 	gepard_session_init(fd, recv_key, send_key, sync_key);
 }
 
+// The key table is indexed with a mask instead of % (KEY_SIZE-1).
+#if ((KEY_SIZE-1) & (KEY_SIZE-2)) != 0
+	#error KEY_SIZE-1 must be a power of two
+#endif
+
+/// Encrypts or decrypts data_size bytes with the stream of link.
+/// The state is worked on in locals and written back at the end, since the
+/// byte stores through in_data/out_data would otherwise force the compiler
+/// to reload link after every byte (uint8 pointers may alias anything).
 void gepard_enc_dec(uint8* in_data, uint8* out_data, uint32 data_size, struct gepard_crypt_link* link)
 {	
+	uint8 key[KEY_SIZE];
+	uint8 pos_1 = link->pos_1;
+	uint8 pos_2 = link->pos_2;
+	uint8 pos_3 = link->pos_3;
+	uint8 step = (uint8)(data_size % 0xFF);
 	uint32 i;
 
+	memcpy(key, link->key, sizeof(key));
+
 	for(i = 0; i < data_size; ++i)
 	{
-		link->pos_1 += link->key[link->pos_3 % (KEY_SIZE-1)];
-		link->pos_2 += (61 - link->pos_1) * 7;
-		link->key[link->pos_2 % (KEY_SIZE-1)] ^= link->pos_1;
-		link->pos_1 += (link->pos_2 + link->pos_3) / 4;
-		link->key[link->pos_3 % (KEY_SIZE-1)] ^= link->pos_1;
-		out_data[i] = in_data[i] ^ link->pos_1;
-		link->pos_1 -= 25;
-		link->pos_2 -= data_size % 0xFF;
-		link->pos_3++;
-	}
+		pos_1 += key[pos_3 & (KEY_SIZE-2)];
+		pos_2 += (61 - pos_1) * 7;
+		key[pos_2 & (KEY_SIZE-2)] ^= pos_1;
+		pos_1 += (pos_2 + pos_3) / 4;
+		key[pos_3 & (KEY_SIZE-2)] ^= pos_1;
+		out_data[i] = in_data[i] ^ pos_1;
+		pos_1 -= 25;
+		pos_2 -= step;
+		pos_3++;
+	}
+
+	memcpy(link->key, key, sizeof(key));
+	link->pos_1 = pos_1;
+	link->pos_2 = pos_2;
+	link->pos_3 = pos_3;
 }
 
 void gepard_send_info(int fd, unsigned short info_type, char* message)
@@ -134,16 +134,6 @@ void gepard_enc_dec(uint8* in_data, uint8* out_data, unsigned int data_size, str
 #define WFIFOSPACE(fd) (session[fd]->max_wdata - session[fd]->wdata_size)
 
 #define RFIFOREST(fd)  (session[fd]->flag.eof ? 0 : session[fd]->rdata_size - session[fd]->rdata_pos)
-#define RFIFOFLUSH(fd) \
-	do { \
-		if(session[fd]->rdata_size == session[fd]->rdata_pos){ \
-			session[fd]->rdata_size = session[fd]->rdata_pos = 0; \
-		} else { \
-			session[fd]->rdata_size -= session[fd]->rdata_pos; \
-			memmove(session[fd]->rdata, session[fd]->rdata+session[fd]->rdata_pos, session[fd]->rdata_size); \
-			session[fd]->rdata_pos = 0; \
-		} \
-	} while(0)
 
 // buffer I/O macros
 #define RBUFP(p,pos) (((uint8*)(p)) + (pos))
@@ -169,6 +159,8 @@ void gepard_enc_dec(uint8* in_data, uint8* out_data, unsigned int data_size, str
 typedef int (*RecvFunc)(int fd);
 typedef int (*SendFunc)(int fd);
 typedef int (*ParseFunc)(int fd);
+typedef void (*PresendFunc)(void);
+typedef void (*SendHookFunc)(int fd, const uint8* data, size_t len);
 
 struct socket_data
 {
@@ -182,8 +174,8 @@ struct socket_data
 
 	uint8 *rdata, *wdata;
 	size_t max_rdata, max_wdata;
-	size_t rdata_size, wdata_size;
-	size_t rdata_pos;
+	size_t rdata_size, wdata_size; // End of the data in the fifo
+	size_t rdata_pos, wdata_pos; // Start of the data not parsed/sent yet
 	time_t rdata_tick; // time of last recv (for detecting timeouts); zero when timeout is disabled
 
 	RecvFunc func_recv;
@@ -191,6 +183,8 @@ struct socket_data
 	ParseFunc func_parse;
 
 	void* session_data; // stores application-specific data related to the session
+	struct socket_frame* frame; // framing of a server link, NULL until it is switched on
+	struct socket_shm* shm; // shared memory of a server link, NULL unless both ends are on this host
 	
 	// Gepard Shield
 	struct gepard_info_data gepard_info;
@@ -224,6 +218,7 @@ int realloc_fifo(int fd, unsigned int rfifo_size, unsigned int wfifo_size);
 int realloc_writefifo(int fd, size_t addition);
 int WFIFOSET(int fd, size_t len);
 int RFIFOSKIP(int fd, size_t len);
+int RFIFOFLUSH(int fd);
 
 int do_sockets(int next);
 void do_close(int fd);
@@ -235,6 +230,27 @@ extern void flush_fifos(void);
 extern void set_nonblocking(int fd, unsigned long yes);
 
 void set_defaultparse(ParseFunc defaultparse);
+void set_presend(PresendFunc presend);
+void set_sendhook(SendHookFunc sendhook);
+
+// Framed server links, optionally compressed (interserver_* in packet_athena.conf).
+// The side asking for it switches its sending after its request went out and its
+// receiving once the answer arrived, the other side the other way round.
+bool socket_frame_enabled(void);
+void socket_frame_send(int fd);
+void socket_frame_recv(int fd);
+void socket_link_stats(bool enable);
+void socket_link_report(int top);
+
+// Shared memory server links between servers on the same host (interserver_shm in packet_athena.conf).
+// Negotiated like the frames, the side that connected creates the memory and sends its name and key.
+#define SHM_NAME_LENGTH 32
+bool socket_shm_local(int fd);
+bool socket_shm_create(int fd, char* name, uint32* key);
+bool socket_shm_open(int fd, const char* name, uint32 key);
+void socket_shm_close(int fd);
+void socket_shm_send(int fd);
+void socket_shm_recv(int fd);
 
 
 /// Server operation request
@@ -6,6 +6,7 @@
 #include "showmsg.h"
 #include "strlib.h"
 #include "timer.h"
+#include "perf.h"
 #include "sql.h"
 
 #ifdef WIN32
@@ -30,6 +31,7 @@ struct Sql
 	MYSQL_ROW row;
 	unsigned long* lengths;
 	int keepalive;
+	bool threaded; // used outside of the main thread, see Sql_SetThreaded
 };
 
 
@@ -104,10 +106,13 @@ int Sql_Connect(Sql* self, const char* user, const char* passwd, const char* hos
 	StringBuf_Clear(&self->buf);
 	if( !mysql_real_connect(&self->handle, host, user, passwd, db, (unsigned int)port, NULL/*unix_socket*/, 0/*clientflag*/) )
 	{
-		ShowSQL("%s\n", mysql_error(&self->handle));
+		if( !self->threaded )
+			ShowSQL("%s\n", mysql_error(&self->handle));
 		return SQL_ERROR;
 	}
 
+	if( self->threaded )
+		return SQL_SUCCESS; // timers are main thread only
 	self->keepalive = Sql_P_Keepalive(self);
 	if( self->keepalive == INVALID_TIMER )
 	{
@@ -192,6 +197,25 @@ int Sql_Ping(Sql* self)
 
 
 
+/// Prepares a handle for use outside of the main thread.
+void Sql_SetThreaded(Sql* self)
+{
+	if( self )
+		self->threaded = true;
+}
+
+
+
+/// Returns the error of the last failed operation on the connection.
+const char* Sql_GetError(Sql* self)
+{
+	if( self == NULL )
+		return "";
+	return mysql_error(&self->handle);
+}
+
+
+
 /// Wrapper function for Sql_Ping.
 ///
 /// @private
@@ -252,6 +276,31 @@ size_t Sql_EscapeStringLen(Sql* self, char *out_to, const char *from, size_t fro
 
 
 
+/// Sends the query in the buffer and stores its result.
+static int Sql_P_Query(Sql* self)
+{
+	uint64 start = perf_start();
+	int res = SQL_SUCCESS;
+
+	if( mysql_real_query(&self->handle, StringBuf_Value(&self->buf), (unsigned long)StringBuf_Length(&self->buf)) )
+		res = SQL_ERROR;
+	else
+	{
+		self->result = mysql_store_result(&self->handle);
+		if( mysql_errno(&self->handle) != 0 )
+			res = SQL_ERROR;
+	}
+	if( res == SQL_ERROR && !self->threaded )
+	{
+		ShowSQL("DB error - %s\n", mysql_error(&self->handle));
+		ra_mysql_error_handler(mysql_errno(&self->handle));
+	}
+	perf_sql(start);
+	return res;
+}
+
+
+
 /// Executes a query.
 int Sql_Query(Sql* self, const char* query, ...)
 {
@@ -276,20 +325,7 @@ int Sql_QueryV(Sql* self, const char* query, va_list args)
 	Sql_FreeResult(self);
 	StringBuf_Clear(&self->buf);
 	StringBuf_Vprintf(&self->buf, query, args);
-	if( mysql_real_query(&self->handle, StringBuf_Value(&self->buf), (unsigned long)StringBuf_Length(&self->buf)) )
-	{
-		ShowSQL("DB error - %s\n", mysql_error(&self->handle));
-		ra_mysql_error_handler(mysql_errno(&self->handle));
-		return SQL_ERROR;
-	}
-	self->result = mysql_store_result(&self->handle);
-	if( mysql_errno(&self->handle) != 0 )
-	{
-		ShowSQL("DB error - %s\n", mysql_error(&self->handle));
-		ra_mysql_error_handler(mysql_errno(&self->handle));
-		return SQL_ERROR;
-	}
-	return SQL_SUCCESS;
+	return Sql_P_Query(self);
 }
 
 
@@ -303,20 +339,7 @@ int Sql_QueryStr(Sql* self, const char* query)
 	Sql_FreeResult(self);
 	StringBuf_Clear(&self->buf);
 	StringBuf_AppendStr(&self->buf, query);
-	if( mysql_real_query(&self->handle, StringBuf_Value(&self->buf), (unsigned long)StringBuf_Length(&self->buf)) )
-	{
-		ShowSQL("DB error - %s\n", mysql_error(&self->handle));
-		ra_mysql_error_handler(mysql_errno(&self->handle));
-		return SQL_ERROR;
-	}
-	self->result = mysql_store_result(&self->handle);
-	if( mysql_errno(&self->handle) != 0 )
-	{
-		ShowSQL("DB error - %s\n", mysql_error(&self->handle));
-		ra_mysql_error_handler(mysql_errno(&self->handle));
-		return SQL_ERROR;
-	}
-	return SQL_SUCCESS;
+	return Sql_P_Query(self);
 }
 
 
@@ -732,15 +755,19 @@ int SqlStmt_BindParam(SqlStmt* self, size_t idx, enum SqlDataType buffer_type, v
 /// Executes the prepared statement.
 int SqlStmt_Execute(SqlStmt* self)
 {
+	uint64 start;
+
 	if( self == NULL )
 		return SQL_ERROR;
 
 	SqlStmt_FreeResult(self);
+	start = perf_start();
 	if( (self->bind_params && mysql_stmt_bind_param(self->stmt, self->params)) ||
 		mysql_stmt_execute(self->stmt) )
 	{
 		ShowSQL("DB error - %s\n", mysql_stmt_error(self->stmt));
 		ra_mysql_error_handler(mysql_stmt_errno(self->stmt));
+		perf_sql(start);
 		return SQL_ERROR;
 	}
 	self->bind_columns = false;
@@ -748,8 +775,10 @@ int SqlStmt_Execute(SqlStmt* self)
 	{
 		ShowSQL("DB error - %s\n", mysql_stmt_error(self->stmt));
 		ra_mysql_error_handler(mysql_stmt_errno(self->stmt));
+		perf_sql(start);
 		return SQL_ERROR;
 	}
+	perf_sql(start);
 
 	return SQL_SUCCESS;
 }
@@ -107,6 +107,18 @@ int Sql_Ping(Sql* self);
 
 
 
+/// Prepares a handle for use outside of the main thread, before Sql_Connect.
+/// Its errors are not shown but kept for Sql_GetError, and no keepalive timer
+/// is set up for it (the connection reconnects by itself after a timeout).
+void Sql_SetThreaded(Sql* self);
+
+
+
+/// Returns the error of the last failed operation on the connection, "" if none.
+const char* Sql_GetError(Sql* self);
+
+
+
 /// Escapes a string.
 /// The output buffer must be at least strlen(from)*2+1 in size.
 ///
@@ -194,6 +194,9 @@ rAthread rathread_createEx( rAthreadProc entryPoint,  void *param,  size_t szSta
 	handle->proc = entryPoint;
 	handle->param = param;
 
+	// the memory manager is shared with the new thread from now on
+	malloc_set_threadsafe();
+
 #ifdef WIN32
 	handle->hThread = CreateThread(NULL, szStack, _raThreadMainRedirector, (void*)handle, 0, NULL);
 #else
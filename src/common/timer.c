@@ -8,6 +8,7 @@
 #include "utils.h"
 #include "nullpo.h"
 #include "timer.h"
+#include "perf.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -43,8 +44,26 @@ static int free_timer_list_pos = 0;
 /// @return negative if tid1 is top, positive if tid2 is top, 0 if equal
 #define DIFFTICK_MINTOPCMP(tid1,tid2) DIFF_TICK(timer_data[tid1].tick,timer_data[tid2].tick)
 
-// timer heap (binary heap of tid's)
-static BHEAP_VAR(int, timer_heap);
+// timer heaps (binary heaps of tid's), one per priority class
+static VECTOR_DECL(int) timer_heap[TIMER_PRIORITY_MAX];
+
+// network-critical timer functions, never deferred by the tick budget
+#define TIMER_CRITICAL_MAX 32
+static TimerFunc timer_critical[TIMER_CRITICAL_MAX];
+static int timer_critical_count = 0;
+
+// tick budget of the bulk timers and overrun threshold of a single call, in microseconds (0 = off)
+static unsigned int timer_budget = 0;
+static unsigned int timer_overrun = 0;
+static int timer_report_tid = INVALID_TIMER;
+
+// budget statistics since the last report
+static struct {
+	unsigned int cycles; // do_timer calls that deferred bulk timers
+	unsigned int max_delay; // ms, oldest deferred timer
+	unsigned int overruns; // calls of unnamed functions over timer_overrun
+	unsigned int overrun_max; // us
+} timer_stats;
 
 
 // server startup time
@@ -58,6 +77,8 @@ struct timer_func_list {
 	struct timer_func_list* next;
 	TimerFunc func;
 	char* name;
+	unsigned int overruns; // calls over timer_overrun since the last report
+	unsigned int overrun_max; // us
 } *tfl_root = NULL;
 
 /// Sets the name of a timer function.
@@ -190,15 +211,48 @@ unsigned int gettick(void)
 #endif
 //////////////////////////////////////////////////////////////////////////
 
+/// Microsecond resolution clock for measuring durations.
+/// Never cached, unrelated to gettick() and only meaningful as a difference.
+uint64 gettick_usec(void)
+{
+#if defined(WIN32)
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if( freq.QuadPart == 0 )
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(HAVE_MONOTONIC_CLOCK)
+	struct timespec tval;
+	clock_gettime(CLOCK_MONOTONIC, &tval);
+	return (uint64)tval.tv_sec * 1000000 + tval.tv_nsec / 1000;
+#else
+	struct timeval tval;
+	gettimeofday(&tval, NULL);
+	return (uint64)tval.tv_sec * 1000000 + tval.tv_usec;
+#endif
+}
+
 /*======================================
  * 	CORE : Timer Heap
  *--------------------------------------*/
 
-/// Adds a timer to the timer_heap
+/// Returns the priority class of a timer function.
+static enum e_timer_priority timer_priority(TimerFunc func)
+{
+	int i;
+
+	ARR_FIND(0, timer_critical_count, i, timer_critical[i] == func);
+	return ( i < timer_critical_count ) ? TIMER_PRIORITY_CRITICAL : TIMER_PRIORITY_BULK;
+}
+
+/// Adds a timer to the timer_heap of its priority class
 static void push_timer_heap(int tid)
 {
-	BHEAP_ENSURE(timer_heap, 1, 256);
-	BHEAP_PUSH(timer_heap, tid, DIFFTICK_MINTOPCMP, swap);
+	enum e_timer_priority p = timer_priority(timer_data[tid].func);
+
+	BHEAP_ENSURE(timer_heap[p], 1, 256);
+	BHEAP_PUSH(timer_heap[p], tid, DIFFTICK_MINTOPCMP, swap);
 }
 
 /*==========================
@@ -319,10 +373,16 @@ int addtick_timer(int tid, unsigned int tick)
 int settick_timer(int tid, unsigned int tick)
 {
 	size_t i;
+	int p;
 
 	// search timer position
-	ARR_FIND(0, BHEAP_LENGTH(timer_heap), i, BHEAP_DATA(timer_heap)[i] == tid);
-	if( i == BHEAP_LENGTH(timer_heap) )
+	for( p = 0; p < TIMER_PRIORITY_MAX; p++ )
+	{
+		ARR_FIND(0, BHEAP_LENGTH(timer_heap[p]), i, BHEAP_DATA(timer_heap[p])[i] == tid);
+		if( i < BHEAP_LENGTH(timer_heap[p]) )
+			break;
+	}
+	if( p == TIMER_PRIORITY_MAX )
 	{
 		ShowError("settick_timer: no such timer %d (%p(%s))\n", tid, timer_data[tid].func, search_timer_func_list(timer_data[tid].func));
 		return -1;
@@ -335,38 +395,150 @@ int settick_timer(int tid, unsigned int tick)
 		return (int)tick;// nothing to do, already in propper position
 
 	// pop and push adjusted timer
-	BHEAP_POPINDEX(timer_heap, i, DIFFTICK_MINTOPCMP, swap);
+	BHEAP_POPINDEX(timer_heap[p], i, DIFFTICK_MINTOPCMP, swap);
 	timer_data[tid].tick = tick;
-	BHEAP_PUSH(timer_heap, tid, DIFFTICK_MINTOPCMP, swap);
+	BHEAP_PUSH(timer_heap[p], tid, DIFFTICK_MINTOPCMP, swap);
 	return (int)tick;
 }
 
-/// Executes all expired timers.
-/// Returns the value of the smallest non-expired timer (or 1 second if there aren't any).
+/// Marks a timer function as network-critical. Its timers always run on time,
+/// even when the bulk timers of the tick are deferred by the budget.
+/// Call before any timer of the function is started.
+void timer_set_critical(TimerFunc func)
+{
+	if( timer_priority(func) == TIMER_PRIORITY_CRITICAL )
+		return;
+	if( timer_critical_count == TIMER_CRITICAL_MAX )
+	{
+		ShowError("timer_set_critical: too many critical functions, %p(%s) ignored (max %d).\n", func, search_timer_func_list(func), TIMER_CRITICAL_MAX);
+		return;
+	}
+	timer_critical[timer_critical_count++] = func;
+}
+
+/// Accounts a timer call that took longer than timer_overrun.
+static void timer_account_overrun(TimerFunc func, unsigned int usec)
+{
+	struct timer_func_list* tfl;
+
+	for( tfl = tfl_root; tfl != NULL && tfl->func != func; tfl = tfl->next );
+	if( tfl != NULL )
+	{
+		tfl->overruns++;
+		tfl->overrun_max = max(tfl->overrun_max, usec);
+	}
+	else
+	{
+		timer_stats.overruns++;
+		timer_stats.overrun_max = max(timer_stats.overrun_max, usec);
+	}
+}
+
+/// Reports the deferred ticks and the timer functions over timer_overrun since the last report.
+static int timer_report(int tid, unsigned int tick, int id, intptr_t data)
+{
+	struct timer_func_list* tfl;
+
+	if( timer_stats.cycles )
+		ShowWarning("Timer budget: %u ticks deferred bulk timers in the last minute, delaying them by up to %ums.\n", timer_stats.cycles, timer_stats.max_delay);
+	for( tfl = tfl_root; tfl != NULL; tfl = tfl->next )
+	{
+		if( !tfl->overruns )
+			continue;
+		ShowWarning("Timer overrun: %s took more than %ums %u times in the last minute (longest %.1fms).\n", tfl->name, timer_overrun/1000, tfl->overruns, tfl->overrun_max/1000.);
+		tfl->overruns = tfl->overrun_max = 0;
+	}
+	if( timer_stats.overruns )
+		ShowWarning("Timer overrun: unnamed functions took more than %ums %u times in the last minute (longest %.1fms).\n", timer_overrun/1000, timer_stats.overruns, timer_stats.overrun_max/1000.);
+	memset(&timer_stats, 0, sizeof(timer_stats));
+	return 0;
+}
+
+/// Starts or stops the report, it runs while the budget or the overrun check is on.
+static void timer_report_update(void)
+{
+	if( (timer_budget || timer_overrun) && timer_report_tid == INVALID_TIMER )
+		timer_report_tid = add_timer_interval(gettick() + 60000, timer_report, 0, 0, 60000);
+	else if( !timer_budget && !timer_overrun && timer_report_tid != INVALID_TIMER )
+	{
+		delete_timer(timer_report_tid, timer_report);
+		timer_report_tid = INVALID_TIMER;
+	}
+}
+
+/// Sets the time in ms the bulk timers may use per tick before the rest is
+/// deferred to the next loop iteration (0 = no limit).
+void timer_set_budget(int ms)
+{
+	timer_budget = (unsigned int)max(ms, 0)*1000;
+	timer_report_update();
+}
+
+/// Sets the time in ms from which a single timer call is reported as an overrun (0 = off).
+void timer_set_overrun(int ms)
+{
+	timer_overrun = (unsigned int)max(ms, 0)*1000;
+	timer_report_update();
+}
+
+/// Executes all expired timers, in tick order.
+/// Once the bulk timers used up timer_budget, the remaining expired bulk timers
+/// are left for the next call and only network-critical timers still run.
+/// Returns the value of the smallest non-expired timer (or 1 second if there aren't any),
+/// 0 if expired timers were deferred.
 int do_timer(unsigned int tick)
 {
 	int diff = TIMER_MAX_INTERVAL; // return value
+	uint64 start = 0, last = 0;
+	bool deferred = false;
+
+	if( timer_budget || timer_overrun )
+		start = last = gettick_usec();
 
 	// process all timers one by one
-	while( BHEAP_LENGTH(timer_heap) )
+	for(;;)
 	{
-		int tid = BHEAP_PEEK(timer_heap);// top element in heap (smallest tick)
+		enum e_timer_priority p = TIMER_PRIORITY_CRITICAL;
+		int tid;
+
+		// top element of the heaps (smallest tick)
+		if( !deferred && BHEAP_LENGTH(timer_heap[TIMER_PRIORITY_BULK]) &&
+			(!BHEAP_LENGTH(timer_heap[p]) || DIFFTICK_MINTOPCMP(BHEAP_PEEK(timer_heap[TIMER_PRIORITY_BULK]), BHEAP_PEEK(timer_heap[p])) < 0) )
+			p = TIMER_PRIORITY_BULK;
+		if( !BHEAP_LENGTH(timer_heap[p]) )
+			break;
+		tid = BHEAP_PEEK(timer_heap[p]);
 
 		diff = DIFF_TICK(timer_data[tid].tick, tick);
 		if( diff > 0 )
 			break; // no more expired timers to process
 
 		// remove timer
-		BHEAP_POP(timer_heap, DIFFTICK_MINTOPCMP, swap);
+		BHEAP_POP(timer_heap[p], DIFFTICK_MINTOPCMP, swap);
 		timer_data[tid].type |= TIMER_REMOVE_HEAP;
 
 		if( timer_data[tid].func )
 		{
+			TimerFunc func = timer_data[tid].func;
+			uint64 perf_usec = perf_start();
+
 			if( diff < -1000 )
 				// timer was delayed for more than 1 second, use current tick instead
-				timer_data[tid].func(tid, tick, timer_data[tid].id, timer_data[tid].data);
+				func(tid, tick, timer_data[tid].id, timer_data[tid].data);
 			else
-				timer_data[tid].func(tid, timer_data[tid].tick, timer_data[tid].id, timer_data[tid].data);
+				func(tid, timer_data[tid].tick, timer_data[tid].id, timer_data[tid].data);
+			perf_timer(func, perf_usec);
+
+			if( start )
+			{
+				uint64 now = gettick_usec();
+
+				if( timer_overrun && now - last >= timer_overrun )
+					timer_account_overrun(func, (unsigned int)(now - last));
+				if( timer_budget && p == TIMER_PRIORITY_BULK && now - start >= timer_budget )
+					deferred = true; // budget spent, bulk timers wait for the next call
+				last = now;
+			}
 		}
 
 		// in the case the function didn't change anything...
@@ -397,6 +569,19 @@ int do_timer(unsigned int tick)
 		}
 	}
 
+	if( deferred && BHEAP_LENGTH(timer_heap[TIMER_PRIORITY_BULK]) )
+	{
+		int bulk_diff = DIFF_TICK(timer_data[BHEAP_PEEK(timer_heap[TIMER_PRIORITY_BULK])].tick, tick);
+
+		if( bulk_diff <= 0 )
+		{// expired bulk timers are left, come back right after the sockets
+			timer_stats.cycles++;
+			timer_stats.max_delay = max(timer_stats.max_delay, (unsigned int)-bulk_diff);
+			return 0;
+		}
+		diff = min(diff, bulk_diff);
+	}
+
 	return cap_value(diff, TIMER_MIN_INTERVAL, TIMER_MAX_INTERVAL);
 }
 
@@ -505,6 +690,7 @@ double solve_time(char* modif_p) {
 
 void timer_init(void)
 {
+	add_timer_func_list(timer_report, "timer_report");
 #if defined(ENABLE_RDTSC)
 	rdtsc_calibrate();
 #endif
@@ -524,6 +710,7 @@ void timer_final(void)
 	}
 
 	if (timer_data) aFree(timer_data);
-	BHEAP_CLEAR(timer_heap);
+	BHEAP_CLEAR(timer_heap[TIMER_PRIORITY_CRITICAL]);
+	BHEAP_CLEAR(timer_heap[TIMER_PRIORITY_BULK]);
 	if (free_timer_list) aFree(free_timer_list);
 }
@@ -19,6 +19,13 @@ enum {
 	TIMER_REMOVE_HEAP = 0x10,
 };
 
+/// Priority classes of timer functions (see timer_set_critical)
+enum e_timer_priority {
+	TIMER_PRIORITY_CRITICAL = 0, ///< Network-critical, never deferred
+	TIMER_PRIORITY_BULK,         ///< Deferred to the next tick when the timer budget is spent
+	TIMER_PRIORITY_MAX
+};
+
 // Struct declaration
 
 typedef int (*TimerFunc)(int tid, unsigned int tick, int id, intptr_t data);
@@ -38,6 +45,7 @@ struct TimerData {
 
 unsigned int gettick(void);
 unsigned int gettick_nocache(void);
+uint64 gettick_usec(void);
 
 int add_timer(unsigned int tick, TimerFunc func, int id, intptr_t data);
 int add_timer_interval(unsigned int tick, TimerFunc func, int id, intptr_t data, int interval);
@@ -48,6 +56,10 @@ int addtick_timer(int tid, unsigned int tick);
 int settick_timer(int tid, unsigned int tick);
 
 int add_timer_func_list(TimerFunc func, char* name);
+char* search_timer_func_list(TimerFunc func);
+void timer_set_critical(TimerFunc func);
+void timer_set_budget(int ms);
+void timer_set_overrun(int ms);
 
 unsigned long get_uptime(void);
 
@@ -766,6 +766,76 @@ int logchrif_parse_accinfo(int fd) {
 	return 1;
 }
 
+/**
+ * Offer of the char-server to move the link to shared memory (interserver_shm).
+ * HA 0x2744
+ * <cmd>.W <stage>.B <key>.L <name>.32B
+ * AH 0x2745
+ * <cmd>.W <result>.B
+ * stage 0: offer, answered with result 0 when accepted or 1 when refused;
+ * stage 1: the char-server sends through the shared memory from now on
+ * @param fd: fd to parse from (char-serv)
+ * @return 0 not enough info transmitted, 1 success
+ */
+int logchrif_parse_shm(int fd){
+	uint8 stage;
+
+	if( RFIFOREST(fd) < 39 )
+		return 0;
+	stage = RFIFOB(fd,2);
+
+	if( stage == 0 ){
+		char name[SHM_NAME_LENGTH];
+		uint32 key = RFIFOL(fd,3);
+		bool ok;
+
+		safestrncpy(name, RFIFOCP(fd,7), sizeof(name));
+		RFIFOSKIP(fd,39);
+		ok = ( socket_shm_local(fd) && socket_shm_open(fd, name, key) );
+		WFIFOHEAD(fd,3);
+		WFIFOW(fd,0) = 0x2745;
+		WFIFOB(fd,2) = ok ? 0 : 1;
+		WFIFOSET(fd,3);
+		if( ok )
+			socket_shm_send(fd);
+	} else {
+		RFIFOSKIP(fd,39);
+		socket_shm_recv(fd);
+		ShowInfo("Link to the char-server (connection #%d) uses shared memory now.\n", fd);
+	}
+	return 1;
+}
+
+/**
+ * Switch of the link to frames, requested by the char-server (interserver_framing).
+ * HA 0x2746
+ * <cmd>.W <stage>.B
+ * AH 0x2747
+ * <cmd>.W
+ * stage 0: request, answered when framing is on here too; stage 1: the char-server sends frames from now on
+ * @param fd: fd to parse from (char-serv)
+ * @return 0 not enough info transmitted, 1 success
+ */
+int logchrif_parse_frame(int fd){
+	uint8 stage;
+
+	if( RFIFOREST(fd) < 3 )
+		return 0;
+	stage = RFIFOB(fd,2);
+	RFIFOSKIP(fd,3);
+
+	if( stage == 0 ){
+		if( socket_frame_enabled() ){
+			WFIFOHEAD(fd,2);
+			WFIFOW(fd,0) = 0x2747;
+			WFIFOSET(fd,2);
+			socket_frame_send(fd);
+		}
+	} else
+		socket_frame_recv(fd);
+	return 1;
+}
+
 /**
  * Entry point from char-server to log-server.
  * Function that checks incoming command, then splits it to the correct handler.
@@ -821,6 +891,8 @@ int logchrif_parse(int fd){
 			case 0x2739: next = logchrif_parse_pincode_authfail(fd); break;
 #endif
 			case 0x2742: next = logchrif_parse_reqvipdata(fd); break; //Vip sys
+			case 0x2744: next = logchrif_parse_shm(fd); break;
+			case 0x2746: next = logchrif_parse_frame(fd); break;
 			default:
 				ShowError("logchrif_parse: Unknown packet 0x%x from a char-server! Disconnecting!\n", command);
 				set_eof(fd);
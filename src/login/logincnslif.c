@@ -14,6 +14,7 @@
 #include "../common/cli.h"
 #include "../common/timer.h"
 #include "../common/strlib.h"
+#include "../common/socket.h"
 #include "login.h"
 #include "logincnslif.h"
 
@@ -145,10 +146,21 @@ int cnslif_parse(const char* buf){
 			}
 			ShowStatus("Console: Account '%s' created successfully.\n", username);
 		}
+		if( strcmpi("linkstats", type) == 0 ){
+			if( strcmpi("on", command) == 0 )
+				socket_link_stats(true);
+			else if( strcmpi("off", command) == 0 )
+				socket_link_stats(false);
+			else
+				socket_link_report(20);
+		}
 	}
 	else if( strcmpi("ers_report", type) == 0 ){
 		ers_report();
 	}
+	else if( strcmpi("linkstats", type) == 0 ){
+		socket_link_report(20);
+	}
 	else if( strcmpi("help", type) == 0 ){
 		ShowInfo("Available commands:\n");
 		ShowInfo("\t server:shutdown => Stops the server.\n");
@@ -156,6 +168,7 @@ int cnslif_parse(const char* buf){
 		ShowInfo("\t server:reloadconf => Reload config file: \"%s\"\n", login_config.loginconf_name);
 		ShowInfo("\t ers_report => Displays database usage.\n");
 		ShowInfo("\t create:<username> <password> <sex:M|F> => Creates a new account.\n");
+		ShowInfo("\t linkstats:<on|off|show> => Controls and shows the server link statistics.\n");
 	}
 	return 1;
 }
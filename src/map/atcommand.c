@@ -12,6 +12,7 @@
 #include "../common/strlib.h"
 #include "../common/utils.h"
 #include "../common/conf.h"
+#include "../common/perf.h"
 
 #include "map.h"
 #include "atcommand.h"
@@ -185,12 +186,12 @@ ACMD_FUNC(send)
 		long num;
 		if(len)
 		{// show packet length
-			sprintf(atcmd_output, msg_txt(sd,904), type, packet_db[sd->packet_ver][type].len); // Packet 0x%x length: %d
+			sprintf(atcmd_output, msg_txt(sd,904), type, packet_db(sd->packet_ver,type).len); // Packet 0x%x length: %d
 			clif_displaymessage(fd, atcmd_output);
 			return 0;
 		}
 
-		len=packet_db[sd->packet_ver][type].len;
+		len=packet_db(sd->packet_ver,type).len;
 		off=2;
 		if(len == 0)
 		{// unknown packet - ERROR
@@ -341,7 +342,7 @@ ACMD_FUNC(send)
 			SKIP_VALUE(message);
 		}
 
-		if(packet_db[sd->packet_ver][type].len == -1)
+		if(packet_db(sd->packet_ver,type).len == -1)
 		{// send dynamic packet
 			WFIFOW(fd,2)=TOW(off);
 			WFIFOSET(fd,off);
@@ -6534,7 +6535,7 @@ static int atcommand_cleanfloor_sub(struct block_list *bl, va_list ap)
 
 ACMD_FUNC(cleanmap)
 {
-	map_foreachinmap(atcommand_cleanfloor_sub, sd->bl.m, BL_ITEM);
+	map_foreachflooritem(atcommand_cleanfloor_sub, sd->bl.m, 0, 0, map[sd->bl.m].xs - 1, map[sd->bl.m].ys - 1);
 	clif_displaymessage(fd, msg_txt(sd,1221)); // All dropped items have been cleaned up.
 	return 0;
 }
@@ -6544,13 +6545,13 @@ ACMD_FUNC(cleanarea)
 	short x0 = 0, y0 = 0, x1 = 0, y1 = 0;
 
 	if (!message || !*message || sscanf(message, "%6hd %6hd %6hd %6hd", &x0, &y0, &x1, &y1) < 1) {
-		map_foreachinarea(atcommand_cleanfloor_sub, sd->bl.m, sd->bl.x - (AREA_SIZE * 2), sd->bl.y - (AREA_SIZE * 2), sd->bl.x + (AREA_SIZE * 2), sd->bl.y + (AREA_SIZE * 2), BL_ITEM);
+		map_foreachflooritem(atcommand_cleanfloor_sub, sd->bl.m, sd->bl.x - (AREA_SIZE * 2), sd->bl.y - (AREA_SIZE * 2), sd->bl.x + (AREA_SIZE * 2), sd->bl.y + (AREA_SIZE * 2));
 	}
 	else if (sscanf(message, "%6hd %6hd %6hd %6hd", &x0, &y0, &x1, &y1) == 1) {
-		map_foreachinarea(atcommand_cleanfloor_sub, sd->bl.m, sd->bl.x - x0, sd->bl.y - x0, sd->bl.x + x0, sd->bl.y + x0, BL_ITEM);
+		map_foreachflooritem(atcommand_cleanfloor_sub, sd->bl.m, sd->bl.x - x0, sd->bl.y - x0, sd->bl.x + x0, sd->bl.y + x0);
 	}
 	else if (sscanf(message, "%6hd %6hd %6hd %6hd", &x0, &y0, &x1, &y1) == 4) {
-		map_foreachinarea(atcommand_cleanfloor_sub, sd->bl.m, x0, y0, x1, y1, BL_ITEM);
+		map_foreachflooritem(atcommand_cleanfloor_sub, sd->bl.m, x0, y0, x1, y1);
 	}
 
 	clif_displaymessage(fd, msg_txt(sd,1221)); // All dropped items have been cleaned up.
@@ -9950,6 +9951,141 @@ ACMD_FUNC(adopt)
 	return -1;
 }
 
+/**
+ * Builds the path of a dump file named in-game.
+ * Only plain file names are accepted and the file is always written to log/,
+ * so a GM can't overwrite files elsewhere.
+ * @param name: File name given to the command
+ * @param path: Resulting path
+ * @param size: Size of path
+ * @return false if name is not a plain file name
+ */
+static bool atcommand_dump_path(const char* name, char* path, size_t size)
+{
+	if (name[0] == '\0' || strpbrk(name, "/\\:") != NULL || strstr(name, "..") != NULL)
+		return false;
+	safesnprintf(path, size, "log/%s", name);
+	return true;
+}
+
+/**
+ * Controls the script profiler.
+ * Usage: @scriptprof {on {<sample>}|off|reset|dump {<file>}}
+ * The dump file is a plain file name, written to log/.
+ */
+ACMD_FUNC(scriptprof)
+{
+	char action[16], file[256];
+	int sample = 0;
+	unsigned int runs = 0;
+
+	nullpo_retr(-1, sd);
+
+	memset(atcmd_output, '\0', sizeof(atcmd_output));
+	action[0] = file[0] = '\0';
+
+	if (message && *message)
+		sscanf(message, "%15s %255[^\n]", action, file);
+
+	if (!action[0]) {
+		bool enabled = script_prof_status(&sample, &runs);
+
+		if (enabled)
+			sprintf(atcmd_output, msg_txt(sd,1500), sample, runs); // Script profiler is on, sampling one of every %d runs (%u runs so far).
+		else
+			sprintf(atcmd_output, msg_txt(sd,1501), runs); // Script profiler is off (%u runs profiled).
+		clif_displaymessage(fd, atcmd_output);
+		clif_displaymessage(fd, msg_txt(sd,1502)); // Usage: @scriptprof {on {<sample>}|off|reset|dump {<file>}}
+		return 0;
+	}
+
+	if (strcmpi(action, "on") == 0) {
+		script_prof_start(atoi(file));
+		script_prof_status(&sample, NULL);
+		sprintf(atcmd_output, msg_txt(sd,1503), sample); // Script profiler enabled, sampling one of every %d runs.
+		clif_displaymessage(fd, atcmd_output);
+	} else if (strcmpi(action, "off") == 0) {
+		script_prof_stop();
+		clif_displaymessage(fd, msg_txt(sd,1504)); // Script profiler disabled.
+	} else if (strcmpi(action, "reset") == 0) {
+		script_prof_reset();
+		clif_displaymessage(fd, msg_txt(sd,1505)); // Script profiler data cleared.
+	} else if (strcmpi(action, "dump") == 0) {
+		char path[256 + 4];
+		int count;
+
+		if (file[0] && !atcommand_dump_path(file, path, sizeof(path))) {
+			clif_displaymessage(fd, msg_txt(sd,1506)); // Invalid file name, only a file name in log/ is allowed.
+			return -1;
+		}
+		if ((count = script_prof_dump(file[0] ? path : NULL)) < 0) {
+			clif_displaymessage(fd, msg_txt(sd,1507)); // Could not write the profiler dump, check the console.
+			return -1;
+		}
+		sprintf(atcmd_output, msg_txt(sd,1508), count, file[0] ? path : script_config.profiler_file); // Dumped %d script labels to '%s'.
+		clif_displaymessage(fd, atcmd_output);
+	} else {
+		clif_displaymessage(fd, msg_txt(sd,1502)); // Usage: @scriptprof {on {<sample>}|off|reset|dump {<file>}}
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Controls and shows the main loop performance stats.
+ * Usage: @perf {on|off|reset|dump {<file>}}
+ * The dump file is a plain file name, written to log/.
+ */
+ACMD_FUNC(perf)
+{
+	char action[16], file[256];
+
+	nullpo_retr(-1, sd);
+
+	action[0] = file[0] = '\0';
+	if (message && *message)
+		sscanf(message, "%15s %255[^\n]", action, file);
+
+	if (!action[0]) {
+		const char* lines[PERF_LINE_MAX];
+		int i;
+
+		for (i = 0; i < PERF_LINE_MAX; i++)
+			lines[i] = msg_txt(sd,1515 + i);
+		perf_show(clif_displaymessage, fd, 5, lines);
+		return 0;
+	}
+
+	if (strcmpi(action, "on") == 0) {
+		perf_enable(true);
+		clif_displaymessage(fd, msg_txt(sd,1509)); // Performance stats enabled.
+	} else if (strcmpi(action, "off") == 0) {
+		perf_enable(false);
+		clif_displaymessage(fd, msg_txt(sd,1510)); // Performance stats disabled.
+	} else if (strcmpi(action, "reset") == 0) {
+		perf_reset();
+		clif_displaymessage(fd, msg_txt(sd,1511)); // Performance stats cleared.
+	} else if (strcmpi(action, "dump") == 0) {
+		char path[256 + 4];
+
+		if (file[0] && !atcommand_dump_path(file, path, sizeof(path))) {
+			clif_displaymessage(fd, msg_txt(sd,1506)); // Invalid file name, only a file name in log/ is allowed.
+			return -1;
+		}
+		if (perf_dump(file[0] ? path : NULL) < 0) {
+			clif_displaymessage(fd, msg_txt(sd,1512)); // Could not write the stats, check the console.
+			return -1;
+		}
+		clif_displaymessage(fd, msg_txt(sd,1513)); // Performance stats written.
+	} else {
+		clif_displaymessage(fd, msg_txt(sd,1514)); // Usage: @perf {on|off|reset|dump {<file>}}
+		return -1;
+	}
+
+	return 0;
+}
+
 #include "../custom/atcommand.inc"
 
 
@@ -10549,6 +10685,8 @@ void atcommand_basecommands(void) {
 		ACMD_DEF(adopt),
 		ACMD_DEF(agitstart3),
 		ACMD_DEF(agitend3),
+		ACMD_DEF(scriptprof),
+		ACMD_DEF(perf),
 	};
 	AtCommandInfo* atcommand;
 	int i;
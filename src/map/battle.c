@@ -8384,6 +8384,16 @@ static const struct _battle_data {
 	{ "tarotcard_equal_chance",             &battle_config.tarotcard_equal_chance,          0,      0,      1,              },
 	{ "change_party_leader_samemap",        &battle_config.change_party_leader_samemap,     1,      0,      1,              },
 	{ "dispel_song",                        &battle_config.dispel_song,                     0,      0,      1,              },
+	{ "packet_rate_default",                &battle_config.packet_rate_default,             50,     0,      1000,           },
+	{ "packet_burst_default",               &battle_config.packet_burst_default,            30,     1,      1000,           },
+	{ "packet_rate_skill",                  &battle_config.packet_rate_skill,               15,     0,      1000,           },
+	{ "packet_burst_skill",                 &battle_config.packet_burst_skill,              10,     1,      1000,           },
+	{ "packet_rate_chat",                   &battle_config.packet_rate_chat,                5,      0,      1000,           },
+	{ "packet_burst_chat",                  &battle_config.packet_burst_chat,               10,     1,      1000,           },
+	{ "packet_rate_storage",                &battle_config.packet_rate_storage,             20,     0,      1000,           },
+	{ "packet_burst_storage",               &battle_config.packet_burst_storage,            40,     1,      1000,           },
+	{ "packet_rate_searchstore",            &battle_config.packet_rate_searchstore,         2,      0,      1000,           },
+	{ "packet_burst_searchstore",           &battle_config.packet_burst_searchstore,        5,      1,      1000,           },
 
 #include "../custom/battle_config_init.inc"
 };
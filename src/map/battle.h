@@ -615,6 +615,11 @@ extern struct Battle_Config
 	int tarotcard_equal_chance; //Official or equal chance for each card
 	int change_party_leader_samemap;
 	int dispel_song; //Can songs be dispelled?
+	int packet_rate_default, packet_burst_default; // Client packet scheduler, see clif_parse
+	int packet_rate_skill, packet_burst_skill;
+	int packet_rate_chat, packet_burst_chat;
+	int packet_rate_storage, packet_burst_storage;
+	int packet_rate_searchstore, packet_burst_searchstore;
 
 #include "../custom/battle_config_struct.inc"
 } battle_config;
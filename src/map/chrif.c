@@ -40,7 +40,8 @@ static const int packet_len_table[0x3d] = { // U - used, F - free
 	11,10,10, 0,11, -1,266,10,	// 2b10-2b17: U->2b10, U->2b11, U->2b12, F->2b13, U->2b14, U->2b15, U->2b16, U->2b17
 	 2,10, 2,-1,-1,-1, 2, 7,	// 2b18-2b1f: U->2b18, U->2b19, U->2b1a, U->2b1b, U->2b1c, U->2b1d, U->2b1e, U->2b1f
 	-1,10, 8, 2, 2,14,19,19,	// 2b20-2b27: U->2b20, U->2b21, U->2b22, U->2b23, U->2b24, U->2b25, U->2b26, U->2b27
-	-1, 0, 6,15, 0, 6,-1,-1,	// 2b28-2b2f: U->2b28, F->2b29, U->2b2a, U->2b2b, F->2b2c, U->2b2d, U->2b2e, U->2b2f
+	-1, 0, 6,15, 2, 6,-1,-1,	// 2b28-2b2f: U->2b28, U->2b29, U->2b2a, U->2b2b, U->2b2c, U->2b2d, U->2b2e, U->2b2f
+	 0, 3,10, 0, 0,			// 2b30-2b34: U->2b30, U->2b31, U->2b32, U->2b33, F->2b34
  };
 
 //Used Packets:
@@ -93,13 +94,17 @@ static const int packet_len_table[0x3d] = { // U - used, F - free
 //2b26: Outgoing, chrif_authreq -> 'client authentication request'
 //2b27: Incoming, chrif_authfail -> 'client authentication failed'
 //2b28: Outgoing, chrif_req_charban -> 'ban a specific char '
-//2b29: FREE
+//2b29: Outgoing, chrif_frame_request -> 'switch the link to frames'
 //2b2a: Outgoing, chrif_req_charunban -> 'unban a specific char '
 //2b2b: Incoming, chrif_parse_ack_vipActive -> vip info result
-//2b2c: FREE
+//2b2c: Incoming, chrif_frame_ack -> 'char-server sends frames from now on'
 //2b2d: Outgoing, chrif_bsdata_request -> request bonus_script for pc_authok'ed char.
 //2b2e: Outgoing, chrif_bsdata_save -> Send bonus_script of player for saving.
 //2b2f: Incoming, chrif_bsdata_received -> received bonus_script of player for loading.
+//2b30: Outgoing, chrif_shm_request -> 'move the link to shared memory'
+//2b31: Incoming, chrif_shm_ack -> 'answer of the 2b30 offer (ok / refused)'
+//2b32: Incoming, map_handoff -> 'map is served by this map-server from now on'
+//2b33: Outgoing, chrif_send_load -> 'load of this map-server'
 
 int chrif_connected = 0;
 int char_fd = -1;
@@ -485,6 +490,76 @@ int chrif_changemapserverack(uint32 account_id, int login_id1, int login_id2, ui
 	return 0;
 }
 
+/**
+ * Asks the char-server to switch the link to frames (interserver_framing).
+ * 0x2b29 <stage>.B
+ * stage 0: request, stage 1: the map-server sends frames from now on
+ */
+static void chrif_frame_request(int fd, uint8 stage) {
+	WFIFOHEAD(fd,3);
+	WFIFOW(fd,0) = 0x2b29;
+	WFIFOB(fd,2) = stage;
+	WFIFOSET(fd,3);
+}
+
+/**
+ * The char-server sends frames from now on, switch both directions.
+ * Everything after this packet in the read fifo is framed already.
+ * 0x2b2c
+ */
+static void chrif_frame_ack(int fd) {
+	RFIFOSKIP(fd,2);
+	socket_frame_recv(fd);
+	chrif_frame_request(fd, 1);
+	socket_frame_send(fd);
+	ShowInfo("Link to the char-server is framed now.\n");
+}
+
+/**
+ * Offers the char-server to move the link to shared memory, when it runs on this host (interserver_shm).
+ * 0x2b30 <stage>.B <key>.L <name>.32B
+ * stage 0: offer, stage 1: the map-server sends through the shared memory from now on
+ * @return true if the offer was sent
+ */
+static bool chrif_shm_request(int fd, uint8 stage) {
+	char name[SHM_NAME_LENGTH];
+	uint32 key = 0;
+
+	memset(name, 0, sizeof(name));
+	if( stage == 0 && (!socket_shm_local(fd) || !socket_shm_create(fd, name, &key)) )
+		return false;
+
+	WFIFOHEAD(fd,39);
+	WFIFOW(fd,0) = 0x2b30;
+	WFIFOB(fd,2) = stage;
+	WFIFOL(fd,3) = key;
+	memcpy(WFIFOP(fd,7), name, SHM_NAME_LENGTH);
+	WFIFOSET(fd,39);
+	return true;
+}
+
+/**
+ * Answer of the char-server to the shared memory offer.
+ * When accepted, the char-server sends through the shared memory from now on, switch both directions.
+ * Otherwise fall back to frames.
+ * 0x2b31 <result>.B
+ */
+static void chrif_shm_ack(int fd) {
+	uint8 result = RFIFOB(fd,2);
+
+	RFIFOSKIP(fd,3);
+	if( result == 0 ) {
+		socket_shm_recv(fd);
+		chrif_shm_request(fd, 1);
+		socket_shm_send(fd);
+		ShowInfo("Link to the char-server uses shared memory now.\n");
+	} else {
+		socket_shm_close(fd);
+		if( socket_frame_enabled() )
+			chrif_frame_request(fd, 0);
+	}
+}
+
 /**
  * Does the char_serv have validate our connection to him ?
  * If yes then 
@@ -504,6 +579,8 @@ int chrif_connectack(int fd) {
 	chrif_connected = 1;
 
 	chrif_sendmap(fd);
+	if( !chrif_shm_request(fd, 0) && socket_frame_enabled() )
+		chrif_frame_request(fd, 0);
 
 	ShowStatus("Event '"CL_WHITE"OnInterIfInit"CL_RESET"' executed with '"CL_WHITE"%d"CL_RESET"' NPCs.\n", npc_event_doall("OnInterIfInit"));
 	if( !char_init_done ) {
@@ -1798,6 +1875,18 @@ int chrif_parse(int fd) {
 			else
 				return 0;
 		}
+		else if (cmd == 0x2b2c)
+		{// skips the packet itself
+			chrif_frame_ack(fd);
+			continue;
+		}
+		else if (cmd == 0x2b31)
+		{// skips the packet itself
+			if (RFIFOREST(fd) < 3)
+				return 0;
+			chrif_shm_ack(fd);
+			continue;
+		}
 		if (cmd < 0x2af8 || cmd >= 0x2af8 + ARRAYLENGTH(packet_len_table) || packet_len_table[cmd-0x2af8] == 0) {
 			int r = intif_parse(fd); // Passed on to the intif
 
@@ -1846,6 +1935,7 @@ int chrif_parse(int fd) {
 			case 0x2b27: chrif_authfail(fd); break;
 			case 0x2b2b: chrif_parse_ack_vipActive(fd); break;
 			case 0x2b2f: chrif_bsdata_received(fd); break;
+			case 0x2b32: map_handoff(RFIFOW(fd,2), ntohl(RFIFOL(fd,4)), ntohs(RFIFOW(fd,8))); break;
 			default:
 				ShowError("chrif_parse : unknown packet (session #%d): 0x%x. Disconnecting.\n", fd, cmd);
 				set_eof(fd);
@@ -1858,6 +1948,62 @@ int chrif_parse(int fd) {
 	return 0;
 }
 
+/// Main loop lag, measured with chrif_lag_probe and reported by chrif_send_load.
+static unsigned int chrif_lag_last = 0, chrif_lag_sum = 0, chrif_lag_count = 0, chrif_lag_max = 0;
+
+/// Measures how late the main loop runs this 100ms timer.
+static int chrif_lag_probe(int tid, unsigned int tick, int id, intptr_t data) {
+	unsigned int now = gettick_nocache();
+	int lag = chrif_lag_last ? DIFF_TICK(now, chrif_lag_last) - 100 : 0;
+
+	chrif_lag_last = now;
+	if( lag < 0 )
+		lag = 0;
+	chrif_lag_sum += lag;
+	chrif_lag_count++;
+	chrif_lag_max = max(chrif_lag_max, (unsigned int)lag);
+	return 0;
+}
+
+/**
+ * Reports the load of this map-server to the char-server: the lag of the main loop
+ * since the last report, and the maps with the most players.
+ * 0x2b33 <len>.W <lag avg>.W <lag max>.W <count>.B { <map index>.W <users>.W }*count
+ */
+static int chrif_send_load(int tid, unsigned int tick, int id, intptr_t data) {
+	int16 top[MAP_LOAD_TOP];
+	int i, j, count = 0;
+
+	chrif_check(-1);
+
+	for( i = 0; i < map_num; i++ ) {
+		if( map[i].users == 0 || map[i].handoff_port )
+			continue;
+		for( j = count; j > 0 && map[top[j-1]].users < map[i].users; j-- )
+			if( j < MAP_LOAD_TOP )
+				top[j] = top[j-1];
+		if( j < MAP_LOAD_TOP ) {
+			top[j] = i;
+			count = min(count + 1, MAP_LOAD_TOP);
+		}
+	}
+
+	WFIFOHEAD(char_fd, 9 + MAP_LOAD_TOP*4);
+	WFIFOW(char_fd,0) = 0x2b33;
+	WFIFOW(char_fd,2) = 9 + count*4;
+	WFIFOW(char_fd,4) = (uint16)min(chrif_lag_count ? chrif_lag_sum / chrif_lag_count : 0, UINT16_MAX);
+	WFIFOW(char_fd,6) = (uint16)min(chrif_lag_max, UINT16_MAX);
+	WFIFOB(char_fd,8) = count;
+	for( i = 0; i < count; i++ ) {
+		WFIFOW(char_fd,9+i*4) = map[top[i]].index;
+		WFIFOW(char_fd,11+i*4) = (uint16)min(map[top[i]].users, UINT16_MAX);
+	}
+	WFIFOSET(char_fd, WFIFOW(char_fd,2));
+
+	chrif_lag_sum = chrif_lag_count = chrif_lag_max = 0;
+	return 0;
+}
+
 // unused
 int send_usercount_tochar(int tid, unsigned int tick, int id, intptr_t data) {
 	chrif_check(-1);
@@ -2018,7 +2164,10 @@ void do_init_chrif(void) {
 	auth_db_ers = ers_new(sizeof(struct auth_node),"chrif.c::auth_db_ers",ERS_OPT_NONE);
 
 	add_timer_func_list(check_connect_char_server, "check_connect_char_server");
+	timer_set_critical(check_connect_char_server);
 	add_timer_func_list(auth_db_cleanup, "auth_db_cleanup");
+	add_timer_func_list(chrif_lag_probe, "chrif_lag_probe");
+	add_timer_func_list(chrif_send_load, "chrif_send_load");
 
 	// establish map-char connection if not present
 	add_timer_interval(gettick() + 1000, check_connect_char_server, 0, 0, 10 * 1000);
@@ -2028,6 +2177,10 @@ void do_init_chrif(void) {
 
 	// send the user count every 10 seconds, to hide the charserver's online counting problem
 	add_timer_interval(gettick() + 1000, send_usercount_tochar, 0, 0, UPDATE_INTERVAL);
+
+	// load of this map-server, for moving maps between map-servers
+	add_timer_interval(gettick() + 100, chrif_lag_probe, 0, 0, 100);
+	add_timer_interval(gettick() + 1000, chrif_send_load, 0, 0, UPDATE_INTERVAL);
 }
 
 
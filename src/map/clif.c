@@ -13,6 +13,8 @@
 #include "../common/utils.h"
 #include "../common/ers.h"
 #include "../common/conf.h"
+#include "../common/packettrace.h"
+#include "../common/perf.h"
 
 #include "map.h"
 #include "chrif.h"
@@ -63,7 +65,10 @@ struct Clif_Config {
 	int connect_cmd[MAX_PACKET_VER + 1]; //Store the connect command for all versions. [Skotlex]
 } clif_config;
 
-struct s_packet_db packet_db[MAX_PACKET_VER + 1][MAX_PACKET_DB + 1];
+struct s_packet_db* packet_db_pool = NULL;
+uint16 packet_db_index[MAX_PACKET_VER + 1][MAX_PACKET_DB + 1];
+static uint8* packet_db_pool_ver = NULL; // Packet version that defined each entry of packet_db_pool
+static int packet_db_pool_count = 0, packet_db_pool_max = 0;
 int packet_db_ack[MAX_PACKET_VER + 1][MAX_ACK_FUNC + 1];
 #ifdef PACKET_OBFUSCATION
 static struct s_packet_keys *packet_keys[MAX_PACKET_VER + 1];
@@ -267,6 +272,110 @@ uint16 clif_getport(void)
 	return map_port;
 }
 
+/// Packet capture for the replay tool, see packettrace.h
+static char capture_file[1024] = "";
+static FILE* capture_fp = NULL;
+static unsigned int capture_start;
+static uint32 capture_session[FD_SETSIZE]; // fd -> capture session, 0 if none
+static uint32 capture_session_count = 0;
+
+/*==========================================
+ * Sets the file client packets are captured to
+ *------------------------------------------*/
+void clif_setcapture(const char* path)
+{
+	safestrncpy(capture_file, path, sizeof(capture_file));
+}
+
+/// Writes a record of the session of fd to the trace.
+static void clif_capture_write(int fd, enum e_ptrace_record type, const void* data, uint32 len)
+{
+	uint8 buf[PTRACE_RECORD_SIZE];
+
+	if( capture_fp == NULL )
+		return;
+	if( capture_session[fd] == 0 ) {
+		if( type == PTRACE_CLOSE )
+			return;
+		capture_session[fd] = ++capture_session_count;
+		if( type != PTRACE_OPEN )
+			clif_capture_write(fd, PTRACE_OPEN, NULL, 0);
+	}
+
+	WBUFL(buf,0) = DIFF_TICK(gettick(), capture_start);
+	WBUFL(buf,4) = capture_session[fd];
+	WBUFB(buf,8) = type;
+	WBUFL(buf,9) = len;
+	fwrite(buf, 1, PTRACE_RECORD_SIZE, capture_fp);
+	if( len )
+		fwrite(data, 1, len, capture_fp);
+
+	if( type == PTRACE_CLOSE )
+		capture_session[fd] = 0;
+}
+
+/// Records a packet queued to a client (socket send hook).
+static void clif_capture_send(int fd, const uint8* data, size_t len)
+{
+	uint8 buf[6];
+
+	if( len < 2 )
+		return;
+	WBUFW(buf,0) = RBUFW(data,0);
+	WBUFL(buf,2) = (uint32)len;
+	clif_capture_write(fd, PTRACE_SEND, buf, sizeof(buf));
+}
+
+/// Records the character data the char-server sent for a player.
+void clif_capture_auth(struct map_session_data *sd, int group_id, struct mmo_charstatus *st)
+{
+	uint8 buf[4 + sizeof(struct mmo_charstatus)];
+
+	if( capture_fp == NULL || !session_isValid(sd->fd) )
+		return;
+	WBUFL(buf,0) = group_id;
+	memcpy(WBUFP(buf,4), st, sizeof(struct mmo_charstatus));
+	clif_capture_write(sd->fd, PTRACE_AUTH, buf, sizeof(buf));
+}
+
+/// Records the inventory or cart the char-server sent for a player.
+void clif_capture_storage(struct map_session_data *sd, struct s_storage *stor)
+{
+	uint8 buf[1 + sizeof(struct s_storage)];
+
+	if( capture_fp == NULL || !session_isValid(sd->fd) )
+		return;
+	WBUFB(buf,0) = stor->type;
+	memcpy(WBUFP(buf,1), stor, sizeof(struct s_storage));
+	clif_capture_write(sd->fd, PTRACE_STORAGE, buf, sizeof(buf));
+}
+
+/// Opens the trace set by clif_setcapture and writes its header.
+static void clif_capture_open(void)
+{
+	uint8 buf[PTRACE_HEADER_SIZE];
+
+	if( capture_file[0] == '\0' )
+		return;
+	if( (capture_fp = fopen(capture_file, "wb")) == NULL ) {
+		ShowError("clif_capture_open: Failed to open packet capture file '%s'.\n", capture_file);
+		return;
+	}
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(WBUFP(buf,0), PTRACE_MAGIC, sizeof(PTRACE_MAGIC));
+	WBUFL(buf,8) = PTRACE_VERSION;
+	WBUFL(buf,12) = clif_config.packet_db_ver;
+	WBUFL(buf,16) = sizeof(struct mmo_charstatus);
+	WBUFL(buf,20) = sizeof(struct s_storage);
+	WBUFL(buf,24) = (uint32)time(NULL);
+	fwrite(buf, 1, PTRACE_HEADER_SIZE, capture_fp);
+
+	capture_start = gettick();
+	set_sendhook(clif_capture_send);
+	ShowNotice("Capturing client packets to '"CL_WHITE"%s"CL_RESET"'.\n", capture_file);
+}
+
 #if PACKETVER >= 20071106
 static inline unsigned char clif_bl_type(struct block_list *bl) {
 	switch (bl->type) {
@@ -364,7 +473,7 @@ static int clif_send_sub(struct block_list *bl, va_list ap)
 		return 0;
 	}
 
-	if (packet_db[sd->packet_ver][RBUFW(buf,0)].len) { // packet must exist for the client version
+	if (packet_db(sd->packet_ver,RBUFW(buf,0)).len) { // packet must exist for the client version
 		memcpy(WFIFOP(fd,0), buf, len);
 		WFIFOSET(fd,len);
 	}
@@ -394,31 +503,33 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 	switch(type) {
 
 	case ALL_CLIENT: //All player clients.
-		iter = mapit_getallusers();
-		while( (tsd = (TBL_PC*)mapit_next(iter)) != NULL )
+		map_objlist_lock(&pc_list);
+		for( i = 0; i < pc_list.count; i++ )
 		{
-			if( packet_db[tsd->packet_ver][RBUFW(buf,0)].len )
+			if( (tsd = (TBL_PC*)pc_list.data[i]) != NULL && packet_db(tsd->packet_ver,RBUFW(buf,0)).len )
 			{ // packet must exist for the client version
 				WFIFOHEAD(tsd->fd, len);
 				memcpy(WFIFOP(tsd->fd,0), buf, len);
 				WFIFOSET(tsd->fd,len);
 			}
 		}
-		mapit_free(iter);
+		map_objlist_unlock(&pc_list);
 		break;
 
 	case ALL_SAMEMAP: //All players on the same map
-		iter = mapit_getallusers();
-		while( (tsd = (TBL_PC*)mapit_next(iter)) != NULL )
+		if( bl->m < 0 || bl->m >= map_num )
+			break;
+		map_objlist_lock(&map[bl->m].pc_list);
+		for( i = 0; i < map[bl->m].pc_list.count; i++ )
 		{
-			if( bl->m == tsd->bl.m && packet_db[tsd->packet_ver][RBUFW(buf,0)].len )
+			if( (tsd = (TBL_PC*)map[bl->m].pc_list.data[i]) != NULL && packet_db(tsd->packet_ver,RBUFW(buf,0)).len )
 			{ // packet must exist for the client version
 				WFIFOHEAD(tsd->fd, len);
 				memcpy(WFIFOP(tsd->fd,0), buf, len);
 				WFIFOSET(tsd->fd,len);
 			}
 		}
-		mapit_free(iter);
+		map_objlist_unlock(&map[bl->m].pc_list);
 		break;
 
 	case AREA:
@@ -449,7 +560,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 			for(i = 0; i < cd->users; i++) {
 				if (type == CHAT_WOS && cd->usersd[i] == sd)
 					continue;
-				if (packet_db[cd->usersd[i]->packet_ver][RBUFW(buf,0)].len) { // packet must exist for the client version
+				if (packet_db(cd->usersd[i]->packet_ver,RBUFW(buf,0)).len) { // packet must exist for the client version
 					if ((fd=cd->usersd[i]->fd) >0 && session[fd]) // Added check to see if session exists [PoW]
 					{
 						WFIFOHEAD(fd,len);
@@ -491,7 +602,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 				if( (type == PARTY_AREA || type == PARTY_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 					continue;
 
-				if( packet_db[sd->packet_ver][RBUFW(buf,0)].len )
+				if( packet_db(sd->packet_ver,RBUFW(buf,0)).len )
 				{ // packet must exist for the client version
 					WFIFOHEAD(fd,len);
 					memcpy(WFIFOP(fd,0), buf, len);
@@ -504,7 +615,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 			iter = mapit_getallusers();
 			while( (tsd = (TBL_PC*)mapit_next(iter)) != NULL )
 			{
-				if( tsd->partyspy == p->party.party_id && packet_db[tsd->packet_ver][RBUFW(buf,0)].len )
+				if( tsd->partyspy == p->party.party_id && packet_db(tsd->packet_ver,RBUFW(buf,0)).len )
 				{ // packet must exist for the client version
 					WFIFOHEAD(tsd->fd, len);
 					memcpy(WFIFOP(tsd->fd,0), buf, len);
@@ -524,7 +635,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 		{
 			if( type == DUEL_WOS && bl->id == tsd->bl.id )
 				continue;
-			if( sd->duel_group == tsd->duel_group && packet_db[tsd->packet_ver][RBUFW(buf,0)].len )
+			if( sd->duel_group == tsd->duel_group && packet_db(tsd->packet_ver,RBUFW(buf,0)).len )
 			{ // packet must exist for the client version
 				WFIFOHEAD(tsd->fd, len);
 				memcpy(WFIFOP(tsd->fd,0), buf, len);
@@ -535,7 +646,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 		break;
 
 	case SELF:
-		if (sd && (fd=sd->fd) && packet_db[sd->packet_ver][RBUFW(buf,0)].len) { // packet must exist for the client version
+		if (sd && (fd=sd->fd) && packet_db(sd->packet_ver,RBUFW(buf,0)).len) { // packet must exist for the client version
 			WFIFOHEAD(fd,len);
 			memcpy(WFIFOP(fd,0), buf, len);
 			WFIFOSET(fd,len);
@@ -576,7 +687,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 					if( (type == GUILD_AREA || type == GUILD_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 						continue;
 
-					if( packet_db[sd->packet_ver][RBUFW(buf,0)].len )
+					if( packet_db(sd->packet_ver,RBUFW(buf,0)).len )
 					{ // packet must exist for the client version
 						WFIFOHEAD(fd,len);
 						memcpy(WFIFOP(fd,0), buf, len);
@@ -590,7 +701,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 			iter = mapit_getallusers();
 			while( (tsd = (TBL_PC*)mapit_next(iter)) != NULL )
 			{
-				if( tsd->guildspy == g->guild_id && packet_db[tsd->packet_ver][RBUFW(buf,0)].len )
+				if( tsd->guildspy == g->guild_id && packet_db(tsd->packet_ver,RBUFW(buf,0)).len )
 				{ // packet must exist for the client version
 					WFIFOHEAD(tsd->fd, len);
 					memcpy(WFIFOP(tsd->fd,0), buf, len);
@@ -623,7 +734,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 					continue;
 				if( (type == BG_AREA || type == BG_AREA_WOS) && (sd->bl.x < x0 || sd->bl.y < y0 || sd->bl.x > x1 || sd->bl.y > y1) )
 					continue;
-				if( packet_db[sd->packet_ver][RBUFW(buf,0)].len )
+				if( packet_db(sd->packet_ver,RBUFW(buf,0)).len )
 				{ // packet must exist for the client version
 					WFIFOHEAD(fd,len);
 					memcpy(WFIFOP(fd,0), buf, len);
@@ -641,7 +752,7 @@ int clif_send(const uint8* buf, int len, struct block_list* bl, enum send_target
 					continue;
 				}
 
-				if( packet_db[sd->packet_ver][RBUFW(buf,0)].len ){ // packet must exist for the client version
+				if( packet_db(sd->packet_ver,RBUFW(buf,0)).len ){ // packet must exist for the client version
 					WFIFOHEAD(fd,len);
 					memcpy(WFIFOP(fd,0), buf, len);
 					WFIFOSET(fd,len);
@@ -859,9 +970,14 @@ void clif_clearunit_single(int id, clr_type type, int fd)
 void clif_clearunit_area(struct block_list* bl, clr_type type)
 {
 	unsigned char buf[8];
+	struct unit_data *ud;
 
 	nullpo_retv(bl);
 
+	// Drop a queued walk, the unit is gone for the viewers (bl is a copy for delayed clears)
+	if (map_id2bl(bl->id) == bl && (ud = unit_bl2ud(bl)) != NULL)
+		ud->state.move_pending = 0;
+
 	WBUFW(buf,0) = 0x80;
 	WBUFL(buf,2) = bl->id;
 	WBUFB(buf,6) = type;
@@ -1758,7 +1874,7 @@ static void clif_move2(struct block_list *bl, struct view_data *vd, struct unit_
 /// Notifies clients in an area, that an other visible object is walking (ZC_NOTIFY_PLAYERMOVE).
 /// 0086 <id>.L <walk data>.6B <walk start time>.L
 /// Note: unit must not be self
-void clif_move(struct unit_data *ud)
+static void clif_move_send(struct unit_data *ud, unsigned int tick)
 {
 	unsigned char buf[16];
 	struct view_data* vd;
@@ -1775,7 +1891,7 @@ void clif_move(struct unit_data *ud)
 			WBUFW(buf,0)=0x86;
 			WBUFL(buf,2)=-bl->id;
 			WBUFPOS2(buf,6,bl->x,bl->y,ud->to_x,ud->to_y,8,8);
-			WBUFL(buf,12)=gettick();
+			WBUFL(buf,12)=tick;
 			clif_send(buf, packet_len(0x86), bl, SELF);
 		}
 		return;
@@ -1801,7 +1917,7 @@ void clif_move(struct unit_data *ud)
 	WBUFW(buf,0)=0x86;
 	WBUFL(buf,2)=bl->id;
 	WBUFPOS2(buf,6,bl->x,bl->y,ud->to_x,ud->to_y,8,8);
-	WBUFL(buf,12)=gettick();
+	WBUFL(buf,12)=tick;
 	clif_send(buf, packet_len(0x86), bl, AREA_WOS);
 	if (disguised(bl)) {
 		WBUFL(buf,2)=-bl->id;
@@ -1810,6 +1926,58 @@ void clif_move(struct unit_data *ud)
 	clif_ally_only = false;
 }
 
+/// Units with a movement notification held back until the end of the tick.
+/// A unit that changes its walk path several times in the same tick is only
+/// sent once, with its last path.
+static struct {
+	int* id;
+	int count, max;
+} clif_move_queue;
+
+/// Notifies clients in an area, that an other visible object is walking.
+/// Players are sent right away, since the order of their packets matters to
+/// their own client, other units are queued until clif_move_flush.
+void clif_move(struct unit_data *ud)
+{
+	nullpo_retv(ud);
+
+	if (ud->bl->type == BL_PC) {
+		clif_move_send(ud, gettick());
+		return;
+	}
+
+	ud->move_tick = gettick(); // The walk starts now, not when the queue is sent
+	if (ud->state.move_pending)
+		return; // Already queued, will send the latest path
+	if (clif_move_queue.count == clif_move_queue.max) {
+		clif_move_queue.max = clif_move_queue.max ? clif_move_queue.max * 2 : 256;
+		RECREATE(clif_move_queue.id, int, clif_move_queue.max);
+	}
+	clif_move_queue.id[clif_move_queue.count++] = ud->bl->id;
+	ud->state.move_pending = 1;
+}
+
+/// Sends the queued movement notifications, called before the session buffers are sent.
+void clif_move_flush(void)
+{
+	int i;
+
+	for (i = 0; i < clif_move_queue.count; i++) {
+		struct block_list* bl = map_id2bl(clif_move_queue.id[i]);
+		struct unit_data* ud;
+
+		if (bl == NULL || (ud = unit_bl2ud(bl)) == NULL || !ud->state.move_pending)
+			continue; // Gone or already sent
+		ud->state.move_pending = 0;
+		if (bl->prev == NULL)
+			continue; // Not on a map anymore
+		if (ud->walkpath.path_pos >= ud->walkpath.path_len)
+			continue; // Stopped or warped since, the queued path is void
+		clif_move_send(ud, ud->move_tick);
+	}
+	clif_move_queue.count = 0;
+}
+
 
 /*==========================================
  * Delays the map_quit of a player after they are disconnected. [Skotlex]
@@ -1892,8 +2060,12 @@ void clif_blown(struct block_list *bl)
 void clif_fixpos(struct block_list *bl)
 {
 	unsigned char buf[10];
+	struct unit_data *ud;
 	nullpo_retv(bl);
 
+	if ((ud = unit_bl2ud(bl)) != NULL)
+		ud->state.move_pending = 0; // The queued walk is void, the clients only need the position
+
 	WBUFW(buf,0) = 0x88;
 	WBUFL(buf,2) = bl->id;
 	WBUFW(buf,6) = bl->x;
@@ -2018,7 +2190,7 @@ void clif_npc_market_open(struct map_session_data *sd, struct npc_data *nd) {
 	if (sd->state.trading)
 		return;
 
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	if (!info || info->len == 0)
 		return;
 
@@ -2065,7 +2237,7 @@ void clif_npc_market_purchase_ack(struct map_session_data *sd, uint8 res, uint8
 	nullpo_retv(sd);
 	nullpo_retv((nd = map_id2nd(sd->npc_shopid)));
 
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	if (!info || info->len == 0)
 		return;
 
@@ -2109,7 +2281,7 @@ void clif_parse_NPCMarketPurchase(int fd, struct map_session_data *sd) {
 	if (!sd->npc_shopid)
 		return;
 
-	info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (!info || info->len == 0)
 		return;
 	len = RFIFOW(fd,info->pos[0]);
@@ -2220,7 +2392,7 @@ void clif_scriptclear(struct map_session_data *sd, int npcid)
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_CLEAR_DIALOG];
 	if(!cmd) cmd = 0x8d6; //default
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	len = info->len;
 	fd = sd->fd;
 
@@ -2704,85 +2876,227 @@ void clif_item_sub(unsigned char *buf, int n, int idx, struct item *it, struct i
 }
 
 
+/// Largest item entry of the inventory/cart/storage list packets, see clif_item_sub
+#define ITEM_RECORD_MAX 57
+
+/// Encoded list entry of one inventory, cart or storage slot.
+/// The entry is encoded again only when the item in the slot or its equip point changed,
+/// so reopening a list just compares and copies the slots.
+struct s_item_cache {
+	struct item item; ///< Item the entry was encoded from
+	int equip;        ///< Equip argument of clif_item_sub
+	uint8 len;        ///< Entry length, 0 for an empty slot
+	bool stackable;   ///< Sent in the stackable item list
+	uint8 buf[ITEM_RECORD_MAX];
+};
+
+/// Slots of the item lists, by enum e_item_cache.
+#if MAX_STORAGE > MAX_GUILD_STORAGE
+static const int item_cache_size[ITEMCACHE_MAX] = { MAX_INVENTORY, MAX_CART, MAX_STORAGE };
+#else
+static const int item_cache_size[ITEMCACHE_MAX] = { MAX_INVENTORY, MAX_CART, MAX_GUILD_STORAGE };
+#endif
+
+/// Returns the cache of an item list of the player, allocating it when it is first used.
+static struct s_item_cache* clif_item_cache(struct map_session_data *sd, enum e_item_cache type)
+{
+	if( sd->item_cache[type] == NULL )
+		CREATE(sd->item_cache[type], struct s_item_cache, item_cache_size[type]);
+	return sd->item_cache[type];
+}
+
+/// Whether the entry of a slot still matches the item in it.
+static bool clif_item_cache_valid(struct s_item_cache *c, struct item *it)
+{
+	return ( c->len && memcmp(&c->item, it, sizeof(struct item)) == 0 );
+}
+
+/// Encodes the entry of a slot, with the arguments of clif_item_sub.
+static void clif_item_cache_set(struct s_item_cache *c, int idx, struct item *it, struct item_data *id, int equip, bool stackable)
+{
+	memcpy(&c->item, it, sizeof(struct item));
+	c->equip = equip;
+	c->stackable = stackable;
+	clif_item_sub(c->buf, 0, idx, it, id, equip);
+#if PACKETVER < 5
+	c->len = stackable ? 10 : 20;
+#elif PACKETVER < 20071002
+	c->len = stackable ? 18 : 20;
+#elif PACKETVER < 20080102
+	c->len = stackable ? 18 : 26;
+#elif PACKETVER < 20100629
+	c->len = stackable ? 22 : 26;
+#elif PACKETVER < 20120925
+	c->len = stackable ? 22 : 28;
+#elif PACKETVER < 20150226
+	c->len = stackable ? 24 : 31;
+#else
+	c->len = stackable ? 24 : 57;
+#endif
+}
+
+/// Brings the inventory cache of the player up to date.
+static struct s_item_cache* clif_item_cache_inventory(struct map_session_data *sd)
+{
+	struct s_item_cache *cache = clif_item_cache(sd, ITEMCACHE_INVENTORY);
+	int i;
+
+	for( i = 0; i < MAX_INVENTORY; i++ ) {
+		struct item *it = &sd->inventory.u.items_inventory[i];
+		struct item_data *id = sd->inventory_data[i];
+		bool stackable;
+		int equip;
+
+		if( it->nameid <= 0 || id == NULL ) {
+			cache[i].len = 0;
+			continue;
+		}
+		// the equip point depends on the job and skills, so it is part of the key
+		stackable = itemdb_isstackable2(id);
+		equip = stackable ? -2 : pc_equippoint(sd, i);
+		if( clif_item_cache_valid(&cache[i], it) && cache[i].equip == equip )
+			continue;
+		clif_item_cache_set(&cache[i], i+2, it, id, equip, stackable);
+	}
+	return cache;
+}
+
+/// Brings the cart or storage cache of the player up to date.
+/// @param idx_base Index of the first slot, as the client knows it
+static struct s_item_cache* clif_item_cache_items(struct map_session_data *sd, enum e_item_cache type, struct item *items, int items_length, int idx_base)
+{
+	struct s_item_cache *cache = clif_item_cache(sd, type);
+	int i;
+
+	if( items_length > item_cache_size[type] ) {
+		ShowWarning("clif_item_cache_items: List of %d items exceeds the %d slots of the cache, sending only the first ones.\n", items_length, item_cache_size[type]);
+		items_length = item_cache_size[type];
+	}
+	for( i = 0; i < items_length; i++ ) {
+		struct item_data *id;
+		bool stackable;
+
+		if( items[i].nameid <= 0 ) {
+			cache[i].len = 0;
+			continue;
+		}
+		if( clif_item_cache_valid(&cache[i], &items[i]) )
+			continue;
+		id = itemdb_search(items[i].nameid);
+		stackable = itemdb_isstackable2(id);
+		clif_item_cache_set(&cache[i], i+idx_base, &items[i], id, stackable ? -1 : id->equip, stackable);
+	}
+	for( ; i < item_cache_size[type]; i++ )
+		cache[i].len = 0;
+	return cache;
+}
+
+/// Queues the stackable or the equippable entries of an item list cache.
+/// The entries are copied straight into the send queue, in packets of at most max_len bytes.
+/// @param hlen Header length, the storage name follows the packet length when above 4
+/// @return Number of entries sent
+static int clif_item_cache_send(int fd, struct s_item_cache *cache, int count, bool stackable, int cmd, int hlen, const char *name, int max_len)
+{
+	int i, n = 0, len = 0;
+
+	for( i = 0; i < count; i++ ) {
+		struct s_item_cache *c = &cache[i];
+
+		if( !c->len || c->stackable != stackable )
+			continue;
+		if( len && len + c->len > max_len ) {
+			WFIFOW(fd,2) = len;
+			WFIFOSET(fd,len);
+			len = 0;
+		}
+		if( !len ) {
+			WFIFOHEAD(fd,max_len);
+			WFIFOW(fd,0) = cmd;
+			if( hlen > 4 )
+				safestrncpy(WFIFOCP(fd,4), name, hlen-4);
+			len = hlen;
+		}
+		memcpy(WFIFOP(fd,len), c->buf, c->len);
+		len += c->len;
+		n++;
+	}
+	if( len ) {
+		WFIFOW(fd,2) = len;
+		WFIFOSET(fd,len);
+	}
+	return n;
+}
+
+/// Drops the encoded entries of the player, e.g. after the item database was reloaded.
+void clif_item_cache_clear(struct map_session_data *sd)
+{
+	int i;
+
+	for( i = 0; i < ITEMCACHE_MAX; i++ ) {
+		if( sd->item_cache[i] != NULL )
+			memset(sd->item_cache[i], 0, sizeof(struct s_item_cache) * item_cache_size[i]);
+	}
+}
+
+/// Frees an item list cache of the player, or all of them with ITEMCACHE_MAX.
+void clif_item_cache_free(struct map_session_data *sd, enum e_item_cache type)
+{
+	int i;
+
+	for( i = 0; i < ITEMCACHE_MAX; i++ ) {
+		if( type != ITEMCACHE_MAX && i != type )
+			continue;
+		if( sd->item_cache[i] != NULL ) {
+			aFree(sd->item_cache[i]);
+			sd->item_cache[i] = NULL;
+		}
+	}
+}
 
 void clif_favorite_item(struct map_session_data* sd, unsigned short index);
 //Unified inventory function which sends all of the inventory (requires two packets, one for equipable items and one for stackable ones. [Skotlex]
 void clif_inventorylist(struct map_session_data *sd) {
-	int i,n,ne,arrow=-1;
-	unsigned char *buf;
-	unsigned char *bufe;
+	struct s_item_cache *cache;
+	int i,fd = sd->fd;
 
 #if PACKETVER < 5
+	const int cmd = 0xa3;
 	const int s = 10; //Entry size
 #elif PACKETVER < 20080102
+	const int cmd = 0x1ee;
 	const int s = 18;
 #elif PACKETVER < 20120925
+	const int cmd = 0x2e8;
 	const int s = 22;
 #else
+	const int cmd = 0x991;
 	const int s = 24;
 #endif
 #if PACKETVER < 20071002
+	const int cmde = 0xa4;
 	const int se = 20;
 #elif PACKETVER < 20100629
+	const int cmde = 0x2d0;
 	const int se = 26;
 #elif PACKETVER < 20120925
+	const int cmde = 0x2d0;
 	const int se = 28;
 #elif PACKETVER < 20150226
+	const int cmde = 0x992;
 	const int se = 31;
 #else
+	const int cmde = 0xa0d;
 	const int se = 57;
 #endif
 
-	buf = (unsigned char*)aMalloc(MAX_INVENTORY * s + 4);
-	bufe = (unsigned char*)aMalloc(MAX_INVENTORY * se + 4);
+	cache = clif_item_cache_inventory(sd);
 
-	for( i = 0, n = 0, ne = 0; i < MAX_INVENTORY; i++ )
-	{
-		if( sd->inventory.u.items_inventory[i].nameid <=0 || sd->inventory_data[i] == NULL )
-			continue;
+	clif_item_cache_send(fd, cache, MAX_INVENTORY, true, cmd, 4, NULL, MAX_INVENTORY * s + 4);
+	ARR_FIND(0, MAX_INVENTORY, i, cache[i].len && cache[i].stackable && sd->inventory_data[i]->equip == EQP_AMMO && sd->inventory.u.items_inventory[i].equip);
+	if( i < MAX_INVENTORY )
+		clif_arrowequip(sd,i);
 
-		if( !itemdb_isstackable2(sd->inventory_data[i]) )
-		{	//Non-stackable (Equippable)
-			clif_item_sub(bufe, ne*se+4, i+2, &sd->inventory.u.items_inventory[i], sd->inventory_data[i], pc_equippoint(sd,i));
-			ne++;
-		}
-		else { //Stackable.
-			clif_item_sub(buf, n*s+4,i+2, &sd->inventory.u.items_inventory[i], sd->inventory_data[i], -2);
-			if( sd->inventory_data[i]->equip == EQP_AMMO && sd->inventory.u.items_inventory[i].equip )
-				arrow=i;
-			n++;
-		}
-	}
-	if( n )
-	{
-#if PACKETVER < 5
-		WBUFW(buf,0)=0xa3;
-#elif PACKETVER < 20080102
-		WBUFW(buf,0)=0x1ee;
-#elif PACKETVER < 20120925
-		WBUFW(buf,0)=0x2e8;
-#else
-		WBUFW(buf,0)=0x991;
-#endif
-		WBUFW(buf,2)=4+n*s;
-		clif_send(buf, WBUFW(buf,2), &sd->bl, SELF);
-	}
-	if( arrow >= 0 )
-		clif_arrowequip(sd,arrow);
-
-	if( ne ) {
-#if PACKETVER < 20071002
-		WBUFW(bufe,0)=0xa4;
-#elif PACKETVER < 20120925
-		WBUFW(bufe,0)=0x2d0;
-#elif PACKETVER < 20150226
-		WBUFW(bufe,0)=0x992;
-#else
-		WBUFW(bufe,0)=0xa0d;
-#endif
-		WBUFW(bufe,2)=4+ne*se;
-		clif_send(bufe, WBUFW(bufe,2), &sd->bl, SELF);
-	}
+	clif_item_cache_send(fd, cache, MAX_INVENTORY, false, cmde, 4, NULL, MAX_INVENTORY * se + 4);
 #if PACKETVER >= 20111122 && PACKETVER < 20120925
 	for( i = 0; i < MAX_INVENTORY; i++ ) {
 		if( sd->inventory.u.items_inventory[i].nameid <= 0 || sd->inventory_data[i] == NULL )
@@ -2791,146 +3105,71 @@ void clif_inventorylist(struct map_session_data *sd) {
 			clif_favorite_item(sd, i);
 	}
 #endif
-
-	if( buf ) aFree(buf);
-	if( bufe ) aFree(bufe);
 }
 
 //Required when items break/get-repaired. Only sends equippable item list.
 void clif_equiplist(struct map_session_data *sd)
 {
-	int i,n,fd = sd->fd;
-	unsigned char *buf;
 #if PACKETVER < 20071002
-	const int cmd = 20;
+	const int cmd = 0xa4;
+	const int se = 20;
 #elif PACKETVER < 20100629
-	const int cmd = 26;
+	const int cmd = 0x2d0;
+	const int se = 26;
 #elif PACKETVER < 20120925
-	const int cmd = 28;
+	const int cmd = 0x2d0;
+	const int se = 28;
 #elif PACKETVER < 20150226
-	const int cmd = 31;
+	const int cmd = 0x992;
+	const int se = 31;
 #else
-	const int cmd = 57;
+	const int cmd = 0xa0d;
+	const int se = 57;
 #endif
 
-	WFIFOHEAD(fd, MAX_INVENTORY * cmd + 4);
-	buf = WFIFOP(fd,0);
-
-	for(i=0,n=0;i<MAX_INVENTORY;i++){
-		if (sd->inventory.u.items_inventory[i].nameid <=0 || sd->inventory_data[i] == NULL)
-			continue;
-
-		if(itemdb_isstackable2(sd->inventory_data[i]))
-			continue;
-		//Equippable
-		clif_item_sub(buf, n*cmd+4,i+2, &sd->inventory.u.items_inventory[i], sd->inventory_data[i], pc_equippoint(sd,i));
-		n++;
-	}
-	if (n) {
-#if PACKETVER < 20071002
-		WBUFW(buf,0)=0xa4;
-#elif PACKETVER < 20120925
-		WBUFW(buf,0)=0x2d0;
-#elif PACKETVER < 20150226
-		WBUFW(buf,0)=0x992;
-#else
-		WBUFW(buf,0)=0xa0d;
-#endif
-		WBUFW(buf,2)=4+n*cmd;
-		WFIFOSET(fd,WFIFOW(fd,2));
-	}
+	clif_item_cache_send(sd->fd, clif_item_cache_inventory(sd), MAX_INVENTORY, false, cmd, 4, NULL, MAX_INVENTORY * se + 4);
 }
 
 void clif_storagelist(struct map_session_data* sd, struct item* items, int items_length, const char *storename)
 {
 	static const int client_buf = 0x5000; // Max buffer to send
-	struct item_data *id;
-	int i,n,ne,nn;
-	unsigned char *buf;
-	unsigned char *bufe;
+	struct s_item_cache *cache;
+	int n;
 #if PACKETVER < 5
-	const int s = 10; //Entry size.normal item
 	const int sidx=4; //start itemlist idx
 	const int cmd = 0xa5;
 #elif PACKETVER < 20080102
-	const int s = 18;
 	const int sidx=4;
 	const int cmd = 0x1f0;
 #elif PACKETVER < 20120925
-	const int s = 22;
 	const int sidx=4;
 	const int cmd = 0x2ea;
 #else
-	const int s = 24;
 	const int sidx = 4+24;
 	const int cmd = 0x995;
 #endif
 #if PACKETVER < 20071002
-	const int se = 20; //entry size equip
 	const int sidxe = 4; //start itemlist idx
 	const int cmde = 0xa6;
-#elif PACKETVER < 20100629
-	const int se = 26;
-	const int sidxe = 4;
-	const int cmde = 0x2d1;
 #elif PACKETVER < 20120925
-	const int se = 28;
 	const int sidxe = 4;
 	const int cmde = 0x2d1;
 #elif PACKETVER < 20150226
-	const int se = 31;
 	const int sidxe = 4+24;
 	const int cmde = 0x996;
 #else
-	const int se = 57;
 	const int sidxe = 4+24;
 	const int cmde = 0xa10;
 #endif
 
-	buf = (unsigned char*)aMalloc(items_length * s + sidx);
-	bufe = (unsigned char*)aMalloc(items_length * se + sidxe);
+	cache = clif_item_cache_items(sd, ITEMCACHE_STORAGE, items, items_length, 1);
+	items_length = min(items_length, item_cache_size[ITEMCACHE_STORAGE]);
 
-	for( i = 0, n = 0, ne = 0; i < items_length; i++ )
-	{
-		if( items[i].nameid <= 0 )
-			continue;
-		id = itemdb_search(items[i].nameid);
-		if( !itemdb_isstackable2(id) ) { //Equippable
-			clif_item_sub(bufe, ne*se+sidxe,i+1, &items[i], id, id->equip);
-			ne++;
-		}
-		else { //Stackable
-			clif_item_sub(buf, n*s+sidx,i+1, &items[i], id,-1);
-			n++;
-		}
-	}
-	for (i = 0; i < n; i += nn) // Loop through non-equipable items
-	{
-		nn = n - i < (client_buf - sidx)/s ? n - i : (client_buf - sidx)/s; // Split up non-equipable items
-		WFIFOHEAD(sd->fd,sidx+nn*s);
-		WFIFOW(sd->fd,0)=cmd;
-		WFIFOW(sd->fd,2)=sidx+nn*s;
-#if PACKETVER >= 20120925
-		safestrncpy(WFIFOCP(sd->fd,4), storename, NAME_LENGTH); //storename
-#endif
-		memcpy(WFIFOP(sd->fd,sidx),buf + sidx + i*s,nn*s);
-		WFIFOSET(sd->fd,WFIFOW(sd->fd,2));
-	}
-	for (i = 0; i < ne; i += nn) // Loop through equipable items
-	{
-		nn = ne - i < (client_buf - sidxe)/se ? ne - i : (client_buf - sidxe)/se; // Split up equipable items
-		WFIFOHEAD(sd->fd,sidxe+nn*se);
-		WFIFOW(sd->fd,0)=cmde;
-		WFIFOW(sd->fd,2)=sidxe+nn*se;
-#if PACKETVER >= 20120925
-		safestrncpy(WFIFOCP(sd->fd,4), storename, NAME_LENGTH); //storename
-#endif
-		memcpy(WFIFOP(sd->fd,sidxe),bufe + sidxe + i*se,nn*se);
-		WFIFOSET(sd->fd,WFIFOW(sd->fd,2));
-	}
+	n = clif_item_cache_send(sd->fd, cache, items_length, true, cmd, sidx, storename, client_buf); // Split up non-equipable items
+	n += clif_item_cache_send(sd->fd, cache, items_length, false, cmde, sidxe, storename, client_buf); // Split up equipable items
 
 	// Empty storage
-	if (n == 0 && ne == 0) {
+	if (n == 0) {
 		WFIFOHEAD(sd->fd, 4+NAME_LENGTH);
 		WFIFOW(sd->fd,0) = cmd;
 		WFIFOW(sd->fd,2) = 4+NAME_LENGTH;
@@ -2939,86 +3178,45 @@ void clif_storagelist(struct map_session_data* sd, struct item* items, int items
 #endif
 		WFIFOSET(sd->fd,WFIFOW(sd->fd,2));
 	}
-
-	if( buf ) aFree(buf);
-	if( bufe ) aFree(bufe);
 }
 
 void clif_cartlist(struct map_session_data *sd)
 {
-	struct item_data *id;
-	int i,n,ne;
-	unsigned char *buf;
-	unsigned char *bufe;
+	struct s_item_cache *cache;
 #if PACKETVER < 5
+	const int cmd = 0x123;
 	const int s = 10; //Entry size.
 #elif PACKETVER < 20080102
+	const int cmd = 0x1ef;
 	const int s = 18;
 #elif PACKETVER < 20120925
+	const int cmd = 0x2e9;
 	const int s = 22;
 #else
+	const int cmd = 0x993;
 	const int s = 24;
 #endif
 #if PACKETVER < 20071002
-	const int cmd = 20;
+	const int cmde = 0x122;
+	const int se = 20;
 #elif PACKETVER < 20100629
-	const int cmd = 26;
+	const int cmde = 0x2d2;
+	const int se = 26;
 #elif PACKETVER < 20120925
-	const int cmd = 28;
+	const int cmde = 0x2d2;
+	const int se = 28;
 #elif PACKETVER < 20150226
-	const int cmd = 31;
+	const int cmde = 0x994;
+	const int se = 31;
 #else
-	const int cmd = 57;
+	const int cmde = 0xa0f;
+	const int se = 57;
 #endif
 
-	buf = (unsigned char*)aMalloc(MAX_CART * s + 4);
-	bufe = (unsigned char*)aMalloc(MAX_CART * cmd + 4);
+	cache = clif_item_cache_items(sd, ITEMCACHE_CART, sd->cart.u.items_cart, MAX_CART, 2);
 
-	for( i = 0, n = 0, ne = 0; i < MAX_CART; i++ )
-	{
-		if( sd->cart.u.items_cart[i].nameid <= 0 )
-			continue;
-		id = itemdb_search(sd->cart.u.items_cart[i].nameid);
-		if( !itemdb_isstackable2(id) ) { //Equippable
-			clif_item_sub(bufe, ne*cmd+4,i+2, &sd->cart.u.items_cart[i], id, id->equip);
-			ne++;
-		}
-		else { //Stackable
-			clif_item_sub(buf, n*s+4,i+2, &sd->cart.u.items_cart[i], id,-1);
-			n++;
-		}
-	}
-	if( n )
-	{
-#if PACKETVER < 5
-		WBUFW(buf,0)=0x123;
-#elif PACKETVER < 20080102
-		WBUFW(buf,0)=0x1ef;
-#elif PACKETVER < 20120925
-		WBUFW(buf,0)=0x2e9;
-#else
-		WBUFW(buf,0)=0x993;
-#endif
-		WBUFW(buf,2)=4+n*s;
-		clif_send(buf, WBUFW(buf,2), &sd->bl, SELF);
-	}
-	if( ne )
-	{
-#if PACKETVER < 20071002
-	WBUFW(bufe,0)=0x122;
-#elif PACKETVER < 20120925
-	WBUFW(bufe,0)=0x2d2;
-#elif PACKETVER < 20150226
-	WBUFW(bufe,0)=0x994;
-#else
-	WBUFW(bufe,0)=0xa0f;
-#endif
-		WBUFW(bufe,2)=4+ne*cmd;
-		clif_send(bufe, WBUFW(bufe,2), &sd->bl, SELF);
-	}
-
-	if( buf ) aFree(buf);
-	if( bufe ) aFree(bufe);
+	clif_item_cache_send(sd->fd, cache, MAX_CART, true, cmd, 4, NULL, MAX_CART * s + 4);
+	clif_item_cache_send(sd->fd, cache, MAX_CART, false, cmde, 4, NULL, MAX_CART * se + 4);
 }
 
 
@@ -3754,7 +3952,7 @@ void clif_equipitemack(struct map_session_data *sd,int n,int pos,uint8 flag)
 	nullpo_retv(sd);
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_WEAR_EQUIP_ACK];
-	if (!cmd || !(info = &packet_db[sd->packet_ver][cmd]) || !info->len)
+	if (!cmd || !(info = &packet_db(sd->packet_ver,cmd)) || !info->len)
 		return;
 
 	fd = sd->fd;
@@ -4517,6 +4715,9 @@ void clif_storageclose(struct map_session_data* sd)
 	WFIFOHEAD(fd,packet_len(0xf8));
 	WFIFOW(fd,0) = 0xf8; // Storage Closed
 	WFIFOSET(fd,packet_len(0xf8));
+
+	// the storage lists are large and rarely reopened soon, don't keep them for the whole session
+	clif_item_cache_free(sd, ITEMCACHE_STORAGE);
 }
 
 /*==========================================
@@ -6798,7 +6999,7 @@ void clif_parse_BankOpen(int fd, struct map_session_data* sd) {
 		return;
 	}
 	else {
-		struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+		struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 		int aid = RFIFOL(fd,info->pos[0]); //unused should we check vs fd ?
 		if(sd->status.account_id == aid){
 			sd->state.banking = 1;
@@ -6829,7 +7030,7 @@ void clif_bank_close(struct map_session_data *sd){
  * 09B8 <aid>L ??? (dunno just wild guess checkme)
  */
 void clif_parse_BankClose(int fd, struct map_session_data* sd) {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int aid = RFIFOL(fd,info->pos[0]); //unused should we check vs fd ?
 
 	nullpo_retv(sd);
@@ -6857,7 +7058,7 @@ void clif_Bank_Check(struct map_session_data* sd) {
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_BANKING_CHECK];
 	if(!cmd) cmd = 0x09A6; //default
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	len = info->len;
 	if(!len) return; //version as packet disable
 	// sd->state.banking = 1; //mark opening and closing
@@ -6880,7 +7081,7 @@ void clif_parse_BankCheck(int fd, struct map_session_data* sd) {
 		return;
 	}
 	else {
-		struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+		struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 		int aid = RFIFOL(fd,info->pos[0]); //unused should we check vs fd ?
 		if(sd->status.account_id == aid) //since we have it let check it for extra security
 			clif_Bank_Check(sd);
@@ -6901,7 +7102,7 @@ void clif_bank_deposit(struct map_session_data *sd, enum e_BANKING_DEPOSIT_ACK r
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_ACK_BANKING_DEPOSIT];
 	if(!cmd) cmd = 0x09A8;
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	len = info->len;
 	if(!len) return; //version as packet disable
 
@@ -6924,7 +7125,7 @@ void clif_parse_BankDeposit(int fd, struct map_session_data* sd) {
 		return;
 	}
 	else {
-		struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+		struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 		int aid = RFIFOL(fd,info->pos[0]); //unused should we check vs fd ?
 		int money = RFIFOL(fd,info->pos[1]);
 
@@ -6949,7 +7150,7 @@ void clif_bank_withdraw(struct map_session_data *sd,enum e_BANKING_WITHDRAW_ACK
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_ACK_BANKING_WITHDRAW];
 	if(!cmd) cmd = 0x09AA;
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	len = info->len;
 	if(!len) return; //version as packet disable
 
@@ -6972,7 +7173,7 @@ void clif_parse_BankWithdraw(int fd, struct map_session_data* sd) {
 		return;
 	}
 	else {
-		struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+		struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 		int aid = RFIFOL(fd,info->pos[0]); //unused should we check vs fd ?
 		int money = RFIFOL(fd,info->pos[1]);
 		if(sd->status.account_id == aid){
@@ -9787,7 +9988,7 @@ static bool clif_process_message(struct map_session_data* sd, bool whisperFormat
 
 	fd = sd->fd;
 
-	info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	packetLength = RFIFOW(fd,info->pos[0]);
 	input = RFIFOCP(fd,info->pos[1]);
@@ -9952,15 +10153,15 @@ static int clif_guess_PacketVer(int fd, int get_previous, int *error)
 	// received, or fix the function to be able to deal with that
 	// case.
 #define CHECK_PACKET_VER() \
-	if( cmd != clif_config.connect_cmd[packet_ver] || packet_len != packet_db[packet_ver][cmd].len )\
+	if( cmd != clif_config.connect_cmd[packet_ver] || packet_len != packet_db(packet_ver,cmd).len )\
 		;/* not wanttoconnection or wrong length */\
-	else if( (value=(int)RFIFOL(fd, packet_db[packet_ver][cmd].pos[0])) < START_ACCOUNT_NUM || value > END_ACCOUNT_NUM )\
+	else if( (value=(int)RFIFOL(fd, packet_db(packet_ver,cmd).pos[0])) < START_ACCOUNT_NUM || value > END_ACCOUNT_NUM )\
 	{ SET_ERROR(2); }/* invalid account_id */\
-	else if( (value=(int)RFIFOL(fd, packet_db[packet_ver][cmd].pos[1])) <= 0 )\
+	else if( (value=(int)RFIFOL(fd, packet_db(packet_ver,cmd).pos[1])) <= 0 )\
 	{ SET_ERROR(3); }/* invalid char_id */\
-	/*                   RFIFOL(fd, packet_db[packet_ver][cmd].pos[2]) - don't care about login_id1 */\
-	/*                   RFIFOL(fd, packet_db[packet_ver][cmd].pos[3]) - don't care about client_tick */\
-	else if( (value=(int)RFIFOB(fd, packet_db[packet_ver][cmd].pos[4])) != 0 && value != 1 )\
+	/*                   RFIFOL(fd, packet_db(packet_ver,cmd).pos[2]) - don't care about login_id1 */\
+	/*                   RFIFOL(fd, packet_db(packet_ver,cmd).pos[3]) - don't care about client_tick */\
+	else if( (value=(int)RFIFOB(fd, packet_db(packet_ver,cmd).pos[4])) != 0 && value != 1 )\
 	{ SET_ERROR(6); }/* invalid sex */\
 	else\
 	{\
@@ -10011,11 +10212,11 @@ void clif_parse_WantToConnection(int fd, struct map_session_data* sd)
 	packet_ver = clif_guess_PacketVer(fd, 1, NULL);
 
 	cmd = RFIFOW(fd,0);
-	account_id  = RFIFOL(fd, packet_db[packet_ver][cmd].pos[0]);
-	char_id     = RFIFOL(fd, packet_db[packet_ver][cmd].pos[1]);
-	login_id1   = RFIFOL(fd, packet_db[packet_ver][cmd].pos[2]);
-	client_tick = RFIFOL(fd, packet_db[packet_ver][cmd].pos[3]);
-	sex         = RFIFOB(fd, packet_db[packet_ver][cmd].pos[4]);
+	account_id  = RFIFOL(fd, packet_db(packet_ver,cmd).pos[0]);
+	char_id     = RFIFOL(fd, packet_db(packet_ver,cmd).pos[1]);
+	login_id1   = RFIFOL(fd, packet_db(packet_ver,cmd).pos[2]);
+	client_tick = RFIFOL(fd, packet_db(packet_ver,cmd).pos[3]);
+	sex         = RFIFOB(fd, packet_db(packet_ver,cmd).pos[4]);
 
 	if( packet_ver < 5 || // reject really old client versions
 	    (packet_ver <= 9 && (battle_config.packet_ver_flag & 1) == 0) || // older than 6sept04
@@ -10469,7 +10670,7 @@ void clif_notify_time(struct map_session_data* sd, unsigned long time)
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_TickSend(int fd, struct map_session_data *sd)
 {
-	sd->client_tick = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	sd->client_tick = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	clif_notify_time(sd, gettick());
 }
@@ -10512,7 +10713,7 @@ void clif_hotkeys_send(struct map_session_data *sd) {
 /// Request to update a position on the hotkey row bar
 void clif_parse_HotkeyRowShift(int fd, struct map_session_data *sd) {
 	int cmd = RFIFOW(fd, 0);
-	sd->status.hotkey_rowshift = RFIFOB(fd, packet_db[sd->packet_ver][cmd].pos[0]);
+	sd->status.hotkey_rowshift = RFIFOB(fd, packet_db(sd->packet_ver,cmd).pos[0]);
 }
 
 /// Request to update a position on the hotkey bar (CZ_SHORTCUT_KEY_CHANGE).
@@ -10520,7 +10721,7 @@ void clif_parse_HotkeyRowShift(int fd, struct map_session_data *sd) {
 void clif_parse_Hotkey(int fd, struct map_session_data *sd) {
 #ifdef HOTKEY_SAVING
 	unsigned short idx;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	idx = RFIFOW(fd, info->pos[0]);
 	if (idx >= MAX_HOTKEYS) return;
@@ -10597,7 +10798,7 @@ void clif_parse_WalkToXY(int fd, struct map_session_data *sd)
 	if(sd->sc.data[SC_RUN] || sd->sc.data[SC_WUGDASH])
 		return;
 
-	RFIFOPOS(fd, packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0], &x, &y, NULL);
+	RFIFOPOS(fd, packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0], &x, &y, NULL);
 
 	//A move command one cell west is only valid if the target cell is free
 	if(battle_config.official_cell_stack_limit > 0
@@ -10643,7 +10844,7 @@ void clif_disconnect_ack(struct map_session_data* sd, short result)
 void clif_parse_QuitGame(int fd, struct map_session_data *sd)
 {
 	/*	Rovert's prevent logout option fixed [Valaris]	*/
-	//int type = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	//int type = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( !sd->sc.data[SC_CLOAKING] && !sd->sc.data[SC_HIDING] && !sd->sc.data[SC_CHASEWALK] && !sd->sc.data[SC_CLOAKINGEXCEED] && !sd->sc.data[SC_SUHIDE] &&
 		(!battle_config.prevent_logout || DIFF_TICK(gettick(), sd->canlog_tick) > battle_config.prevent_logout) )
 	{
@@ -10662,7 +10863,7 @@ void clif_parse_QuitGame(int fd, struct map_session_data *sd)
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_GetCharNameRequest(int fd, struct map_session_data *sd)
 {
-	int id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	struct block_list* bl;
 	//struct status_change *sc;
 
@@ -10742,7 +10943,7 @@ void clif_parse_MapMove(int fd, struct map_session_data *sd)
 {
 	char command[MAP_NAME_LENGTH_EXT+25];
 	char* map_name;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	map_name = RFIFOCP(fd,info->pos[0]);
 	map_name[MAP_NAME_LENGTH_EXT-1]='\0';
@@ -10794,7 +10995,7 @@ void clif_changed_dir(struct block_list *bl, enum send_target target)
 void clif_parse_ChangeDir(int fd, struct map_session_data *sd)
 {
 	unsigned char headdir, dir;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	headdir = RFIFOB(fd,info->pos[0]);
 	dir = RFIFOB(fd,info->pos[1]);
@@ -10810,7 +11011,7 @@ void clif_parse_ChangeDir(int fd, struct map_session_data *sd)
 ///     @see enum emotion_type
 void clif_parse_Emotion(int fd, struct map_session_data *sd)
 {
-	int emoticon = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int emoticon = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	if (battle_config.basic_skill_check == 0 || pc_checkskill(sd, NV_BASIC) >= 2 || pc_checkskill(sd, SU_BASIC_SKILL) >= 1) {
 		if (emoticon == E_MUTE) {// prevent use of the mute emote [Valaris]
@@ -10969,7 +11170,7 @@ void clif_parse_ActionRequest_sub(struct map_session_data *sd, int action_type,
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_ActionRequest(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	clif_parse_ActionRequest_sub(sd,
 		RFIFOB(fd,info->pos[1]),
 		RFIFOL(fd,info->pos[0]),
@@ -10985,7 +11186,7 @@ void clif_parse_ActionRequest(int fd, struct map_session_data *sd)
 ///     1 = char-select (disconnect)
 void clif_parse_Restart(int fd, struct map_session_data *sd)
 {
-	switch(RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])) {
+	switch(RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])) {
 	case 0x00:
 		pc_respawn(sd,CLR_OUTSIGHT);
 		break;
@@ -11129,7 +11330,7 @@ void clif_parse_WisMessage(int fd, struct map_session_data* sd)
 /// 0099 <packet len>.W <text>.?B 00
 void clif_parse_Broadcast(int fd, struct map_session_data* sd) {
 	char command[CHAT_SIZE_MAX+11];
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	unsigned int len = RFIFOW(fd,info->pos[0])-4;
 	char* msg = RFIFOCP(fd,info->pos[1]);
 
@@ -11150,7 +11351,7 @@ void clif_parse_TakeItem(int fd, struct map_session_data *sd)
 	struct flooritem_data *fitem;
 	int map_object_id;
 
-	map_object_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	map_object_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	fitem = (struct flooritem_data*)map_id2bl(map_object_id);
 
@@ -11181,7 +11382,7 @@ void clif_parse_TakeItem(int fd, struct map_session_data *sd)
 /// 0363 <index>.W <amount>.W (CZ_ITEM_THROW2)
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_DropItem(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int item_index  = RFIFOW(fd,info->pos[0]) -2;
 	int item_amount = RFIFOW(fd,info->pos[1]) ;
 
@@ -11232,7 +11433,7 @@ void clif_parse_UseItem(int fd, struct map_session_data *sd)
 	//Whether the item is used or not is irrelevant, the char ain't idle. [Skotlex]
 	if (battle_config.idletime_option&IDLE_USEITEM)
 		sd->idletime = last_tick;
-	n = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])-2;
+	n = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])-2;
 
 	if(n <0 || n >= MAX_INVENTORY)
 		return;
@@ -11247,7 +11448,7 @@ void clif_parse_UseItem(int fd, struct map_session_data *sd)
 void clif_parse_EquipItem(int fd,struct map_session_data *sd)
 {
 	int index;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if(pc_isdead(sd)) {
 		clif_clearunit_area(&sd->bl,CLR_DEAD);
@@ -11314,7 +11515,7 @@ void clif_parse_UnequipItem(int fd,struct map_session_data *sd)
 	else if (pc_cant_act2(sd))
 		return;
 
-	index = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])-2;
+	index = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])-2;
 
 	if (battle_config.idletime_option&IDLE_USEITEM)
 		sd->idletime = last_tick;
@@ -11330,7 +11531,7 @@ void clif_parse_UnequipItem(int fd,struct map_session_data *sd)
 void clif_parse_NpcClicked(int fd,struct map_session_data *sd)
 {
 	struct block_list *bl;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if(pc_isdead(sd)) {
 		clif_clearunit_area(&sd->bl,CLR_DEAD);
@@ -11374,7 +11575,7 @@ void clif_parse_NpcClicked(int fd,struct map_session_data *sd)
 ///     1 = sell
 void clif_parse_NpcBuySellSelected(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (sd->state.trading)
 		return;
 	npc_buysellsel(sd,RFIFOL(fd,info->pos[0]),RFIFOB(fd,info->pos[1]));
@@ -11403,7 +11604,7 @@ void clif_npc_buy_result(struct map_session_data* sd, unsigned char result)
 /// 00c8 <packet len>.W { <amount>.W <name id>.W }*
 void clif_parse_NpcBuyListSend(int fd, struct map_session_data* sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	uint16 n = (RFIFOW(fd,info->pos[0])-4) /4;
 	int result;
 
@@ -11439,7 +11640,7 @@ void clif_parse_NpcSellListSend(int fd,struct map_session_data *sd)
 {
 	int fail=0,n;
 	unsigned short *item_list;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	n = (RFIFOW(fd,info->pos[0])-4) /4; // (pktlen-(cmd+len))/listsize
 	item_list = (unsigned short*)RFIFOP(fd,info->pos[1]);
@@ -11461,7 +11662,7 @@ void clif_parse_NpcSellListSend(int fd,struct map_session_data *sd)
 ///     1 = public
 void clif_parse_CreateChatRoom(int fd, struct map_session_data* sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = RFIFOW(fd,info->pos[0])-15;
 	int limit = RFIFOW(fd,info->pos[1]);
 	bool pub = (RFIFOB(fd,info->pos[2]) != 0);
@@ -11499,7 +11700,7 @@ void clif_parse_CreateChatRoom(int fd, struct map_session_data* sd)
 /// Chatroom join request (CZ_REQ_ENTER_ROOM).
 /// 00d9 <chat ID>.L <passwd>.8B
 void clif_parse_ChatAddMember(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int chatid = RFIFOL(fd,info->pos[0]);
 	const char* password = RFIFOCP(fd,info->pos[1]); // not zero-terminated
 
@@ -11513,7 +11714,7 @@ void clif_parse_ChatAddMember(int fd, struct map_session_data* sd){
 ///     0 = private
 ///     1 = public
 void clif_parse_ChatRoomStatusChange(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = RFIFOW(fd,info->pos[0])-15;
 	int limit = RFIFOW(fd,info->pos[1]);
 	bool pub = (RFIFOB(fd,info->pos[2]) != 0);
@@ -11539,8 +11740,8 @@ void clif_parse_ChatRoomStatusChange(int fd, struct map_session_data* sd){
 ///     1 = normal
 void clif_parse_ChangeChatOwner(int fd, struct map_session_data* sd)
 {
-	//int role = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
-	chat_changechatowner(sd,RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]));
+	//int role = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
+	chat_changechatowner(sd,RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]));
 }
 
 
@@ -11548,7 +11749,7 @@ void clif_parse_ChangeChatOwner(int fd, struct map_session_data* sd)
 /// 00e2 <name>.24B
 void clif_parse_KickFromChat(int fd,struct map_session_data *sd)
 {
-	chat_kickchat(sd,RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	chat_kickchat(sd,RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -11582,7 +11783,7 @@ void clif_parse_TradeRequest(int fd,struct map_session_data *sd)
 {
 	struct map_session_data *t_sd;
 
-	t_sd = map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	t_sd = map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 
 	if(!sd->chatID && pc_cant_act(sd))
 		return; //You can trade while in a chatroom.
@@ -11609,7 +11810,7 @@ void clif_parse_TradeRequest(int fd,struct map_session_data *sd)
 ///     4 = rejected
 void clif_parse_TradeAck(int fd,struct map_session_data *sd)
 {
-	trade_tradeack(sd,RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	trade_tradeack(sd,RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -11617,7 +11818,7 @@ void clif_parse_TradeAck(int fd,struct map_session_data *sd)
 /// 00e8 <index>.W <amount>.L
 void clif_parse_TradeAddItem(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	short index = RFIFOW(fd,info->pos[0]);
 	int amount = RFIFOL(fd,info->pos[1]);
 
@@ -11665,7 +11866,7 @@ void clif_parse_StopAttack(int fd,struct map_session_data *sd)
 /// 0126 <index>.W <amount>.L
 void clif_parse_PutItemToCart(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (pc_istrading(sd))
 		return;
 	if (!pc_iscarton(sd))
@@ -11678,7 +11879,7 @@ void clif_parse_PutItemToCart(int fd,struct map_session_data *sd)
 /// 0127 <index>.W <amount>.L
 void clif_parse_GetItemFromCart(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (!pc_iscarton(sd))
 		return;
 	pc_getitemfromcart(sd,RFIFOW(fd,info->pos[0])-2,RFIFOL(fd,info->pos[1]));
@@ -11759,7 +11960,7 @@ void clif_parse_ChangeCart(int fd,struct map_session_data *sd)
 	}
 #endif
 
-	type = (int)RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	type = (int)RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	if( 
 #ifdef NEW_CARTS
@@ -11786,13 +11987,13 @@ void clif_parse_ChangeCart(int fd,struct map_session_data *sd)
 ///     Newer clients (2013-12-23 and newer) send the correct amount.
 void clif_parse_StatusUp(int fd,struct map_session_data *sd)
 {
-	int increase_amount = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
+	int increase_amount = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
 
 	if( increase_amount < 0 ) {
 		ShowDebug("clif_parse_StatusUp: Negative 'increase' value sent by client! (fd: %d, value: %d)\n",
 			fd, increase_amount);
 	}
-	pc_statusup(sd,RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]),increase_amount);
+	pc_statusup(sd,RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]),increase_amount);
 }
 
 
@@ -11800,7 +12001,7 @@ void clif_parse_StatusUp(int fd,struct map_session_data *sd)
 /// 0112 <skill id>.W
 void clif_parse_SkillUp(int fd,struct map_session_data *sd)
 {
-	pc_skillup(sd,RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	pc_skillup(sd,RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 static void clif_parse_UseSkillToId_homun(struct homun_data *hd, struct map_session_data *sd, unsigned int tick, uint16 skill_id, uint16 skill_lv, int target_id)
@@ -11917,7 +12118,7 @@ void clif_parse_UseSkillToId(int fd, struct map_session_data *sd)
 	uint16 skill_id, skill_lv;
 	int inf,target_id;
 	unsigned int tick = gettick();
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	skill_lv = RFIFOW(fd,info->pos[0]);
 	skill_id = RFIFOW(fd,info->pos[1]);
@@ -12109,7 +12310,7 @@ static void clif_parse_UseSkillToPosSub(int fd, struct map_session_data *sd, uin
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_UseSkillToPos(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (pc_cant_act(sd))
 		return;
 	if (pc_issit(sd))
@@ -12131,7 +12332,7 @@ void clif_parse_UseSkillToPos(int fd, struct map_session_data *sd)
 /// There are various variants of this packet, some of them have padding between fields.
 void clif_parse_UseSkillToPosMoreInfo(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (pc_cant_act(sd))
 		return;
 	if (pc_issit(sd))
@@ -12151,7 +12352,7 @@ void clif_parse_UseSkillToPosMoreInfo(int fd, struct map_session_data *sd)
 /// 011b <skill id>.W <map name>.16B
 void clif_parse_UseSkillMap(int fd, struct map_session_data* sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	uint16 skill_id = RFIFOW(fd,info->pos[0]);
 	char map_name[MAP_NAME_LENGTH];
 
@@ -12184,7 +12385,7 @@ void clif_parse_RequestMemo(int fd,struct map_session_data *sd)
 /// Answer to pharmacy item selection dialog (CZ_REQMAKINGITEM).
 /// 018e <name id>.W { <material id>.W }*3
 void clif_parse_ProduceMix(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	unsigned short nameid = RFIFOW(fd,info->pos[0]);
 	int slot1  = RFIFOW(fd,info->pos[1]);
 	int slot2  = RFIFOW(fd,info->pos[2]);
@@ -12222,7 +12423,7 @@ void clif_parse_ProduceMix(int fd,struct map_session_data *sd){
 ///     5 = GN_MAKEBOMB
 ///     6 = GN_S_PHARMACY
 void clif_parse_Cooking(int fd,struct map_session_data *sd) {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int type = RFIFOW(fd,info->pos[0]);
 	unsigned short nameid = RFIFOW(fd,info->pos[1]);
 	int amount = sd->menuskill_val2 ? sd->menuskill_val2 : 1;
@@ -12256,11 +12457,11 @@ void clif_parse_RepairItem(int fd, struct map_session_data *sd)
 		clif_menuskill_clear(sd);
 		return;
 	}
-	skill_repairweapon(sd,RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
-	//nameid = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
-	//refine = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[2]);
+	skill_repairweapon(sd,RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
+	//nameid = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
+	//refine = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[2]);
 	//for(i = 0; i<MAX_SLOTS; i++)
-	//	card[i] = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[3+i]);
+	//	card[i] = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[3+i]);
 	clif_menuskill_clear(sd);
 }
 
@@ -12279,7 +12480,7 @@ void clif_parse_WeaponRefine(int fd, struct map_session_data *sd)
 		clif_menuskill_clear(sd);
 		return;
 	}
-	idx = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	idx = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	skill_weaponrefine(sd, idx-2);
 	clif_menuskill_clear(sd);
 }
@@ -12293,7 +12494,7 @@ void clif_parse_WeaponRefine(int fd, struct map_session_data *sd)
 /// NOTE: If there were more than 254 items in the list, choice
 ///     overflows to choice%256.
 void clif_parse_NpcSelectMenu(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int npc_id = RFIFOL(fd,info->pos[0]);
 	uint8 select = RFIFOB(fd,info->pos[1]);
 
@@ -12319,14 +12520,14 @@ void clif_parse_NpcSelectMenu(int fd,struct map_session_data *sd){
 /// 00b9 <npc id>.L
 void clif_parse_NpcNextClicked(int fd,struct map_session_data *sd)
 {
-	npc_scriptcont(sd,RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]), false);
+	npc_scriptcont(sd,RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]), false);
 }
 
 
 /// NPC numeric input dialog value (CZ_INPUT_EDITDLG).
 /// 0143 <npc id>.L <value>.L
 void clif_parse_NpcAmountInput(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int npcid = RFIFOL(fd,info->pos[0]);
 	int amount = (int)RFIFOL(fd,info->pos[1]);
 
@@ -12338,7 +12539,7 @@ void clif_parse_NpcAmountInput(int fd,struct map_session_data *sd){
 /// NPC text input dialog value (CZ_INPUT_EDITDLGSTR).
 /// 01d5 <packet len>.W <npc id>.L <string>.?B
 void clif_parse_NpcStringInput(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int message_len = RFIFOW(fd,info->pos[0])-8;
 	int npcid = RFIFOL(fd,info->pos[1]);
 	const char* message = RFIFOCP(fd,info->pos[2]);
@@ -12361,7 +12562,7 @@ void clif_parse_NpcCloseClicked(int fd,struct map_session_data *sd)
 {
 	if (!sd->npc_id) //Avoid parsing anything when the script was done with. [Skotlex]
 		return;
-	npc_scriptcont(sd, RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]), true);
+	npc_scriptcont(sd, RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]), true);
 }
 
 
@@ -12370,7 +12571,7 @@ void clif_parse_NpcCloseClicked(int fd,struct map_session_data *sd)
 /// index:
 ///     -1 = cancel
 void clif_parse_ItemIdentify(int fd,struct map_session_data *sd) {
-	short idx = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]) - 2;
+	short idx = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]) - 2;
 
 	if (sd->menuskill_id != MC_IDENTIFY)
 		return;
@@ -12395,7 +12596,7 @@ void clif_parse_ItemIdentify(int fd,struct map_session_data *sd) {
 /// Answer to arrow crafting item selection dialog (CZ_REQ_MAKINGARROW).
 /// 01ae <name id>.W
 void clif_parse_SelectArrow(int fd,struct map_session_data *sd) {
-	unsigned short nameid = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	unsigned short nameid = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if (pc_istrading(sd)) {
 		//Make it fail to avoid shop exploits where you sell something different than you see.
 		clif_skill_fail(sd,sd->ud.skill_id,USESKILL_FAIL_LEVEL,0);
@@ -12431,7 +12632,7 @@ void clif_parse_AutoSpell(int fd,struct map_session_data *sd)
 	if (sd->menuskill_id != SA_AUTOSPELL)
 		return;
 	sd->state.workinprogress = WIP_DISABLE_NONE;
-	skill_autospell(sd,RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	skill_autospell(sd,RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 	clif_menuskill_clear(sd);
 }
 
@@ -12442,7 +12643,7 @@ void clif_parse_UseCard(int fd,struct map_session_data *sd)
 {
 	if (sd->state.trading != 0)
 		return;
-	clif_use_card(sd,RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])-2);
+	clif_use_card(sd,RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])-2);
 }
 
 
@@ -12450,7 +12651,7 @@ void clif_parse_UseCard(int fd,struct map_session_data *sd)
 /// 017c <card index>.W <equip index>.W
 void clif_parse_InsertCard(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if (sd->state.trading != 0)
 		return;
 	pc_insert_card(sd,RFIFOW(fd,info->pos[0])-2,RFIFOW(fd,info->pos[1])-2);
@@ -12465,7 +12666,7 @@ void clif_parse_SolveCharName(int fd, struct map_session_data *sd)
 {
 	int charid;
 
-	charid = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	charid = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	map_reqnickdb(sd, charid);
 }
 
@@ -12479,7 +12680,7 @@ void clif_parse_SolveCharName(int fd, struct map_session_data *sd)
 void clif_parse_ResetChar(int fd, struct map_session_data *sd) {
 	char cmd[15];
 
-	if( RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]) )
+	if( RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]) )
 		safesnprintf(cmd,sizeof(cmd),"%cresetskill",atcommand_symbol);
 	else
 		safesnprintf(cmd,sizeof(cmd),"%cresetstat",atcommand_symbol);
@@ -12493,7 +12694,7 @@ void clif_parse_ResetChar(int fd, struct map_session_data *sd) {
 /// 019c <packet len>.W <text>.?B
 void clif_parse_LocalBroadcast(int fd, struct map_session_data* sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	char command[CHAT_SIZE_MAX+16];
 	unsigned int len = RFIFOW(fd,info->pos[0])-4;
 	char* msg = RFIFOCP(fd,info->pos[1]);
@@ -12513,7 +12714,7 @@ void clif_parse_LocalBroadcast(int fd, struct map_session_data* sd)
 void clif_parse_MoveToKafra(int fd, struct map_session_data *sd)
 {
 	int item_index, item_amount;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if (pc_istrading(sd))
 		return;
@@ -12540,7 +12741,7 @@ void clif_parse_MoveToKafra(int fd, struct map_session_data *sd)
 void clif_parse_MoveFromKafra(int fd,struct map_session_data *sd)
 {
 	int item_index, item_amount;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	item_index = RFIFOW(fd,info->pos[0])-1;
 	item_amount = RFIFOL(fd,info->pos[1]);
@@ -12557,7 +12758,7 @@ void clif_parse_MoveFromKafra(int fd,struct map_session_data *sd)
 /// Request to move an item from cart to storage (CZ_MOVE_ITEM_FROM_CART_TO_STORE).
 /// 0129 <index>.W <amount>.L
 void clif_parse_MoveToKafraFromCart(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	int idx = RFIFOW(fd,info->pos[0]) - 2;
 	int amount = RFIFOL(fd,info->pos[1]);
@@ -12579,7 +12780,7 @@ void clif_parse_MoveToKafraFromCart(int fd, struct map_session_data *sd){
 /// Request to move an item from storage to cart (CZ_MOVE_ITEM_FROM_STORE_TO_CART).
 /// 0128 <index>.W <amount>.L
 void clif_parse_MoveFromKafraToCart(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int idx = RFIFOW(fd,info->pos[0]) - 1;
 	int amount = RFIFOL(fd,info->pos[1]);
 
@@ -12638,7 +12839,7 @@ void clif_storagepassword(struct map_session_data* sd, short info)
 ///     3 = check password
 /// NOTE: This packet is only available on certain non-kRO clients.
 void clif_parse_StoragePassword(int fd, struct map_session_data *sd){ //@TODO
-//	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+//	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 //	int type = RFIFOW(fd,info->pos[0]);
 //	char* password = RFIFOP(fd,info->pos[1]);
 //	char* new_password = RFIFOP(fd,info->pos[2]);
@@ -12672,7 +12873,7 @@ void clif_storagepassword_result(struct map_session_data* sd, short result, shor
 /// Party creation request
 /// 00f9 <party name>.24B (CZ_MAKE_GROUP)
 void clif_parse_CreateParty(int fd, struct map_session_data *sd){
-	char* name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	char* name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	name[NAME_LENGTH-1] = '\0';
 
 	if( map[sd->bl.m].flag.partylock ) {// Party locked.
@@ -12689,7 +12890,7 @@ void clif_parse_CreateParty(int fd, struct map_session_data *sd){
 
 /// 01e8 <party name>.24B <item pickup rule>.B <item share rule>.B (CZ_MAKE_GROUP2)
 void clif_parse_CreateParty2(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	char* name = RFIFOCP(fd,info->pos[0]);
 	int item1 = RFIFOB(fd,info->pos[1]);
 	int item2 = RFIFOB(fd,info->pos[2]);
@@ -12719,7 +12920,7 @@ void clif_parse_PartyInvite(int fd, struct map_session_data *sd)
 		return;
 	}
 
-	t_sd = map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	t_sd = map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 
 	if(t_sd && t_sd->state.noask) {// @noask [LuzZza]
 		clif_noask_sub(sd, t_sd, 1);
@@ -12732,7 +12933,7 @@ void clif_parse_PartyInvite(int fd, struct map_session_data *sd)
 /// 02c4 <char name>.24B (CZ_PARTY_JOIN_REQ)
 void clif_parse_PartyInvite2(int fd, struct map_session_data *sd){
 	struct map_session_data *t_sd;
-	char *name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	char *name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	name[NAME_LENGTH-1] = '\0';
 
 	if(map[sd->bl.m].flag.partylock) {// Party locked.
@@ -12759,14 +12960,14 @@ void clif_parse_PartyInvite2(int fd, struct map_session_data *sd){
 ///     1 = accept
 void clif_parse_ReplyPartyInvite(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	party_reply_invite(sd,RFIFOL(fd,info->pos[0]),
 	    RFIFOL(fd,info->pos[1]));
 }
 //(CZ_PARTY_JOIN_REQ_ACK)
 void clif_parse_ReplyPartyInvite2(int fd,struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	party_reply_invite(sd,RFIFOL(fd,info->pos[0]),
 	    RFIFOB(fd,info->pos[1]));
 }
@@ -12788,7 +12989,7 @@ void clif_parse_LeaveParty(int fd, struct map_session_data *sd)
 /// 0103 <account id>.L <char name>.24B
 void clif_parse_RemovePartyMember(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if(map[sd->bl.m].flag.partylock) {// Party locked.
 		clif_displaymessage(fd, msg_txt(sd,227));
 		return;
@@ -12806,7 +13007,7 @@ void clif_parse_PartyChangeOption(int fd, struct map_session_data *sd)
 	struct party_data *p;
 	int i,expflag;
 	int cmd = RFIFOW(fd,0);
-	struct s_packet_db* info = &packet_db[sd->packet_ver][cmd];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,cmd);
 
 	if( !sd->status.party_id )
 		return;
@@ -12847,7 +13048,7 @@ void clif_parse_PartyMessage(int fd, struct map_session_data* sd){
 /// Changes Party Leader (CZ_CHANGE_GROUP_MASTER).
 /// 07da <account id>.L
 void clif_parse_PartyChangeLeader(int fd, struct map_session_data* sd){
-	party_changeleader(sd, map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])),NULL);
+	party_changeleader(sd, map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])),NULL);
 }
 
 
@@ -12857,7 +13058,7 @@ void clif_parse_PartyChangeLeader(int fd, struct map_session_data* sd){
 /// Request to register a party booking advertisment (CZ_PARTY_BOOKING_REQ_REGISTER).
 /// 0802 <level>.W <map id>.W { <job>.W }*6
 void clif_parse_PartyBookingRegisterReq(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	short level = RFIFOW(fd,info->pos[0]);
 	short mapid = RFIFOW(fd,info->pos[1]);
 	int idxpbj = info->pos[2];
@@ -12891,7 +13092,7 @@ void clif_PartyBookingRegisterAck(struct map_session_data *sd, int flag)
 /// Request to search for party booking advertisments (CZ_PARTY_BOOKING_REQ_SEARCH).
 /// 0804 <level>.W <map id>.W <job>.W <last index>.L <result count>.W
 void clif_parse_PartyBookingSearchReq(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	short level = RFIFOW(fd,info->pos[0]);
 	short mapid = RFIFOW(fd,info->pos[1]);
 	short job = RFIFOW(fd,info->pos[2]);
@@ -12964,7 +13165,7 @@ void clif_parse_PartyBookingUpdateReq(int fd, struct map_session_data* sd)
 {
 	short job[MAX_PARTY_BOOKING_JOBS];
 	int i;
-	int idxpbu = packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0];
+	int idxpbu = packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0];
 
 	for(i=0; i<MAX_PARTY_BOOKING_JOBS; i++)
 		job[i] = RFIFOW(fd,idxpbu+i*2);
@@ -13040,14 +13241,14 @@ void clif_parse_VendingListReq(int fd, struct map_session_data* sd)
 	if( sd->npc_id ) {// using an NPC
 		return;
 	}
-	vending_vendinglistreq(sd,RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	vending_vendinglistreq(sd,RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
 /// Shop item(s) purchase request (CZ_PC_PURCHASE_ITEMLIST_FROMMC).
 /// 0134 <packet len>.W <account id>.L { <amount>.W <index>.W }*
 void clif_parse_PurchaseReq(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = (int)RFIFOW(fd,info->pos[0]) - 8;
 	int id = (int)RFIFOL(fd,info->pos[1]);
 	const uint8* data = (uint8*)RFIFOP(fd,info->pos[2]);
@@ -13062,7 +13263,7 @@ void clif_parse_PurchaseReq(int fd, struct map_session_data* sd){
 /// Shop item(s) purchase request (CZ_PC_PURCHASE_ITEMLIST_FROMMC2).
 /// 0801 <packet len>.W <account id>.L <unique id>.L { <amount>.W <index>.W }*
 void clif_parse_PurchaseReq2(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = (int)RFIFOW(fd,info->pos[0]) - 12;
 	int aid = (int)RFIFOL(fd,info->pos[1]);
 	int uid = (int)RFIFOL(fd,info->pos[2]);
@@ -13083,7 +13284,7 @@ void clif_parse_PurchaseReq2(int fd, struct map_session_data* sd){
 ///     1 = open
 void clif_parse_OpenVending(int fd, struct map_session_data* sd){
 	int cmd = RFIFOW(fd,0);
-	struct s_packet_db* info = &packet_db[sd->packet_ver][cmd];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,cmd);
 	short len = (short)RFIFOW(fd,info->pos[0]);
 	const char* message = RFIFOCP(fd,info->pos[1]);
 	const uint8* data = (uint8*)RFIFOP(fd,info->pos[3]);
@@ -13123,8 +13324,8 @@ void clif_parse_OpenVending(int fd, struct map_session_data* sd){
 /// Guild creation request (CZ_REQ_MAKE_GUILD).
 /// 0165 <char id>.L <guild name>.24B
 void clif_parse_CreateGuild(int fd,struct map_session_data *sd){
-	//int charid = RFIFOL(fd,packet_db[sd->packet_ver][cmd].pos[0]);
-	char* name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
+	//int charid = RFIFOL(fd,packet_db(sd->packet_ver,cmd).pos[0]);
+	char* name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
 	name[NAME_LENGTH-1] = '\0';
 
 	if(map[sd->bl.m].flag.guildlock) { //Guild locked.
@@ -13161,7 +13362,7 @@ void clif_parse_GuildCheckMaster(int fd, struct map_session_data *sd)
 ///     6 = notice
 void clif_parse_GuildRequestInfo(int fd, struct map_session_data *sd)
 {
-	int type = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int type = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( !sd->status.guild_id && !sd->bg_id )
 		return;
 
@@ -13197,7 +13398,7 @@ void clif_parse_GuildRequestInfo(int fd, struct map_session_data *sd)
 void clif_parse_GuildChangePositionInfo(int fd, struct map_session_data *sd)
 {
 	int i;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = RFIFOW(fd,info->pos[0]);
 	int idxgpos = info->pos[1];
 
@@ -13215,7 +13416,7 @@ void clif_parse_GuildChangePositionInfo(int fd, struct map_session_data *sd)
 void clif_parse_GuildChangeMemberPosition(int fd, struct map_session_data *sd)
 {
 	int i;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int len = RFIFOW(fd,info->pos[0]);
 	int idxgpos = info->pos[1];
 
@@ -13234,7 +13435,7 @@ void clif_parse_GuildChangeMemberPosition(int fd, struct map_session_data *sd)
 void clif_parse_GuildRequestEmblem(int fd,struct map_session_data *sd)
 {
 	struct guild* g;
-	int guild_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int guild_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	if( (g = guild_search(guild_id)) != NULL )
 		clif_guild_emblem(sd,g);
@@ -13280,7 +13481,7 @@ static enum e_result_validate_emblem clif_validate_emblem(const uint8* emblem, u
 /// Request to update the guild emblem (CZ_REGISTER_GUILD_EMBLEM_IMG).
 /// 0153 <packet len>.W <emblem data>.?B
 void clif_parse_GuildChangeEmblem(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	unsigned long emblem_len = RFIFOW(fd,info->pos[0])-4;
 	const uint8* emblem = RFIFOP(fd,info->pos[1]);
 	int emb_val=0;
@@ -13311,7 +13512,7 @@ void clif_parse_GuildChangeEmblem(int fd,struct map_session_data *sd){
 /// Guild notice update request (CZ_GUILD_NOTICE).
 /// 016e <guild id>.L <msg1>.60B <msg2>.120B
 void clif_parse_GuildChangeNotice(int fd, struct map_session_data* sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int guild_id = RFIFOL(fd,info->pos[0]);
 	char* msg1 = RFIFOCP(fd,info->pos[1]);
 	char* msg2 = RFIFOCP(fd,info->pos[2]);
@@ -13355,7 +13556,7 @@ int clif_sub_guild_invite(int fd, struct map_session_data *sd, struct map_sessio
 /// Guild invite request (CZ_REQ_JOIN_GUILD).
 /// 0168 <account id>.L <inviter account id>.L <inviter char id>.L
 void clif_parse_GuildInvite(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	struct map_session_data *t_sd = map_id2sd(RFIFOL(fd,info->pos[0]));
 //	int inv_aid = RFIFOL(fd,info->pos[1]);
 //	int inv_cid = RFIFOL(fd,info->pos[2]);
@@ -13368,7 +13569,7 @@ void clif_parse_GuildInvite(int fd,struct map_session_data *sd){
 /// 0916 <char name>.24B (CZ_REQ_JOIN_GUILD2)
 void
 clif_parse_GuildInvite2(int fd, struct map_session_data *sd) {
-	struct map_session_data *t_sd = map_nick2sd(RFIFOCP(fd, packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	struct map_session_data *t_sd = map_nick2sd(RFIFOCP(fd, packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 
 	if (clif_sub_guild_invite(fd, sd, t_sd))
 		return;
@@ -13381,7 +13582,7 @@ clif_parse_GuildInvite2(int fd, struct map_session_data *sd) {
 ///     0 = refuse
 ///     1 = accept
 void clif_parse_GuildReplyInvite(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	guild_reply_invite(sd,RFIFOL(fd,info->pos[0]),
 	    RFIFOL(fd,info->pos[1]));
 }
@@ -13390,7 +13591,7 @@ void clif_parse_GuildReplyInvite(int fd,struct map_session_data *sd){
 /// Request to leave guild (CZ_REQ_LEAVE_GUILD).
 /// 0159 <guild id>.L <account id>.L <char id>.L <reason>.40B
 void clif_parse_GuildLeave(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if(map[sd->bl.m].flag.guildlock) { //Guild locked.
 		clif_displaymessage(fd, msg_txt(sd,228));
 		return;
@@ -13410,7 +13611,7 @@ void clif_parse_GuildLeave(int fd,struct map_session_data *sd){
 /// Request to expel a member of a guild (CZ_REQ_BAN_GUILD).
 /// 015b <guild id>.L <account id>.L <char id>.L <reason>.40B
 void clif_parse_GuildExpulsion(int fd,struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if( map[sd->bl.m].flag.guildlock || sd->bg_id )
 	{ // Guild locked.
 		clif_displaymessage(fd, msg_txt(sd,228));
@@ -13453,9 +13654,9 @@ void clif_parse_GuildRequestAlliance(int fd, struct map_session_data *sd)
 		return;
 	}
 
-	t_sd = map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
-	//inv_aid = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
-	//inv_cid = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[2]);
+	t_sd = map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
+	//inv_aid = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
+	//inv_cid = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[2]);
 
 	// @noask [LuzZza]
 	if(t_sd && t_sd->state.noask) {
@@ -13473,7 +13674,7 @@ void clif_parse_GuildRequestAlliance(int fd, struct map_session_data *sd)
 ///     0 = refuse
 ///     1 = accept
 void clif_parse_GuildReplyAlliance(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	guild_reply_reqalliance(sd,
 	    RFIFOL(fd,info->pos[0]),
 	    RFIFOL(fd,info->pos[1]));
@@ -13486,7 +13687,7 @@ void clif_parse_GuildReplyAlliance(int fd, struct map_session_data *sd){
 ///     0 = Ally
 ///     1 = Enemy
 void clif_parse_GuildDelAlliance(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	if(!sd->state.gmaster_flag)
 		return;
 
@@ -13514,7 +13715,7 @@ void clif_parse_GuildOpposition(int fd, struct map_session_data *sd)
 		return;
 	}
 
-	t_sd = map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	t_sd = map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 
 	// @noask [LuzZza]
 	if(t_sd && t_sd->state.noask) {
@@ -13537,7 +13738,7 @@ void clif_parse_GuildBreak(int fd, struct map_session_data *sd)
 		clif_displaymessage(fd, msg_txt(sd,228));
 		return;
 	}
-	guild_break(sd,RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	guild_break(sd,RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -13553,14 +13754,14 @@ void clif_parse_GuildBreak(int fd, struct map_session_data *sd)
 ///     3 = return to egg
 ///     4 = unequip accessory
 void clif_parse_PetMenu(int fd, struct map_session_data *sd){
-	pet_menu(sd,RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	pet_menu(sd,RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
 /// Attempt to tame a monster (CZ_TRYCAPTURE_MONSTER).
 /// 019f <id>.L
 void clif_parse_CatchPet(int fd, struct map_session_data *sd){
-	pet_catch_process2(sd,RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	pet_catch_process2(sd,RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -13570,7 +13771,7 @@ void clif_parse_SelectEgg(int fd, struct map_session_data *sd){
 	if (sd->menuskill_id != SA_TAMINGMONSTER || sd->menuskill_val != -1)
 		return;
 
-	pet_select_egg(sd,RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0])-2);
+	pet_select_egg(sd,RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0])-2);
 	clif_menuskill_clear(sd);
 }
 
@@ -13602,7 +13803,7 @@ void clif_parse_SelectEgg(int fd, struct map_session_data *sd){
 void clif_parse_SendEmotion(int fd, struct map_session_data *sd)
 {
 	if(sd->pd)
-		clif_pet_emotion(sd->pd,RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+		clif_pet_emotion(sd->pd,RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -13610,7 +13811,7 @@ void clif_parse_SendEmotion(int fd, struct map_session_data *sd)
 /// 01a5 <name>.24B
 void clif_parse_ChangePetName(int fd, struct map_session_data *sd)
 {
-	pet_change_name(sd,RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	pet_change_name(sd,RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
@@ -13623,7 +13824,7 @@ void clif_parse_GMKick(int fd, struct map_session_data *sd)
 	struct block_list *target;
 	int tid;
 
-	tid = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	tid = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	target = map_id2bl(tid);
 	if (!target) {
 		clif_GM_kickack(sd, 0);
@@ -13694,7 +13895,7 @@ void clif_parse_GMShift(int fd, struct map_session_data *sd)
 	char *player_name;
 	char command[NAME_LENGTH+8];
 
-	player_name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	player_name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	player_name[NAME_LENGTH-1] = '\0';
 
 	safesnprintf(command,sizeof(command),"%cjumpto %s", atcommand_symbol, player_name);
@@ -13710,7 +13911,7 @@ void clif_parse_GMRemove2(int fd, struct map_session_data* sd)
 	uint32 account_id;
 	struct map_session_data* pl_sd;
 
-	account_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	account_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( (pl_sd = map_id2sd(account_id)) != NULL ) {
 		char command[NAME_LENGTH+8];
 		safesnprintf(command,sizeof(command),"%cjumpto %s", atcommand_symbol, pl_sd->status.name);
@@ -13731,7 +13932,7 @@ void clif_parse_GMRecall(int fd, struct map_session_data *sd)
 	char *player_name;
 	char command [NAME_LENGTH+8];
 
-	player_name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	player_name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	player_name[NAME_LENGTH-1] = '\0';
 
 	safesnprintf(command,sizeof(command),"%crecall %s", atcommand_symbol, player_name);
@@ -13747,7 +13948,7 @@ void clif_parse_GMRecall2(int fd, struct map_session_data* sd)
 	uint32 account_id;
 	struct map_session_data* pl_sd;
 
-	account_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	account_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( (pl_sd = map_id2sd(account_id)) != NULL ) {
 		char command[NAME_LENGTH+8];
 		safesnprintf(command,sizeof(command),"%crecall %s", atcommand_symbol, pl_sd->status.name);
@@ -13771,7 +13972,7 @@ void clif_parse_GMRecall2(int fd, struct map_session_data* sd)
 /// 09ce <item/mob name>.100B [Ind/Yommy]
 void clif_parse_GM_Item_Monster(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int mob_id = 0;
 	struct item_data *id = NULL;
 	struct mob_db *mob = NULL;
@@ -13835,7 +14036,7 @@ void clif_parse_GM_Item_Monster(int fd, struct map_session_data *sd)
 ///     TODO: Any OPTION_* ?
 void clif_parse_GMHide(int fd, struct map_session_data *sd) {
 	char cmd[6];
-	//int eff_st = RFIFOL(packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	//int eff_st = RFIFOL(packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	safesnprintf(cmd,sizeof(cmd),"%chide",atcommand_symbol);
 	is_atcommand(fd, sd, cmd, 1);
@@ -13853,7 +14054,7 @@ void clif_parse_GMReqNoChat(int fd,struct map_session_data *sd)
 	int id, type, value;
 	struct map_session_data *dstsd;
 	char command[NAME_LENGTH+15];
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 
 	id = RFIFOL(fd,info->pos[0]);
@@ -13883,7 +14084,7 @@ void clif_parse_GMReqNoChat(int fd,struct map_session_data *sd)
 void clif_parse_GMRc(int fd, struct map_session_data* sd)
 {
 	char command[NAME_LENGTH+15];
-	char *name = RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	char *name = RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	name[NAME_LENGTH-1] = '\0';
 	safesnprintf(command,sizeof(command),"%cmute %d %s", atcommand_symbol, 60, name);
@@ -13908,7 +14109,7 @@ void clif_account_name(int fd, uint32 account_id, const char* accname)
 //! TODO: Figure out how does this actually work
 void clif_parse_GMReqAccountName(int fd, struct map_session_data *sd)
 {
-	uint32 account_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	uint32 account_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	/*
 	char query[30];
 	safesnprintf(query,sizeof(query),"%d", account_id);
@@ -13928,7 +14129,7 @@ void clif_parse_GMReqAccountName(int fd, struct map_session_data *sd)
 void clif_parse_GMChangeMapType(int fd, struct map_session_data *sd)
 {
 	int x,y,type;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if(! pc_has_permission(sd, PC_PERM_USE_CHANGEMAPTYPE) )
 		return;
@@ -13954,7 +14155,7 @@ void clif_parse_PMIgnore(int fd, struct map_session_data* sd)
 	char* nick;
 	uint8 type;
 	int i;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	nick = RFIFOCP(fd,info->pos[0]);
 	nick[NAME_LENGTH-1] = '\0'; // to be sure that the player name has at most 23 characters
@@ -14005,7 +14206,7 @@ void clif_parse_PMIgnore(int fd, struct map_session_data* sd)
 ///     1 = (/inall) allow all speech
 void clif_parse_PMIgnoreAll(int fd, struct map_session_data *sd)
 {
-	int type = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]), flag;
+	int type = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]), flag;
 
 	if( type == 0 ) {// Deny all
 		if( sd->state.ignoreAll ) {
@@ -14220,7 +14421,7 @@ void clif_parse_FriendsListAdd(int fd, struct map_session_data *sd)
 	struct map_session_data *f_sd;
 	int i;
 
-	f_sd = map_nick2sd(RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	f_sd = map_nick2sd(RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 
 	// ensure that the request player's friend list is not full
 	ARR_FIND(0, MAX_FRIENDS, i, sd->status.friends[i].char_id == 0);
@@ -14272,7 +14473,7 @@ void clif_parse_FriendsListReply(int fd, struct map_session_data *sd)
 	struct map_session_data *f_sd;
 	uint32 account_id;
 	char reply;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	account_id = RFIFOL(fd,info->pos[0]);
 	//char_id = RFIFOL(fd,info->pos[1]);
@@ -14336,7 +14537,7 @@ void clif_parse_FriendsListRemove(int fd, struct map_session_data *sd)
 	struct map_session_data *f_sd = NULL;
 	uint32 account_id, char_id;
 	int i, j;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	account_id = RFIFOL(fd,info->pos[0]);
 	char_id = RFIFOL(fd,info->pos[1]);
@@ -14416,8 +14617,8 @@ void clif_PVPInfo(struct map_session_data* sd)
 void clif_parse_PVPInfo(int fd,struct map_session_data *sd)
 {
 	// TODO: Is there a way to use this on an another player (char/acc id)?
-	//int cid = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
-	//int aid = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
+	//int cid = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
+	//int aid = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
 	clif_PVPInfo(sd);
 }
 
@@ -14430,7 +14631,7 @@ void clif_parse_PVPInfo(int fd,struct map_session_data *sd)
 void clif_parse_FeelSaveOk(int fd,struct map_session_data *sd)
 {
 	int i;
-	//int wich = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	//int wich = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if (sd->menuskill_id != SG_FEEL)
 		return;
 	i = sd->menuskill_val-1;
@@ -14468,14 +14669,14 @@ void clif_feel_req(int fd, struct map_session_data *sd, uint16 skill_lv)
 /// Request to change homunculus' name (CZ_RENAME_MER).
 /// 0231 <name>.24B
 void clif_parse_ChangeHomunculusName(int fd, struct map_session_data *sd){
-	hom_change_name(sd,RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	hom_change_name(sd,RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 }
 
 
 /// Request to warp/move homunculus/mercenary to it's owner (CZ_REQUEST_MOVETOOWNER).
 /// 0234 <id>.L
 void clif_parse_HomMoveToMaster(int fd, struct map_session_data *sd){
-	int id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]); // Mercenary or Homunculus
+	int id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]); // Mercenary or Homunculus
 	struct block_list *bl = NULL;
 	struct unit_data *ud = NULL;
 
@@ -14495,7 +14696,7 @@ void clif_parse_HomMoveToMaster(int fd, struct map_session_data *sd){
 /// Request to move homunculus/mercenary (CZ_REQUEST_MOVENPC).
 /// 0232 <id>.L <position data>.3B
 void clif_parse_HomMoveTo(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int id = RFIFOL(fd,info->pos[0]); // Mercenary or Homunculus
 	struct block_list *bl = NULL;
 	short x, y;
@@ -14520,7 +14721,7 @@ void clif_parse_HomMoveTo(int fd, struct map_session_data *sd){
 void clif_parse_HomAttack(int fd,struct map_session_data *sd)
 {
 	struct block_list *bl = NULL;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int id = RFIFOL(fd,info->pos[0]);
 	int target_id = RFIFOL(fd,info->pos[1]);
 	int action_type = RFIFOB(fd,info->pos[2]);
@@ -14547,11 +14748,11 @@ void clif_parse_HomAttack(int fd,struct map_session_data *sd)
 void clif_parse_HomMenu(int fd, struct map_session_data *sd)
 {	//[orn]
 	int cmd = RFIFOW(fd,0);
-	//int type = RFIFOW(fd,packet_db[sd->packet_ver][cmd].pos[0]);
+	//int type = RFIFOW(fd,packet_db(sd->packet_ver,cmd).pos[0]);
 	if(!hom_is_active(sd->hd))
 		return;
 
-	hom_menu(sd,RFIFOB(fd,packet_db[sd->packet_ver][cmd].pos[1]));
+	hom_menu(sd,RFIFOB(fd,packet_db(sd->packet_ver,cmd).pos[1]));
 }
 
 
@@ -14639,7 +14840,7 @@ void clif_parse_Check(int fd, struct map_session_data *sd)
 	if(!pc_has_permission(sd, PC_PERM_USE_CHECK))
 		return;
 
-	safestrncpy(charname, RFIFOCP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]), sizeof(charname));
+	safestrncpy(charname, RFIFOCP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]), sizeof(charname));
 
 	if( ( pl_sd = map_nick2sd(charname) ) == NULL || pc_get_group_level(sd) < pc_get_group_level(pl_sd) )
 	{
@@ -14879,7 +15080,7 @@ void clif_Mail_read(struct map_session_data *sd, int mail_id)
 /// 0241 <mail id>.L
 void clif_parse_Mail_read(int fd, struct map_session_data *sd)
 {
-	int mail_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int mail_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	if( mail_id <= 0 )
 		return;
@@ -14894,7 +15095,7 @@ void clif_parse_Mail_read(int fd, struct map_session_data *sd)
 /// 0244 <mail id>.L
 void clif_parse_Mail_getattach(int fd, struct map_session_data *sd)
 {
-	int mail_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int mail_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	int i;
 	bool fail = false;
 
@@ -14955,7 +15156,7 @@ void clif_parse_Mail_getattach(int fd, struct map_session_data *sd)
 /// Request to delete a mail (CZ_MAIL_DELETE).
 /// 0243 <mail id>.L
 void clif_parse_Mail_delete(int fd, struct map_session_data *sd){
-	int mail_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int mail_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	int i;
 
 	if( !chrif_isconnected() )
@@ -14982,8 +15183,8 @@ void clif_parse_Mail_delete(int fd, struct map_session_data *sd){
 /// Request to return a mail (CZ_REQ_MAIL_RETURN).
 /// 0273 <mail id>.L <receive name>.24B
 void clif_parse_Mail_return(int fd, struct map_session_data *sd){
-	int mail_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
-	//char *rec_name = RFIFOP(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
+	int mail_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
+	//char *rec_name = RFIFOP(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
 	int i;
 
 	if( mail_id <= 0 )
@@ -15002,7 +15203,7 @@ void clif_parse_Mail_return(int fd, struct map_session_data *sd){
 /// Request to add an item or Zeny to mail (CZ_MAIL_ADD_ITEM).
 /// 0247 <index>.W <amount>.L
 void clif_parse_Mail_setattach(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int idx = RFIFOW(fd,info->pos[0]);
 	int amount = RFIFOL(fd,info->pos[1]);
 	unsigned char flag;
@@ -15025,7 +15226,7 @@ void clif_parse_Mail_setattach(int fd, struct map_session_data *sd){
 ///     2 = remove zeny
 void clif_parse_Mail_winopen(int fd, struct map_session_data *sd)
 {
-	int type = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int type = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	if (type == 0 || type == 1)
 		mail_removeitem(sd, 0);
@@ -15038,7 +15239,7 @@ void clif_parse_Mail_winopen(int fd, struct map_session_data *sd)
 /// 0248 <packet len>.W <recipient>.24B <title>.40B <body len>.B <body>.?B
 void clif_parse_Mail_send(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if( !chrif_isconnected() )
 		return;
@@ -15144,7 +15345,7 @@ static void clif_Auction_setitem(int fd, int index, bool fail)
 ///     1 = cancel (cancel pressed on register tab)
 ///     ? = junk, uninitialized value (ex. when switching between list filters)
 void clif_parse_Auction_cancelreg(int fd, struct map_session_data *sd){
-	//int type = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	//int type = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( sd->auction.amount > 0 )
 		clif_additem(sd, sd->auction.index, sd->auction.amount, 0);
 
@@ -15155,7 +15356,7 @@ void clif_parse_Auction_cancelreg(int fd, struct map_session_data *sd){
 /// Request to add an item to the action (CZ_AUCTION_ADD_ITEM).
 /// 024c <index>.W <count>.L
 void clif_parse_Auction_setitem(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int idx = RFIFOW(fd,info->pos[0]) - 2;
 	int amount = RFIFOL(fd,info->pos[1]); // Always 1
 	struct item_data *item;
@@ -15239,7 +15440,7 @@ void clif_parse_Auction_register(int fd, struct map_session_data *sd)
 {
 	struct auction_data auction;
 	struct item_data *item;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	if( !battle_config.feature_auction )
 		return;
@@ -15322,7 +15523,7 @@ void clif_parse_Auction_register(int fd, struct map_session_data *sd)
 /// Cancels an auction (CZ_AUCTION_ADD_CANCEL).
 /// 024e <auction id>.L
 void clif_parse_Auction_cancel(int fd, struct map_session_data *sd){
-	unsigned int auction_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	unsigned int auction_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	intif_Auction_cancel(sd->status.char_id, auction_id);
 }
 
@@ -15330,7 +15531,7 @@ void clif_parse_Auction_cancel(int fd, struct map_session_data *sd){
 /// Closes an auction (CZ_AUCTION_REQ_MY_SELL_STOP).
 /// 025d <auction id>.L
 void clif_parse_Auction_close(int fd, struct map_session_data *sd){
-	unsigned int auction_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	unsigned int auction_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	intif_Auction_close(sd->status.char_id, auction_id);
 }
 
@@ -15338,7 +15539,7 @@ void clif_parse_Auction_close(int fd, struct map_session_data *sd){
 /// Places a bid on an auction (CZ_AUCTION_BUY).
 /// 024f <auction id>.L <money>.L
 void clif_parse_Auction_bid(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	unsigned int auction_id = RFIFOL(fd,info->pos[0]);
 	int bid = RFIFOL(fd,info->pos[1]);
 
@@ -15371,7 +15572,7 @@ void clif_parse_Auction_bid(int fd, struct map_session_data *sd){
 ///     5 = auction id search
 void clif_parse_Auction_search(int fd, struct map_session_data* sd){
 	char search_text[NAME_LENGTH];
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	short type = RFIFOW(fd,info->pos[0]);
 	int price = RFIFOL(fd,info->pos[1]);  // FIXME: bug #5071
 	int page = RFIFOW(fd,info->pos[3]);
@@ -15393,7 +15594,7 @@ void clif_parse_Auction_search(int fd, struct map_session_data* sd){
 ///     1 = buy (own bids)
 void clif_parse_Auction_buysell(int fd, struct map_session_data* sd)
 {
-	short type = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]) + 6;
+	short type = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]) + 6;
 
 	if( !battle_config.feature_auction )
 		return;
@@ -15428,7 +15629,7 @@ void clif_parse_cashshop_close( int fd, struct map_session_data* sd ){
 //0846 <tabid>.W (CZ_REQ_SE_CASH_TAB_CODE))
 //08c0 <len>.W <openIdentity>.L <itemcount>.W (ZC_ACK_SE_CASH_ITEM_LIST2)
 void clif_parse_CashShopReqTab(int fd, struct map_session_data *sd) {
-	short tab = RFIFOW(fd, packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	short tab = RFIFOW(fd, packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	int j;
 
 	if( tab < 0 || tab > CASHSHOP_TAB_SEARCH )
@@ -15575,7 +15776,7 @@ void clif_parse_cashshop_buy(int fd, struct map_session_data *sd){
 
 	nullpo_retv(sd);
 
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 
 	if( sd->state.trading || !sd->npc_shopid ) {
 		clif_cashshop_ack(sd,1);
@@ -15650,7 +15851,7 @@ void clif_Adopt_request(struct map_session_data *sd, struct map_session_data *sr
 /// 01f9 <account id>.L
 void clif_parse_Adopt_request(int fd, struct map_session_data *sd)
 {
-	TBL_PC *tsd = map_id2sd(RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]));
+	TBL_PC *tsd = map_id2sd(RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]));
 	TBL_PC *p_sd = map_charid2sd(sd->status.partner_id);
 
 	if( pc_try_adopt(sd, p_sd, tsd) == ADOPT_ALLOWED )
@@ -15667,7 +15868,7 @@ void clif_parse_Adopt_request(int fd, struct map_session_data *sd)
 ///     0 = rejected
 ///     1 = accepted
 void clif_parse_Adopt_reply(int fd, struct map_session_data *sd){
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int p1_id = RFIFOL(fd,info->pos[0]);
 	int p2_id = RFIFOL(fd,info->pos[1]);
 	int result = RFIFOL(fd,info->pos[2]);
@@ -15736,7 +15937,7 @@ void clif_bossmapinfo(int fd, struct mob_data *md, short flag)
 /// 02d6 <account id>.L
 void clif_parse_ViewPlayerEquip(int fd, struct map_session_data* sd)
 {
-	int aid = RFIFOL(fd, packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int aid = RFIFOL(fd, packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	struct map_session_data* tsd = map_id2sd(aid);
 
 	if (!tsd)
@@ -15758,8 +15959,8 @@ void clif_parse_ViewPlayerEquip(int fd, struct map_session_data* sd)
 ///     1 = enabled
 void clif_parse_EquipTick(int fd, struct map_session_data* sd)
 {
-	//int type = RFIFOL(fd,packet_db[sd->packet_ver][cmd].pos[0]);
-	bool flag = (bool)RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[1]);
+	//int type = RFIFOL(fd,packet_db(sd->packet_ver,cmd).pos[0]);
+	bool flag = (bool)RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[1]);
 	sd->status.show_equip = flag;
 	clif_equiptickack(sd, flag);
 }
@@ -15969,7 +16170,7 @@ void clif_quest_update_objective(struct map_session_data *sd, struct quest *qd,
 /// 02b6 <quest id>.L <active>.B
 void clif_parse_questStateAck(int fd, struct map_session_data *sd)
 {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	quest_update_status(sd, RFIFOL(fd,info->pos[0]),
 	    RFIFOB(fd,info->pos[1])?Q_ACTIVE:Q_INACTIVE);
 }
@@ -16175,7 +16376,7 @@ void clif_mercenary_skillblock(struct map_session_data *sd)
 ///     2 = delete
 void clif_parse_mercenary_action(int fd, struct map_session_data* sd)
 {
-	int option = RFIFOB(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int option = RFIFOB(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	if( sd->md == NULL )
 		return;
 
@@ -16606,7 +16807,7 @@ void clif_showdigit(struct map_session_data* sd, unsigned char type, int value)
 ///         as the only skill unit, that is sent with 0x1c9 is
 ///         Graffiti.
 void clif_parse_LessEffect(int fd, struct map_session_data* sd){
-	int isLess = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	int isLess = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 	sd->state.lesseffect = ( isLess != 0 );
 }
 
@@ -16614,7 +16815,7 @@ void clif_parse_LessEffect(int fd, struct map_session_data* sd){
 /// S 0945 <length>.w <option>.l <val>.l {<index>.w <amount>.w).4b* (CZ_* RagexeRE 2012-04-10a)
 /// S 0281 <length>.w <option>.l <val>.l {<index>.w <amount>.w).4b* (CZ_* Ragexe 2013-08-07)
 void clif_parse_ItemListWindowSelected(int fd, struct map_session_data* sd) {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int n = (RFIFOW(fd,info->pos[0])-12) / 4;
 	int type = RFIFOL(fd,info->pos[1]);
 	int flag = RFIFOL(fd,info->pos[2]); // Button clicked: 0 = Cancel, 1 = OK
@@ -16731,7 +16932,7 @@ static void clif_parse_ReqOpenBuyingStore(int fd, struct map_session_data* sd)
 	unsigned char result;
 	int zenylimit;
 	unsigned int count, packet_len;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	packet_len = RFIFOW(fd,info->pos[0]);
 
@@ -16865,7 +17066,7 @@ static void clif_parse_ReqClickBuyingStore(int fd, struct map_session_data* sd)
 {
 	uint32 account_id;
 
-	account_id = RFIFOL(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]);
+	account_id = RFIFOL(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]);
 
 	buyingstore_open(sd, account_id);
 }
@@ -16905,7 +17106,7 @@ static void clif_parse_ReqTradeBuyingStore(int fd, struct map_session_data* sd)
 	uint8* itemlist;
 	uint32 account_id;
 	unsigned int count, packet_len, buyer_id;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	packet_len = RFIFOW(fd,info->pos[0]);
 
@@ -17037,7 +17238,7 @@ static void clif_parse_SearchStoreInfo(int fd, struct map_session_data* sd)
 	const uint8* cardlist;
 	unsigned char type;
 	unsigned int min_price, max_price, packet_len, count, item_count, card_count;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	packet_len = RFIFOW(fd,info->pos[0]);
 
@@ -17190,7 +17391,7 @@ static void clif_parse_SearchStoreInfoListItemClick(int fd, struct map_session_d
 {
 	unsigned short nameid;
 	uint32 account_id, store_id;
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 
 	account_id = RFIFOL(fd,info->pos[0]);
 	store_id   = RFIFOL(fd,info->pos[1]);
@@ -17223,7 +17424,7 @@ void clif_parse_debug(int fd,struct map_session_data *sd)
 	cmd = RFIFOW(fd,0);
 
 	if( sd ) {
-		packet_len = packet_db[sd->packet_ver][cmd].len;
+		packet_len = packet_db(sd->packet_ver,cmd).len;
 
 		if( packet_len == 0 )
 		{// unknown
@@ -17468,7 +17669,7 @@ int clif_skill_itemlistwindow( struct map_session_data *sd, uint16 skill_id, uin
  * RFIFOL(fd,2) - type (currently not used)
  *------------------------------------------*/
 void clif_parse_SkillSelectMenu(int fd, struct map_session_data *sd) {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	//int type = RFIFOL(fd,info->pos[0]); //WHY_LOWERVER_COMPATIBILITY =  0x0, WHY_SC_AUTOSHADOWSPELL =  0x1,
 	if( sd->menuskill_id != SC_AUTOSHADOWSPELL )
 		return;
@@ -17509,7 +17710,7 @@ void clif_spiritcharm(struct map_session_data *sd) {
 /// 	1 = move item to normal tab
 void clif_parse_MoveItem(int fd, struct map_session_data *sd) {
 #if PACKETVER >= 20111122
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int index = RFIFOW(fd,info->pos[0]) - 2;
 	int type = RFIFOB(fd, info->pos[1]);
 
@@ -17768,7 +17969,7 @@ void clif_ranklist(struct map_session_data *sd, int16 rankingType) {
  *  3: /pk
  * */
 void clif_parse_ranklist(int fd,struct map_session_data *sd) {
-	struct s_packet_db* info = &packet_db[sd->packet_ver][RFIFOW(fd,0)];
+	struct s_packet_db* info = &packet_db(sd->packet_ver,RFIFOW(fd,0));
 	int16 rankingtype = RFIFOW(fd,info->pos[0]); //type
 
 	clif_ranklist(sd,rankingtype);
@@ -17937,7 +18138,7 @@ void clif_display_pinfo(struct map_session_data *sd, int cmdtype) {
 		/* End - Penalty set*/
 
 		cmd = packet_db_ack[sd->packet_ver][cmdtype];
-		info = &packet_db[sd->packet_ver][cmd];
+		info = &packet_db(sd->packet_ver,cmd);
 		len = info->len; //this is the base len without details
 		if(!len) return; //version as packet disable
 
@@ -18010,7 +18211,7 @@ void clif_crimson_marker(struct map_session_data *sd, struct block_list *bl, boo
 	cmd = packet_db_ack[sd->packet_ver][ZC_C_MARKERINFO];
 	if (!cmd)
 		cmd = 0x09C1; //default
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	if (!(len = info->len))
 		return;
 
@@ -18031,7 +18232,7 @@ void clif_notify_bindOnEquip(struct map_session_data *sd, int n) {
 	nullpo_retv(sd);
 
 	cmd = packet_db_ack[sd->packet_ver][ZC_NOTIFY_BIND_ON_EQUIP];
-	info = &packet_db[sd->packet_ver][cmd];
+	info = &packet_db(sd->packet_ver,cmd);
 	if (!cmd || !info->len)
 		return;
 
@@ -18372,7 +18573,7 @@ static void clif_roulette_recvitem_ack(struct map_session_data *sd, enum RECV_RO
 
 	nullpo_retv(sd);
 
-	if (packet_db[sd->packet_ver][cmd].len == 0)
+	if (packet_db(sd->packet_ver,cmd).len == 0)
 		return;
 
 	WBUFW(buf,0) = cmd;
@@ -18555,7 +18756,7 @@ void clif_merge_item_ack(struct map_session_data *sd, unsigned short index, unsi
 		return;
 	if (!(cmd = packet_db_ack[sd->packet_ver][ZC_ACK_MERGE_ITEM]))
 		return;
-	if (!(info = &packet_db[sd->packet_ver][cmd]) || info->len == 0)
+	if (!(info = &packet_db(sd->packet_ver,cmd)) || info->len == 0)
 		return;
 
 	WBUFW(buf, 0) = cmd;
@@ -18622,7 +18823,7 @@ void clif_merge_item_open(struct map_session_data *sd) {
 		return;
 	if (!(cmd = packet_db_ack[sd->packet_ver][ZC_MERGE_ITEM_OPEN]))
 		return;
-	if (!(info = &packet_db[sd->packet_ver][cmd]) || info->len == 0)
+	if (!(info = &packet_db(sd->packet_ver,cmd)) || info->len == 0)
 		return;
 
 	// Get entries
@@ -18662,7 +18863,7 @@ void clif_parse_merge_item_req(int fd, struct map_session_data* sd) {
 	nullpo_retv(sd);
 	if (!clif_session_isValid(sd))
 		return;
-	if (!(info = &packet_db[sd->packet_ver][RFIFOW(fd,0)]) || info->len == 0)
+	if (!(info = &packet_db(sd->packet_ver,RFIFOW(fd,0))) || info->len == 0)
 		return;
 
 	n = (RFIFOW(fd, info->pos[0]) - 4) / 2;
@@ -18732,7 +18933,7 @@ void clif_broadcast_obtain_special_item(const char *char_name, unsigned short na
 	if (!(cmd = packet_db_ack[clif_config.packet_db_ver][ZC_BROADCASTING_SPECIAL_ITEM_OBTAIN]))
 		return;
 
-	if (!(info = &packet_db[clif_config.packet_db_ver][cmd]) || info->len == 0)
+	if (!(info = &packet_db(clif_config.packet_db_ver,cmd)) || info->len == 0)
 		return;
 
 	WBUFW(buf, 0) = 0x7fd;
@@ -18787,7 +18988,7 @@ void clif_dressing_room(struct map_session_data *sd, int flag) {
 /// 0A35 <result>.W
 void clif_parse_Oneclick_Itemidentify(int fd, struct map_session_data *sd) {
 #if PACKETVER >= 20150513
-	short idx = RFIFOW(fd,packet_db[sd->packet_ver][RFIFOW(fd,0)].pos[0]) - 2, magnifier_idx;
+	short idx = RFIFOW(fd,packet_db(sd->packet_ver,RFIFOW(fd,0)).pos[0]) - 2, magnifier_idx;
 
 	// Ignore the request
 	// - Invalid item index
@@ -18900,19 +19101,160 @@ void clif_hat_effect_single( struct map_session_data* sd, uint16 effectId, bool
 #endif
 }
 
+/// Rate and burst settings of each packet class, in packets per second and packets.
+static struct {
+	const char* name;
+	int* rate;
+	int* burst;
+} packet_class_config[PACKET_CLASS_MAX] = {
+	{ "default",     &battle_config.packet_rate_default,     &battle_config.packet_burst_default     },
+	{ "skill",       &battle_config.packet_rate_skill,       &battle_config.packet_burst_skill       },
+	{ "chat",        &battle_config.packet_rate_chat,        &battle_config.packet_burst_chat        },
+	{ "storage",     &battle_config.packet_rate_storage,     &battle_config.packet_burst_storage     },
+	{ "searchstore", &battle_config.packet_rate_searchstore, &battle_config.packet_burst_searchstore },
+};
+
+/// Returns the throughput class of a packet, based on its parse function.
+static enum e_packet_class clif_packet_class(void (*func)(int, struct map_session_data *))
+{
+	if( func == clif_parse_UseSkillToId || func == clif_parse_UseSkillToPos
+	||  func == clif_parse_UseSkillToPosMoreInfo || func == clif_parse_UseSkillMap )
+		return PACKET_CLASS_SKILL;
+	if( func == clif_parse_GlobalMessage || func == clif_parse_WisMessage
+	||  func == clif_parse_PartyMessage || func == clif_parse_GuildMessage
+	||  func == clif_parse_BattleChat )
+		return PACKET_CLASS_CHAT;
+	if( func == clif_parse_MoveToKafra || func == clif_parse_MoveFromKafra
+	||  func == clif_parse_MoveToKafraFromCart || func == clif_parse_MoveFromKafraToCart )
+		return PACKET_CLASS_STORAGE;
+	if( func == clif_parse_SearchStoreInfo || func == clif_parse_SearchStoreInfoNextPage
+	||  func == clif_parse_SearchStoreInfoListItemClick )
+		return PACKET_CLASS_SEARCHSTORE;
+	return PACKET_CLASS_DEFAULT;
+}
+
+/// Refills the bucket of class c for the time elapsed since its last refill.
+/// Returns true if it holds at least one packet.
+static bool clif_packet_refill(struct s_packet_bucket* b, enum e_packet_class c, unsigned int tick)
+{
+	int rate = *packet_class_config[c].rate;
+	int burst = *packet_class_config[c].burst * 1000;
+
+	if( rate == 0 )
+		return true; // unlimited
+
+	if( b->tick == 0 )
+		b->tokens = burst;
+	else if( DIFF_TICK(tick, b->tick) > 0 )
+		b->tokens = (int)min((int64)b->tokens + (int64)DIFF_TICK(tick, b->tick) * rate, burst);
+	else
+		b->tokens = min(b->tokens, burst); // burst lowered by a config reload
+	b->tick = tick;
+
+	return ( b->tokens >= 1000 );
+}
+
+/// Takes one packet of class c from the buckets of the player.
+/// Returns false if the default bucket or the one of the class is empty;
+/// the packet must then stay in the receive buffer until they have refilled.
+static bool clif_packet_schedule(struct map_session_data* sd, enum e_packet_class c)
+{
+	struct s_packet_bucket* b = sd->packet_bucket;
+	unsigned int tick = gettick();
+
+	if( !clif_packet_refill(&b[PACKET_CLASS_DEFAULT], PACKET_CLASS_DEFAULT, tick) )
+		c = PACKET_CLASS_DEFAULT;
+	else if( c == PACKET_CLASS_DEFAULT || clif_packet_refill(&b[c], c, tick) ) {
+		if( *packet_class_config[PACKET_CLASS_DEFAULT].rate )
+			b[PACKET_CLASS_DEFAULT].tokens -= 1000;
+		if( c != PACKET_CLASS_DEFAULT && *packet_class_config[c].rate )
+			b[c].tokens -= 1000;
+		return true;
+	}
+
+	if( !sd->state.packet_held ) // count each delayed packet once
+		b[c].throttled++;
+	return false;
+}
+
+/// Reports the players whose packets were delayed by clif_parse since the last report.
+static int clif_packet_throttle_report(int tid, unsigned int tick, int id, intptr_t data)
+{
+	struct s_mapiterator* iter = mapit_getallusers();
+	struct map_session_data* sd;
+
+	for( sd = (TBL_PC*)mapit_first(iter); mapit_exists(iter); sd = (TBL_PC*)mapit_next(iter) ) {
+		StringBuf buf;
+		int i;
+
+		ARR_FIND(0, PACKET_CLASS_MAX, i, sd->packet_bucket[i].throttled);
+		if( i == PACKET_CLASS_MAX )
+			continue;
+
+		StringBuf_Init(&buf);
+		for( i = 0; i < PACKET_CLASS_MAX; i++ ) {
+			if( !sd->packet_bucket[i].throttled )
+				continue;
+			StringBuf_Printf(&buf, " %s:%u", packet_class_config[i].name, sd->packet_bucket[i].throttled);
+			sd->packet_bucket[i].throttled = 0;
+		}
+		ShowInfo("clif_parse: Delayed packets of '"CL_WHITE"%s"CL_RESET"' (AID/CID: '"CL_WHITE"%d/%d"CL_RESET"'):%s\n", sd->status.name, sd->status.account_id, sd->status.char_id, StringBuf_Value(&buf));
+		StringBuf_Destroy(&buf);
+	}
+	mapit_free(iter);
+	return 0;
+}
+
+/// Fields of client packets that can hold the account or char id of the player who sends
+/// them, as indexes into the pos of their packet_db entry (-1 = unused). The capture stores
+/// their offsets with every packet, so the replay tool rewrites just these for its copies.
+static const struct {
+	void (*func)(int, struct map_session_data *);
+	int8 pos[PTRACE_ID_FIELDS];
+} capture_id_fields[] = {
+	{ clif_parse_WantToConnection, { 0, 1 } },
+	{ clif_parse_GetCharNameRequest, { 0, -1 } },
+	{ clif_parse_ActionRequest, { 0, -1 } },
+	{ clif_parse_UseSkillToId, { 2, -1 } },
+	{ clif_parse_SelectCart, { 0, -1 } },
+	{ clif_parse_BankOpen, { 0, -1 } },
+	{ clif_parse_BankClose, { 0, -1 } },
+	{ clif_parse_BankCheck, { 0, -1 } },
+	{ clif_parse_BankDeposit, { 0, -1 } },
+	{ clif_parse_BankWithdraw, { 0, -1 } },
+};
+
+/// Records a client packet, with the offsets of its id fields.
+static void clif_capture_recv(int fd, int packet_ver, int cmd, int packet_len)
+{
+	static uint8 buf[2*PTRACE_ID_FIELDS + UINT16_MAX];
+	int i, j;
+
+	memset(buf, 0, 2*PTRACE_ID_FIELDS);
+	ARR_FIND(0, ARRAYLENGTH(capture_id_fields), i, capture_id_fields[i].func == packet_db(packet_ver,cmd).func);
+	if( i < ARRAYLENGTH(capture_id_fields) ) {
+		for( j = 0; j < PTRACE_ID_FIELDS; j++ ) {
+			if( capture_id_fields[i].pos[j] >= 0 )
+				WBUFW(buf,2*j) = packet_db(packet_ver,cmd).pos[capture_id_fields[i].pos[j]];
+		}
+	}
+	memcpy(WBUFP(buf,2*PTRACE_ID_FIELDS), RFIFOP(fd,0), packet_len);
+	clif_capture_write(fd, PTRACE_RECV, buf, 2*PTRACE_ID_FIELDS + packet_len);
+}
+
 /*==========================================
  * Main client packet processing function
  *------------------------------------------*/
 static int clif_parse(int fd)
 {
 	int cmd, packet_ver, packet_len, err;
+	uint64 perf_start_usec;
 	TBL_PC* sd;
-	int pnum;
 
-	//TODO apply delays or disconnect based on packet throughput [FlavioJS]
-	// Note: "click masters" can do 80+ clicks in 10 seconds
-
-	for( pnum = 0; pnum < 3; ++pnum )// Limit max packets per cycle to 3 (delay packet spammers) [FlavioJS]  -- This actually aids packet spammers, but stuff like /str+ gets slow without it [Ai4rei]
+	// Packets are processed until the receive buffer runs out of complete packets or the
+	// player runs out of tokens (see clif_packet_schedule). A delayed packet stays in the
+	// buffer, do_sockets calls clif_parse again for every session on the next cycle.
+	for(;;)
 	{ // begin main client packet processing loop
 
 	sd = (TBL_PC *)session[fd]->session_data;
@@ -18937,6 +19279,7 @@ static int clif_parse(int fd)
 		} else {
 			ShowInfo("Closed connection from '"CL_WHITE"%s"CL_RESET"'.\n", ip2str(session[fd]->client_addr, NULL));
 		}
+		clif_capture_write(fd, PTRACE_CLOSE, NULL, 0);
 		do_close(fd);
 		return 0;
 	}
@@ -18950,7 +19293,7 @@ static int clif_parse(int fd)
 	if (sd) {
 		packet_ver = sd->packet_ver;
 			// Gepard Shield
-		if (is_gepard_active == true && clif_gepard_process_packet(sd) == true)
+		if (is_gepard_active == true && !sd->state.packet_held && clif_gepard_process_packet(sd) == true)
 		{
 			return 0;
 		}
@@ -18985,7 +19328,7 @@ static int clif_parse(int fd)
 	}
 
 	// filter out invalid / unsupported packets
-	if (cmd > MAX_PACKET_DB || cmd < MIN_PACKET_DB || packet_db[packet_ver][cmd].len == 0) {
+	if (cmd > MAX_PACKET_DB || cmd < MIN_PACKET_DB || packet_db(packet_ver,cmd).len == 0) {
 		ShowWarning("clif_parse: Received unsupported packet (packet 0x%04x, %d bytes received), disconnecting session #%d.\n", cmd, RFIFOREST(fd), fd);
 #ifdef DUMP_INVALID_PACKET
 		ShowDump(RFIFOP(fd,0), RFIFOREST(fd));
@@ -18995,7 +19338,7 @@ static int clif_parse(int fd)
 	}
 
 	// determine real packet length
-	packet_len = packet_db[packet_ver][cmd].len;
+	packet_len = packet_db(packet_ver,cmd).len;
 	if (packet_len == -1) { // variable-length packet
 		if (RFIFOREST(fd) < 4)
 			return 0;
@@ -19013,26 +19356,39 @@ static int clif_parse(int fd)
 	if ((int)RFIFOREST(fd) < packet_len)
 		return 0; // not enough data received to form the packet
 
+	if (sd) {
+		if (!clif_packet_schedule(sd, (enum e_packet_class)packet_db(packet_ver,cmd).pclass)) {
+			sd->state.packet_held = 1;
+			return 0; // wait for the buckets to refill
+		}
+		sd->state.packet_held = 0;
+	}
+
 #ifdef PACKET_OBFUSCATION
 	RFIFOW(fd, 0) = cmd;
 	if (sd)
 		sd->cryptKey = ((sd->cryptKey * clif_cryptKey[1]) + clif_cryptKey[2]) & 0xFFFFFFFF; // Update key for the next packet
 #endif
 
-	if( packet_db[packet_ver][cmd].func == clif_parse_debug )
-		packet_db[packet_ver][cmd].func(fd, sd);
-	else if( packet_db[packet_ver][cmd].func != NULL ) {
-		if( !sd && packet_db[packet_ver][cmd].func != clif_parse_WantToConnection )
+	if( capture_fp )
+		clif_capture_recv(fd, packet_ver, cmd, packet_len);
+
+	perf_start_usec = perf_start();
+	if( packet_db(packet_ver,cmd).func == clif_parse_debug )
+		packet_db(packet_ver,cmd).func(fd, sd);
+	else if( packet_db(packet_ver,cmd).func != NULL ) {
+		if( !sd && packet_db(packet_ver,cmd).func != clif_parse_WantToConnection )
 			; //Only valid packet when there is no session
 		else
-		if( sd && sd->bl.prev == NULL && packet_db[packet_ver][cmd].func != clif_parse_LoadEndAck )
+		if( sd && sd->bl.prev == NULL && packet_db(packet_ver,cmd).func != clif_parse_LoadEndAck )
 			; //Only valid packet when player is not on a map
 		else
-			packet_db[packet_ver][cmd].func(fd, sd);
+			packet_db(packet_ver,cmd).func(fd, sd);
 	}
 #ifdef DUMP_UNKNOWN_PACKET
 	else DumpUnknown(fd,sd,cmd,packet_len);
 #endif
+	perf_packet(cmd, perf_start_usec);
 	RFIFOSKIP(fd, packet_len);
 	}; // main loop end
 
@@ -19042,6 +19398,35 @@ static int clif_parse(int fd)
 /*==========================================
  * Reads packet_db.txt and setups its array reference
  *------------------------------------------*/
+/// Returns the entry of cmd for packet version ver, to be filled by packetdb_readdb.
+/// Versions start as a copy of the index of the previous version, so an entry
+/// still shared with an older version is copied before being changed.
+static struct s_packet_db* packetdb_edit(int ver, int cmd)
+{
+	uint16 idx = packet_db_index[ver][cmd];
+
+	if( idx && packet_db_pool_ver[idx] == ver )
+		return &packet_db_pool[idx];
+
+	if( packet_db_pool_count == UINT16_MAX ) {
+		ShowFatalError("packetdb_edit: Too many packet definitions (max=%d).\n", UINT16_MAX);
+		exit(EXIT_FAILURE);
+	}
+	if( packet_db_pool_count == packet_db_pool_max ) {
+		packet_db_pool_max += 1024;
+		RECREATE(packet_db_pool, struct s_packet_db, packet_db_pool_max);
+		RECREATE(packet_db_pool_ver, uint8, packet_db_pool_max);
+	}
+	if( idx )
+		memcpy(&packet_db_pool[packet_db_pool_count], &packet_db_pool[idx], sizeof(struct s_packet_db));
+	else
+		memset(&packet_db_pool[packet_db_pool_count], 0, sizeof(struct s_packet_db));
+	packet_db_pool_ver[packet_db_pool_count] = ver;
+	if( packet_db_pool_count ) // entry 0 stays the undefined packet
+		packet_db_index[ver][cmd] = packet_db_pool_count;
+	return &packet_db_pool[packet_db_pool_count++];
+}
+
 void packetdb_readdb(bool reload)
 {
 	char line[1024];
@@ -19575,12 +19960,15 @@ void packetdb_readdb(bool reload)
 	const char *filename[] = { "packet_db.txt", DBIMPORT"/packet_db.txt"};
 	int f;
 
-	memset(packet_db,0,sizeof(packet_db));
+	memset(packet_db_index,0,sizeof(packet_db_index));
 	memset(packet_db_ack,0,sizeof(packet_db_ack));
+	packet_db_pool_count = 0;
+	packetdb_edit(SERVER, 0); // entry 0: undefined packet
 
-	// initialize packet_db[SERVER] from hardcoded packet_len_table[] values
+	// initialize packet_db(SERVER) from hardcoded packet_len_table[] values
 	for( i = 0; i < ARRAYLENGTH(packet_len_table); ++i )
-		packet_len(i) = packet_len_table[i];
+		if( packet_len_table[i] )
+			packetdb_edit(SERVER, i)->len = packet_len_table[i];
 
 	clif_config.packet_db_ver = MAX_PACKET_VER;
 	for(f = 0; f < ARRAYLENGTH(filename); f++) {
@@ -19638,7 +20026,7 @@ void packetdb_readdb(bool reload)
 					}
 					// copy from previous version into new version and continue
 					// - indicating all following packets should be read into the newer version
-					memcpy(&packet_db[packet_ver], &packet_db[prev_ver], sizeof(packet_db[0]));
+					memcpy(&packet_db_index[packet_ver], &packet_db_index[prev_ver], sizeof(packet_db_index[0]));
 					memcpy(&packet_db_ack[packet_ver], &packet_db_ack[prev_ver], sizeof(packet_db_ack[0]));
 					continue;
 				} else if(strcmpi(w1,"packet_db_ver")==0) {
@@ -19704,19 +20092,21 @@ void packetdb_readdb(bool reload)
 				continue;
 			}
 
-			packet_db[packet_ver][cmd].len = (short)atoi(str[1]);
+			packetdb_edit(packet_ver, cmd)->len = (short)atoi(str[1]);
 
 			if(str[2]==NULL){
-				packet_db[packet_ver][cmd].func = NULL;
+				packetdb_edit(packet_ver, cmd)->func = NULL;
+				packetdb_edit(packet_ver, cmd)->pclass = PACKET_CLASS_DEFAULT;
 				ln++;
 				continue;
 			}
 
 			// look up processing function by name
 			ARR_FIND( 0, ARRAYLENGTH(clif_parse_func), j, clif_parse_func[j].name != NULL && strcmp(str[2],clif_parse_func[j].name)==0 );
-			if( j < ARRAYLENGTH(clif_parse_func) )
-				packet_db[packet_ver][cmd].func = clif_parse_func[j].func;
-			else { //search if it's a mapped ack func
+			if( j < ARRAYLENGTH(clif_parse_func) ) {
+				packetdb_edit(packet_ver, cmd)->func = clif_parse_func[j].func;
+				packetdb_edit(packet_ver, cmd)->pclass = clif_packet_class(clif_parse_func[j].func);
+			} else { //search if it's a mapped ack func
 				ARR_FIND( 0, ARRAYLENGTH(clif_ack_func), j, clif_ack_func[j].name != NULL && strcmp(str[2],clif_ack_func[j].name)==0 );
 				if( j < ARRAYLENGTH(clif_ack_func)) {
 					int fidx = clif_ack_func[j].funcidx;
@@ -19740,7 +20130,7 @@ void packetdb_readdb(bool reload)
 				if(p2)
 					*p2++=0;
 				k = atoi(str2[j]);
-				// if (packet_db[packet_ver][cmd].pos[j] != k && clif_config.prefer_packet_db)	// not used for now
+				// if (packet_db(packet_ver,cmd).pos[j] != k && clif_config.prefer_packet_db)	// not used for now
 
 				if( j >= MAX_PACKET_POS )
 				{
@@ -19748,7 +20138,7 @@ void packetdb_readdb(bool reload)
 					break;
 				}
 
-				packet_db[packet_ver][cmd].pos[j] = k;
+				packetdb_edit(packet_ver, cmd)->pos[j] = k;
 			}
 			entries++;
 		}
@@ -19821,8 +20211,10 @@ void do_init_clif(void) {
 
 	//Using the packet_db file is the only way to set up packets now [Skotlex]
 	packetdb_readdb(false);
+	clif_capture_open();
 
 	set_defaultparse(clif_parse);
+	set_presend(clif_move_flush);
 	if( make_listen_bind(bind_ip,map_port) == -1 ) {
 		ShowFatalError("Failed to bind to port '"CL_WHITE"%d"CL_RESET"'\n",map_port);
 		exit(EXIT_FAILURE);
@@ -19830,12 +20222,24 @@ void do_init_clif(void) {
 
 	add_timer_func_list(clif_clearunit_delayed_sub, "clif_clearunit_delayed_sub");
 	add_timer_func_list(clif_delayquit, "clif_delayquit");
+	timer_set_critical(clif_clearunit_delayed_sub);
+	timer_set_critical(clif_delayquit);
+	add_timer_func_list(clif_packet_throttle_report, "clif_packet_throttle_report");
+	add_timer_interval(gettick() + 60000, clif_packet_throttle_report, 0, 0, 60000);
 
 	delay_clearunit_ers = ers_new(sizeof(struct block_list),"clif.c::delay_clearunit_ers",ERS_OPT_CLEAR);
 }
 
 void do_final_clif(void) {
 	ers_destroy(delay_clearunit_ers);
+	if (clif_move_queue.id)
+		aFree(clif_move_queue.id);
+	if (packet_db_pool)
+		aFree(packet_db_pool);
+	if (packet_db_pool_ver)
+		aFree(packet_db_pool_ver);
+	if (capture_fp)
+		fclose(capture_fp);
 }
 
 
@@ -19864,7 +20268,7 @@ bool clif_gepard_process_packet(struct map_session_data* sd)
 
 	if (packet_id <= MAX_PACKET_DB)
 	{
-		return gepard_process_packet(fd, session[fd]->rdata + session[fd]->rdata_pos, packet_db[sd->packet_ver][packet_id].len, &session[fd]->recv_crypt);
+		return gepard_process_packet(fd, session[fd]->rdata + session[fd]->rdata_pos, packet_db(sd->packet_ver,packet_id).len, &session[fd]->recv_crypt);
 	}
 
 	switch (packet_id)
@@ -12,6 +12,7 @@ struct Channel;
 struct clan;
 struct item;
 struct s_storage;
+struct mmo_charstatus;
 //#include "map.h"
 struct block_list;
 struct unit_data;
@@ -31,6 +32,7 @@ struct battleground_data;
 struct quest;
 struct party_booking_ad_info;
 enum e_party_member_withdraw;
+enum e_item_cache;
 #include <stdarg.h>
 
 enum { // packet DB
@@ -58,10 +60,28 @@ enum e_packet_ack {
 	MAX_ACK_FUNC //auto upd len
 };
 
+/// Throughput classes of the client packet scheduler, see clif_parse
+enum e_packet_class {
+	PACKET_CLASS_DEFAULT = 0, ///< Taken by every packet, besides its own class
+	PACKET_CLASS_SKILL,
+	PACKET_CLASS_CHAT,
+	PACKET_CLASS_STORAGE,
+	PACKET_CLASS_SEARCHSTORE,
+	PACKET_CLASS_MAX
+};
+
+/// Token bucket of a player for one packet class
+struct s_packet_bucket {
+	int tokens; ///< Packets left, in 1/1000 of a packet
+	unsigned int tick; ///< Last refill, 0 if never used
+	unsigned int throttled; ///< Packets delayed since the last report
+};
+
 struct s_packet_db {
 	short len;
 	void (*func)(int, struct map_session_data *);
 	short pos[MAX_PACKET_POS];
+	uint8 pclass; ///< enum e_packet_class
 };
 
 #ifdef PACKET_OBFUSCATION
@@ -163,10 +183,15 @@ enum e_party_invite_reply {
 	PARTY_REPLY_INVALID_MAPPROPERTY_ME, ///< return=9 : !TODO "Cannot join a party in this map" -> MsgStringTable[1871] (since 20110205)
 };
 
-// packet_db[SERVER] is reserved for server use
+// Each packet definition is stored once in packet_db_pool, the versions map
+// their commands to it through packet_db_index (0 = undefined packet).
+#define packet_db(ver,cmd) (packet_db_pool[packet_db_index[ver][cmd]])
+extern struct s_packet_db* packet_db_pool;
+extern uint16 packet_db_index[MAX_PACKET_VER+1][MAX_PACKET_DB+1];
+
+// packet_db(SERVER,...) is reserved for server use
 #define SERVER 0
-#define packet_len(cmd) packet_db[SERVER][cmd].len
-extern struct s_packet_db packet_db[MAX_PACKET_VER+1][MAX_PACKET_DB+1];
+#define packet_len(cmd) packet_db(SERVER,cmd).len
 extern int packet_db_ack[MAX_PACKET_VER + 1][MAX_ACK_FUNC + 1];
 
 // local define
@@ -518,6 +543,9 @@ enum e_damage_type {
 int clif_setip(const char* ip);
 void clif_setbindip(const char* ip);
 void clif_setport(uint16 port);
+void clif_setcapture(const char* path);
+void clif_capture_auth(struct map_session_data *sd, int group_id, struct mmo_charstatus *st);
+void clif_capture_storage(struct map_session_data *sd, struct s_storage *stor);
 
 uint32 clif_getip(void);
 uint32 clif_refresh_ip(void);
@@ -537,6 +565,7 @@ void clif_clearunit_delayed(struct block_list* bl, clr_type type, unsigned int t
 int clif_spawn(struct block_list *bl);	//area
 void clif_walkok(struct map_session_data *sd);	// self
 void clif_move(struct unit_data *ud); //area
+void clif_move_flush(void);
 void clif_changemap(struct map_session_data *sd, short m, int x, int y);	//self
 void clif_changemapserver(struct map_session_data* sd, unsigned short map_index, int x, int y, uint32 ip, uint16 port);	//self
 void clif_blown(struct block_list *bl); // area
@@ -680,6 +709,8 @@ void clif_insert_card(struct map_session_data *sd,int idx_equip,int idx_card,int
 
 void clif_inventorylist(struct map_session_data *sd);
 void clif_equiplist(struct map_session_data *sd);
+void clif_item_cache_clear(struct map_session_data *sd);
+void clif_item_cache_free(struct map_session_data *sd, enum e_item_cache type);
 
 void clif_cart_additem(struct map_session_data *sd,int n,int amount,int fail);
 void clif_cart_additem_ack(struct map_session_data *sd, uint8 flag);
@@ -3197,6 +3197,7 @@ static bool intif_parse_StorageReceived(int fd)
 	}
 
 	memcpy(stor, p, sz_stor); //copy the items data to correct destination
+	clif_capture_storage(sd, stor);
 
 	switch (type) {
 		case TABLE_INVENTORY: {
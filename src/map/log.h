@@ -95,11 +95,4 @@ extern struct Log_Config
 	char log_feeding[64];
 } log_config;
 
-#ifdef BETA_THREAD_TEST
-	struct {
-		char** entry;
-		int count;
-	} logThreadData;
-#endif
-
 #endif /* _LOG_H_ */
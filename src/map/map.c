@@ -14,6 +14,7 @@
 #include "../common/utils.h"
 #include "../common/cli.h"
 #include "../common/ers.h"
+#include "../common/perf.h"
 
 #include "map.h"
 #include "path.h"
@@ -41,7 +42,13 @@
 
 #include <stdlib.h>
 #include <math.h>
-#ifndef _WIN32
+#ifdef WIN32
+#include "../common/winapi.h" // CreateFileMapping()
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 char default_codepage[32] = "";
@@ -92,6 +99,37 @@ static DBMap* charid_db=NULL; /// uint32 char_id -> struct map_session_data*
 static DBMap* regen_db=NULL; /// int id -> struct block_list* (status_natural_heal processing)
 static DBMap* map_msg_db=NULL;
 
+struct map_objlist pc_list;
+struct map_objlist mob_list;
+struct map_objlist npc_list;
+static struct eri* map_iterator_ers = NULL;
+
+/// Ids handed out by map_get_new_object_id are a slot of object_slots plus a
+/// generation, so looking them up is a single array access and a stale id
+/// never matches the object that reuses its slot.
+#define OBJECT_SLOT_BITS 17
+#define OBJECT_SLOT_COUNT (1<<OBJECT_SLOT_BITS)
+#define OBJECT_GEN_COUNT ((MAX_FLOORITEM-MIN_FLOORITEM)>>OBJECT_SLOT_BITS)
+static struct object_slot {
+	int id; // id given to the slot (0 while free)
+	uint8 gen; // generation of the next id given to the slot
+	struct block_list* bl;
+}* object_slots = NULL;
+static int* object_free = NULL; // queue of free slots, the oldest is reused first
+static int object_free_head = 0, object_free_count = 0;
+
+/// Open addressing table (linear probing) of int id -> object, for the lookups of the other ids.
+struct map_idhash {
+	struct map_idhash_entry {
+		int id; // 0 if the entry is empty
+		void* data;
+	}* entry;
+	unsigned int mask; // size of the table - 1 (the size is a power of 2)
+	unsigned int count;
+};
+static struct map_idhash id_hash; /// int id -> struct block_list* (ids not in object_slots)
+static struct map_idhash charid_hash; /// int char_id -> struct map_session_data*
+
 static int map_users=0;
 
 #define BLOCK_SIZE 8
@@ -103,7 +141,7 @@ static int block_free_count = 0, block_free_lock = 0;
 static struct block_list *bl_list[BL_LIST_MAX];
 static int bl_list_count = 0;
 
-#define MAP_MAX_MSG 1500
+#define MAP_MAX_MSG 1550
 
 struct map_data map[MAX_MAP_PER_SERVER];
 int map_num = 0;
@@ -144,6 +182,43 @@ struct map_cache_map_info {
 	int32 len;
 };
 
+// Map cache v2: the directory is sorted by name and the terrain of every map is
+// stored uncompressed as bit planes, so the file is used in place once mapped.
+#define MAP_CACHE_V2_MAGIC "MCv2"
+#define MAP_CACHE_V2_PLANES 3 // walkable, shootable, water
+
+struct map_cache_v2_header {
+	char magic[4];
+	uint32 file_size;
+	uint32 map_count;
+	uint32 dir_offset; // map_count entries of struct map_cache_v2_entry, sorted by name
+};
+
+// Bit x of row y of a plane is bit (x&7) of byte [y*stride + x/8].
+struct map_cache_v2_entry {
+	char name[MAP_NAME_LENGTH];
+	int16 xs;
+	int16 ys;
+	uint32 stride; // bytes per row, multiple of 8
+	uint32 offset; // first plane, the others follow every stride*ys bytes
+};
+
+/// An opened map cache file.
+struct map_cache {
+	char* data;
+	size_t size;
+	int version;
+	DBMap* index; // v1: const char* map name -> struct map_cache_map_info*
+	bool mapped; // data is a read-only file mapping instead of a buffer
+#ifdef WIN32
+	HANDLE file, mapping;
+#endif
+};
+
+/// The main and the import cache. A mapped v2 cache stays open after loading,
+/// since the terrain planes of its maps point into the mapping.
+static struct map_cache map_caches[2];
+
 char motd_txt[256] = "conf/motd.txt";
 char help_txt[256] = "conf/help.txt";
 char help2_txt[256] = "conf/help2.txt";
@@ -247,6 +322,161 @@ int map_freeblock_timer(int tid, unsigned int tick, int id, intptr_t data)
  *------------------------------------------*/
 static struct block_list bl_head;
 
+/*==========================================
+ * Cell access
+ * Terrain flags are kept in bit planes (see enum map_plane_type), the
+ * other flags in struct mapcell.
+ * Instance maps start without any of the flags in struct mapcell, which
+ * belong to the npcs, skills and scripts of their source map, and allocate
+ * a block of cells (BLOCK_SIZE x BLOCK_SIZE) the first time one of them
+ * changes. They read the terrain planes of their source map as they were
+ * when the instance was created, and copy a whole plane the first time
+ * one of its bits changes.
+ *------------------------------------------*/
+static const struct mapcell map_cell_empty; // cell of an instance map that never changed
+
+static inline const struct mapcell* map_cell_get(struct map_data* m, int16 x, int16 y)
+{
+	if( m->instance_id ) {
+		struct mapcell* tile;
+
+		if( m->cell_tiles == NULL || (tile = m->cell_tiles[x/BLOCK_SIZE + (y/BLOCK_SIZE)*m->bxs]) == NULL )
+			return &map_cell_empty;
+		return &tile[x%BLOCK_SIZE + (y%BLOCK_SIZE)*BLOCK_SIZE];
+	}
+	return &m->cell[x + y*m->xs];
+}
+
+/// Returns a cell that may be modified, allocating its block first on instance maps.
+static struct mapcell* map_cell_write(struct map_data* m, int16 x, int16 y)
+{
+	struct mapcell* tile;
+	int b;
+
+	if( !m->instance_id )
+		return &m->cell[x + y*m->xs];
+
+	if( m->cell_tiles == NULL )
+		CREATE(m->cell_tiles, struct mapcell*, m->bxs*m->bys);
+
+	b = x/BLOCK_SIZE + (y/BLOCK_SIZE)*m->bxs;
+	if( (tile = m->cell_tiles[b]) == NULL ) {
+		CREATE(tile, struct mapcell, BLOCK_SIZE*BLOCK_SIZE); // empty, like the cells it stands for
+		m->cell_tiles[b] = tile;
+	}
+	return &tile[x%BLOCK_SIZE + (y%BLOCK_SIZE)*BLOCK_SIZE];
+}
+
+/// Allocates the cells of a map, once its size is known.
+/// @param planes also allocate empty bit planes, false if the caller points them somewhere else
+static void map_cell_alloc(struct map_data* m, bool planes)
+{
+	int i;
+
+	m->plane_stride = (m->xs + 63)/64;
+	CREATE(m->cell, struct mapcell, m->xs*m->ys);
+	m->plane_own = 0;
+	if( !planes )
+		return;
+	for( i = 0; i < MAP_PLANE_MAX; i++ )
+		CREATE(m->plane[i], uint64, m->plane_stride*m->ys);
+	m->plane_own = (1<<MAP_PLANE_MAX)-1;
+}
+
+/// Drops a reference to a plane snapshot, the last one frees it.
+static void map_plane_release(struct map_plane_snapshot** snap)
+{
+	int i;
+
+	if( *snap == NULL )
+		return;
+	if( --(*snap)->ref == 0 ) {
+		for( i = 0; i < MAP_PLANE_MAX; i++ )
+			aFree((*snap)->plane[i]);
+		aFree(*snap);
+	}
+	*snap = NULL;
+}
+
+static inline bool map_plane_get(const struct map_data* m, enum map_plane_type type, int16 x, int16 y)
+{
+	return (m->plane[type][y*m->plane_stride + (x>>6)]>>(x&63))&1;
+}
+
+/// Changes a bit of a plane, copying the plane first if the map shares it.
+static void map_plane_set(struct map_data* m, enum map_plane_type type, int16 x, int16 y, bool flag)
+{
+	uint64 bit = (uint64)1<<(x&63);
+	int i = y*m->plane_stride + (x>>6);
+
+	if( ((m->plane[type][i]&bit) != 0) == flag )
+		return;
+	if( !(m->plane_own&(1<<type)) ) {
+		uint64* plane;
+
+		CREATE(plane, uint64, m->plane_stride*m->ys);
+		memcpy(plane, m->plane[type], m->plane_stride*m->ys*sizeof(uint64));
+		m->plane[type] = plane;
+		m->plane_own |= 1<<type;
+	}
+	if( !m->instance_id ) // instances created from now on need a new snapshot
+		map_plane_release(&m->plane_snap);
+	if( flag )
+		m->plane[type][i] |= bit;
+	else
+		m->plane[type][i] &= ~bit;
+}
+
+/// Frees the cells of a map, instance maps only own what they changed.
+static void map_cell_free(struct map_data* m)
+{
+	int i;
+
+	if( m->cell_tiles ) {
+		for( i = 0; i < m->bxs*m->bys; i++ ) {
+			if( m->cell_tiles[i] )
+				aFree(m->cell_tiles[i]);
+		}
+		aFree(m->cell_tiles);
+		m->cell_tiles = NULL;
+	}
+	if( m->cell && !m->instance_id )
+		aFree(m->cell);
+	m->cell = NULL;
+	for( i = 0; i < MAP_PLANE_MAX; i++ ) {
+		if( m->plane[i] && m->plane_own&(1<<i) )
+			aFree(m->plane[i]);
+		m->plane[i] = NULL;
+	}
+	map_plane_release(&m->plane_snap);
+	m->plane_own = 0;
+}
+
+/// Sets up the cells of a new instance map.
+/// The instance starts with empty cells and the terrain of its source map as it is now;
+/// the planes are shared with the other instances created since the last terrain change.
+static void map_cell_share(struct map_data* src, struct map_data* dst)
+{
+	int i;
+
+	if( src->plane_snap == NULL ) {
+		CREATE(src->plane_snap, struct map_plane_snapshot, 1);
+		for( i = 0; i < MAP_PLANE_MAX; i++ ) {
+			CREATE(src->plane_snap->plane[i], uint64, src->plane_stride*src->ys);
+			memcpy(src->plane_snap->plane[i], src->plane[i], src->plane_stride*src->ys*sizeof(uint64));
+		}
+		src->plane_snap->ref = 1; // held by the source map until its terrain changes
+	}
+
+	dst->cell = (struct mapcell*)&map_cell_empty; // only tells that the map is local, see map_cell_get
+	dst->cell_tiles = NULL;
+	dst->plane_snap = src->plane_snap;
+	dst->plane_snap->ref++;
+	for( i = 0; i < MAP_PLANE_MAX; i++ )
+		dst->plane[i] = dst->plane_snap->plane[i];
+	dst->plane_own = 0;
+}
+
 #ifdef CELL_NOSTACK
 /*==========================================
  * These pair of functions update the counter of how many objects
@@ -256,7 +486,7 @@ static void map_addblcell(struct block_list *bl)
 {
 	if( bl->m<0 || bl->x<0 || bl->x>=map[bl->m].xs || bl->y<0 || bl->y>=map[bl->m].ys || !(bl->type&BL_CHAR) )
 		return;
-	map[bl->m].cell[bl->x+bl->y*map[bl->m].xs].cell_bl++;
+	map_cell_write(&map[bl->m], bl->x, bl->y)->cell_bl++;
 	return;
 }
 
@@ -264,10 +494,213 @@ static void map_delblcell(struct block_list *bl)
 {
 	if( bl->m <0 || bl->x<0 || bl->x>=map[bl->m].xs || bl->y<0 || bl->y>=map[bl->m].ys || !(bl->type&BL_CHAR) )
 		return;
-	map[bl->m].cell[bl->x+bl->y*map[bl->m].xs].cell_bl--;
+	map_cell_write(&map[bl->m], bl->x, bl->y)->cell_bl--;
 }
 #endif
 
+/*==========================================
+ * Id lookup tables
+ *------------------------------------------*/
+static inline unsigned int map_idhash_index(const struct map_idhash* h, int id)
+{
+	uint32 k = (uint32)id;
+
+	k ^= k>>16;
+	k *= 0x45d9f3b;
+	k ^= k>>16;
+	return k & h->mask;
+}
+
+static void* map_idhash_get(const struct map_idhash* h, int id)
+{
+	unsigned int i;
+
+	if( h->entry == NULL || id == 0 )
+		return NULL;
+	for( i = map_idhash_index(h, id); h->entry[i].id != 0; i = (i+1) & h->mask ) {
+		if( h->entry[i].id == id )
+			return h->entry[i].data;
+	}
+	return NULL;
+}
+
+static void map_idhash_put(struct map_idhash* h, int id, void* data)
+{
+	unsigned int i;
+
+	if( id == 0 )
+		return;
+	if( h->entry == NULL || (h->count+1)*2 > h->mask+1 ) { // keep the table at most half full
+		struct map_idhash_entry* old = h->entry;
+		unsigned int size = (old ? h->mask+1 : 0);
+
+		h->mask = (size ? size*2 : 1024) - 1;
+		CREATE(h->entry, struct map_idhash_entry, h->mask+1);
+		h->count = 0;
+		for( i = 0; i < size; i++ ) {
+			if( old[i].id != 0 )
+				map_idhash_put(h, old[i].id, old[i].data);
+		}
+		if( old )
+			aFree(old);
+	}
+	for( i = map_idhash_index(h, id); h->entry[i].id != 0; i = (i+1) & h->mask ) {
+		if( h->entry[i].id == id ) {
+			h->entry[i].data = data;
+			return;
+		}
+	}
+	h->entry[i].id = id;
+	h->entry[i].data = data;
+	h->count++;
+}
+
+static void map_idhash_remove(struct map_idhash* h, int id)
+{
+	unsigned int i, j;
+
+	if( h->entry == NULL || id == 0 )
+		return;
+	for( i = map_idhash_index(h, id); h->entry[i].id != id; i = (i+1) & h->mask ) {
+		if( h->entry[i].id == 0 )
+			return; // not found
+	}
+	// move back the entries that would no longer be reached
+	for( j = (i+1) & h->mask; h->entry[j].id != 0; j = (j+1) & h->mask ) {
+		unsigned int k = map_idhash_index(h, h->entry[j].id);
+
+		if( (i <= j) ? (i < k && k <= j) : (i < k || k <= j) )
+			continue; // still reached from its own index
+		h->entry[i] = h->entry[j];
+		i = j;
+	}
+	h->entry[i].id = 0;
+	h->entry[i].data = NULL;
+	h->count--;
+}
+
+static void map_idhash_clear(struct map_idhash* h)
+{
+	if( h->entry )
+		aFree(h->entry);
+	memset(h, 0, sizeof(*h));
+}
+
+/// Returns the slot of an id given by map_get_new_object_id, or NULL.
+static inline struct object_slot* map_object_slot(int id)
+{
+	struct object_slot* slot;
+
+	if( id < MIN_FLOORITEM || id >= MAX_FLOORITEM || object_slots == NULL )
+		return NULL;
+	slot = &object_slots[(id-MIN_FLOORITEM) & (OBJECT_SLOT_COUNT-1)];
+	return (slot->id == id ? slot : NULL);
+}
+
+static void map_object_ids_init(void)
+{
+	int i;
+
+	CREATE(object_slots, struct object_slot, OBJECT_SLOT_COUNT);
+	CREATE(object_free, int, OBJECT_SLOT_COUNT);
+	for( i = 0; i < OBJECT_SLOT_COUNT; i++ )
+		object_free[i] = i;
+	object_free_head = 0;
+	object_free_count = OBJECT_SLOT_COUNT;
+}
+
+/// Gives back an id of map_get_new_object_id.
+static void map_free_object_id(struct object_slot* slot)
+{
+	slot->id = 0;
+	slot->bl = NULL;
+	object_free[(object_free_head + object_free_count) % OBJECT_SLOT_COUNT] = (int)(slot - object_slots);
+	object_free_count++;
+}
+
+/*==========================================
+ * Object lists
+ * Players, mobs and npcs are kept in dense arrays for iterations; each
+ * object remembers its position so it can be removed in constant time.
+ *------------------------------------------*/
+static int* map_objlist_pos(struct map_objlist* list, struct block_list* bl)
+{
+	switch( bl->type ) {
+		case BL_PC:  return &((TBL_PC*)bl)->objlist_pos[list->slot];
+		case BL_MOB: return &((TBL_MOB*)bl)->objlist_pos;
+		case BL_NPC: return &((TBL_NPC*)bl)->objlist_pos;
+		default:     return NULL;
+	}
+}
+
+static void map_objlist_add(struct map_objlist* list, struct block_list* bl)
+{
+	int* pos = map_objlist_pos(list, bl);
+
+	if( pos == NULL )
+		return;
+	if( *pos >= 0 && *pos < list->count && list->data[*pos] == bl )
+		return; // already in the list
+	if( list->count == list->max ) {
+		list->max = (list->max ? list->max*2 : 32);
+		RECREATE(list->data, struct block_list*, list->max);
+	}
+	*pos = list->count;
+	list->data[list->count++] = bl;
+}
+
+static void map_objlist_remove(struct map_objlist* list, struct block_list* bl)
+{
+	int* pos = map_objlist_pos(list, bl);
+
+	if( pos == NULL || *pos < 0 || *pos >= list->count || list->data[*pos] != bl )
+		return; // not in the list
+	if( list->lock ) { // keep the positions of the other objects until the iterations end
+		list->data[*pos] = NULL;
+		list->dirty = true;
+	} else {
+		struct block_list* last = list->data[--list->count];
+
+		list->data[*pos] = last;
+		*map_objlist_pos(list, last) = *pos;
+	}
+	*pos = -1;
+}
+
+static void map_objlist_clear(struct map_objlist* list)
+{
+	if( list->data )
+		aFree(list->data);
+	list->data = NULL;
+	list->count = list->max = list->lock = 0;
+	list->dirty = false;
+}
+
+/// Starts an iteration over a list, objects removed until map_objlist_unlock leave a NULL hole.
+void map_objlist_lock(struct map_objlist* list)
+{
+	list->lock++;
+}
+
+/// Ends an iteration over a list, the last one closes the holes.
+void map_objlist_unlock(struct map_objlist* list)
+{
+	int i, n = 0;
+
+	if( --list->lock > 0 || !list->dirty )
+		return;
+
+	for( i = 0; i < list->count; i++ ) {
+		if( list->data[i] == NULL )
+			continue;
+		list->data[n] = list->data[i];
+		*map_objlist_pos(list, list->data[n]) = n;
+		n++;
+	}
+	list->count = n;
+	list->dirty = false;
+}
+
 /*==========================================
  * Adds a block to the map.
  * Returns 0 on success, 1 on failure (illegal coordinates).
@@ -305,11 +738,21 @@ int map_addblock(struct block_list* bl)
 		bl->prev = &bl_head;
 		if (bl->next) bl->next->prev = bl;
 		map[m].block_mob[pos] = bl;
+	} else if (bl->type == BL_PC) {
+		bl->next = map[m].block_pc[pos];
+		bl->prev = &bl_head;
+		if (bl->next) bl->next->prev = bl;
+		map[m].block_pc[pos] = bl;
+		map_objlist_add(&map[m].pc_list, bl);
 	} else {
 		bl->next = map[m].block[pos];
 		bl->prev = &bl_head;
 		if (bl->next) bl->next->prev = bl;
 		map[m].block[pos] = bl;
+		if (bl->type == BL_ITEM) {
+			map[m].block_item[pos]++;
+			map[m].flooritem_count++;
+		}
 	}
 
 #ifdef CELL_NOSTACK
@@ -342,12 +785,21 @@ int map_delblock(struct block_list* bl)
 
 	pos = bl->x/BLOCK_SIZE+(bl->y/BLOCK_SIZE)*map[bl->m].bxs;
 
+	if (bl->type == BL_PC)
+		map_objlist_remove(&map[bl->m].pc_list, bl);
+	else if (bl->type == BL_ITEM) {
+		map[bl->m].block_item[pos]--;
+		map[bl->m].flooritem_count--;
+	}
+
 	if (bl->next)
 		bl->next->prev = bl->prev;
 	if (bl->prev == &bl_head) {
 	//Since the head of the list, update the block_list map of []
 		if (bl->type == BL_MOB) {
 			map[bl->m].block_mob[pos] = bl->next;
+		} else if (bl->type == BL_PC) {
+			map[bl->m].block_pc[pos] = bl->next;
 		} else {
 			map[bl->m].block[pos] = bl->next;
 		}
@@ -498,7 +950,10 @@ int map_count_oncell(int16 m, int16 x, int16 y, int type, int flag)
 	bx = x/BLOCK_SIZE;
 	by = y/BLOCK_SIZE;
 
-	if (type&~BL_MOB)
+	if (type == BL_ITEM && !map[m].block_item[bx+by*map[m].bxs])
+		return 0;
+
+	if (type&~(BL_MOB|BL_PC))
 		for( bl = map[m].block[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
 			if(bl->x == x && bl->y == y && bl->type&type) {
 				if(flag&1) {
@@ -522,6 +977,18 @@ int map_count_oncell(int16 m, int16 x, int16 y, int type, int flag)
 				}
 			}
 
+	if (type&BL_PC)
+		for( bl = map[m].block_pc[bx+by*map[m].bxs] ; bl != NULL ; bl = bl->next )
+			if(bl->x == x && bl->y == y) {
+				if(flag&1) {
+					struct unit_data *ud = unit_bl2ud(bl);
+					if(!ud || ud->walktimer == INVALID_TIMER)
+						count++;
+				} else {
+					count++;
+				}
+			}
+
 	return count;
 }
 
@@ -568,12 +1035,14 @@ int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_lis
 	va_list ap;
 
 	m = center->m;
+	if ( type == BL_PC && !map[ m ].pc_list.count )
+		return 0; // Nobody to look for
 	x0 = i16max(center->x - range, 0);
 	y0 = i16max(center->y - range, 0);
 	x1 = i16min(center->x + range, map[ m ].xs - 1);
 	y1 = i16min(center->y + range, map[ m ].ys - 1);
 
-	if ( type&~BL_MOB )
+	if ( type&~(BL_MOB|BL_PC) )
 		for ( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
 				for( bl = map[m].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
@@ -602,6 +1071,20 @@ int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_lis
 			}
 		}
 
+	if( type&BL_PC )
+		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
+			for(bx=x0/BLOCK_SIZE;bx<=x1/BLOCK_SIZE;bx++) {
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
+#ifdef CIRCULAR_AREA
+						&& check_distance_bl(center, bl, range)
+#endif
+						&& bl_list_count < BL_LIST_MAX )
+						bl_list[ bl_list_count++ ] = bl;
+				}
+			}
+		}
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinrange: block count too many!\n");
 
@@ -641,7 +1124,7 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
 	x1 = i16min(center->x+range, map[m].xs-1);
 	y1 = i16min(center->y+range, map[m].ys-1);
 
-	if ( type&~BL_MOB )
+	if ( type&~(BL_MOB|BL_PC) )
 		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
 				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
@@ -671,6 +1154,21 @@ int map_foreachinshootrange(int (*func)(struct block_list*,va_list),struct block
 			}
 		}
 
+	if( type&BL_PC )
+		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
+			for( bx=x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
+#ifdef CIRCULAR_AREA
+						&& check_distance_bl(center, bl, range)
+#endif
+						&& path_search_long(NULL, center->m, center->x, center->y, bl->x, bl->y, CELL_CHKWALL)
+						&& bl_list_count < BL_LIST_MAX )
+						bl_list[ bl_list_count++ ] = bl;
+				}
+			}
+		}
+
 	if( bl_list_count >= BL_LIST_MAX )
 			ShowWarning("map_foreachinrange: block count too many!\n");
 
@@ -704,6 +1202,8 @@ int map_foreachinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0
 
 	if ( m < 0 || m >= map_num)
 		return 0;
+	if ( type == BL_PC && !map[ m ].pc_list.count )
+		return 0; // Nobody to look for
 
 	if ( x1 < x0 )
 		swap(x0, x1);
@@ -714,7 +1214,7 @@ int map_foreachinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0
 	y0 = i16max(y0, 0);
 	x1 = i16min(x1, map[ m ].xs - 1);
 	y1 = i16min(y1, map[ m ].ys - 1);
-	if ( type&~BL_MOB )
+	if ( type&~(BL_MOB|BL_PC) )
 		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
 				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next )
@@ -728,6 +1228,13 @@ int map_foreachinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0
 					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
 						bl_list[ bl_list_count++ ] = bl;
 
+	if( type&BL_PC )
+		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
+			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next )
+					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
+						bl_list[ bl_list_count++ ] = bl;
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinarea: block count too many!\n");
 
@@ -746,6 +1253,67 @@ int map_foreachinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0
 	return returnCount;	//[Skotlex]
 }
 
+/*==========================================
+ * Apply func to the floor items in the area (x0,y0)-(x1,y1) of map m.
+ * Same as foreachinarea with BL_ITEM, but only walks the blocks holding
+ * floor items and returns right away when the map has none.
+ * @param m: ID of map
+ * @param x0: West end of area
+ * @param y0: South end of area
+ * @param x1: East end of area
+ * @param y1: North end of area
+ *------------------------------------------*/
+int map_foreachflooritem(int (*func)(struct block_list*,va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, ...)
+{
+	int bx, by;
+	int returnCount = 0;
+	struct block_list *bl;
+	int blockcount = bl_list_count, i;
+	va_list ap;
+
+	if ( m < 0 || m >= map_num || !map[ m ].flooritem_count )
+		return 0;
+
+	if ( x1 < x0 )
+		swap(x0, x1);
+	if ( y1 < y0 )
+		swap(y0, y1);
+
+	x0 = i16max(x0, 0);
+	y0 = i16max(y0, 0);
+	x1 = i16min(x1, map[ m ].xs - 1);
+	y1 = i16min(y1, map[ m ].ys - 1);
+
+	for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
+		for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
+			int pos = bx + by * map[ m ].bxs;
+
+			if( !map[ m ].block_item[ pos ] )
+				continue;
+			for( bl = map[ m ].block[ pos ]; bl != NULL; bl = bl->next )
+				if( bl->type == BL_ITEM && bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
+					bl_list[ bl_list_count++ ] = bl;
+		}
+	}
+
+	if( bl_list_count >= BL_LIST_MAX )
+		ShowWarning("map_foreachflooritem: block count too many!\n");
+
+	map_freeblock_lock();
+
+	for( i = blockcount; i < bl_list_count; i++ )
+		if( bl_list[ i ]->prev ) {
+			va_start(ap, y1);
+			returnCount += func(bl_list[ i ], ap);
+			va_end(ap);
+		}
+
+	map_freeblock_unlock();
+
+	bl_list_count = blockcount;
+	return returnCount;
+}
+
 /*========================================== [Playtester]
 * Same as foreachinarea, but there must be a shoot-able range between area center and target.
 * @param m: ID of map
@@ -779,7 +1347,7 @@ int map_foreachinshootarea(int(*func)(struct block_list*, va_list), int16 m, int
 	cx = x0 + (x1 - x0) / 2;
 	cy = y0 + (y1 - y0) / 2;
 
-	if (type&~BL_MOB)
+	if (type&~(BL_MOB|BL_PC))
 		for (by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++)
 			for (bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++)
 				for (bl = map[m].block[bx + by * map[m].bxs]; bl != NULL; bl = bl->next)
@@ -797,6 +1365,15 @@ int map_foreachinshootarea(int(*func)(struct block_list*, va_list), int16 m, int
 						&& bl_list_count < BL_LIST_MAX)
 						bl_list[bl_list_count++] = bl;
 
+	if (type&BL_PC)
+		for (by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++)
+			for (bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++)
+				for (bl = map[m].block_pc[bx + by * map[m].bxs]; bl != NULL; bl = bl->next)
+					if (bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
+						&& path_search_long(NULL, m, cx, cy, bl->x, bl->y, CELL_CHKWALL)
+						&& bl_list_count < BL_LIST_MAX)
+						bl_list[bl_list_count++] = bl;
+
 	if (bl_list_count >= BL_LIST_MAX)
 		ShowWarning("map_foreachinshootarea: block count too many!\n");
 
@@ -833,7 +1410,7 @@ int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_li
 	x1 = i16min(center->x + range, map[ m ].xs - 1);
 	y1 = i16min(center->y + range, map[ m ].ys - 1);
 
-	if ( type&~BL_MOB )
+	if ( type&~(BL_MOB|BL_PC) )
 		for ( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
 				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
@@ -861,6 +1438,20 @@ int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_li
 			}
 		}
 
+	if( type&BL_PC )
+		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
+			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ){
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1
+#ifdef CIRCULAR_AREA
+						&& check_distance_bl(center, bl, range)
+#endif
+						&& bl_list_count < BL_LIST_MAX )
+						bl_list[ bl_list_count++ ] = bl;
+				}
+			}
+		}
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_forcountinrange: block count too many!\n");
 
@@ -901,7 +1492,7 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x
 	x1 = i16min(x1, map[ m ].xs - 1);
 	y1 = i16min(y1, map[ m ].ys - 1);
 
-	if ( type&~BL_MOB )
+	if ( type&~(BL_MOB|BL_PC) )
 		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
 				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next )
@@ -915,6 +1506,13 @@ int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x
 					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
 						bl_list[ bl_list_count++ ] = bl;
 
+	if( type&BL_PC )
+		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ )
+			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ )
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next )
+					if( bl->x >= x0 && bl->x <= x1 && bl->y >= y0 && bl->y <= y1 && bl_list_count < BL_LIST_MAX )
+						bl_list[ bl_list_count++ ] = bl;
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinarea: block count too many!\n");
 
@@ -952,6 +1550,8 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 	if ( !dx && !dy ) return 0; //No movement.
 
 	m = center->m;
+	if ( type == BL_PC && !map[ m ].pc_list.count )
+		return 0; // Nobody to look for
 
 	x0 = center->x - range;
 	x1 = center->x + range;
@@ -984,7 +1584,7 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 
 		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				if ( type&~BL_MOB ) {
+				if ( type&~(BL_MOB|BL_PC) ) {
 					for( bl = map[m].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
 						if( bl->type&type &&
 							bl->x >= x0 && bl->x <= x1 &&
@@ -1001,6 +1601,15 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 							bl_list[ bl_list_count++ ] = bl;
 					}
 				}
+
+				if ( type&BL_PC ) {
+					for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+						if( bl->x >= x0 && bl->x <= x1 &&
+							bl->y >= y0 && bl->y <= y1 &&
+							bl_list_count < BL_LIST_MAX )
+							bl_list[ bl_list_count++ ] = bl;
+					}
+				}
 			}
 		}
 	} else { // Diagonal movement
@@ -1011,7 +1620,7 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 
 		for( by = y0 / BLOCK_SIZE; by <= y1 / BLOCK_SIZE; by++ ) {
 			for( bx = x0 / BLOCK_SIZE; bx <= x1 / BLOCK_SIZE; bx++ ) {
-				if ( type & ~BL_MOB ) {
+				if ( type&~(BL_MOB|BL_PC) ) {
 					for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
 						if( bl->type&type &&
 							bl->x >= x0 && bl->x <= x1 &&
@@ -1036,6 +1645,19 @@ int map_foreachinmovearea(int (*func)(struct block_list*,va_list), struct block_
 							bl_list[ bl_list_count++ ] = bl;
 					}
 				}
+
+				if ( type&BL_PC ) {
+					for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+						if( bl->x >= x0 && bl->x <= x1 &&
+							bl->y >= y0 && bl->y <= y1 &&
+							bl_list_count < BL_LIST_MAX)
+						if( ( dx > 0 && bl->x < x0 + dx) ||
+							( dx < 0 && bl->x > x1 + dx) ||
+							( dy > 0 && bl->y < y0 + dy) ||
+							( dy < 0 && bl->y > y1 + dy) )
+							bl_list[ bl_list_count++ ] = bl;
+					}
+				}
 			}
 		}
 
@@ -1076,7 +1698,7 @@ int map_foreachincell(int (*func)(struct block_list*,va_list), int16 m, int16 x,
 	by = y / BLOCK_SIZE;
 	bx = x / BLOCK_SIZE;
 
-	if( type&~BL_MOB )
+	if( type&~(BL_MOB|BL_PC) )
 		for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next )
 			if( bl->type&type && bl->x == x && bl->y == y && bl_list_count < BL_LIST_MAX )
 				bl_list[ bl_list_count++ ] = bl;
@@ -1085,6 +1707,11 @@ int map_foreachincell(int (*func)(struct block_list*,va_list), int16 m, int16 x,
 			if( bl->x == x && bl->y == y && bl_list_count < BL_LIST_MAX)
 				bl_list[ bl_list_count++ ] = bl;
 
+	if( type&BL_PC )
+		for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs]; bl != NULL; bl = bl->next )
+			if( bl->x == x && bl->y == y && bl_list_count < BL_LIST_MAX)
+				bl_list[ bl_list_count++ ] = bl;
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachincell: block count too many!\n");
 
@@ -1198,24 +1825,55 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int16 m,int16 x0,i
 
 	range *= range << 8; //Values are shifted later on for higher precision using int math.
 
-	if ( type&~BL_MOB )
-		for ( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
+	if ( type&~(BL_MOB|BL_PC) )
+		for ( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
+			for( bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++ ) {
+				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+					if( bl->prev && bl->type&type && bl_list_count < BL_LIST_MAX ) {
+						xi = bl->x;
+						yi = bl->y;
+
+						k = ( xi - x0 ) * ( x1 - x0 ) + ( yi - y0 ) * ( y1 - y0 );
+
+						if ( k < 0 || k > len_limit ) //Since more skills use this, check for ending point as well.
+							continue;
+
+						if ( k > magnitude2 && !path_search_long(NULL, m, x0, y0, xi, yi, CELL_CHKWALL) )
+							continue; //Targets beyond the initial ending point need the wall check.
+
+						//All these shifts are to increase the precision of the intersection point and distance considering how it's
+						//int math.
+						k  = ( k << 4 ) / magnitude2; //k will be between 1~16 instead of 0~1
+						xi <<= 4;
+						yi <<= 4;
+						xu = ( x0 << 4 ) + k * ( x1 - x0 );
+						yu = ( y0 << 4 ) + k * ( y1 - y0 );
+						k  = MAGNITUDE2(xi, yi, xu, yu);
+
+						//If all dot coordinates were <<4 the square of the magnitude is <<8
+						if ( k > range )
+							continue;
+
+						bl_list[ bl_list_count++ ] = bl;
+					}
+				}
+			}
+		}
+	 if( type&BL_MOB )
+		for( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
 			for( bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++ ) {
-				for( bl = map[ m ].block[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
-					if( bl->prev && bl->type&type && bl_list_count < BL_LIST_MAX ) {
+				for( bl = map[ m ].block_mob[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+					if( bl->prev && bl_list_count < BL_LIST_MAX ) {
 						xi = bl->x;
 						yi = bl->y;
-
 						k = ( xi - x0 ) * ( x1 - x0 ) + ( yi - y0 ) * ( y1 - y0 );
 
-						if ( k < 0 || k > len_limit ) //Since more skills use this, check for ending point as well.
+						if ( k < 0 || k > len_limit )
 							continue;
 
 						if ( k > magnitude2 && !path_search_long(NULL, m, x0, y0, xi, yi, CELL_CHKWALL) )
 							continue; //Targets beyond the initial ending point need the wall check.
 
-						//All these shifts are to increase the precision of the intersection point and distance considering how it's
-						//int math.
 						k  = ( k << 4 ) / magnitude2; //k will be between 1~16 instead of 0~1
 						xi <<= 4;
 						yi <<= 4;
@@ -1232,10 +1890,11 @@ int map_foreachinpath(int (*func)(struct block_list*,va_list),int16 m,int16 x0,i
 				}
 			}
 		}
-	 if( type&BL_MOB )
+
+	if( type&BL_PC )
 		for( by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++ ) {
 			for( bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++ ) {
-				for( bl = map[ m ].block_mob[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
+				for( bl = map[ m ].block_pc[ bx + by * map[ m ].bxs ]; bl != NULL; bl = bl->next ) {
 					if( bl->prev && bl_list_count < BL_LIST_MAX ) {
 						xi = bl->x;
 						yi = bl->y;
@@ -1352,7 +2011,7 @@ int map_foreachindir(int(*func)(struct block_list*, va_list), int16 m, int16 x0,
 	mx1 = min(mx1, map[m].xs - 1);
 	my1 = min(my1, map[m].ys - 1);
 
-	if (type&~BL_MOB) {
+	if (type&~(BL_MOB|BL_PC)) {
 		for (by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++) {
 			for (bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++) {
 				for (bl = map[m].block[bx + by * map[m].bxs]; bl != NULL; bl = bl->next) {
@@ -1425,6 +2084,43 @@ int map_foreachindir(int(*func)(struct block_list*, va_list), int16 m, int16 x0,
 		}
 	}
 
+	if (type&BL_PC) {
+		for (by = my0 / BLOCK_SIZE; by <= my1 / BLOCK_SIZE; by++) {
+			for (bx = mx0 / BLOCK_SIZE; bx <= mx1 / BLOCK_SIZE; bx++) {
+				for (bl = map[m].block_pc[bx + by * map[m].bxs]; bl != NULL; bl = bl->next) {
+					if (bl->prev && bl_list_count < BL_LIST_MAX) {
+						//Check if inside search area
+						if (bl->x < mx0 || bl->x > mx1 || bl->y < my0 || bl->y > my1)
+							continue;
+						//What matters now is the relative x and y from the start point
+						rx = (bl->x - x0);
+						ry = (bl->y - y0);
+						//Do not hit source cell
+						if (rx == 0 && ry == 0)
+							continue;
+						//This turns it so that the area that is hit is always with positive rx and ry
+						rx *= dx;
+						ry *= dy;
+						//These checks only need to be done for diagonal paths
+						if (dir % 2) {
+							//Check for length
+							if ((rx + ry < offset) || (rx + ry > 2 * (length + (offset / 2) - 1)))
+								continue;
+							//Check for width
+							if (abs(rx - ry) > 2 * range)
+								continue;
+						}
+						//Everything else ok, check for line of sight from source
+						if (!path_search_long(NULL, m, x0, y0, bl->x, bl->y, CELL_CHKWALL))
+							continue;
+						//All checks passed, add to list
+						bl_list[bl_list_count++] = bl;
+					}
+				}
+			}
+		}
+	}
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachindir: block count too many!\n");
 
@@ -1454,7 +2150,7 @@ int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,
 
 	bsize = map[ m ].bxs * map[ m ].bys;
 
-	if( type&~BL_MOB )
+	if( type&~(BL_MOB|BL_PC) )
 		for( b = 0; b < bsize; b++ )
 			for( bl = map[ m ].block[ b ]; bl != NULL; bl = bl->next )
 				if( bl->type&type && bl_list_count < BL_LIST_MAX )
@@ -1466,6 +2162,12 @@ int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,
 				if( bl_list_count < BL_LIST_MAX )
 					bl_list[ bl_list_count++ ] = bl;
 
+	if( type&BL_PC )
+		for( b = 0; b < bsize; b++ )
+			for( bl = map[ m ].block_pc[ b ]; bl != NULL; bl = bl->next )
+				if( bl_list_count < BL_LIST_MAX )
+					bl_list[ bl_list_count++ ] = bl;
+
 	if( bl_list_count >= BL_LIST_MAX )
 		ShowWarning("map_foreachinmap: block count too many!\n");
 
@@ -1487,56 +2189,122 @@ int map_foreachinmap(int (*func)(struct block_list*,va_list), int16 m, int type,
 
 /// Generates a new flooritem object id from the interval [MIN_FLOORITEM, MAX_FLOORITEM).
 /// Used for floor items, skill units and chatroom objects.
+/// The id is given back when the object leaves the id_db.
 /// @return The new object id
 int map_get_new_object_id(void)
 {
-	static int last_object_id = MIN_FLOORITEM - 1;
-	int i;
-
-	// find a free id
-	i = last_object_id + 1;
-	while( i != last_object_id ) {
-		if( i == MAX_FLOORITEM )
-			i = MIN_FLOORITEM;
-
-		if( !idb_exists(id_db, i) )
-			break;
-
-		++i;
-	}
+	struct object_slot* slot;
 
-	if( i == last_object_id ) {
+	if( object_free_count == 0 ) {
 		ShowError("map_addobject: no free object id!\n");
 		return 0;
 	}
 
-	// update cursor
-	last_object_id = i;
+	slot = &object_slots[object_free[object_free_head]];
+	object_free_head = (object_free_head + 1) % OBJECT_SLOT_COUNT;
+	object_free_count--;
+
+	slot->id = MIN_FLOORITEM + (slot->gen<<OBJECT_SLOT_BITS) + (int)(slot - object_slots);
+	slot->gen = (slot->gen + 1) % OBJECT_GEN_COUNT;
+	slot->bl = NULL;
 
-	return i;
+	return slot->id;
 }
 
 /*==========================================
- * Timered function to clear the floor (remove remaining item)
- * Called each flooritem_lifetime ms
+ * Floor item expiry queue.
+ * Items are queued in the order they expire and a single timer clears all
+ * the items that are due within the same FLOORITEM_EXPIRE_STEP ms, instead
+ * of each item owning a timer. Items picked up or cleaned up before they
+ * expire are left in the queue and skipped when their entry comes up.
  *------------------------------------------*/
-int map_clearflooritem_timer(int tid, unsigned int tick, int id, intptr_t data)
+#define FLOORITEM_EXPIRE_STEP 1000
+
+struct flooritem_expire {
+	int id;
+	unsigned int tick;
+};
+
+static struct flooritem_expire* flooritem_expire_queue = NULL;
+static int flooritem_expire_head = 0, flooritem_expire_count = 0, flooritem_expire_max = 0;
+static int flooritem_expire_tid = INVALID_TIMER;
+
+#define flooritem_expire_at(i) (&flooritem_expire_queue[(flooritem_expire_head + (i)) % flooritem_expire_max])
+
+/// Schedules the expiry timer for the first entry of the queue.
+static void map_flooritem_expire_schedule(void)
+{
+	if( flooritem_expire_tid != INVALID_TIMER || !flooritem_expire_count )
+		return;
+	flooritem_expire_tid = add_timer(flooritem_expire_at(0)->tick + FLOORITEM_EXPIRE_STEP - 1, map_flooritem_expire_timer, 0, 0);
+}
+
+/// Queues floor item id to expire at tick.
+static void map_flooritem_expire_push(int id, unsigned int tick)
 {
-	struct flooritem_data* fitem = (struct flooritem_data*)idb_get(id_db, id);
+	int i;
+
+	if( flooritem_expire_count == flooritem_expire_max ) {
+		struct flooritem_expire* queue;
+		int max = flooritem_expire_max ? flooritem_expire_max * 2 : 256;
+
+		CREATE(queue, struct flooritem_expire, max);
+		for( i = 0; i < flooritem_expire_count; i++ )
+			queue[i] = *flooritem_expire_at(i);
+		if( flooritem_expire_queue )
+			aFree(flooritem_expire_queue);
+		flooritem_expire_queue = queue;
+		flooritem_expire_head = 0;
+		flooritem_expire_max = max;
+	}
+
+	// Entries come in order unless flooritem_lifetime was lowered by a reload
+	for( i = flooritem_expire_count; i > 0 && DIFF_TICK(flooritem_expire_at(i-1)->tick, tick) > 0; i-- )
+		*flooritem_expire_at(i) = *flooritem_expire_at(i-1);
+	flooritem_expire_at(i)->id = id;
+	flooritem_expire_at(i)->tick = tick;
+	flooritem_expire_count++;
+
+	if( i == 0 && flooritem_expire_tid != INVALID_TIMER ) { // New first entry, reschedule
+		delete_timer(flooritem_expire_tid, map_flooritem_expire_timer);
+		flooritem_expire_tid = INVALID_TIMER;
+	}
+	map_flooritem_expire_schedule();
+}
 
-	if (fitem == NULL || fitem->bl.type != BL_ITEM || (fitem->cleartimer != tid)) {
-		ShowError("map_clearflooritem_timer : error\n");
+/*==========================================
+ * Timered function to clear the floor (remove remaining items)
+ * Clears every queued item that is due.
+ *------------------------------------------*/
+int map_flooritem_expire_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	if( flooritem_expire_tid != tid ) {
+		ShowError("map_flooritem_expire_timer: timer mismatch %d != %d\n", flooritem_expire_tid, tid);
 		return 1;
 	}
+	flooritem_expire_tid = INVALID_TIMER;
 
+	while( flooritem_expire_count && DIFF_TICK(flooritem_expire_at(0)->tick, tick) <= 0 ) {
+		struct flooritem_expire entry = *flooritem_expire_at(0);
+		struct flooritem_data* fitem;
 
-	if (search_petDB_index(fitem->item.nameid, PET_EGG) >= 0)
-		intif_delete_petdata(MakeDWord(fitem->item.card[1], fitem->item.card[2]));
+		flooritem_expire_head = (flooritem_expire_head + 1) % flooritem_expire_max;
+		flooritem_expire_count--;
 
-	clif_clearflooritem(fitem, 0);
-	map_deliddb(&fitem->bl);
-	map_delblock(&fitem->bl);
-	map_freeblock(&fitem->bl);
+		fitem = BL_CAST(BL_ITEM, map_id2bl(entry.id));
+		if( fitem == NULL || fitem->cleartick != entry.tick )
+			continue; // Already gone
+
+		if (search_petDB_index(fitem->item.nameid, PET_EGG) >= 0)
+			intif_delete_petdata(MakeDWord(fitem->item.card[1], fitem->item.card[2]));
+
+		clif_clearflooritem(fitem, 0);
+		map_deliddb(&fitem->bl);
+		map_delblock(&fitem->bl);
+		map_freeblock(&fitem->bl);
+	}
+
+	map_flooritem_expire_schedule();
 	return 0;
 }
 
@@ -1546,9 +2314,6 @@ int map_clearflooritem_timer(int tid, unsigned int tick, int id, intptr_t data)
 void map_clearflooritem(struct block_list *bl) {
 	struct flooritem_data* fitem = (struct flooritem_data*)bl;
 
-	if( fitem->cleartimer != INVALID_TIMER )
-		delete_timer(fitem->cleartimer,map_clearflooritem_timer);
-
 	clif_clearflooritem(fitem, 0);
 	map_deliddb(&fitem->bl);
 	map_delblock(&fitem->bl);
@@ -1607,7 +2372,7 @@ static int map_count_sub(struct block_list *bl,va_list ap)
  *------------------------------------------*/
 int map_search_freecell(struct block_list *src, int16 m, int16 *x,int16 *y, int16 rx, int16 ry, int flag)
 {
-	int tries, spawn=0;
+	int tries, spawn=0, count=0;
 	int bx, by;
 	int rx2 = 2*rx+1;
 	int ry2 = 2*ry+1;
@@ -1636,19 +2401,27 @@ int map_search_freecell(struct block_list *src, int16 m, int16 *x,int16 *y, int1
 	if (rx >= 0 && ry >= 0) {
 		tries = rx2*ry2;
 		if (tries > 100) tries = 100;
+		// Only pick among the reachable cells of the area
+		count = map_count_cells(&map[m], bx-rx, by-ry, bx+rx, by+ry, CELL_CHKREACH);
+		if (count == 0)
+			tries = 0;
 	} else {
 		tries = map[m].xs*map[m].ys;
 		if (tries > 500) tries = 500;
 	}
 
 	while(tries--) {
-		*x = (rx >= 0)?(rnd()%rx2-rx+bx):(rnd()%(map[m].xs-2)+1);
-		*y = (ry >= 0)?(rnd()%ry2-ry+by):(rnd()%(map[m].ys-2)+1);
+		if (count > 0)
+			map_nth_cell(&map[m], bx-rx, by-ry, bx+rx, by+ry, CELL_CHKREACH, rnd()%count, x, y);
+		else {
+			*x = (rx >= 0)?(rnd()%rx2-rx+bx):(rnd()%(map[m].xs-2)+1);
+			*y = (ry >= 0)?(rnd()%ry2-ry+by):(rnd()%(map[m].ys-2)+1);
+		}
 
 		if (*x == bx && *y == by)
 			continue; //Avoid picking the same target tile.
 
-		if (map_getcell(m,*x,*y,CELL_CHKREACH))
+		if (count > 0 || map_getcell(m,*x,*y,CELL_CHKREACH))
 		{
 			if(flag&2 && !unit_can_reach_pos(src, *x, *y, 1))
 				continue;
@@ -1801,7 +2574,8 @@ int map_addflooritem(struct item *item, int amount, int16 m, int16 x, int16 y, i
 	fitem->item.amount = amount;
 	fitem->subx = (r&3)*3+3;
 	fitem->suby = ((r>>2)&3)*3+3;
-	fitem->cleartimer = add_timer(gettick()+battle_config.flooritem_lifetime,map_clearflooritem_timer,fitem->bl.id,0);
+	fitem->cleartick = gettick()+battle_config.flooritem_lifetime;
+	map_flooritem_expire_push(fitem->bl.id, fitem->cleartick);
 
 	map_addiddb(&fitem->bl);
 	if (map_addblock(&fitem->bl))
@@ -1904,6 +2678,8 @@ void map_reqnickdb(struct map_session_data * sd, int charid)
  *------------------------------------------*/
 void map_addiddb(struct block_list *bl)
 {
+	struct object_slot* slot;
+
 	nullpo_retv(bl);
 
 	if( bl->type == BL_PC )
@@ -1911,20 +2687,29 @@ void map_addiddb(struct block_list *bl)
 		TBL_PC* sd = (TBL_PC*)bl;
 		idb_put(pc_db,sd->bl.id,sd);
 		uidb_put(charid_db,sd->status.char_id,sd);
+		map_idhash_put(&charid_hash, sd->status.char_id, sd);
+		map_objlist_add(&pc_list, bl);
 	}
 	else if( bl->type == BL_MOB )
 	{
 		TBL_MOB* md = (TBL_MOB*)bl;
 		idb_put(mobid_db,bl->id,bl);
+		map_objlist_add(&mob_list, bl);
 
 		if( md->state.boss )
 			idb_put(bossid_db, bl->id, bl);
 	}
+	else if( bl->type == BL_NPC )
+		map_objlist_add(&npc_list, bl);
 
 	if( bl->type & BL_REGEN )
 		idb_put(regen_db, bl->id, bl);
 
 	idb_put(id_db,bl->id,bl);
+	if( (slot = map_object_slot(bl->id)) != NULL )
+		slot->bl = bl;
+	else
+		map_idhash_put(&id_hash, bl->id, bl);
 }
 
 /*==========================================
@@ -1932,6 +2717,8 @@ void map_addiddb(struct block_list *bl)
  *------------------------------------------*/
 void map_deliddb(struct block_list *bl)
 {
+	struct object_slot* slot;
+
 	nullpo_retv(bl);
 
 	if( bl->type == BL_PC )
@@ -1939,17 +2726,26 @@ void map_deliddb(struct block_list *bl)
 		TBL_PC* sd = (TBL_PC*)bl;
 		idb_remove(pc_db,sd->bl.id);
 		uidb_remove(charid_db,sd->status.char_id);
+		map_idhash_remove(&charid_hash, sd->status.char_id);
+		map_objlist_remove(&pc_list, bl);
 	}
 	else if( bl->type == BL_MOB )
 	{
 		idb_remove(mobid_db,bl->id);
 		idb_remove(bossid_db,bl->id);
+		map_objlist_remove(&mob_list, bl);
 	}
+	else if( bl->type == BL_NPC )
+		map_objlist_remove(&npc_list, bl);
 
 	if( bl->type & BL_REGEN )
 		idb_remove(regen_db,bl->id);
 
 	idb_remove(id_db,bl->id);
+	if( (slot = map_object_slot(bl->id)) != NULL )
+		map_free_object_id(slot);
+	else
+		map_idhash_remove(&id_hash, bl->id);
 }
 
 /*==========================================
@@ -2117,13 +2913,17 @@ int map_quit(struct map_session_data *sd) {
  * Lookup, id to session (player,mob,npc,homon,merc..)
  *------------------------------------------*/
 struct map_session_data * map_id2sd(int id){
+	struct block_list* bl;
 	if (id <= 0) return NULL;
-	return (struct map_session_data*)idb_get(pc_db,id);
+	bl = (struct block_list*)map_idhash_get(&id_hash, id);
+	return BL_CAST(BL_PC, bl);
 }
 
 struct mob_data * map_id2md(int id){
+	struct block_list* bl;
 	if (id <= 0) return NULL;
-	return (struct mob_data*)idb_get(mobid_db,id);
+	bl = (struct block_list*)map_idhash_get(&id_hash, id);
+	return BL_CAST(BL_MOB, bl);
 }
 
 struct npc_data * map_id2nd(int id){
@@ -2177,7 +2977,7 @@ const char* map_charid2nick(int charid)
 /// Returns the struct map_session_data of the charid or NULL if the char is not online.
 struct map_session_data* map_charid2sd(int charid)
 {
-	return (struct map_session_data*)uidb_get(charid_db, charid);
+	return (struct map_session_data*)map_idhash_get(&charid_hash, charid);
 }
 
 /*==========================================
@@ -2235,14 +3035,18 @@ struct map_session_data * map_nick2sd(const char *nick)
  * Looksup id_db DBMap and returns BL pointer of 'id' or NULL if not found
  *------------------------------------------*/
 struct block_list * map_id2bl(int id) {
-	return (struct block_list*)idb_get(id_db,id);
+	struct object_slot* slot = map_object_slot(id);
+
+	if( slot != NULL )
+		return slot->bl;
+	return (struct block_list*)map_idhash_get(&id_hash, id);
 }
 
 /**
  * Same as map_id2bl except it only checks for its existence
  **/
 bool map_blid_exists( int id ) {
-	return (idb_exists(id_db,id));
+	return (map_id2bl(id) != NULL);
 }
 
 /*==========================================
@@ -2278,70 +3082,75 @@ struct mob_data * map_id2boss(int id)
 /// Stops iterating if func returns -1.
 void map_foreachpc(int (*func)(struct map_session_data* sd, va_list args), ...)
 {
-	DBIterator* iter;
-	struct map_session_data* sd;
+	int i;
 
-	iter = db_iterator(pc_db);
-	for( sd = (struct map_session_data*)dbi_first(iter); dbi_exists(iter); sd = (struct map_session_data*)dbi_next(iter) )
+	map_objlist_lock(&pc_list);
+	for( i = 0; i < pc_list.count; i++ )
 	{
+		struct map_session_data* sd = (struct map_session_data*)pc_list.data[i];
 		va_list args;
 		int ret;
 
+		if( sd == NULL )
+			continue;// removed during the iteration
+
 		va_start(args, func);
 		ret = func(sd, args);
 		va_end(args);
 		if( ret == -1 )
 			break;// stop iterating
 	}
-	dbi_destroy(iter);
+	map_objlist_unlock(&pc_list);
 }
 
 /// Applies func to all the mobs in the db.
 /// Stops iterating if func returns -1.
 void map_foreachmob(int (*func)(struct mob_data* md, va_list args), ...)
 {
-	DBIterator* iter;
-	struct mob_data* md;
+	int i;
 
-	iter = db_iterator(mobid_db);
-	for( md = (struct mob_data*)dbi_first(iter); dbi_exists(iter); md = (struct mob_data*)dbi_next(iter) )
+	map_objlist_lock(&mob_list);
+	for( i = 0; i < mob_list.count; i++ )
 	{
+		struct mob_data* md = (struct mob_data*)mob_list.data[i];
 		va_list args;
 		int ret;
 
+		if( md == NULL )
+			continue;// removed during the iteration
+
 		va_start(args, func);
 		ret = func(md, args);
 		va_end(args);
 		if( ret == -1 )
 			break;// stop iterating
 	}
-	dbi_destroy(iter);
+	map_objlist_unlock(&mob_list);
 }
 
 /// Applies func to all the npcs in the db.
 /// Stops iterating if func returns -1.
 void map_foreachnpc(int (*func)(struct npc_data* nd, va_list args), ...)
 {
-	DBIterator* iter;
-	struct block_list* bl;
+	int i;
 
-	iter = db_iterator(id_db);
-	for( bl = (struct block_list*)dbi_first(iter); dbi_exists(iter); bl = (struct block_list*)dbi_next(iter) )
+	map_objlist_lock(&npc_list);
+	for( i = 0; i < npc_list.count; i++ )
 	{
-		if( bl->type == BL_NPC )
-		{
-			struct npc_data* nd = (struct npc_data*)bl;
-			va_list args;
-			int ret;
-
-			va_start(args, func);
-			ret = func(nd, args);
-			va_end(args);
-			if( ret == -1 )
-				break;// stop iterating
-		}
+		struct npc_data* nd = (struct npc_data*)npc_list.data[i];
+		va_list args;
+		int ret;
+
+		if( nd == NULL )
+			continue;// removed during the iteration
+
+		va_start(args, func);
+		ret = func(nd, args);
+		va_end(args);
+		if( ret == -1 )
+			break;// stop iterating
 	}
-	dbi_destroy(iter);
+	map_objlist_unlock(&npc_list);
 }
 
 /// Applies func to everything in the db.
@@ -2394,7 +3203,9 @@ struct s_mapiterator
 {
 	enum e_mapitflags flags;// flags for special behaviour
 	enum bl_type types;// what bl types to return
-	DBIterator* dbi;// database iterator
+	DBIterator* dbi;// database iterator (mixed types)
+	struct map_objlist* list;// object list (players, mobs or npcs)
+	int pos;// position in the object list
 };
 
 /// Returns true if the block_list matches the description in the iterator.
@@ -2419,12 +3230,18 @@ struct s_mapiterator* mapit_alloc(enum e_mapitflags flags, enum bl_type types)
 {
 	struct s_mapiterator* mapit;
 
-	CREATE(mapit, struct s_mapiterator, 1);
+	mapit = ers_alloc(map_iterator_ers, struct s_mapiterator);
 	mapit->flags = flags;
 	mapit->types = types;
-	if( types == BL_PC )       mapit->dbi = db_iterator(pc_db);
-	else if( types == BL_MOB ) mapit->dbi = db_iterator(mobid_db);
+	mapit->dbi = NULL;
+	mapit->list = NULL;
+	mapit->pos = -1;
+	if( types == BL_PC )       mapit->list = &pc_list;
+	else if( types == BL_MOB ) mapit->list = &mob_list;
+	else if( types == BL_NPC ) mapit->list = &npc_list;
 	else                       mapit->dbi = db_iterator(id_db);
+	if( mapit->list )
+		map_objlist_lock(mapit->list);
 	return mapit;
 }
 
@@ -2435,8 +3252,11 @@ void mapit_free(struct s_mapiterator* mapit)
 {
 	nullpo_retv(mapit);
 
-	dbi_destroy(mapit->dbi);
-	aFree(mapit);
+	if( mapit->list )
+		map_objlist_unlock(mapit->list);
+	else
+		dbi_destroy(mapit->dbi);
+	ers_free(map_iterator_ers, mapit);
 }
 
 /// Returns the first block_list that matches the description.
@@ -2450,6 +3270,12 @@ struct block_list* mapit_first(struct s_mapiterator* mapit)
 
 	nullpo_retr(NULL,mapit);
 
+	if( mapit->list )
+	{
+		mapit->pos = -1;
+		return mapit_next(mapit);
+	}
+
 	for( bl = (struct block_list*)dbi_first(mapit->dbi); bl != NULL; bl = (struct block_list*)dbi_next(mapit->dbi) )
 	{
 		if( MAPIT_MATCHES(mapit,bl) )
@@ -2469,6 +3295,12 @@ struct block_list* mapit_last(struct s_mapiterator* mapit)
 
 	nullpo_retr(NULL,mapit);
 
+	if( mapit->list )
+	{
+		mapit->pos = mapit->list->count;
+		return mapit_prev(mapit);
+	}
+
 	for( bl = (struct block_list*)dbi_last(mapit->dbi); bl != NULL; bl = (struct block_list*)dbi_prev(mapit->dbi) )
 	{
 		if( MAPIT_MATCHES(mapit,bl) )
@@ -2488,6 +3320,17 @@ struct block_list* mapit_next(struct s_mapiterator* mapit)
 
 	nullpo_retr(NULL,mapit);
 
+	if( mapit->list )
+	{
+		while( ++mapit->pos < mapit->list->count )
+		{
+			if( mapit->list->data[mapit->pos] != NULL )
+				return mapit->list->data[mapit->pos];
+		}
+		mapit->pos = mapit->list->count;
+		return NULL;// end
+	}
+
 	for( ; ; )
 	{
 		bl = (struct block_list*)dbi_next(mapit->dbi);
@@ -2511,6 +3354,17 @@ struct block_list* mapit_prev(struct s_mapiterator* mapit)
 
 	nullpo_retr(NULL,mapit);
 
+	if( mapit->list )
+	{
+		while( --mapit->pos >= 0 )
+		{
+			if( mapit->list->data[mapit->pos] != NULL )
+				return mapit->list->data[mapit->pos];
+		}
+		mapit->pos = -1;
+		return NULL;// end
+	}
+
 	for( ; ; )
 	{
 		bl = (struct block_list*)dbi_prev(mapit->dbi);
@@ -2531,6 +3385,8 @@ bool mapit_exists(struct s_mapiterator* mapit)
 {
 	nullpo_retr(false,mapit);
 
+	if( mapit->list )
+		return ( mapit->pos >= 0 && mapit->pos < mapit->list->count && mapit->list->data[mapit->pos] != NULL );
 	return dbi_exists(mapit->dbi);
 }
 
@@ -2552,7 +3408,8 @@ bool map_addnpc(int16 m,struct npc_data *nd)
 
 	map[m].npc[map[m].npc_num]=nd;
 	map[m].npc_num++;
-	idb_put(id_db,nd->bl.id,nd);
+	nd->bl.type = BL_NPC; // not set yet by most callers, map_addiddb needs it
+	map_addiddb(&nd->bl);
 	return true;
 }
 
@@ -2564,7 +3421,7 @@ int map_addinstancemap(const char *name, unsigned short instance_id)
 	int src_m = map_mapname2mapid(name);
 	int dst_m = -1, i;
 	char iname[MAP_NAME_LENGTH];
-	size_t num_cell, size;
+	size_t size;
 
 	if(src_m < 0)
 		return -1;
@@ -2618,15 +3475,17 @@ int map_addinstancemap(const char *name, unsigned short instance_id)
 
 	memset(map[dst_m].npc, 0, sizeof(map[dst_m].npc));
 	map[dst_m].npc_num = 0;
+	memset(&map[dst_m].pc_list, 0, sizeof(map[dst_m].pc_list));
 
-	// Reallocate cells
-	num_cell = map[dst_m].xs * map[dst_m].ys;
-	CREATE( map[dst_m].cell, struct mapcell, num_cell );
-	memcpy( map[dst_m].cell, map[src_m].cell, num_cell * sizeof(struct mapcell) );
+	// Cells start empty and the terrain is shared with the other instances of the map (see map_cell_share)
+	map_cell_share(&map[src_m], &map[dst_m]);
 
 	size = map[dst_m].bxs * map[dst_m].bys * sizeof(struct block_list*);
 	map[dst_m].block = (struct block_list **)aCalloc(1,size);
 	map[dst_m].block_mob = (struct block_list **)aCalloc(1,size);
+	map[dst_m].block_pc = (struct block_list **)aCalloc(1,size);
+	map[dst_m].block_item = (int *)aCalloc(map[dst_m].bxs * map[dst_m].bys, sizeof(int));
+	map[dst_m].flooritem_count = 0;
 
 	map[dst_m].index = mapindex_addmap(-1, map[dst_m].name);
 	map[dst_m].channel = NULL;
@@ -2700,9 +3559,12 @@ int map_delinstancemap(int m)
 		delete_timer(map[m].mob_delete_timer, map_removemobs_timer);
 
 	// Free memory
-	aFree(map[m].cell);
+	map_cell_free(&map[m]);
 	aFree(map[m].block);
 	aFree(map[m].block_mob);
+	aFree(map[m].block_pc);
+	aFree(map[m].block_item);
+	map_objlist_clear(&map[m].pc_list);
 	map_free_questinfo(m);
 
 	mapindex_removemap( map[m].index );
@@ -2876,8 +3738,16 @@ int map_mapname2ipport(unsigned short name, uint32* ip, uint16* port)
 	struct map_data_other_server *mdos;
 
 	mdos = (struct map_data_other_server*)uidb_get(map_db,(unsigned int)name);
-	if(mdos==NULL || mdos->cell) //If gat isn't null, this is a local map.
+	if(mdos==NULL)
 		return -1;
+	if(mdos->cell) { //If gat isn't null, this is a local map, unless it was handed over to another map-server.
+		int16 m = map_mapindex2mapid(name);
+		if( m < 0 || !map[m].handoff_port )
+			return -1;
+		*ip = map[m].handoff_ip;
+		*port = map[m].handoff_port;
+		return 0;
+	}
 	*ip=mdos->ip;
 	*port=mdos->port;
 	return 0;
@@ -2984,125 +3854,345 @@ int map_random_dir(struct block_list *bl, int16 *x, int16 *y)
 		(map_getcell(bl->m,xi,yi,CELL_CHKNOPASS) || !path_search(NULL,bl->m,bl->x,bl->y,xi,yi,1,CELL_CHKNOREACH))
 		&& (++i)<100 );
 
-	if (i < 100) {
-		*x = xi;
-		*y = yi;
-		return 1;
+	if (i < 100) {
+		*x = xi;
+		*y = yi;
+		return 1;
+	}
+	return 0;
+}
+
+// gat system
+static void map_gat2plane(struct map_data* m, int16 x, int16 y, int gat)
+{
+	bool walkable = false, shootable = false, water = false;
+
+	switch( gat ) {
+		case 0: walkable = true;  shootable = true; water = false; break; // walkable ground
+		case 1: walkable = false; shootable = false; water = false; break; // non-walkable ground
+		case 2: walkable = true;  shootable = true; water = false; break; // ???
+		case 3: walkable = true;  shootable = true; water = true;  break; // walkable water
+		case 4: walkable = true;  shootable = true; water = false; break; // ???
+		case 5: walkable = false; shootable = true; water = false; break; // gap (snipable)
+		case 6: walkable = true;  shootable = true; water = false; break; // ???
+		default:
+			ShowWarning("map_gat2plane: unrecognized gat type '%d'\n", gat);
+			break;
+	}
+
+	map_plane_set(m, MAP_PLANE_WALKABLE, x, y, walkable);
+	map_plane_set(m, MAP_PLANE_SHOOTABLE, x, y, shootable);
+	map_plane_set(m, MAP_PLANE_WATER, x, y, water);
+}
+
+static int map_plane2gat(struct map_data* m, int16 x, int16 y)
+{
+	bool walkable = map_plane_get(m, MAP_PLANE_WALKABLE, x, y);
+	bool shootable = map_plane_get(m, MAP_PLANE_SHOOTABLE, x, y);
+	bool water = map_plane_get(m, MAP_PLANE_WATER, x, y);
+
+	if( walkable && shootable && !water ) return 0;
+	if( !walkable && !shootable && !water ) return 1;
+	if( walkable && shootable && water ) return 3;
+	if( !walkable && shootable && !water ) return 5;
+
+	ShowWarning("map_plane2gat: cell has no matching gat type\n");
+	return 1; // default to 'wall'
+}
+
+/*==========================================
+ * Confirm if celltype in (m,x,y) match the one given in cellchk
+ *------------------------------------------*/
+int map_getcell(int16 m,int16 x,int16 y,cell_chk cellchk)
+{
+	return (m < 0 || m >= MAX_MAP_PER_SERVER) ? 0 : map_getcellp(&map[m],x,y,cellchk);
+}
+
+int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk)
+{
+	struct mapcell cell;
+
+	nullpo_ret(m);
+
+	//NOTE: this intentionally overrides the last row and column
+	if(x<0 || x>=m->xs-1 || y<0 || y>=m->ys-1)
+		return( cellchk == CELL_CHKNOPASS );
+
+	switch(cellchk)
+	{
+		// gat type retrieval
+		case CELL_GETTYPE:
+			return map_plane2gat(m, x, y);
+
+		// base gat type checks
+		case CELL_CHKWALL:
+			return (!map_plane_get(m, MAP_PLANE_WALKABLE, x, y) && !map_plane_get(m, MAP_PLANE_SHOOTABLE, x, y));
+
+		case CELL_CHKWATER:
+			return map_plane_get(m, MAP_PLANE_WATER, x, y);
+
+		case CELL_CHKCLIFF:
+			return (!map_plane_get(m, MAP_PLANE_WALKABLE, x, y) && map_plane_get(m, MAP_PLANE_SHOOTABLE, x, y));
+
+		// special checks
+		case CELL_CHKPASS:
+#ifdef CELL_NOSTACK
+			if (map_cell_get(m, x, y)->cell_bl >= battle_config.custom_cell_stack_limit) return 0;
+#endif
+		case CELL_CHKREACH:
+			return map_plane_get(m, MAP_PLANE_WALKABLE, x, y);
+
+		case CELL_CHKNOPASS:
+#ifdef CELL_NOSTACK
+			if (map_cell_get(m, x, y)->cell_bl >= battle_config.custom_cell_stack_limit) return 1;
+#endif
+		case CELL_CHKNOREACH:
+			return !map_plane_get(m, MAP_PLANE_WALKABLE, x, y);
+
+		case CELL_CHKSTACK:
+#ifdef CELL_NOSTACK
+			return (map_cell_get(m, x, y)->cell_bl >= battle_config.custom_cell_stack_limit);
+#else
+			return 0;
+#endif
+
+		default:
+			break;
+	}
+
+	cell = *map_cell_get(m, x, y);
+
+	switch(cellchk)
+	{
+		// base cell type checks
+		case CELL_CHKNPC:
+			return (cell.npc);
+		case CELL_CHKBASILICA:
+			return (cell.basilica);
+		case CELL_CHKLANDPROTECTOR:
+			return (cell.landprotector);
+		case CELL_CHKNOVENDING:
+			return (cell.novending);
+		case CELL_CHKNOCHAT:
+			return (cell.nochat);
+		case CELL_CHKMAELSTROM:
+			return (cell.maelstrom);
+		case CELL_CHKICEWALL:
+			return (cell.icewall);
+
+		default:
+			return 0;
+	}
+}
+
+/*==========================================
+ * Region queries
+ * Checks that only depend on the terrain are answered 64 cells at a time
+ * from the bit planes, the others fall back to map_getcellp.
+ * Like map_getcellp, the last row and column are never matched (except by
+ * CELL_CHKNOPASS in map_getcell_row/map_getcell_area).
+ *------------------------------------------*/
+
+/// Returns whether cellchk can be answered from the bit planes.
+static bool map_plane_check(cell_chk cellchk)
+{
+	switch( cellchk ) {
+		case CELL_CHKWALL:
+		case CELL_CHKWATER:
+		case CELL_CHKCLIFF:
+		case CELL_CHKREACH:
+		case CELL_CHKNOREACH:
+#ifndef CELL_NOSTACK
+		case CELL_CHKPASS:
+		case CELL_CHKNOPASS:
+#endif
+			return true;
+		default:
+			return false;
+	}
+}
+
+/// Returns the cells of word i of the planes that match cellchk, as bits.
+static inline uint64 map_plane_word(const struct map_data* m, cell_chk cellchk, int i)
+{
+	switch( cellchk ) {
+		case CELL_CHKWALL:    return ~m->plane[MAP_PLANE_WALKABLE][i] & ~m->plane[MAP_PLANE_SHOOTABLE][i];
+		case CELL_CHKWATER:   return m->plane[MAP_PLANE_WATER][i];
+		case CELL_CHKCLIFF:   return ~m->plane[MAP_PLANE_WALKABLE][i] & m->plane[MAP_PLANE_SHOOTABLE][i];
+		case CELL_CHKPASS:
+		case CELL_CHKREACH:   return m->plane[MAP_PLANE_WALKABLE][i];
+		case CELL_CHKNOPASS:
+		case CELL_CHKNOREACH: return ~m->plane[MAP_PLANE_WALKABLE][i];
+		default:              return 0;
 	}
-	return 0;
 }
 
-// gat system
-inline static struct mapcell map_gat2cell(int gat) {
-	struct mapcell cell;
+/// Returns the matching cells of row y between x0 and x1 (inside the map), as bits of the words of the row.
+/// Calls func for each word with at least one match until it returns false.
+static bool map_plane_row(const struct map_data* m, int16 x0, int16 x1, int16 y, cell_chk cellchk, bool (*func)(uint64 bits, int16 x, int16 y, void* data), void* data)
+{
+	int i, first = x0>>6, last = x1>>6;
+	const int row = y*m->plane_stride;
 
-	memset(&cell,0,sizeof(struct mapcell));
+	for( i = first; i <= last; i++ ) {
+		uint64 bits = map_plane_word(m, cellchk, row + i);
 
-	switch( gat ) {
-		case 0: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // walkable ground
-		case 1: cell.walkable = 0; cell.shootable = 0; cell.water = 0; break; // non-walkable ground
-		case 2: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
-		case 3: cell.walkable = 1; cell.shootable = 1; cell.water = 1; break; // walkable water
-		case 4: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
-		case 5: cell.walkable = 0; cell.shootable = 1; cell.water = 0; break; // gap (snipable)
-		case 6: cell.walkable = 1; cell.shootable = 1; cell.water = 0; break; // ???
-		default:
-			ShowWarning("map_gat2cell: unrecognized gat type '%d'\n", gat);
-			break;
+		if( i == first )
+			bits &= UINT64_MAX<<(x0&63);
+		if( i == last )
+			bits &= UINT64_MAX>>(63-(x1&63));
+		if( bits && !func(bits, (int16)(i*64), y, data) )
+			return false;
 	}
+	return true;
+}
 
-	return cell;
+/// Clips a region to the cells map_getcellp looks at; returns false if nothing is left.
+static bool map_clip_region(const struct map_data* m, int16* x0, int16* y0, int16* x1, int16* y1)
+{
+	if( *x0 > *x1 ) swap(*x0, *x1);
+	if( *y0 > *y1 ) swap(*y0, *y1);
+	*x0 = max(*x0, 0);
+	*y0 = max(*y0, 0);
+	*x1 = min(*x1, m->xs-2);
+	*y1 = min(*y1, m->ys-2);
+	return (*x0 <= *x1 && *y0 <= *y1);
 }
 
-static int map_cell2gat(struct mapcell cell)
+static bool map_plane_any_sub(uint64 bits, int16 x, int16 y, void* data)
 {
-	if( cell.walkable == 1 && cell.shootable == 1 && cell.water == 0 ) return 0;
-	if( cell.walkable == 0 && cell.shootable == 0 && cell.water == 0 ) return 1;
-	if( cell.walkable == 1 && cell.shootable == 1 && cell.water == 1 ) return 3;
-	if( cell.walkable == 0 && cell.shootable == 1 && cell.water == 0 ) return 5;
+	return false; // found one, stop
+}
 
-	ShowWarning("map_cell2gat: cell has no matching gat type\n");
-	return 1; // default to 'wall'
+/// Returns whether any cell of row y between x0 and x1 (inclusive) matches cellchk.
+bool map_getcell_row(struct map_data* m, int16 x0, int16 x1, int16 y, cell_chk cellchk)
+{
+	return map_getcell_area(m, x0, y, x1, y, cellchk);
 }
 
-/*==========================================
- * Confirm if celltype in (m,x,y) match the one given in cellchk
- *------------------------------------------*/
-int map_getcell(int16 m,int16 x,int16 y,cell_chk cellchk)
+/// Returns whether any cell of the rectangle (x0,y0)-(x1,y1) (inclusive) matches cellchk.
+bool map_getcell_area(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk)
 {
-	return (m < 0 || m >= MAX_MAP_PER_SERVER) ? 0 : map_getcellp(&map[m],x,y,cellchk);
+	int16 x, y, cx0 = x0, cy0 = y0, cx1 = x1, cy1 = y1;
+
+	nullpo_retr(false, m);
+
+	if( !map_clip_region(m, &cx0, &cy0, &cx1, &cy1) )
+		return (cellchk == CELL_CHKNOPASS);
+	if( cellchk == CELL_CHKNOPASS && (cx1-cx0 != abs(x1-x0) || cy1-cy0 != abs(y1-y0)) )
+		return true; // part of the region is outside the map
+
+	if( !map_plane_check(cellchk) ) {
+		for( y = cy0; y <= cy1; y++ )
+			for( x = cx0; x <= cx1; x++ )
+				if( map_getcellp(m, x, y, cellchk) )
+					return true;
+		return false;
+	}
+
+	for( y = cy0; y <= cy1; y++ )
+		if( !map_plane_row(m, cx0, cx1, y, cellchk, map_plane_any_sub, NULL) )
+			return true;
+	return false;
 }
 
-int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk)
+static inline int map_popcount(uint64 bits)
 {
-	struct mapcell cell;
+#if defined(__GNUC__)
+	return __builtin_popcountll(bits);
+#else
+	int count = 0;
 
-	nullpo_ret(m);
+	for( ; bits; bits &= bits-1 )
+		count++;
+	return count;
+#endif
+}
 
-	//NOTE: this intentionally overrides the last row and column
-	if(x<0 || x>=m->xs-1 || y<0 || y>=m->ys-1)
-		return( cellchk == CELL_CHKNOPASS );
+struct map_nth_data {
+	int n; // cells left to skip
+	int16 x, y; // result
+};
 
-	cell = m->cell[x + y*m->xs];
+static bool map_plane_count_sub(uint64 bits, int16 x, int16 y, void* data)
+{
+	*(int*)data += map_popcount(bits);
+	return true;
+}
 
-	switch(cellchk)
-	{
-		// gat type retrieval
-		case CELL_GETTYPE:
-			return map_cell2gat(cell);
+static bool map_plane_nth_sub(uint64 bits, int16 x, int16 y, void* data)
+{
+	struct map_nth_data* nth = (struct map_nth_data*)data;
+	int count = map_popcount(bits);
+	int16 i = 0;
 
-		// base gat type checks
-		case CELL_CHKWALL:
-			return (!cell.walkable && !cell.shootable);
+	if( nth->n >= count ) {
+		nth->n -= count;
+		return true;
+	}
+	for( ; nth->n > 0; nth->n-- )
+		bits &= bits-1; // drop the lowest cells
+	while( !(bits&((uint64)1<<i)) )
+		i++;
+	nth->x = x + i;
+	nth->y = y;
+	return false;
+}
 
-		case CELL_CHKWATER:
-			return (cell.water);
+/// Counts the cells inside the map of the rectangle (x0,y0)-(x1,y1) (inclusive) that match cellchk.
+int map_count_cells(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk)
+{
+	int16 x, y;
+	int count = 0;
 
-		case CELL_CHKCLIFF:
-			return (!cell.walkable && cell.shootable);
+	nullpo_ret(m);
 
+	if( !map_clip_region(m, &x0, &y0, &x1, &y1) )
+		return 0;
 
-		// base cell type checks
-		case CELL_CHKNPC:
-			return (cell.npc);
-		case CELL_CHKBASILICA:
-			return (cell.basilica);
-		case CELL_CHKLANDPROTECTOR:
-			return (cell.landprotector);
-		case CELL_CHKNOVENDING:
-			return (cell.novending);
-		case CELL_CHKNOCHAT:
-			return (cell.nochat);
-		case CELL_CHKMAELSTROM:
-			return (cell.maelstrom);
-		case CELL_CHKICEWALL:
-			return (cell.icewall);
+	for( y = y0; y <= y1; y++ ) {
+		if( map_plane_check(cellchk) )
+			map_plane_row(m, x0, x1, y, cellchk, map_plane_count_sub, &count);
+		else {
+			for( x = x0; x <= x1; x++ )
+				if( map_getcellp(m, x, y, cellchk) )
+					count++;
+		}
+	}
+	return count;
+}
 
-		// special checks
-		case CELL_CHKPASS:
-#ifdef CELL_NOSTACK
-			if (cell.cell_bl >= battle_config.custom_cell_stack_limit) return 0;
-#endif
-		case CELL_CHKREACH:
-			return (cell.walkable);
+/// Finds the n-th cell (starting at 0, row by row) inside the map of the rectangle (x0,y0)-(x1,y1) that matches cellchk.
+/// Use with map_count_cells to pick a random matching cell.
+bool map_nth_cell(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk, int n, int16* x, int16* y)
+{
+	struct map_nth_data nth;
+	int16 i, j;
 
-		case CELL_CHKNOPASS:
-#ifdef CELL_NOSTACK
-			if (cell.cell_bl >= battle_config.custom_cell_stack_limit) return 1;
-#endif
-		case CELL_CHKNOREACH:
-			return (!cell.walkable);
+	nullpo_retr(false, m);
 
-		case CELL_CHKSTACK:
-#ifdef CELL_NOSTACK
-			return (cell.cell_bl >= battle_config.custom_cell_stack_limit);
-#else
-			return 0;
-#endif
+	if( n < 0 || !map_clip_region(m, &x0, &y0, &x1, &y1) )
+		return false;
 
-		default:
-			return 0;
+	nth.n = n;
+	for( j = y0; j <= y1; j++ ) {
+		if( map_plane_check(cellchk) ) {
+			if( !map_plane_row(m, x0, x1, j, cellchk, map_plane_nth_sub, &nth) ) {
+				*x = nth.x;
+				*y = nth.y;
+				return true;
+			}
+		} else {
+			for( i = x0; i <= x1; i++ ) {
+				if( map_getcellp(m, i, j, cellchk) && nth.n-- == 0 ) {
+					*x = i;
+					*y = j;
+					return true;
+				}
+			}
+		}
 	}
+	return false;
 }
 
 /*==========================================
@@ -3112,45 +4202,42 @@ int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk)
  *------------------------------------------*/
 void map_setcell(int16 m, int16 x, int16 y, cell_t cell, bool flag)
 {
-	int j;
+	struct mapcell c;
 
 	if( m < 0 || m >= map_num || x < 0 || x >= map[m].xs || y < 0 || y >= map[m].ys )
 		return;
 
-	j = x + y*map[m].xs;
+	switch( cell ) {
+		case CELL_WALKABLE:  map_plane_set(&map[m], MAP_PLANE_WALKABLE, x, y, flag);  return;
+		case CELL_SHOOTABLE: map_plane_set(&map[m], MAP_PLANE_SHOOTABLE, x, y, flag); return;
+		case CELL_WATER:     map_plane_set(&map[m], MAP_PLANE_WATER, x, y, flag);     return;
+		default:             break;
+	}
 
+	c = *map_cell_get(&map[m], x, y);
 	switch( cell ) {
-		case CELL_WALKABLE:      map[m].cell[j].walkable = flag;      break;
-		case CELL_SHOOTABLE:     map[m].cell[j].shootable = flag;     break;
-		case CELL_WATER:         map[m].cell[j].water = flag;         break;
-
-		case CELL_NPC:           map[m].cell[j].npc = flag;           break;
-		case CELL_BASILICA:      map[m].cell[j].basilica = flag;      break;
-		case CELL_LANDPROTECTOR: map[m].cell[j].landprotector = flag; break;
-		case CELL_NOVENDING:     map[m].cell[j].novending = flag;     break;
-		case CELL_NOCHAT:        map[m].cell[j].nochat = flag;        break;
-		case CELL_MAELSTROM:	 map[m].cell[j].maelstrom = flag;	  break;
-		case CELL_ICEWALL:		 map[m].cell[j].icewall = flag;		  break;
+		case CELL_NPC:           c.npc = flag;           break;
+		case CELL_BASILICA:      c.basilica = flag;      break;
+		case CELL_LANDPROTECTOR: c.landprotector = flag; break;
+		case CELL_NOVENDING:     c.novending = flag;     break;
+		case CELL_NOCHAT:        c.nochat = flag;        break;
+		case CELL_MAELSTROM:	 c.maelstrom = flag;	 break;
+		case CELL_ICEWALL:		 c.icewall = flag;		 break;
 		default:
 			ShowWarning("map_setcell: invalid cell type '%d'\n", (int)cell);
-			break;
+			return;
 	}
+	// don't allocate a block of an instance map for nothing
+	if( memcmp(&c, map_cell_get(&map[m], x, y), sizeof(c)) != 0 )
+		*map_cell_write(&map[m], x, y) = c;
 }
 
 void map_setgatcell(int16 m, int16 x, int16 y, int gat)
 {
-	int j;
-	struct mapcell cell;
-
 	if( m < 0 || m >= map_num || x < 0 || x >= map[m].xs || y < 0 || y >= map[m].ys )
 		return;
 
-	j = x + y*map[m].xs;
-
-	cell = map_gat2cell(gat);
-	map[m].cell[j].walkable = cell.walkable;
-	map[m].cell[j].shootable = cell.shootable;
-	map[m].cell[j].water = cell.water;
+	map_gat2plane(&map[m], x, y, gat);
 }
 
 /*==========================================
@@ -3276,6 +4363,76 @@ static DBData create_map_data_other_server(DBKey key, va_list args)
 	return db_ptr2data(mdos);
 }
 
+/*==========================================
+ * Map handoff between map-servers
+ *------------------------------------------*/
+static int map_handoff_rate = 20; // players moved per run of map_handoff_timer
+static int map_handoff_tid = INVALID_TIMER;
+
+/// Moves the players of the maps handed over to another map-server, a few at a time.
+/// They go through the usual change-map-server flow and keep their position.
+static int map_handoff_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	struct s_mapiterator* iter;
+	struct map_session_data* sd;
+	int* list;
+	int i, count = 0, left = 0;
+
+	map_handoff_tid = INVALID_TIMER;
+	CREATE(list, int, max(map_handoff_rate, 1));
+	iter = mapit_getallusers();
+	for( sd = (TBL_PC*)mapit_first(iter); mapit_exists(iter); sd = (TBL_PC*)mapit_next(iter) ) {
+		if( sd->bl.m < 0 || !map[sd->bl.m].handoff_port )
+			continue;
+		if( sd->state.autotrade )
+			continue; // can't change map-server, stays here
+		if( !sd->state.active || sd->state.warping || pc_isdead(sd) || count >= max(map_handoff_rate, 1) ) {
+			left++; // next run
+			continue;
+		}
+		list[count++] = sd->bl.id;
+	}
+	mapit_free(iter);
+
+	// warping frees the player data, so not while iterating
+	for( i = 0; i < count; i++ ) {
+		if( (sd = map_id2sd(list[i])) != NULL && sd->bl.m >= 0 )
+			pc_setpos(sd, map[sd->bl.m].index, sd->bl.x, sd->bl.y, CLR_TELEPORT);
+	}
+	aFree(list);
+
+	if( left )
+		map_handoff_tid = add_timer(gettick() + 100, map_handoff_timer, 0, 0);
+	return 0;
+}
+
+/// Hands a local map over to another map-server, which has it loaded too, or takes it back
+/// when ip and port are our own. The players on the map are moved there by map_handoff_timer,
+/// players warping to it go there directly (see pc_setpos). Maps that are not loaded here
+/// only get their map-server updated.
+void map_handoff(unsigned short mapindex, uint32 ip, uint16 port)
+{
+	int16 m = map_mapindex2mapid(mapindex);
+
+	if( m < 0 ) {
+		map_setipport(mapindex, ip, port);
+		return;
+	}
+	if( ip == clif_getip() && port == clif_getport() ) {
+		if( map[m].handoff_port )
+			ShowStatus("Map '"CL_WHITE"%s"CL_RESET"' is served by this map-server again.\n", map[m].name);
+		map[m].handoff_ip = 0;
+		map[m].handoff_port = 0;
+		return;
+	}
+
+	map[m].handoff_ip = ip;
+	map[m].handoff_port = port;
+	ShowStatus("Map '"CL_WHITE"%s"CL_RESET"' is handed over to %d.%d.%d.%d:%d, moving its %d players.\n", map[m].name, CONVIP(ip), port, map[m].users);
+	if( map_handoff_tid == INVALID_TIMER )
+		map_handoff_tid = add_timer(gettick() + 100, map_handoff_timer, 0, 0);
+}
+
 /*==========================================
  * Add mapindex to db of another map server
  *------------------------------------------*/
@@ -3337,60 +4494,251 @@ int map_eraseipport(unsigned short mapindex, uint32 ip, uint16 port)
 }
 
 /*==========================================
- * [Shinryo]: Init the mapcache
+ * Map cache files
  *------------------------------------------*/
-static char *map_init_mapcache(FILE *fp)
+
+/// Maps a file into memory read-only, so several map-servers on one host share its pages.
+static bool map_cache_mapfile(const char* path, struct map_cache* mc)
+{
+#ifdef WIN32
+	LARGE_INTEGER size;
+
+	mc->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if( mc->file == INVALID_HANDLE_VALUE )
+		return false;
+	if( !GetFileSizeEx(mc->file, &size) || size.QuadPart == 0
+	||  (mc->mapping = CreateFileMapping(mc->file, NULL, PAGE_READONLY, 0, 0, NULL)) == NULL ) {
+		CloseHandle(mc->file);
+		return false;
+	}
+	if( (mc->data = (char*)MapViewOfFile(mc->mapping, FILE_MAP_READ, 0, 0, 0)) == NULL ) {
+		CloseHandle(mc->mapping);
+		CloseHandle(mc->file);
+		return false;
+	}
+	mc->size = (size_t)size.QuadPart;
+#else
+	struct stat st;
+	void* data;
+	int fd;
+
+	if( (fd = open(path, O_RDONLY)) < 0 )
+		return false;
+	if( fstat(fd, &st) != 0 || st.st_size == 0
+	||  (data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ) {
+		close(fd);
+		return false;
+	}
+	close(fd); // the mapping stays valid
+	mc->data = (char*)data;
+	mc->size = (size_t)st.st_size;
+#endif
+	mc->mapped = true;
+	return true;
+}
+
+/// Reads a whole file into a buffer, used when it can't be mapped.
+/// [Shinryo]: Init the mapcache
+static bool map_cache_readfile(const char* path, struct map_cache* mc)
 {
-	size_t size = 0;
-	char *buffer;
+	FILE* fp;
+	long size;
 
-	// No file open? Return..
-	nullpo_ret(fp);
+	if( (fp = fopen(path, "rb")) == NULL )
+		return false;
 
 	// Get file size
 	fseek(fp, 0, SEEK_END);
 	size = ftell(fp);
 	fseek(fp, 0, SEEK_SET);
+	if( size <= 0 ) {
+		fclose(fp);
+		return false;
+	}
 
-	// Allocate enough space
-	CREATE(buffer, char, size);
+	// Read file into buffer..
+	CREATE(mc->data, char, size);
+	if( fread(mc->data, 1, size, fp) != (size_t)size ) {
+		ShowError("map_cache_readfile: Could not read entire mapcache file\n");
+		aFree(mc->data);
+		mc->data = NULL;
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	mc->size = (size_t)size;
+	mc->mapped = false;
+	return true;
+}
 
-	// No memory? Return..
-	nullpo_ret(buffer);
+static void map_cache_close(struct map_cache* mc)
+{
+	if( mc->index ) {
+		db_destroy(mc->index);
+		mc->index = NULL;
+	}
+	if( mc->data == NULL )
+		return;
+	if( !mc->mapped )
+		aFree(mc->data);
+	else {
+#ifdef WIN32
+		UnmapViewOfFile(mc->data);
+		CloseHandle(mc->mapping);
+		CloseHandle(mc->file);
+#else
+		munmap(mc->data, mc->size);
+#endif
+	}
+	mc->data = NULL;
+	mc->size = 0;
+}
 
-	// Read file into buffer..
-	if(fread(buffer, 1, size, fp) != size) {
-		ShowError("map_init_mapcache: Could not read entire mapcache file\n");
-		return NULL;
+/// Checks the directory of a v2 cache, everything it points to must be inside the file.
+static bool map_cache_check_v2(struct map_cache* mc)
+{
+	const struct map_cache_v2_header* header = (const struct map_cache_v2_header*)mc->data;
+	const struct map_cache_v2_entry* dir;
+	uint32 i;
+
+	if( header->file_size != mc->size || header->dir_offset > mc->size
+	||  (mc->size - header->dir_offset) / sizeof(struct map_cache_v2_entry) < header->map_count )
+		return false;
+
+	dir = (const struct map_cache_v2_entry*)(mc->data + header->dir_offset);
+	for( i = 0; i < header->map_count; i++ ) {
+		const struct map_cache_v2_entry* e = &dir[i];
+		uint64 plane = (uint64)e->stride * (e->ys > 0 ? e->ys : 0);
+
+		if( e->xs <= 0 || e->ys <= 0 || e->stride < (uint32)(e->xs + 7) / 8
+		||  e->offset > mc->size || (mc->size - e->offset) / MAP_CACHE_V2_PLANES < plane )
+			return false;
+		if( i > 0 && strncmp(dir[i-1].name, e->name, MAP_NAME_LENGTH) >= 0 )
+			return false; // not sorted
+	}
+	return true;
+}
+
+/// Builds the name index of a v1 cache, which is a chain of variable-sized entries.
+static bool map_cache_index_v1(struct map_cache* mc)
+{
+	const struct map_cache_main_header* header = (const struct map_cache_main_header*)mc->data;
+	size_t pos = sizeof(struct map_cache_main_header);
+	int i;
+
+	mc->index = strdb_alloc(DB_OPT_BASE, MAP_NAME_LENGTH);
+	for( i = 0; i < header->map_count; i++ ) {
+		struct map_cache_map_info* info = (struct map_cache_map_info*)(mc->data + pos);
+
+		if( mc->size - pos < sizeof(struct map_cache_map_info) || info->len < 0
+		||  mc->size - pos - sizeof(struct map_cache_map_info) < (size_t)info->len )
+			return false;
+		if( strdb_get(mc->index, info->name) == NULL ) // the first entry of a name wins, like the old linear search
+			strdb_put(mc->index, info->name, info);
+		pos += sizeof(struct map_cache_map_info) + info->len;
+	}
+	return true;
+}
+
+/// Opens a map cache file of either format.
+static bool map_cache_open(const char* path, struct map_cache* mc)
+{
+	memset(mc, 0, sizeof(*mc));
+
+	if( !map_cache_mapfile(path, mc) && !map_cache_readfile(path, mc) )
+		return false;
+
+	if( mc->size >= sizeof(struct map_cache_v2_header) && memcmp(mc->data, MAP_CACHE_V2_MAGIC, 4) == 0 ) {
+		mc->version = 2;
+		if( !map_cache_check_v2(mc) ) {
+			ShowError("map_cache_open: '%s' is truncated or corrupted.\n", path);
+			map_cache_close(mc);
+			return false;
+		}
+	} else {
+		mc->version = 1;
+		if( mc->size < sizeof(struct map_cache_main_header) || !map_cache_index_v1(mc) ) {
+			ShowError("map_cache_open: '%s' is truncated or corrupted.\n", path);
+			map_cache_close(mc);
+			return false;
+		}
+	}
+	return true;
+}
+
+static int map_cache_cmp_v2(const void* name, const void* entry)
+{
+	return strncmp((const char*)name, ((const struct map_cache_v2_entry*)entry)->name, MAP_NAME_LENGTH);
+}
+
+/// Copies the bit planes of a v2 entry into the map's planes.
+/// The file stores bit (x&7) of byte x/8, the planes bit (x&63) of word x/64.
+static void map_cache_expand_v2(struct map_data* m, const struct map_cache* mc, const struct map_cache_v2_entry* e)
+{
+	size_t size = (size_t)e->stride * e->ys;
+	int i, x, y;
+
+	for( i = 0; i < MAP_PLANE_MAX; i++ ) {
+		const uint8* src = (const uint8*)mc->data + e->offset + i*size;
+		uint64* dst = m->plane[i];
+
+		for( y = 0; y < m->ys; y++, src += e->stride, dst += m->plane_stride ) {
+			for( x = 0; x < (m->xs+7)/8; x++ )
+				dst[x/8] |= (uint64)src[x]<<((x&7)*8);
+		}
 	}
+}
+
+/// Whether the planes of a v2 entry can be used straight from the mapping, read-only:
+/// the words must be aligned and in host order, and the rows padded like the planes.
+static bool map_cache_inplace_v2(const struct map_cache* mc, const struct map_cache_v2_entry* e, int16 plane_stride)
+{
+	static const uint16 one = 1;
 
-	return buffer;
+	return ( mc->mapped && *(const uint8*)&one == 1 // little endian
+		&& e->stride == (uint32)plane_stride*8 && e->offset%8 == 0 );
 }
 
 /*==========================================
  * Map cache reading
  * [Shinryo]: Optimized some behaviour to speed this up
  *==========================================*/
-int map_readfromcache(struct map_data *m, char *buffer, char *decode_buffer)
+int map_readfromcache(struct map_data *m, struct map_cache *mc, char *decode_buffer)
 {
-	int i;
-	struct map_cache_main_header *header = (struct map_cache_main_header *)buffer;
-	struct map_cache_map_info *info = NULL;
-	char *p = buffer + sizeof(struct map_cache_main_header);
+	unsigned long size, xy;
 
-	for(i = 0; i < header->map_count; i++) {
-		info = (struct map_cache_map_info *)p;
+	if( mc->version == 2 ) {
+		const struct map_cache_v2_header* header = (const struct map_cache_v2_header*)mc->data;
+		const struct map_cache_v2_entry* e = (const struct map_cache_v2_entry*)bsearch(m->name, mc->data + header->dir_offset, header->map_count, sizeof(struct map_cache_v2_entry), map_cache_cmp_v2);
 
-		if( strcmp(m->name, info->name) == 0 )
-			break; // Map found
+		if( e == NULL )
+			return 0; // Not found
 
-		// Jump to next entry..
-		p += sizeof(struct map_cache_map_info) + info->len;
-	}
+		m->xs = e->xs;
+		m->ys = e->ys;
+		size = (unsigned long)e->xs*(unsigned long)e->ys;
+		if( size > MAX_MAP_SIZE ) {
+			ShowWarning("map_readfromcache: %s exceeded MAX_MAP_SIZE of %d\n", m->name, MAX_MAP_SIZE);
+			return 0; // Say not found to remove it from list.. [Shinryo]
+		}
+
+		if( map_cache_inplace_v2(mc, e, (int16)((e->xs + 63)/64)) ) {
+			// shared with the other map-servers on the host; map_plane_set copies a plane before changing it
+			int i;
 
-	if( info && i < header->map_count ) {
-		unsigned long size, xy;
+			map_cell_alloc(m, false);
+			for( i = 0; i < MAP_PLANE_MAX; i++ )
+				m->plane[i] = (uint64*)(mc->data + e->offset + (size_t)i*e->stride*e->ys);
+		} else {
+			map_cell_alloc(m, true);
+			map_cache_expand_v2(m, mc, e);
+		}
+		return 1;
+	} else {
+		const struct map_cache_map_info* info = (const struct map_cache_map_info*)strdb_get(mc->index, m->name);
 
+		if( info == NULL )
+			return 0; // Not found
 		if( info->xs <= 0 || info->ys <= 0 )
 			return 0;// Invalid
 
@@ -3404,18 +4752,15 @@ int map_readfromcache(struct map_data *m, char *buffer, char *decode_buffer)
 		}
 
 		// TO-DO: Maybe handle the scenario, if the decoded buffer isn't the same size as expected? [Shinryo]
-		decode_zip(decode_buffer, &size, p+sizeof(struct map_cache_map_info), info->len);
-
-		CREATE(m->cell, struct mapcell, size);
+		decode_zip(decode_buffer, &size, (const char*)info+sizeof(struct map_cache_map_info), info->len);
 
+		map_cell_alloc(m, true);
 
 		for( xy = 0; xy < size; ++xy )
-			m->cell[xy] = map_gat2cell(decode_buffer[xy]);
+			map_gat2plane(m, (int16)(xy%m->xs), (int16)(xy/m->xs), decode_buffer[xy]);
 
 		return 1;
 	}
-
-	return 0; // Not found
 }
 
 int map_addmap(char* mapname)
@@ -3547,7 +4892,7 @@ int map_readgat (struct map_data* m)
 	m->xs = *(int32*)(gat+6);
 	m->ys = *(int32*)(gat+10);
 	num_cells = m->xs * m->ys;
-	CREATE(m->cell, struct mapcell, num_cells);
+	map_cell_alloc(m, true);
 
 	water_height = map_waterheight(m->name);
 
@@ -3563,7 +4908,7 @@ int map_readgat (struct map_data* m)
 		if( type == 0 && water_height != NO_WATER && height > water_height )
 			type = 3; // Cell is 0 (walkable) but under water level, set to 3 (walkable water)
 
-		m->cell[xy] = map_gat2cell(type);
+		map_gat2plane(m, (int16)(xy%m->xs), (int16)(xy/m->xs), type);
 	}
 
 	aFree(gat);
@@ -3590,15 +4935,12 @@ void map_removemapdb(struct map_data *m)
 int map_readallmaps (void)
 {
 	int i;
-	FILE* fp=NULL;
 	int maps_removed = 0;
-	// Has the uncompressed gat data of all maps, so just one allocation has to be made
-	char *map_cache_buffer[2] = {
-		NULL,
-		NULL
-	};
+	struct map_cache* map_cache = map_caches;
 	char map_cache_decode_buffer[MAX_MAP_SIZE];
 
+	memset(map_caches, 0, sizeof(map_caches));
+
 	if( enable_grf )
 		ShowStatus("Loading maps (using GRF files)...\n");
 	else {
@@ -3610,7 +4952,7 @@ int map_readallmaps (void)
 		for( i = 0; i < 2; i++ ){
 			ShowStatus( "Loading maps (using %s as map cache)...\n", mapcachefilepath[i] );
 
-			if( ( fp = fopen(mapcachefilepath[i], "rb") ) == NULL ){
+			if( !map_cache_open(mapcachefilepath[i], &map_cache[i]) ){
 				if( i == 0 ){
 					ShowFatalError( "Unable to open map cache file "CL_WHITE"%s"CL_RESET"\n", mapcachefilepath[i] );
 					exit(EXIT_FAILURE); //No use launching server if maps can't be read.
@@ -3619,16 +4961,6 @@ int map_readallmaps (void)
 					break;
 				}
 			}
-
-			// Init mapcache data. [Shinryo]
-			map_cache_buffer[i] = map_init_mapcache(fp);
-
-			if( !map_cache_buffer[i] ) {
-				ShowFatalError( "Failed to initialize mapcache data (%s)..\n", mapcachefilepath );
-				exit(EXIT_FAILURE);
-			}
-
-			fclose(fp);
 		}
 	}
 
@@ -3646,13 +4978,13 @@ int map_readallmaps (void)
 		}else{
 			// try to load the map
 			// Read from import first, in case of override
-			if( map_cache_buffer[1] != NULL ){
-				success = map_readfromcache( &map[i], map_cache_buffer[1], map_cache_decode_buffer ) != 0;
+			if( map_cache[1].data != NULL ){
+				success = map_readfromcache( &map[i], &map_cache[1], map_cache_decode_buffer ) != 0;
 			}
 
 			// Nothing was found in import - try to find it in the main file
 			if( !success ){
-				success = map_readfromcache( &map[i], map_cache_buffer[0], map_cache_decode_buffer ) != 0;
+				success = map_readfromcache( &map[i], &map_cache[0], map_cache_decode_buffer ) != 0;
 			}
 		}
 
@@ -3669,10 +5001,7 @@ int map_readallmaps (void)
 		if (uidb_get(map_db,(unsigned int)map[i].index) != NULL)
 		{
 			ShowWarning("Map %s already loaded!"CL_CLL"\n", map[i].name);
-			if (map[i].cell) {
-				aFree(map[i].cell);
-				map[i].cell = NULL;
-			}
+			map_cell_free(&map[i]);
 			map_delmapid(i);
 			maps_removed++;
 			i--;
@@ -3691,6 +5020,8 @@ int map_readallmaps (void)
 		size = map[i].bxs * map[i].bys * sizeof(struct block_list*);
 		map[i].block = (struct block_list**)aCalloc(size, 1);
 		map[i].block_mob = (struct block_list**)aCalloc(size, 1);
+		map[i].block_pc = (struct block_list**)aCalloc(size, 1);
+		map[i].block_item = (int*)aCalloc(map[i].bxs * map[i].bys, sizeof(int));
 	}
 
 	// intialization and configuration-dependent adjustments of mapflags
@@ -3698,10 +5029,11 @@ int map_readallmaps (void)
 
 	if( !enable_grf ) {
 		// The cache isn't needed anymore, so free it. [Shinryo]
-		if( map_cache_buffer[1] != NULL ){
-			aFree(map_cache_buffer[1]);
+		// Mapped v2 caches stay open, the maps read their terrain from them.
+		for( i = 0; i < 2; i++ ) {
+			if( map_cache[i].version != 2 || !map_cache[i].mapped )
+				map_cache_close(&map_cache[i]);
 		}
-		aFree(map_cache_buffer[0]);
 	}
 
 	// finished map loading
@@ -3718,6 +5050,12 @@ int map_readallmaps (void)
 static int map_ip_set = 0;
 static int char_ip_set = 0;
 
+/// Prints a line of perf_show on the console.
+static void map_perf_show(int fd, const char* line)
+{
+	ShowInfo("%s\n", line);
+}
+
 /*==========================================
  * Console Command Parser [Wizputer]
  *------------------------------------------*/
@@ -3779,12 +5117,57 @@ int parse_console(const char* buf){
 	else if( strcmpi("ers_report", type) == 0 ){
 		ers_report();
 	}
+	else if( strcmpi("scriptprof", type) == 0 ){
+		char action[16], file[256];
+		int sample = 0;
+		unsigned int runs = 0;
+
+		action[0] = file[0] = '\0';
+		if( n >= 2 )
+			sscanf(command, "%15s %255[^\n]", action, file);
+		if( strcmpi("on", action) == 0 )
+			script_prof_start(atoi(file));
+		else if( strcmpi("off", action) == 0 )
+			script_prof_stop();
+		else if( strcmpi("reset", action) == 0 )
+			script_prof_reset();
+		else if( strcmpi("dump", action) == 0 )
+			script_prof_dump(file[0] ? file : NULL);
+		ShowInfo("Script profiler is %s, sampling one of every %d runs, %u runs so far.\n", script_prof_status(&sample, &runs) ? "on" : "off", sample, runs);
+	}
+	else if( strcmpi("perf", type) == 0 ){
+		char action[16], file[256];
+
+		action[0] = file[0] = '\0';
+		if( n >= 2 )
+			sscanf(command, "%15s %255[^\n]", action, file);
+		if( strcmpi("on", action) == 0 )
+			perf_enable(true);
+		else if( strcmpi("off", action) == 0 )
+			perf_enable(false);
+		else if( strcmpi("reset", action) == 0 )
+			perf_reset();
+		else if( strcmpi("dump", action) == 0 )
+			perf_dump(file[0] ? file : NULL);
+		perf_show(map_perf_show, 0, 10, NULL);
+	}
+	else if( strcmpi("linkstats", type) == 0 ){
+		if( n == 2 && strcmpi("on", command) == 0 )
+			socket_link_stats(true);
+		else if( n == 2 && strcmpi("off", command) == 0 )
+			socket_link_stats(false);
+		else
+			socket_link_report(20);
+	}
 	else if( strcmpi("help", type) == 0 ) {
 		ShowInfo("Available commands:\n");
 		ShowInfo("\t admin:@<atcommand> => Uses an atcommand. Do NOT use commands requiring an attached player.\n");
 		ShowInfo("\t admin:map:<map> <x> <y> => Changes the map from which console commands are executed.\n");
 		ShowInfo("\t server:shutdown => Stops the server.\n");
 		ShowInfo("\t ers_report => Displays database usage.\n");
+		ShowInfo("\t scriptprof:<on {<sample>}|off|reset|dump {<file>}> => Controls the script profiler.\n");
+		ShowInfo("\t perf:<on|off|reset|show|dump {<file>}> => Controls and shows the main loop performance stats.\n");
+		ShowInfo("\t linkstats:<on|off|show> => Controls and shows the server link statistics.\n");
 	}
 
 	return 0;
@@ -3845,7 +5228,23 @@ int map_config_read(char *cfgName)
 		else if (strcmpi(w1, "map_port") == 0) {
 			clif_setport(atoi(w2));
 			map_port = (atoi(w2));
-		} else if (strcmpi(w1, "map") == 0)
+		} else if (strcmpi(w1, "packet_capture") == 0)
+			clif_setcapture(w2);
+		else if (strcmpi(w1, "perf_stats") == 0)
+			perf_enable(config_switch(w2) != 0);
+		else if (strcmpi(w1, "perf_slow_tick") == 0)
+			perf_set_slow_tick(atoi(w2));
+		else if (strcmpi(w1, "perf_dump_interval") == 0)
+			perf_set_dump_interval(atoi(w2));
+		else if (strcmpi(w1, "perf_dump_file") == 0)
+			perf_set_dump_file(w2);
+		else if (strcmpi(w1, "timer_budget") == 0)
+			timer_set_budget(atoi(w2));
+		else if (strcmpi(w1, "timer_overrun") == 0)
+			timer_set_overrun(atoi(w2));
+		else if (strcmpi(w1, "map_handoff_rate") == 0)
+			map_handoff_rate = max(atoi(w2), 1);
+		else if (strcmpi(w1, "map") == 0)
 			map_addmap(w2);
 		else if (strcmpi(w1, "delmap") == 0)
 			map_delmap(w2);
@@ -4092,20 +5491,17 @@ int map_sql_close(void)
 	Sql_Free(qsmysql_handle);
 	mmysql_handle = NULL;
 	qsmysql_handle = NULL;
-#ifndef BETA_THREAD_TEST
 	if (log_config.sql_logs)
 	{
 		ShowStatus("Close Log DB Connection....\n");
 		Sql_Free(logmysql_handle);
 		logmysql_handle = NULL;
 	}
-#endif
 	return 0;
 }
 
 int log_sql_init(void)
 {
-#ifndef BETA_THREAD_TEST
 	// log db connection
 	logmysql_handle = Sql_Malloc();
 
@@ -4122,7 +5518,6 @@ int log_sql_init(void)
 	if( strlen(default_codepage) > 0 )
 		if ( SQL_ERROR == Sql_SetEncoding(logmysql_handle, default_codepage) )
 			Sql_ShowDebug(logmysql_handle);
-#endif
 	return 0;
 }
 
@@ -4422,9 +5817,12 @@ void do_final(void)
 	map_db->destroy(map_db, map_db_final);
 
 	for (i=0; i<map_num; i++) {
-		if(map[i].cell) aFree(map[i].cell);
+		map_cell_free(&map[i]);
 		if(map[i].block) aFree(map[i].block);
 		if(map[i].block_mob) aFree(map[i].block_mob);
+		if(map[i].block_pc) aFree(map[i].block_pc);
+		if(map[i].block_item) aFree(map[i].block_item);
+		map_objlist_clear(&map[i].pc_list);
 		if(battle_config.dynamic_mobs) { //Dynamic mobs flag by [random]
 			if(map[i].mob_delete_timer != INVALID_TIMER)
 				delete_timer(map[i].mob_delete_timer, map_removemobs_timer);
@@ -4438,6 +5836,13 @@ void do_final(void)
 #endif
 	}
 
+	if (flooritem_expire_queue)
+		aFree(flooritem_expire_queue);
+
+	// after the maps, whose planes may point into them
+	map_cache_close(&map_caches[1]);
+	map_cache_close(&map_caches[0]);
+
 	mapindex_final();
 	if(enable_grf)
 		grfio_final();
@@ -4450,6 +5855,14 @@ void do_final(void)
 	charid_db->destroy(charid_db, NULL);
 	iwall_db->destroy(iwall_db, NULL);
 	regen_db->destroy(regen_db, NULL);
+	map_objlist_clear(&pc_list);
+	map_objlist_clear(&mob_list);
+	map_objlist_clear(&npc_list);
+	ers_destroy(map_iterator_ers);
+	map_idhash_clear(&id_hash);
+	map_idhash_clear(&charid_hash);
+	aFree(object_slots);
+	aFree(object_free);
 
 #ifdef ADJUST_SKILL_DAMAGE
 	ers_destroy(map_skill_damage_ers);
@@ -4705,6 +6118,9 @@ int do_init(int argc, char *argv[])
 	charid_db = uidb_alloc(DB_OPT_BASE);
 	regen_db = idb_alloc(DB_OPT_BASE); // efficient status_natural_heal processing
 	iwall_db = strdb_alloc(DB_OPT_RELEASE_DATA,2*NAME_LENGTH+2+1); // [Zephyrus] Invisible Walls
+	pc_list.slot = 1; // the players keep their position in the list of their map first
+	map_object_ids_init();
+	map_iterator_ers = ers_new(sizeof(struct s_mapiterator), "map.c::map_iterator_ers", ERS_OPT_NONE);
 
 #ifdef ADJUST_SKILL_DAMAGE
 	map_skill_damage_ers = ers_new(sizeof(struct s_skill_damage), "map.c:map_skill_damage_ers", ERS_OPT_NONE);
@@ -4721,8 +6137,9 @@ int do_init(int argc, char *argv[])
 	map_readallmaps();
 
 	add_timer_func_list(map_freeblock_timer, "map_freeblock_timer");
-	add_timer_func_list(map_clearflooritem_timer, "map_clearflooritem_timer");
+	add_timer_func_list(map_flooritem_expire_timer, "map_flooritem_expire_timer");
 	add_timer_func_list(map_removemobs_timer, "map_removemobs_timer");
+	add_timer_func_list(map_handoff_timer, "map_handoff_timer");
 	add_timer_interval(gettick()+1000, map_freeblock_timer, 0, 0, 60*1000);
 	
 	map_do_init_msg();
@@ -391,7 +391,7 @@ struct spawn_data {
 struct flooritem_data {
 	struct block_list bl;
 	unsigned char subx,suby;
-	int cleartimer;
+	unsigned int cleartick; // When the item expires (see map_flooritem_expire_timer)
 	int first_get_charid,second_get_charid,third_get_charid;
 	unsigned int first_get_tick,second_get_tick,third_get_tick;
 	struct item item;
@@ -537,14 +537,23 @@ typedef enum {
 
 } cell_chk;
 
+/// Terrain flags of the map cells, kept as bit planes (one bit per cell).
+/// Rows are padded to whole 64-bit words so that a row segment is tested a word at a time.
+enum map_plane_type {
+	MAP_PLANE_WALKABLE,
+	MAP_PLANE_SHOOTABLE,
+	MAP_PLANE_WATER,
+	MAP_PLANE_MAX
+};
+
+/// Terrain planes of a map, shared by the instances created from it.
+struct map_plane_snapshot {
+	uint64* plane[MAP_PLANE_MAX];
+	int ref; // maps using the snapshot
+};
+
 struct mapcell
 {
-	// terrain flags
-	unsigned char
-		walkable : 1,
-		shootable : 1,
-		water : 1;
-
 	// dynamic flags
 	unsigned char
 		npc : 1,
@@ -560,6 +569,17 @@ struct mapcell
 #endif
 };
 
+/// Dense list of objects, removing one moves the last one into its place.
+/// Objects removed during an iteration (see map_objlist_lock) leave a NULL
+/// hole until the last iteration ends.
+struct map_objlist {
+	struct block_list** data;
+	int count, max;
+	int lock; // iterations in progress
+	bool dirty; // holes were left by removals
+	uint8 slot; // index of the objlist_pos of the players that holds their position in this list
+};
+
 struct iwall_data {
 	char wall_name[50];
 	short m, x, y, size;
@@ -603,9 +623,18 @@ struct questinfo {
 struct map_data {
 	char name[MAP_NAME_LENGTH];
 	uint16 index; // The map index used by the mapindex* functions.
-	struct mapcell* cell; // Holds the information of each map cell (NULL if the map is not on this map-server).
+	struct mapcell* cell; // Holds the information of each map cell (NULL if the map is not on this map-server). Instance maps keep their cells in cell_tiles instead.
+	struct mapcell** cell_tiles; // Instance maps: each block of cells changed since creation (NULL until the first change), unchanged cells are empty.
+	uint64* plane[MAP_PLANE_MAX]; // Terrain bit planes. Instance maps point to the planes of plane_snap until a bit changes.
+	struct map_plane_snapshot* plane_snap; // Source maps: snapshot given to new instances (NULL after a terrain change). Instance maps: the snapshot they read.
+	int16 plane_stride; // Length of a plane row (in 64-bit words)
+	uint8 plane_own; // Bitmask of the planes owned by this map
 	struct block_list **block;
 	struct block_list **block_mob;
+	struct block_list **block_pc; // Players of each block, kept apart so that area broadcasts only walk players
+	int *block_item; // Number of floor items in each block
+	int flooritem_count; // Number of floor items on this map
+	struct map_objlist pc_list; // Players on this map
 	int16 m;
 	int16 xs,ys; // map dimensions (in cells)
 	int16 bxs,bys; // map dimensions (in blocks)
@@ -614,6 +643,8 @@ struct map_data {
 	int users;
 	int users_pvp;
 	int iwall_num; // Total of invisible walls in this map
+	uint32 handoff_ip; // Map-server that serves this map now, see map_handoff (0 if it is served here)
+	uint16 handoff_port;
 	struct map_flag {
 		unsigned town : 1; // [Suggestion to protect Mail System]
 		unsigned autotrade : 1;
@@ -729,6 +760,10 @@ struct map_data_other_server {
 
 int map_getcell(int16 m,int16 x,int16 y,cell_chk cellchk);
 int map_getcellp(struct map_data* m,int16 x,int16 y,cell_chk cellchk);
+bool map_getcell_row(struct map_data* m, int16 x0, int16 x1, int16 y, cell_chk cellchk);
+bool map_getcell_area(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk);
+int map_count_cells(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk);
+bool map_nth_cell(struct map_data* m, int16 x0, int16 y0, int16 x1, int16 y1, cell_chk cellchk, int n, int16* x, int16* y);
 void map_setcell(int16 m, int16 x, int16 y, cell_t cell, bool flag);
 void map_setgatcell(int16 m, int16 x, int16 y, int gat);
 
@@ -791,6 +826,7 @@ int map_moveblock(struct block_list *, int, int, unsigned int);
 int map_foreachinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int type, ...);
 int map_foreachinshootrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int type, ...);
 int map_foreachinarea(int(*func)(struct block_list*, va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, ...);
+int map_foreachflooritem(int(*func)(struct block_list*, va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, ...);
 int map_foreachinshootarea(int(*func)(struct block_list*, va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int type, ...);
 int map_forcountinrange(int (*func)(struct block_list*,va_list), struct block_list* center, int16 range, int count, int type, ...);
 int map_forcountinarea(int (*func)(struct block_list*,va_list), int16 m, int16 x0, int16 y0, int16 x1, int16 y1, int count, int type, ...);
@@ -812,7 +848,7 @@ int map_quit(struct map_session_data *);
 bool map_addnpc(int16 m,struct npc_data *);
 
 // map item
-int map_clearflooritem_timer(int tid, unsigned int tick, int id, intptr_t data);
+int map_flooritem_expire_timer(int tid, unsigned int tick, int id, intptr_t data);
 int map_removemobs_timer(int tid, unsigned int tick, int id, intptr_t data);
 void map_clearflooritem(struct block_list* bl);
 int map_addflooritem(struct item *item, int amount, int16 m, int16 x, int16 y, int first_charid, int second_charid, int third_charid, int flags, unsigned short mob_id);
@@ -845,6 +881,7 @@ int16 map_mapindex2mapid(unsigned short mapindex);
 int16 map_mapname2mapid(const char* name);
 int map_mapname2ipport(unsigned short name, uint32* ip, uint16* port);
 int map_setipport(unsigned short map, uint32 ip, uint16 port);
+void map_handoff(unsigned short mapindex, uint32 ip, uint16 port);
 int map_eraseipport(unsigned short map, uint32 ip, uint16 port);
 int map_eraseallipport(void);
 void map_addiddb(struct block_list *);
@@ -872,6 +909,12 @@ enum e_mapitflags
 //	MAPIT_PCISPLAYING = 1,// Unneeded as pc_db/id_db will only hold auth'ed, active players.
 };
 struct s_mapiterator;
+extern struct map_objlist pc_list; // Online players
+extern struct map_objlist mob_list; // Mobs in the id_db
+extern struct map_objlist npc_list; // NPCs in the id_db
+void map_objlist_lock(struct map_objlist* list);
+void map_objlist_unlock(struct map_objlist* list);
+
 struct s_mapiterator*   mapit_alloc(enum e_mapitflags flags, enum bl_type types);
 void                    mapit_free(struct s_mapiterator* mapit);
 struct block_list*      mapit_first(struct s_mapiterator* mapit);
@@ -952,8 +995,6 @@ typedef struct elemental_data	TBL_ELEM;
 	( ((bl) == (struct block_list*)NULL || (bl)->type != (type_)) ? (T ## type_ *)NULL : (T ## type_ *)(bl) )
 
 
-#ifdef BETA_THREAD_TEST
-
 extern char default_codepage[32];
 extern int map_server_port;
 extern char map_server_ip[32];
@@ -967,8 +1008,6 @@ extern char log_db_id[32];
 extern char log_db_pw[32];
 extern char log_db_db[32];
 
-#endif
-
 #include "../common/sql.h"
 
 extern int db_use_sqldbs;
@@ -9,6 +9,8 @@
 #include "../common/sql.h"
 #include "../common/strlib.h"
 #include "../common/timer.h"
+#include "../common/thread.h"
+#include "../common/mutex.h"
 
 #include "map.h" // mmysql_handle
 #include "mapreg.h"
@@ -21,9 +23,56 @@ static struct eri *mapreg_ers;
 bool skip_insert = false;
 
 static char mapreg_table[32] = "mapreg";
-static bool mapreg_dirty = false; // Whether there are modified regs to be saved
+static DBMap *mapreg_dirty_db; // int64 uid -> enum e_mapreg_op, variables with a pending save operation
+static bool mapreg_save_thread = false; // Whether flushes are executed by a background SQL thread
 
 #define MAPREG_AUTOSAVE_INTERVAL (300*1000)
+#define MAPREG_SAVE_BATCH 500 // Maximum number of rows per multi-row statement
+#define MAPREG_REPORT_INTERVAL 1000 // How often the results of the save thread are checked
+
+/// Pending save operations of a dirty variable
+enum e_mapreg_op {
+	MAPREG_OP_UPSERT = 1, ///< Insert or update the row
+	MAPREG_OP_DELETE,     ///< Remove the row
+};
+
+/// Statements of a single flush, executed inside one transaction
+struct mapreg_flush {
+	char **queries;
+	int count;
+	char *error;      ///< Why the flush failed, NULL if it succeeded
+	struct mapreg_flush *next;
+};
+
+/// Background flush thread
+static struct {
+	rAthread thread;
+	ramutex mutex;
+	racond cond;      ///< Signalled when a flush is queued or on termination
+	racond done;      ///< Signalled when the queue has been drained
+	struct mapreg_flush *head, *tail;
+	struct mapreg_flush *failed; ///< Failed flushes, reported by the main thread
+	bool busy;        ///< A flush is being executed
+	bool terminate;
+	int report_timer; ///< Checks for failed flushes while the thread has work
+} mapreg_flusher;
+
+/**
+ * Queues a save operation for a permanent variable.
+ * Operations on the same variable are coalesced, only the last one is kept.
+ * Nothing is written right away, not even new or deleted variables: the
+ * queued operations are saved together at the next autosave, reload or
+ * shutdown (see script_save_mapreg).
+ *
+ * @param uid: variable's unique identifier
+ * @param op: operation to perform on the next save
+ */
+static void mapreg_mark_dirty(int64 uid, enum e_mapreg_op op)
+{
+	if (skip_insert)
+		return;
+	i64db_iput(mapreg_dirty_db, uid, op);
+}
 
 
 /**
@@ -67,10 +116,6 @@ bool mapreg_setreg(int64 uid, int val)
 	if (val != 0) {
 		if ((m = i64db_get(regs.vars, uid))) {
 			m->u.i = val;
-			if (name[1] != '@') {
-				m->save = true;
-				mapreg_dirty = true;
-			}
 		} else {
 			if (i)
 				script_array_update(&regs, uid, false);
@@ -79,17 +124,13 @@ bool mapreg_setreg(int64 uid, int val)
 
 			m->u.i = val;
 			m->uid = uid;
-			m->save = false;
 			m->is_string = false;
 
-			if (name[1] != '@' && !skip_insert) {// write new variable to database
-				char tmp_str[32 * 2 + 1];
-				Sql_EscapeStringLen(mmysql_handle, tmp_str, name, strnlen(name, 32));
-				if (SQL_ERROR == Sql_Query(mmysql_handle, "INSERT INTO `%s`(`varname`,`index`,`value`) VALUES ('%s','%d','%d')", mapreg_table, tmp_str, i, val))
-					Sql_ShowDebug(mmysql_handle);
-			}
 			i64db_put(regs.vars, uid, m);
 		}
+		if (name[1] != '@') {
+			mapreg_mark_dirty(uid, MAPREG_OP_UPSERT);
+		}
 	} else { // val == 0
 		if (i)
 			script_array_update(&regs, uid, true);
@@ -98,10 +139,8 @@ bool mapreg_setreg(int64 uid, int val)
 		}
 		i64db_remove(regs.vars, uid);
 
-		if (name[1] != '@') {// Remove from database because it is unused.
-			if (SQL_ERROR == Sql_Query(mmysql_handle, "DELETE FROM `%s` WHERE `varname`='%s' AND `index`='%d'", mapreg_table, name, i))
-				Sql_ShowDebug(mmysql_handle);
-		}
+		if (name[1] != '@') // Remove from database because it is unused.
+			mapreg_mark_dirty(uid, MAPREG_OP_DELETE);
 	}
 
 	return true;
@@ -124,10 +163,8 @@ bool mapreg_setregstr(int64 uid, const char* str)
 	if (str == NULL || *str == 0) {
 		if (i)
 			script_array_update(&regs, uid, true);
-		if (name[1] != '@') {
-			if (SQL_ERROR == Sql_Query(mmysql_handle, "DELETE FROM `%s` WHERE `varname`='%s' AND `index`='%d'", mapreg_table, name, i))
-				Sql_ShowDebug(mmysql_handle);
-		}
+		if (name[1] != '@')
+			mapreg_mark_dirty(uid, MAPREG_OP_DELETE);
 		if ((m = i64db_get(regs.vars, uid))) {
 			if (m->u.str != NULL)
 				aFree(m->u.str);
@@ -139,10 +176,6 @@ bool mapreg_setregstr(int64 uid, const char* str)
 			if (m->u.str != NULL)
 				aFree(m->u.str);
 			m->u.str = aStrdup(str);
-			if (name[1] != '@') {
-				mapreg_dirty = true;
-				m->save = true;
-			}
 		} else {
 			if (i)
 				script_array_update(&regs, uid, false);
@@ -151,19 +184,13 @@ bool mapreg_setregstr(int64 uid, const char* str)
 
 			m->uid = uid;
 			m->u.str = aStrdup(str);
-			m->save = false;
 			m->is_string = true;
 
-			if (name[1] != '@' && !skip_insert) { //put returned null, so we must insert.
-				char tmp_str[32 * 2 + 1];
-				char tmp_str2[255 * 2 + 1];
-				Sql_EscapeStringLen(mmysql_handle, tmp_str, name, strnlen(name, 32));
-				Sql_EscapeStringLen(mmysql_handle, tmp_str2, str, strnlen(str, 255));
-				if (SQL_ERROR == Sql_Query(mmysql_handle, "INSERT INTO `%s`(`varname`,`index`,`value`) VALUES ('%s','%d','%s')", mapreg_table, tmp_str, i, tmp_str2))
-					Sql_ShowDebug(mmysql_handle);
-			}
 			i64db_put(regs.vars, uid, m);
 		}
+		if (name[1] != '@') {
+			mapreg_mark_dirty(uid, MAPREG_OP_UPSERT);
+		}
 	}
 
 	return true;
@@ -218,37 +245,275 @@ static void script_load_mapreg(void)
 	SqlStmt_Free(stmt);
 
 	skip_insert = false;
-	mapreg_dirty = false;
+}
+
+/**
+ * Executes the statements of a flush inside a single transaction, so a
+ * failed flush leaves the table untouched (the table must be InnoDB, see
+ * upgrade_20161201.sql).
+ * Doesn't show anything, so it can run on the flush thread; a failure is
+ * kept in flush->error for mapreg_flush_report.
+ *
+ * @param handle: SQL handle to use
+ * @param flush: statements to execute
+ */
+static void mapreg_flush_execute(Sql *handle, struct mapreg_flush *flush)
+{
+	int i;
+
+	if (SQL_ERROR == Sql_QueryStr(handle, "START TRANSACTION"))
+		flush->error = aStrdup(Sql_GetError(handle));
+	for (i = 0; flush->error == NULL && i < flush->count; i++) {
+		if (SQL_ERROR == Sql_QueryStr(handle, flush->queries[i]))
+			flush->error = aStrdup(Sql_GetError(handle));
+	}
+	if (SQL_ERROR == Sql_QueryStr(handle, flush->error == NULL ? "COMMIT" : "ROLLBACK") && flush->error == NULL)
+		flush->error = aStrdup(Sql_GetError(handle));
+}
+
+/**
+ * Frees a flush and its statements.
+ */
+static void mapreg_flush_free(struct mapreg_flush *flush)
+{
+	int i;
+
+	for (i = 0; i < flush->count; i++)
+		aFree(flush->queries[i]);
+	aFree(flush->queries);
+	if (flush->error != NULL)
+		aFree(flush->error);
+	aFree(flush);
+}
+
+/**
+ * Shows the error of a failed flush, on the main thread.
+ */
+static void mapreg_flush_report(struct mapreg_flush *flush)
+{
+	if (flush->error != NULL)
+		ShowError("mapreg_flush_report: Failed to save %d statement(s) to `%s`: %s\n", flush->count, mapreg_table, flush->error);
+}
+
+/**
+ * Reports and frees the flushes the flush thread failed to save.
+ *
+ * @return true if the thread has no more work queued
+ */
+static bool mapreg_flush_report_failed(void)
+{
+	struct mapreg_flush *flush;
+	bool idle;
+
+	ramutex_lock(mapreg_flusher.mutex);
+	flush = mapreg_flusher.failed;
+	mapreg_flusher.failed = NULL;
+	idle = (mapreg_flusher.head == NULL && !mapreg_flusher.busy);
+	ramutex_unlock(mapreg_flusher.mutex);
+
+	while (flush != NULL) {
+		struct mapreg_flush *next = flush->next;
+
+		mapreg_flush_report(flush);
+		mapreg_flush_free(flush);
+		flush = next;
+	}
+	return idle;
+}
+
+/**
+ * Timer event to report the failures of the flush thread while it has work.
+ */
+static int mapreg_flush_report_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	if (mapreg_flush_report_failed()) {
+		delete_timer(mapreg_flusher.report_timer, mapreg_flush_report_timer);
+		mapreg_flusher.report_timer = INVALID_TIMER;
+	}
+	return 0;
+}
+
+/**
+ * Moves the finished statement of a buffer into the flush.
+ */
+static void mapreg_flush_add(struct mapreg_flush *flush, StringBuf *buf)
+{
+	RECREATE(flush->queries, char *, flush->count + 1);
+	flush->queries[flush->count++] = aStrdup(StringBuf_Value(buf));
+	StringBuf_Clear(buf);
+}
+
+/**
+ * Background flush thread: executes queued flushes on its own connection.
+ * It doesn't show anything itself, failed flushes are handed back to the
+ * main thread (mapreg_flush_report_failed).
+ */
+static void *mapreg_flush_main(void *param)
+{
+	Sql *handle = Sql_Malloc();
+	char error[256] = "";
+
+	Sql_SetThreaded(handle);
+	if (SQL_ERROR == Sql_Connect(handle, map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db)) {
+		safesnprintf(error, sizeof(error), "couldn't connect with uname='%s',host='%s',port='%d',database='%s' (%s)",
+			map_server_id, map_server_ip, map_server_port, map_server_db, Sql_GetError(handle));
+		Sql_Free(handle);
+		handle = NULL;
+	} else if (default_codepage[0] != '\0')
+		Sql_SetEncoding(handle, default_codepage); // same as the main connection, which reports a failure
+
+	ramutex_lock(mapreg_flusher.mutex);
+	while (true) {
+		struct mapreg_flush *flush;
+
+		while (mapreg_flusher.head == NULL && !mapreg_flusher.terminate)
+			racond_wait(mapreg_flusher.cond, mapreg_flusher.mutex, -1);
+		if (mapreg_flusher.head == NULL)
+			break; // terminating and nothing left to do
+
+		flush = mapreg_flusher.head;
+		if ((mapreg_flusher.head = flush->next) == NULL)
+			mapreg_flusher.tail = NULL;
+		mapreg_flusher.busy = true;
+		ramutex_unlock(mapreg_flusher.mutex);
+
+		if (handle != NULL)
+			mapreg_flush_execute(handle, flush);
+		else
+			flush->error = aStrdup(error);
+
+		ramutex_lock(mapreg_flusher.mutex);
+		if (flush->error != NULL) {
+			flush->next = mapreg_flusher.failed;
+			mapreg_flusher.failed = flush;
+		} else
+			mapreg_flush_free(flush);
+		mapreg_flusher.busy = false;
+		if (mapreg_flusher.head == NULL)
+			racond_broadcast(mapreg_flusher.done);
+	}
+	ramutex_unlock(mapreg_flusher.mutex);
+
+	if (handle != NULL)
+		Sql_Free(handle);
+	return NULL;
+}
+
+/**
+ * Blocks until the background flush thread has executed every queued flush.
+ */
+static void mapreg_flush_wait(void)
+{
+	if (mapreg_flusher.thread == NULL)
+		return;
+	ramutex_lock(mapreg_flusher.mutex);
+	while (mapreg_flusher.head != NULL || mapreg_flusher.busy)
+		racond_wait(mapreg_flusher.done, mapreg_flusher.mutex, -1);
+	ramutex_unlock(mapreg_flusher.mutex);
+	mapreg_flush_report_failed();
 }
 
 /**
  * Saves permanent variables to database.
+ * Only the dirty variables are visited; they are written with multi-row
+ * upserts/deletes inside one transaction, either synchronously or by the
+ * background flush thread (mapreg_save_thread).
+ * Runs on autosave (every MAPREG_AUTOSAVE_INTERVAL), reload and shutdown,
+ * changes made since the last save are lost if the map-server crashes.
  */
 static void script_save_mapreg(void)
 {
-	if (mapreg_dirty) {
-		DBIterator *iter = db_iterator(regs.vars);
-		struct mapreg_save *m;
-		for (m = dbi_first(iter); dbi_exists(iter); m = dbi_next(iter)) {
-			if (m->save) {
-				int num = script_getvarid(m->uid);
-				int i = script_getvaridx(m->uid);
-				const char* name = get_str(num);
-				if (!m->is_string) {
-					if (SQL_ERROR == Sql_Query(mmysql_handle, "UPDATE `%s` SET `value`='%d' WHERE `varname`='%s' AND `index`='%d' LIMIT 1", mapreg_table, m->u.i, name, i))
-						Sql_ShowDebug(mmysql_handle);
-				} else {
-					char tmp_str2[2 * 255 + 1];
-					Sql_EscapeStringLen(mmysql_handle, tmp_str2, m->u.str, safestrnlen(m->u.str, 255));
-					if (SQL_ERROR == Sql_Query(mmysql_handle, "UPDATE `%s` SET `value`='%s' WHERE `varname`='%s' AND `index`='%d' LIMIT 1", mapreg_table, tmp_str2, name, i))
-						Sql_ShowDebug(mmysql_handle);
-				}
-				m->save = false;
+	DBIterator *iter;
+	DBKey key;
+	DBData *data;
+	StringBuf upsert, remove;
+	int upsert_rows = 0, remove_rows = 0;
+	struct mapreg_flush *flush;
+
+	if (db_size(mapreg_dirty_db) == 0)
+		return;
+
+	CREATE(flush, struct mapreg_flush, 1);
+	StringBuf_Init(&upsert);
+	StringBuf_Init(&remove);
+
+	iter = db_iterator(mapreg_dirty_db);
+	for (data = iter->first(iter, &key); dbi_exists(iter); data = iter->next(iter, &key)) {
+		int64 uid = key.i64;
+		const char* name = get_str(script_getvarid(uid));
+		unsigned int i = script_getvaridx(uid);
+		char esc_name[32 * 2 + 1];
+
+		Sql_EscapeStringLen(mmysql_handle, esc_name, name, strnlen(name, 32));
+
+		if (db_data2i(data) == MAPREG_OP_DELETE) {
+			if (remove_rows == 0)
+				StringBuf_Printf(&remove, "DELETE FROM `%s` WHERE ", mapreg_table);
+			else
+				StringBuf_AppendStr(&remove, " OR ");
+			StringBuf_Printf(&remove, "(`varname`='%s' AND `index`='%u')", esc_name, i);
+			if (++remove_rows == MAPREG_SAVE_BATCH) {
+				mapreg_flush_add(flush, &remove);
+				remove_rows = 0;
+			}
+		} else {
+			struct mapreg_save *m = (struct mapreg_save *)i64db_get(regs.vars, uid);
+
+			if (m == NULL)
+				continue;
+			if (upsert_rows == 0)
+				StringBuf_Printf(&upsert, "INSERT INTO `%s` (`varname`,`index`,`value`) VALUES ", mapreg_table);
+			else
+				StringBuf_AppendStr(&upsert, ",");
+			if (m->is_string) {
+				char esc_value[255 * 2 + 1];
+
+				Sql_EscapeStringLen(mmysql_handle, esc_value, m->u.str, safestrnlen(m->u.str, 255));
+				StringBuf_Printf(&upsert, "('%s','%u','%s')", esc_name, i, esc_value);
+			} else
+				StringBuf_Printf(&upsert, "('%s','%u','%d')", esc_name, i, m->u.i);
+			if (++upsert_rows == MAPREG_SAVE_BATCH) {
+				StringBuf_AppendStr(&upsert, " ON DUPLICATE KEY UPDATE `value`=VALUES(`value`)");
+				mapreg_flush_add(flush, &upsert);
+				upsert_rows = 0;
 			}
 		}
-		dbi_destroy(iter);
-		mapreg_dirty = false;
 	}
+	dbi_destroy(iter);
+	db_clear(mapreg_dirty_db);
+
+	if (remove_rows > 0)
+		mapreg_flush_add(flush, &remove);
+	if (upsert_rows > 0) {
+		StringBuf_AppendStr(&upsert, " ON DUPLICATE KEY UPDATE `value`=VALUES(`value`)");
+		mapreg_flush_add(flush, &upsert);
+	}
+	StringBuf_Destroy(&upsert);
+	StringBuf_Destroy(&remove);
+
+	if (flush->count == 0) {
+		mapreg_flush_free(flush);
+		return;
+	}
+
+	if (mapreg_flusher.thread == NULL) {
+		mapreg_flush_execute(mmysql_handle, flush);
+		mapreg_flush_report(flush);
+		mapreg_flush_free(flush);
+		return;
+	}
+
+	ramutex_lock(mapreg_flusher.mutex);
+	if (mapreg_flusher.tail != NULL)
+		mapreg_flusher.tail->next = flush;
+	else
+		mapreg_flusher.head = flush;
+	mapreg_flusher.tail = flush;
+	ramutex_unlock(mapreg_flusher.mutex);
+	racond_signal(mapreg_flusher.cond);
+
+	if (mapreg_flusher.report_timer == INVALID_TIMER)
+		mapreg_flusher.report_timer = add_timer_interval(gettick() + MAPREG_REPORT_INTERVAL, mapreg_flush_report_timer, 0, 0, MAPREG_REPORT_INTERVAL);
 }
 
 /**
@@ -292,6 +557,7 @@ int mapreg_destroyreg(DBKey key, DBData *data, va_list ap)
 void mapreg_reload(void)
 {
 	script_save_mapreg();
+	mapreg_flush_wait();
 
 	regs.vars->clear(regs.vars, mapreg_destroyreg);
 
@@ -310,7 +576,25 @@ void mapreg_final(void)
 {
 	script_save_mapreg();
 
+	if (mapreg_flusher.thread != NULL) {
+		ramutex_lock(mapreg_flusher.mutex);
+		mapreg_flusher.terminate = true;
+		ramutex_unlock(mapreg_flusher.mutex);
+		racond_signal(mapreg_flusher.cond);
+		rathread_wait(mapreg_flusher.thread, NULL);
+		mapreg_flush_report_failed();
+		if (mapreg_flusher.report_timer != INVALID_TIMER) {
+			delete_timer(mapreg_flusher.report_timer, mapreg_flush_report_timer);
+			mapreg_flusher.report_timer = INVALID_TIMER;
+		}
+		racond_destroy(mapreg_flusher.cond);
+		racond_destroy(mapreg_flusher.done);
+		ramutex_destroy(mapreg_flusher.mutex);
+		mapreg_flusher.thread = NULL;
+	}
+
 	regs.vars->destroy(regs.vars, mapreg_destroyreg);
+	db_destroy(mapreg_dirty_db);
 
 	ers_destroy(mapreg_ers);
 
@@ -324,6 +608,7 @@ void mapreg_final(void)
 void mapreg_init(void)
 {
 	regs.vars = i64db_alloc(DB_OPT_BASE);
+	mapreg_dirty_db = i64db_alloc(DB_OPT_BASE);
 	mapreg_ers = ers_new(sizeof(struct mapreg_save), "mapreg.c:mapreg_ers", ERS_OPT_CLEAN);
 
 	skip_insert = false;
@@ -331,6 +616,21 @@ void mapreg_init(void)
 
 	script_load_mapreg();
 
+	memset(&mapreg_flusher, 0, sizeof(mapreg_flusher));
+	mapreg_flusher.report_timer = INVALID_TIMER;
+	if (mapreg_save_thread) {
+		mapreg_flusher.mutex = ramutex_create();
+		mapreg_flusher.cond = racond_create();
+		mapreg_flusher.done = racond_create();
+		if ((mapreg_flusher.thread = rathread_create(mapreg_flush_main, NULL)) == NULL) {
+			ShowError("mapreg_init: Cannot spawn the save thread, saving synchronously.\n");
+			racond_destroy(mapreg_flusher.cond);
+			racond_destroy(mapreg_flusher.done);
+			ramutex_destroy(mapreg_flusher.mutex);
+		}
+	}
+
+	add_timer_func_list(mapreg_flush_report_timer, "mapreg_flush_report_timer");
 	add_timer_func_list(script_autosave_mapreg, "script_autosave_mapreg");
 	add_timer_interval(gettick() + MAPREG_AUTOSAVE_INTERVAL, script_autosave_mapreg, 0, 0, MAPREG_AUTOSAVE_INTERVAL);
 }
@@ -342,6 +642,8 @@ bool mapreg_config_read(const char* w1, const char* w2)
 {
 	if(!strcmpi(w1, "mapreg_table"))
 		safestrncpy(mapreg_table, w2, sizeof(mapreg_table));
+	else if(!strcmpi(w1, "mapreg_save_thread"))
+		mapreg_save_thread = config_switch(w2) != 0;
 	else
 		return false;
 
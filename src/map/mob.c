@@ -1292,6 +1292,13 @@ static int mob_ai_sub_hard_lootsearch(struct block_list *bl,va_list ap)
 	md = va_arg(ap,struct mob_data *);
 	target = va_arg(ap,struct block_list**);
 
+#ifdef CIRCULAR_AREA
+	if (!check_distance_bl(&md->bl, bl, va_arg(ap,int))) // view range
+		return 0;
+#endif
+	if (!path_search_long(NULL, md->bl.m, md->bl.x, md->bl.y, bl->x, bl->y, CELL_CHKWALL))
+		return 0; // Not in shoot range
+
 	dist = distance_bl(&md->bl, bl);
 	if (mob_can_reach(md,bl,dist+1, MSS_LOOT) && (
 		(*target) == NULL ||
@@ -1729,7 +1736,7 @@ static bool mob_ai_sub_hard(struct mob_data *md, unsigned int tick)
 	if (!tbl && can_move && mode&MD_LOOTER && md->lootitems && DIFF_TICK(tick, md->ud.canact_tick) > 0 &&
 		(md->lootitem_count < LOOTITEM_SIZE || battle_config.monster_loot_type != 1))
 	{	// Scan area for items to loot, avoid trying to loot if the mob is full and can't consume the items.
-		map_foreachinshootrange (mob_ai_sub_hard_lootsearch, &md->bl, view_range, BL_ITEM, md, &tbl);
+		map_foreachflooritem(mob_ai_sub_hard_lootsearch, md->bl.m, md->bl.x - view_range, md->bl.y - view_range, md->bl.x + view_range, md->bl.y + view_range, md, &tbl, view_range);
 	}
 
 	if ((!tbl && mode&MD_AGGRESSIVE) || md->state.skillstate == MSS_FOLLOW)
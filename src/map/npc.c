@@ -74,11 +74,23 @@ int npc_get_new_npc_id(void) {
 }
 
 static DBMap* ev_db; // const char* event_name -> struct event_data*
+static DBMap* ev_label_db; // const char* label_name -> struct event_label*
 static DBMap* npcname_db; // const char* npc_name -> struct npc_data*
 
 struct event_data {
 	struct npc_data *nd;
 	int pos;
+	char name[EVENT_NAME_LENGTH]; // "<npc>::<label>", also the ev_db key
+};
+
+/// All exported events sharing one label name, in export order.
+/// Global events ("::OnInit", "::OnPCLoginEvent", ...) are dispatched from here
+/// instead of walking every entry of ev_db.
+struct event_label {
+	struct event_data **ev;
+	int count, max;
+	int lock; // >0 while being dispatched, removals only clear their slot
+	bool dirty; // cleared slots waiting to be compacted
 };
 
 static struct eri *timer_event_ers; //For the npc timer data. [Skotlex]
@@ -325,6 +337,77 @@ int npc_event_dequeue(struct map_session_data* sd)
 	return 1;
 }
 
+/// Returns the label part of an event name ("<npc>::<label>" -> "<label>").
+static const char* npc_event_labelname(const char* eventname)
+{
+	const char* p = strstr(eventname, "::");
+	return p ? p+2 : eventname;
+}
+
+/// @see DBCreateData
+static DBData npc_event_label_create(DBKey key, va_list args)
+{
+	struct event_label *label;
+	CREATE(label, struct event_label, 1);
+	return db_ptr2data(label);
+}
+
+/// @see DBApply
+static int npc_event_label_free(DBKey key, DBData *data, va_list ap)
+{
+	struct event_label *label = (struct event_label*)db_data2ptr(data);
+	if( label->ev )
+		aFree(label->ev);
+	return 0;
+}
+
+/// Adds an exported event to the index of its label.
+static void npc_event_label_add(struct event_data *ev)
+{
+	struct event_label *label = (struct event_label*)strdb_ensure(ev_label_db, npc_event_labelname(ev->name), npc_event_label_create);
+
+	if( label->count == label->max ) {
+		label->max = label->max ? label->max*2 : 4;
+		RECREATE(label->ev, struct event_data*, label->max);
+	}
+	label->ev[label->count++] = ev;
+}
+
+/// Removes an event from the index of its label, must be called before it is freed.
+static void npc_event_label_remove(struct event_data *ev)
+{
+	struct event_label *label = (struct event_label*)strdb_get(ev_label_db, npc_event_labelname(ev->name));
+	int i;
+
+	if( label == NULL )
+		return;
+	ARR_FIND(0, label->count, i, label->ev[i] == ev);
+	if( i == label->count )
+		return;
+	if( label->lock ) { // being dispatched, compacted once it finishes
+		label->ev[i] = NULL;
+		label->dirty = true;
+		return;
+	}
+	memmove(label->ev+i, label->ev+i+1, sizeof(label->ev[0])*(label->count-i-1));
+	label->count--;
+}
+
+/// Drops the slots cleared while the label was being dispatched.
+static void npc_event_label_unlock(struct event_label *label)
+{
+	int i, j;
+
+	if( --label->lock > 0 || !label->dirty )
+		return;
+	for( i = j = 0; i < label->count; i++ ) {
+		if( label->ev[i] )
+			label->ev[j++] = label->ev[i];
+	}
+	label->count = j;
+	label->dirty = false;
+}
+
 /*==========================================
  * exports a npc event label
  * called from npc_parse_script
@@ -345,11 +428,15 @@ static int npc_event_export(struct npc_data *nd, int i)
 		}
 
 		snprintf(buf, ARRAYLENGTH(buf), "%s::%s", nd->exname, lname);
+		if( (ev = (struct event_data*)strdb_get(ev_db, buf)) != NULL ) // There was already another event of the same name?
+			npc_event_label_remove(ev);
 		// generate the data and insert it
 		CREATE(ev, struct event_data, 1);
 		ev->nd = nd;
 		ev->pos = pos;
-		if (strdb_put(ev_db, buf, ev)) // There was already another event of the same name?
+		safestrncpy(ev->name, buf, sizeof(ev->name));
+		npc_event_label_add(ev);
+		if (strdb_put(ev_db, ev->name, ev))
 			return 1;
 	}
 	return 0;
@@ -359,68 +446,66 @@ int npc_event_sub(struct map_session_data* sd, struct event_data* ev, const char
 
 /**
  * Exec name (NPC events) on player or global
- * Do on all NPC when called with foreach
- * @see DBApply
+ * Runs the label on every NPC that exports it.
+ * @param name Label name, without the "::" prefix
+ * @param rid Player to attach, 0 for none
+ * @return Number of events executed
  */
-int npc_event_doall_sub(DBKey key, DBData *data, va_list ap)
+static int npc_event_doall_label(const char* name, int rid)
 {
-	const char* p = key.str;
-	struct event_data* ev;
-	int* c;
-	const char* name;
-	int rid;
+	struct event_label *label = (struct event_label*)strdb_get(ev_label_db, name);
+	int i, c = 0;
+
+	if( label == NULL )
+		return 0;
 
-	nullpo_ret(ev = (struct event_data*)db_data2ptr(data));
-	nullpo_ret(c = va_arg(ap, int *));
-	nullpo_ret(name = va_arg(ap, const char *));
-	rid = va_arg(ap, int);
+	label->lock++;
+	for( i = 0; i < label->count; i++ ) { // scripts may export or unload events, re-read count and slots
+		struct event_data* ev = label->ev[i];
 
-	p = strchr(p, ':'); // match only the event name
-	if( p && strcmpi(name, p) == 0 /* && !ev->nd->src_id */ ) // Do not run on duplicates. [Paradox924X]
-	{
+		if( ev == NULL /* || ev->nd->src_id */ ) // Do not run on duplicates. [Paradox924X]
+			continue;
 		if(rid) // a player may only have 1 script running at the same time
-			npc_event_sub(map_id2sd(rid),ev,key.str);
+			npc_event_sub(map_id2sd(rid),ev,ev->name);
 		else
 			run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
-		(*c)++;
+		c++;
 	}
+	npc_event_label_unlock(label);
 
-	return 0;
+	return c;
 }
 
 /**
- * @see DBApply
+ * Runs a single "<npc>::<label>" event, the name is matched case-insensitively.
+ * @return Number of events executed
  */
-static int npc_event_do_sub(DBKey key, DBData *data, va_list ap)
+static int npc_event_do_one(const char* name, int rid)
 {
-	const char* p = key.str;
-	struct event_data* ev;
-	int* c, rid;
-	const char* name;
+	struct event_label *label = (struct event_label*)strdb_get(ev_label_db, npc_event_labelname(name));
+	int i, c = 0;
 
-	nullpo_ret(ev = (struct event_data*)db_data2ptr(data));
-	nullpo_ret(c = va_arg(ap, int *));
-	nullpo_ret(name = va_arg(ap, const char *));
-	rid = va_arg(ap, int);
+	if( label == NULL )
+		return 0;
 
-	if( p && strcmpi(name, p) == 0 )
-	{
-		run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
-		(*c)++;
+	label->lock++;
+	for( i = 0; i < label->count; i++ ) {
+		struct event_data* ev = label->ev[i];
+
+		if( ev && strcmpi(name, ev->name) == 0 ) {
+			run_script(ev->nd->u.scr.script,ev->pos,rid,ev->nd->bl.id);
+			c++;
+		}
 	}
+	npc_event_label_unlock(label);
 
-	return 0;
+	return c;
 }
 
 int npc_event_do_id(const char* name, int rid) {
-	int c = 0;
-
 	if( name[0] == ':' && name[1] == ':' )
-		ev_db->foreach(ev_db,npc_event_doall_sub,&c,name,0,rid);
-	else
-		ev_db->foreach(ev_db,npc_event_do_sub,&c,name,rid);
-
-	return c;
+		return npc_event_doall_label(name+2, 0);
+	return npc_event_do_one(name, rid);
 }
 
 // runs the specified event (supports both single-npc and global events)
@@ -437,11 +522,7 @@ int npc_event_doall(const char* name)
 // runs the specified event, with a RID attached (global only)
 int npc_event_doall_id(const char* name, int rid)
 {
-	int c = 0;
-	char buf[EVENT_NAME_LENGTH];
-	safesnprintf(buf, sizeof(buf), "::%s", name);
-	ev_db->foreach(ev_db,npc_event_doall_sub,&c,buf,rid);
-	return c;
+	return npc_event_doall_label(name, rid);
 }
 
 /*==========================================
@@ -2031,18 +2112,23 @@ int npc_remove_map(struct npc_data* nd)
 }
 
 /**
- * @see DBApply
+ * Removes the events exported by a npc.
+ * Only labels of its own label list can have been exported, so those are looked up directly.
  */
-static int npc_unload_ev(DBKey key, DBData *data, va_list ap)
+static void npc_unload_ev(struct npc_data* nd)
 {
-	struct event_data* ev = (struct event_data*)db_data2ptr(data);
-	char* npcname = va_arg(ap, char *);
+	int i;
 
-	if(strcmp(ev->nd->exname,npcname)==0){
-		db_remove(ev_db, key);
-		return 1;
+	for( i = 0; i < nd->u.scr.label_list_num; i++ ) {
+		char buf[EVENT_NAME_LENGTH];
+		struct event_data* ev;
+
+		snprintf(buf, ARRAYLENGTH(buf), "%s::%s", nd->exname, nd->u.scr.label_list[i].name);
+		if( (ev = (struct event_data*)strdb_get(ev_db, buf)) == NULL || strcmp(ev->nd->exname, nd->exname) != 0 )
+			continue;
+		npc_event_label_remove(ev);
+		strdb_remove(ev_db, buf);
 	}
-	return 0;
 }
 
 //Chk if npc matches src_id, then unload.
@@ -2057,10 +2143,21 @@ static int npc_unload_dup_sub(struct npc_data* nd, va_list args)
 	return 0;
 }
 
+//Reports a duplicate that survived npc_unload_duplicates.
+static int npc_check_dup_sub(struct npc_data* nd, va_list args)
+{
+	struct npc_data* src_nd = va_arg(args, struct npc_data*);
+
+	if (nd->src_id == src_nd->bl.id)
+		ShowError("npc_unload_duplicates: Duplicate '%s' of '%s' was not unloaded.\n", nd->exname, src_nd->exname);
+	return 0;
+}
+
 //Removes all npcs that are duplicates of the passed one. [Skotlex]
 void npc_unload_duplicates(struct npc_data* nd)
 {
 	map_foreachnpc(npc_unload_dup_sub,nd->bl.id);
+	map_foreachnpc(npc_check_dup_sub,nd);
 }
 
 //Removes an npc from map and db.
@@ -2102,7 +2199,7 @@ int npc_unload(struct npc_data* nd, bool single) {
 		struct block_list* bl;
 
 		if( single )
-			ev_db->foreach(ev_db,npc_unload_ev,nd->exname); //Clean up all events related
+			npc_unload_ev(nd); //Clean up all events related
 
 		iter = mapit_geteachpc();
 		for( bl = (struct block_list*)mapit_first(iter); mapit_exists(iter); bl = (struct block_list*)mapit_next(iter) ) {
@@ -2128,9 +2225,9 @@ int npc_unload(struct npc_data* nd, bool single) {
 				ers_free(timer_event_ers, (void*)td->data);
 			delete_timer(nd->u.scr.timerid, npc_timerevent);
 		}
-		if (nd->u.scr.timer_event)
-			aFree(nd->u.scr.timer_event);
 		if (nd->src_id == 0) {
+			if (nd->u.scr.timer_event)
+				aFree(nd->u.scr.timer_event);
 			if(nd->u.scr.script) {
 				script_free_code(nd->u.scr.script);
 				nd->u.scr.script = NULL;
@@ -3106,6 +3203,8 @@ const char* npc_parse_duplicate(char* w1, char* w2, char* w3, char* w4, const ch
 			nd->u.scr.script = dnd->u.scr.script;
 			nd->u.scr.label_list = dnd->u.scr.label_list;
 			nd->u.scr.label_list_num = dnd->u.scr.label_list_num;
+			nd->u.scr.timer_event = dnd->u.scr.timer_event;
+			nd->u.scr.timeramount = dnd->u.scr.timeramount;
 			break;
 
 		case NPCTYPE_SHOP:
@@ -3157,12 +3256,12 @@ const char* npc_parse_duplicate(char* w1, char* w2, char* w3, char* w4, const ch
 
 	//-----------------------------------------
 	// Loop through labels to export them as necessary
+	// (the OnTimer list is shared with the source npc)
 	for (i = 0; i < nd->u.scr.label_list_num; i++) {
 		if (npc_event_export(nd, i)) {
 			ShowWarning("npc_parse_duplicate : duplicate event %s::%s (%s)\n",
 			             nd->exname, nd->u.scr.label_list[i].name, filepath);
 		}
-		npc_timerevent_export(nd, i);
 	}
 
 	if(!strcmp(filepath,"INSTANCING")) //Instance NPCs will use this for commands
@@ -4401,35 +4500,27 @@ void npc_read_event_script(void)
 
 	for (i = 0; i < NPCE_MAX; i++)
 	{
-		DBIterator* iter;
-		DBKey key;
-		DBData *data;
-		char name[EVENT_NAME_LENGTH];
-
-		safesnprintf(name,EVENT_NAME_LENGTH,"::%s",config[i].event_name);
+		struct event_label *label = (struct event_label*)strdb_get(ev_label_db, config[i].event_name);
+		int j;
 
 		script_event[i].event_count = 0;
-		iter = db_iterator(ev_db);
-		for( data = iter->first(iter,&key); iter->exists(iter); data = iter->next(iter,&key) )
+		for( j = 0; label && j < label->count; j++ )
 		{
-			const char* p = key.str;
-			struct event_data* ed = (struct event_data*)db_data2ptr(data);
+			struct event_data* ed = label->ev[j];
 			unsigned char count = script_event[i].event_count;
 
+			if( ed == NULL )
+				continue;
 			if( count >= ARRAYLENGTH(script_event[i].event) )
 			{
 				ShowWarning("npc_read_event_script: too many occurences of event '%s'!\n", config[i].event_name);
 				break;
 			}
 
-			if( (p=strchr(p,':')) && p && strcmpi(name,p)==0 )
-			{
-				script_event[i].event[count] = ed;
-				script_event[i].event_name[count] = key.str;
-				script_event[i].event_count++;
-			}
+			script_event[i].event[count] = ed;
+			script_event[i].event_name[count] = ed->name;
+			script_event[i].event_count++;
 		}
-		dbi_destroy(iter);
 	}
 
 	if (battle_config.etc_log) {
@@ -4468,6 +4559,7 @@ int npc_reload(void) {
 
 	db_clear(npcname_db);
 	db_clear(ev_db);
+	ev_label_db->clear(ev_label_db, npc_event_label_free);
 
 	//Remove all npcs/mobs. [Skotlex]
 
@@ -4585,6 +4677,7 @@ bool npc_unloadfile( const char* path ) {
 void do_clear_npc(void) {
 	db_clear(npcname_db);
 	db_clear(ev_db);
+	ev_label_db->clear(ev_label_db, npc_event_label_free);
 }
 
 /*==========================================
@@ -4593,6 +4686,7 @@ void do_clear_npc(void) {
 void do_final_npc(void) {
 	npc_clear_pathlist();
 	ev_db->destroy(ev_db, NULL);
+	ev_label_db->destroy(ev_label_db, npc_event_label_free);
 	npcname_db->destroy(npcname_db, NULL);
 	npc_path_db->destroy(npc_path_db, NULL);
 #if PACKETVER >= 20131223
@@ -4651,7 +4745,8 @@ void do_init_npc(void){
 	for( i = MAX_NPC_CLASS2_START; i < MAX_NPC_CLASS2_END; i++ )
 		npc_viewdb2[i - MAX_NPC_CLASS2_START].class_ = i;
 
-	ev_db = strdb_alloc((DBOptions)(DB_OPT_DUP_KEY|DB_OPT_RELEASE_DATA), EVENT_NAME_LENGTH);
+	ev_db = strdb_alloc(DB_OPT_RELEASE_DATA, EVENT_NAME_LENGTH);
+	ev_label_db = stridb_alloc((DBOptions)(DB_OPT_DUP_KEY|DB_OPT_RELEASE_DATA), NAME_LENGTH);
 	npcname_db = strdb_alloc(DB_OPT_BASE, NPC_NAME_LENGTH+1);
 	npc_path_db = strdb_alloc(DB_OPT_BASE|DB_OPT_DUP_KEY|DB_OPT_RELEASE_DATA,80);
 #if PACKETVER >= 20131223
@@ -47,6 +47,7 @@ struct npc_data {
 	char name[NPC_NAME_LENGTH+1];// display name
 	char exname[NPC_NAME_LENGTH+1];// unique npc name
 	int chat_id,touching_id;
+	int objlist_pos; // Position in npc_list
 	unsigned int next_walktime;
 
 	unsigned size : 2;
@@ -61,6 +61,18 @@
  *  deletes a pset
  */
 
+// JIT compilation of patterns, available since PCRE 8.20
+#ifdef PCRE_STUDY_JIT_COMPILE
+	#define NPC_CHAT_STUDY_OPTIONS PCRE_STUDY_JIT_COMPILE
+	#define npc_chat_free_study(extra) pcre_free_study(extra)
+#else
+	#define NPC_CHAT_STUDY_OPTIONS 0
+	#define npc_chat_free_study(extra) pcre_free(extra)
+#endif
+
+// Number of $@pN$ variables set on a match ($@p0$ through $@p9$)
+#define NPC_CHAT_MAX_VARS 10
+
 /* Structure containing all info associated with a single pattern block */
 struct pcrematch_entry {
 	struct pcrematch_entry* next;
@@ -68,6 +80,8 @@ struct pcrematch_entry {
 	pcre* pcre_;
 	pcre_extra* pcre_extra_;
 	char* label;
+	int capture_count; // number of capturing groups in the pattern
+	bool combinable; // whether the pattern can be part of the combined matcher
 };
 
 /* A set of patterns that can be activated and deactived with a single command */
@@ -90,6 +104,16 @@ struct pcrematch_set {
 struct npc_parse {
 	struct pcrematch_set* active;
 	struct pcrematch_set* inactive;
+
+	// Combined matcher of all active patterns, rebuilt when the sets change
+	bool dirty;
+	pcre* combined;
+	pcre_extra* combined_extra;
+	struct pcrematch_entry** entries; // active patterns in priority order
+	int* bases; // group number wrapping each entry in the combined pattern
+	int entry_count;
+	int* ovector;
+	int ovecsize;
 };
 
 
@@ -101,11 +125,61 @@ struct npc_parse {
 void finalize_pcrematch_entry(struct pcrematch_entry* e)
 {
 	pcre_free(e->pcre_);
-	pcre_free(e->pcre_extra_);
+	if (e->pcre_extra_ != NULL)
+		npc_chat_free_study(e->pcre_extra_);
 	aFree(e->pattern);
 	aFree(e->label);
 }
 
+/**
+ * free the combined matcher of a NPC, it will be rebuilt on the next message
+ */
+static void npc_chat_clear_matcher(struct npc_parse* npcParse)
+{
+	if (npcParse->combined != NULL)
+		pcre_free(npcParse->combined);
+	if (npcParse->combined_extra != NULL)
+		npc_chat_free_study(npcParse->combined_extra);
+	if (npcParse->entries != NULL)
+		aFree(npcParse->entries);
+	if (npcParse->bases != NULL)
+		aFree(npcParse->bases);
+	if (npcParse->ovector != NULL)
+		aFree(npcParse->ovector);
+	npcParse->combined = NULL;
+	npcParse->combined_extra = NULL;
+	npcParse->entries = NULL;
+	npcParse->bases = NULL;
+	npcParse->ovector = NULL;
+	npcParse->entry_count = 0;
+	npcParse->ovecsize = 0;
+	npcParse->dirty = true;
+}
+
+/**
+ * check whether a pattern keeps its meaning when embedded in another one
+ *
+ * numbered back references, subroutine calls and named groups refer to
+ * group numbers/names that shift once the pattern is combined.
+ */
+static bool pcrematch_entry_combinable(struct pcrematch_entry* e)
+{
+	int backrefmax = 0, namecount = 0;
+	const char* p;
+
+	if (pcre_fullinfo(e->pcre_, NULL, PCRE_INFO_BACKREFMAX, &backrefmax) != 0 || backrefmax > 0)
+		return false;
+	if (pcre_fullinfo(e->pcre_, NULL, PCRE_INFO_NAMECOUNT, &namecount) != 0 || namecount > 0)
+		return false;
+	if (strstr(e->pattern, "\\g") != NULL || strstr(e->pattern, "(?R") != NULL)
+		return false;
+	for (p = strstr(e->pattern, "(?"); p != NULL; p = strstr(p + 2, "(?")) {
+		if (ISDIGIT(p[2]) || p[2] == '+' || (p[2] == '-' && ISDIGIT(p[3])))
+			return false;
+	}
+	return true;
+}
+
 /**
  * Lookup (and possibly create) a new set of patterns by the set id
  */
@@ -164,6 +238,7 @@ static void activate_pcreset(struct npc_data* nd, int setid)
 	}
 	if (pcreset == NULL)
 		return; // not in inactive list
+	npc_chat_clear_matcher(npcParse);
 	if (pcreset->next != NULL)
 		pcreset->next->prev = pcreset->prev;
 	if (pcreset->prev != NULL)
@@ -202,6 +277,7 @@ static void deactivate_pcreset(struct npc_data* nd, int setid)
 	}
 	if (pcreset == NULL)
 		return; // not in active list
+	npc_chat_clear_matcher(npcParse);
 	if (pcreset->next != NULL)
 		pcreset->next->prev = pcreset->prev;
 	if (pcreset->prev != NULL)
@@ -244,6 +320,7 @@ static void delete_pcreset(struct npc_data* nd, int setid)
 	if (pcreset == NULL) 
 		return;
 	
+	npc_chat_clear_matcher(npcParse);
 	if (pcreset->next != NULL)
 		pcreset->next->prev = pcreset->prev;
 	if (pcreset->prev != NULL)
@@ -309,7 +386,114 @@ void npc_chat_def_pattern(struct npc_data* nd, int setid, const char* pattern, c
 	e->pattern = aStrdup(pattern);
 	e->label = aStrdup(label);
 	e->pcre_ = pcre_compile(pattern, PCRE_CASELESS, &err, &erroff, NULL);
-	e->pcre_extra_ = pcre_study(e->pcre_, 0, &err);
+	if (e->pcre_ == NULL) {
+		ShowWarning("npc_chat_def_pattern: Invalid pattern '%s' in NPC '%s' (%s at offset %d).\n", pattern, nd->exname, err, erroff);
+		e->pcre_ = pcre_compile("(*FAIL)", 0, &err, &erroff, NULL); // never matches
+	}
+	e->pcre_extra_ = pcre_study(e->pcre_, NPC_CHAT_STUDY_OPTIONS, &err);
+	if (pcre_fullinfo(e->pcre_, NULL, PCRE_INFO_CAPTURECOUNT, &e->capture_count) != 0)
+		e->capture_count = 0;
+	e->combinable = pcrematch_entry_combinable(e);
+	npc_chat_clear_matcher((struct npc_parse *) nd->chatdb);
+}
+
+/**
+ * build the combined matcher of all active patterns
+ *
+ * every active pattern becomes one alternative of a single anchored
+ * expression: ^(?:(?s:.*?)(p1)|(?s:.*?)(p2)|...)
+ * alternatives are tried in order, so the first pattern matching anywhere
+ * in the message wins, just like when the patterns are tried one by one.
+ * if a pattern can't be combined the matcher is left unset and the
+ * patterns are matched one by one instead.
+ */
+static void npc_chat_build_matcher(struct npc_parse* npcParse)
+{
+	struct pcrematch_set* pcreset;
+	struct pcrematch_entry* e;
+	StringBuf buf;
+	const char *err;
+	int erroff, count = 0, group = 1, capture_count = 0;
+
+	npc_chat_clear_matcher(npcParse);
+	npcParse->dirty = false;
+
+	for (pcreset = npcParse->active; pcreset != NULL; pcreset = pcreset->next) {
+		for (e = pcreset->head; e != NULL; e = e->next) {
+			if (!e->combinable)
+				return;
+			count++;
+		}
+	}
+	if (count < 2)
+		return; // nothing to gain over the single pattern
+
+	CREATE(npcParse->entries, struct pcrematch_entry*, count);
+	CREATE(npcParse->bases, int, count);
+	StringBuf_Init(&buf);
+	StringBuf_AppendStr(&buf, "^(?:");
+	for (pcreset = npcParse->active; pcreset != NULL; pcreset = pcreset->next) {
+		for (e = pcreset->head; e != NULL; e = e->next) {
+			if (npcParse->entry_count > 0)
+				StringBuf_AppendStr(&buf, "|");
+			StringBuf_Printf(&buf, "(?s:.*?)(%s)", e->pattern);
+			npcParse->entries[npcParse->entry_count] = e;
+			npcParse->bases[npcParse->entry_count] = group;
+			npcParse->entry_count++;
+			group += 1 + e->capture_count;
+		}
+	}
+	StringBuf_AppendStr(&buf, ")");
+
+	npcParse->combined = pcre_compile(StringBuf_Value(&buf), PCRE_CASELESS, &err, &erroff, NULL);
+	StringBuf_Destroy(&buf);
+	if (npcParse->combined == NULL
+	||  pcre_fullinfo(npcParse->combined, NULL, PCRE_INFO_CAPTURECOUNT, &capture_count) != 0
+	||  capture_count != group - 1
+	) {// a pattern didn't survive being embedded, fall back to matching one by one
+		npc_chat_clear_matcher(npcParse);
+		npcParse->dirty = false;
+		return;
+	}
+	npcParse->combined_extra = pcre_study(npcParse->combined, NPC_CHAT_STUDY_OPTIONS, &err);
+	npcParse->ovecsize = 3 * group;
+	CREATE(npcParse->ovector, int, npcParse->ovecsize);
+}
+
+/**
+ * run the label of a matched pattern
+ *
+ * @param offsets match offsets, the whole match of the pattern is at group 'base'
+ * @param base group number of the whole match
+ * @param count number of $@pN$ variables to set
+ */
+static void npc_chat_run_match(struct npc_data* nd, struct map_session_data* sd, struct pcrematch_entry* e, const char* msg, const int* offsets, int base, int count)
+{
+	struct npc_label_list* lst;
+	int i;
+
+	// save out the matched strings
+	for (i = 0; i < count; i++)
+	{
+		char var[6], val[255];
+		int start = offsets[2*(base+i)], end = offsets[2*(base+i)+1];
+		int len = ( start < 0 ) ? 0 : min(end - start, (int)sizeof(val) - 1);
+		snprintf(var, sizeof(var), "$@p%i$", i);
+		memcpy(val, msg + max(start,0), len);
+		val[len] = '\0';
+		set_var(sd, var, val);
+	}
+
+	// find the target label.. this sucks..
+	lst = nd->u.scr.label_list;
+	ARR_FIND(0, nd->u.scr.label_list_num, i, strncmp(lst[i].name, e->label, sizeof(lst[i].name)) == 0);
+	if (i == nd->u.scr.label_list_num) {
+		ShowWarning("Unable to find label: %s\n", e->label);
+		return;
+	}
+
+	// run the npc script
+	run_script(nd->u.scr.script,lst[i].pos,sd->bl.id,nd->bl.id);
 }
 
 /**
@@ -330,6 +514,8 @@ void npc_chat_finalize(struct npc_data* nd)
 	while(npcParse->inactive)
 		delete_pcreset(nd, npcParse->inactive->setid);
 	
+	npc_chat_clear_matcher(npcParse);
+
 	// Additional cleaning up [Lance]
 	aFree(npcParse);
 }
@@ -344,7 +530,6 @@ int npc_chat_sub(struct block_list* bl, va_list ap)
 	char* msg;
 	int len, i;
 	struct map_session_data* sd;
-	struct npc_label_list* lst;
 	struct pcrematch_set* pcreset;
 	struct pcrematch_entry* e;
 	
@@ -356,37 +541,41 @@ int npc_chat_sub(struct block_list* bl, va_list ap)
 	len = va_arg(ap,int);
 	sd = va_arg(ap,struct map_session_data *);
 	
+	if (npcParse->dirty)
+		npc_chat_build_matcher(npcParse);
+
+	// single pass over all active patterns
+	if (npcParse->combined != NULL)
+	{
+		int r = pcre_exec(npcParse->combined, npcParse->combined_extra, msg, len, 0, 0, npcParse->ovector, npcParse->ovecsize);
+		if (r <= 0)
+			return 0;
+
+		// the matched alternative is the one whose wrapping group is set
+		ARR_FIND(0, npcParse->entry_count, i, npcParse->ovector[2*npcParse->bases[i]] >= 0);
+		if (i == npcParse->entry_count)
+			return 0;
+		e = npcParse->entries[i];
+		// set the variables up to the highest matched group, like pcre_exec reports it
+		for (r = min(e->capture_count, NPC_CHAT_MAX_VARS - 1); r > 0 && npcParse->ovector[2*(npcParse->bases[i]+r)] < 0; r--)
+			;
+		npc_chat_run_match(nd, sd, e, msg, npcParse->ovector, npcParse->bases[i], r + 1);
+		return 0;
+	}
+
 	// iterate across all active sets
 	for (pcreset = npcParse->active; pcreset != NULL; pcreset = pcreset->next)
 	{
 		// interate across all patterns in that set
 		for (e = pcreset->head; e != NULL; e = e->next)
 		{
-			int offsets[2*10 + 10]; // 1/3 reserved for temp space requred by pcre_exec
+			int offsets[2*NPC_CHAT_MAX_VARS + NPC_CHAT_MAX_VARS]; // 1/3 reserved for temp space requred by pcre_exec
 			
 			// perform pattern match
 			int r = pcre_exec(e->pcre_, e->pcre_extra_, msg, len, 0, 0, offsets, ARRAYLENGTH(offsets));
 			if (r > 0)
 			{
-				// save out the matched strings
-				for (i = 0; i < r; i++)
-				{
-					char var[6], val[255];
-					snprintf(var, sizeof(var), "$@p%i$", i);
-					pcre_copy_substring(msg, offsets, r, i, val, sizeof(val));
-					set_var(sd, var, val);
-				}
-				
-				// find the target label.. this sucks..
-				lst = nd->u.scr.label_list;
-				ARR_FIND(0, nd->u.scr.label_list_num, i, strncmp(lst[i].name, e->label, sizeof(lst[i].name)) == 0);
-				if (i == nd->u.scr.label_list_num) {
-					ShowWarning("Unable to find label: %s\n", e->label);
-					return 0;
-				}
-				
-				// run the npc script
-				run_script(nd->u.scr.script,lst[i].pos,sd->bl.id,nd->bl.id);
+				npc_chat_run_match(nd, sd, e, msg, offsets, 0, r);
 				return 0;
 			}
 		}
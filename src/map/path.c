@@ -127,12 +127,16 @@ int path_blownpos(int16 m,int16 x0,int16 y0,int16 dx,int16 dy,int count)
 
 /*==========================================
  * is ranged attack from (x0,y0) to (x1,y1) possible?
+ * The cells between both ends are checked one row segment at a time, so
+ * on failure spd may go on up to the end of the segment that failed.
  *------------------------------------------*/
 bool path_search_long(struct shootpath_data *spd,int16 m,int16 x0,int16 y0,int16 x1,int16 y1,cell_chk cell)
 {
 	int dx, dy;
 	int wx = 0, wy = 0;
 	int weight;
+	int16 sx = 0, sy = 0, ex = 0; // row segment waiting to be checked
+	bool segment = false;
 	struct map_data *md;
 	struct shootpath_data s_spd;
 
@@ -185,10 +189,22 @@ bool path_search_long(struct shootpath_data *spd,int16 m,int16 x0,int16 y0,int16
 			spd->y[spd->len] = y0;
 			spd->len++;
 		}
-		if ((x0 != x1 || y0 != y1) && map_getcellp(md,x0,y0,cell))
+		if (x0 == x1 && y0 == y1)
+			break; // the target cell isn't checked
+		if (segment && y0 == sy) { // x moves by one each step while y stays the same
+			ex = x0;
+			continue;
+		}
+		if (segment && map_getcell_row(md,sx,ex,sy,cell))
 			return false;
+		sx = ex = x0;
+		sy = y0;
+		segment = true;
 	}
 
+	if (segment && map_getcell_row(md,sx,ex,sy,cell))
+		return false;
+
 	return true;
 }
 
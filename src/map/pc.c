@@ -1074,6 +1074,7 @@ bool pc_authok(struct map_session_data *sd, uint32 login_id2, time_t expiration_
 
 	sd->login_id2 = login_id2;
 	sd->group_id = group_id;
+	clif_capture_auth(sd, group_id, st);
 
 	/* load user permissions */
 	pc_group_pc_load(sd);
@@ -5351,6 +5352,8 @@ enum e_setpos pc_setpos(struct map_session_data* sd, unsigned short mapindex, in
 	}
 
 	m = map_mapindex2mapid(mapindex);
+	if( m >= 0 && map[m].handoff_port ) // served by another map-server now, see map_handoff
+		m = -1;
 
 	sd->state.changemap = (sd->mapindex != mapindex);
 	sd->state.warping = 1;
@@ -179,6 +179,14 @@ enum npc_timeout_type {
 	NPCT_WAIT  = 2,
 };
 
+/// Item lists whose encoded records are kept per player, see clif_item_cache_clear
+enum e_item_cache {
+	ITEMCACHE_INVENTORY = 0,
+	ITEMCACHE_CART,
+	ITEMCACHE_STORAGE, ///< Shared by the storage, premium storages and guild storage, freed when the window closes
+	ITEMCACHE_MAX
+};
+
 /// Item Group heal rate struct
 struct s_pc_itemgrouphealrate {
 	uint16 group_id; /// Item Group ID
@@ -259,6 +267,7 @@ struct map_session_data {
 		uint8 isBoundTrading; // Player is currently add bound item to trade list [Cydh]
 		bool ignoretimeout; // Prevent the SECURE_NPCTIMEOUT function from closing current script.
 		unsigned int workinprogress : 2; // See clif.h::e_workinprogress
+		unsigned int packet_held : 1; // Packet at the head of the receive buffer passed Gepard but is waiting for its bucket
 	} state;
 	struct {
 		unsigned char no_weapon_damage, no_magic_damage, no_misc_damage;
@@ -280,6 +289,7 @@ struct map_session_data {
 	int count_rewarp; //count how many time we being rewarped
 
 	int langtype;
+	struct s_packet_bucket packet_bucket[PACKET_CLASS_MAX]; // Client packet scheduler, see clif_parse
 	uint32 packet_ver;  // 5: old, 6: 7july04, 7: 13july04, 8: 26july04, 9: 9aug04/16aug04/17aug04, 10: 6sept04, 11: 21sept04, 12: 18oct04, 13: 25oct04 ... 18
 	struct mmo_charstatus status;
 
@@ -289,10 +299,12 @@ struct map_session_data {
 	struct s_storage cart;
 
 	struct item_data* inventory_data[MAX_INVENTORY]; // direct pointers to itemdb entries (faster than doing item_id lookups)
+	struct s_item_cache* item_cache[ITEMCACHE_MAX]; // encoded item list records per slot, allocated when the list is first sent
 	short equip_index[EQI_MAX];
 	unsigned int weight,max_weight,add_max_weight;
 	int cart_weight,cart_num,cart_weight_max;
 	int fd;
+	int objlist_pos[2]; // Position in the player list of its map and in the online player list (see struct map_objlist)
 	unsigned short mapindex;
 	unsigned char head_dir; //0: Look forward. 1: Look right, 2: Look left.
 	unsigned int client_tick;
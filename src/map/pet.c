@@ -1137,7 +1137,7 @@ static int pet_ai_sub_hard(struct pet_data *pd, struct map_session_data *sd, uns
 
 	if(!target && pd->loot && pd->loot->count < pd->loot->max && DIFF_TICK(tick,pd->ud.canact_tick) > 0) {
 		// Use half the pet's range of sight.
-		map_foreachinrange(pet_ai_sub_hard_lootsearch, &pd->bl, pd->db->range2 / 2, BL_ITEM, pd, &target);
+		map_foreachflooritem(pet_ai_sub_hard_lootsearch, pd->bl.m, pd->bl.x - pd->db->range2 / 2, pd->bl.y - pd->db->range2 / 2, pd->bl.x + pd->db->range2 / 2, pd->bl.y + pd->db->range2 / 2, pd, &target);
 	}
 
 	if (!target) { // Just walk around.
@@ -1242,6 +1242,11 @@ static int pet_ai_sub_hard_lootsearch(struct block_list *bl,va_list ap)
 	pd = va_arg(ap,struct pet_data *);
 	target = va_arg(ap,struct block_list**);
 
+#ifdef CIRCULAR_AREA
+	if (!check_distance_bl(&pd->bl, bl, pd->db->range2 / 2))
+		return 0;
+#endif
+
 	sd_charid = fitem->first_get_charid;
 
 	if(sd_charid && sd_charid != pd->master->status.char_id)
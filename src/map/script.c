@@ -21,12 +21,8 @@
 #include "../common/strlib.h"
 #include "../common/timer.h"
 #include "../common/utils.h"
-#ifdef BETA_THREAD_TEST
-	#include "../common/atomic.h"
-	#include "../common/spinlock.h"
-	#include "../common/thread.h"
-	#include "../common/mutex.h"
-#endif
+#include "../common/thread.h"
+#include "../common/mutex.h"
 
 #include "map.h"
 #include "path.h"
@@ -219,6 +215,8 @@ struct Script_Config script_config = {
 	"OnTouch_",	//ontouch_name (runs on first visible char to enter area, picks another char if the first char leaves)
 	"OnTouch",	//ontouch2_name (run whenever a char walks into the OnTouch area)
 	"OnWhisperGlobal",	//onwhisper_event_name (is executed when a player sends a whisper message to the NPC)
+	0, 2, 30000, // query_sql_async/query_sql_workers/query_sql_timeout
+	0, 100, "log/scriptprof.txt", // profiler/profiler_sample/profiler_file
 };
 
 static jmp_buf     error_jump;
@@ -289,35 +287,15 @@ typedef struct script_function {
 
 extern script_function buildin_func[];
 
-#ifdef BETA_THREAD_TEST
-/**
- * MySQL Query Slave
- **/
-static SPIN_LOCK queryThreadLock;
-static rAthread queryThread = NULL;
-static ramutex	queryThreadMutex = NULL;
-static racond	queryThreadCond = NULL;
-static volatile int32 queryThreadTerminate = 0;
-
-struct queryThreadEntry {
-	bool ok;
-	bool type; /* main db or log db? */
-	struct script_state *st;
-};
-
-/* Ladies and Gentleman the Manager! */
-struct {
-	struct queryThreadEntry **entry;/* array of structs */
-	int count;
-	int timer;/* used to receive processed entries */
-} queryThreadData;
-#endif
 
 /*==========================================
  * (Only those needed) local declaration prototype
  *------------------------------------------*/
 const char* parse_subexpr(const char* p,int limit);
 int run_func(struct script_state *st);
+static void script_query_cancel(struct script_query* q);
+static void script_query_init(void);
+static void script_query_final(void);
 unsigned short script_instancegetid(struct script_state *st);
 
 enum {
@@ -3021,10 +2999,12 @@ int set_reg(struct script_state* st, TBL_PC* sd, int64 num, const char* name, co
 					struct reg_db *n = (ref) ? ref : (name[1] == '@') ? &st->stack->scope : &st->script->local;
 					if( n ) {
 						if (str[0])  {
+							if( !n->vars ) // NPC variables are allocated on first write
+								n->vars = i64db_alloc(DB_OPT_RELEASE_DATA);
 							i64db_put(n->vars, num, aStrdup(str));
 							if( script_getvaridx(num) )
 								script_array_update(n, num, false);
-						} else {
+						} else if( n->vars ) {
 							i64db_remove(n->vars, num);
 							if( script_getvaridx(num) )
 								script_array_update(n, num, true);
@@ -3084,10 +3064,12 @@ int set_reg(struct script_state* st, TBL_PC* sd, int64 num, const char* name, co
 					struct reg_db *n = (ref) ? ref : (name[1] == '@') ? &st->stack->scope : &st->script->local;
 					if( n ) {
 						if( val != 0 ) {
+							if( !n->vars ) // NPC variables are allocated on first write
+								n->vars = i64db_alloc(DB_OPT_RELEASE_DATA);
 							i64db_iput(n->vars, num, val);
 							if( script_getvaridx(num) )
 								script_array_update(n, num, false);
-						} else {
+						} else if( n->vars ) {
 							i64db_remove(n->vars, num);
 							if( script_getvaridx(num) )
 								script_array_update(n, num, true);
@@ -3239,6 +3221,270 @@ int conv_num(struct script_state* st, struct script_data* data)
 	return conv_num_(st, data, NULL);
 }
 
+/*==========================================
+ * Script profiler
+ * Samples one of every script_profiler_sample runs and accounts its
+ * executed code, buildin calls, stack string allocations and wall time
+ * to the NPC label the run started in.
+ * Executed code is measured in bytes of script code, summed from the
+ * position deltas between buildin calls (every jump is a buildin), so the
+ * VM loop itself has no profiling cost.
+ *------------------------------------------*/
+
+/// Costs of one NPC label.
+struct script_prof_entry {
+	char npc[NPC_NAME_LENGTH+1];
+	char label[NAME_LENGTH];
+	unsigned int runs; // sampled runs
+	uint64 code; // bytes of script code executed
+	uint64 buildins;
+	uint64 allocs;
+	uint64 usec;
+	unsigned int max_usec;
+};
+
+/// Costs of one buildin function.
+struct script_prof_buildin {
+	unsigned int calls;
+	uint64 usec;
+};
+
+static struct {
+	bool enabled;
+	int sample; // profile one of every <sample> runs
+	int countdown;
+	time_t started;
+	unsigned int runs; // all runs while enabled, sampled or not
+	DBMap* entries; // int64 (npc id << 32 | label pos) -> struct script_prof_entry*
+	struct script_prof_buildin* buildin; // indexed by str_data id
+	int buildin_max;
+	struct script_prof_entry* current; // entry of the sampled run being executed
+	struct script_state* st; // sampled run being executed
+	int pos; // position of st up to which its code has been accounted
+} script_prof;
+
+/// Starts (or restarts with a new sample rate) profiling.
+void script_prof_start(int sample)
+{
+	if( sample <= 0 )
+		sample = script_config.profiler_sample;
+	script_prof.sample = max(sample, 1);
+	script_prof.countdown = 1;
+	if( !script_prof.enabled ) {
+		script_prof.enabled = true;
+		if( !script_prof.started )
+			script_prof.started = time(NULL);
+	}
+}
+
+/// Stops profiling, the collected data is kept.
+void script_prof_stop(void)
+{
+	script_prof.enabled = false;
+}
+
+/// Discards the collected data.
+/// Entries are zeroed instead of freed, a sampled run may be executing this.
+void script_prof_reset(void)
+{
+	DBIterator* iter = db_iterator(script_prof.entries);
+	struct script_prof_entry* e;
+
+	for( e = (struct script_prof_entry*)dbi_first(iter); dbi_exists(iter); e = (struct script_prof_entry*)dbi_next(iter) ) {
+		e->runs = 0;
+		e->code = e->buildins = e->allocs = e->usec = 0;
+		e->max_usec = 0;
+	}
+	dbi_destroy(iter);
+	if( script_prof.buildin )
+		memset(script_prof.buildin, 0, sizeof(script_prof.buildin[0])*script_prof.buildin_max);
+	script_prof.runs = 0;
+	script_prof.started = script_prof.enabled ? time(NULL) : 0;
+}
+
+/// Reports whether profiling is enabled and how much was collected.
+bool script_prof_status(int* sample, unsigned int* runs)
+{
+	if( sample )
+		*sample = script_prof.sample;
+	if( runs )
+		*runs = script_prof.runs;
+	return script_prof.enabled;
+}
+
+/// Finds the entry of the label a run is starting (or resuming) in.
+static struct script_prof_entry* script_prof_get(struct script_state* st)
+{
+	struct npc_data* nd = st->oid ? map_id2nd(st->oid) : NULL;
+	struct script_prof_entry* e;
+	const char* label;
+	int pos = 0;
+	int64 key;
+
+	if( nd == NULL || nd->subtype != NPCTYPE_SCRIPT ) {
+		nd = NULL;
+		label = "-"; // item scripts, functions run without npc, ...
+		pos = -1;
+	} else if( nd->u.scr.script != st->script ) {
+		label = "(function)"; // resumed inside a callfunc
+		pos = -1;
+	} else {
+		int i;
+
+		label = "(main)";
+		for( i = 0; i < nd->u.scr.label_list_num; i++ ) {
+			int lpos = nd->u.scr.label_list[i].pos;
+
+			if( lpos <= st->pos && lpos >= pos ) {
+				pos = lpos;
+				label = nd->u.scr.label_list[i].name;
+			}
+		}
+	}
+
+	key = ((int64)(nd ? nd->bl.id : 0) << 32) | (uint32)pos;
+	if( (e = (struct script_prof_entry*)i64db_get(script_prof.entries, key)) == NULL ) {
+		CREATE(e, struct script_prof_entry, 1);
+		safestrncpy(e->npc, nd ? nd->exname : "-", sizeof(e->npc));
+		safestrncpy(e->label, label, sizeof(e->label));
+		i64db_put(script_prof.entries, key, e);
+	}
+	return e;
+}
+
+/// Decides whether the run that is about to start gets sampled.
+static struct script_prof_entry* script_prof_begin(struct script_state* st)
+{
+	script_prof.runs++;
+	if( --script_prof.countdown > 0 )
+		return NULL;
+	script_prof.countdown = script_prof.sample;
+	return script_prof_get(st);
+}
+
+/// Accounts the code the sampled run executed since the last call.
+static void script_prof_code(struct script_state* st)
+{
+	if( script_prof.st == st && script_prof.current ) {
+		script_prof.current->code += st->pos - script_prof.pos;
+		script_prof.pos = st->pos;
+	}
+}
+
+/// Accounts a buildin call made by the sampled run.
+/// The buildin may have jumped, its new position is where the code accounting resumes.
+static void script_prof_buildin(struct script_state* st, int func, uint64 start)
+{
+	uint64 usec = gettick_usec() - start;
+
+	if( func >= script_prof.buildin_max ) {
+		int size = max(str_num, func+1);
+		RECREATE(script_prof.buildin, struct script_prof_buildin, size);
+		memset(script_prof.buildin+script_prof.buildin_max, 0, sizeof(script_prof.buildin[0])*(size-script_prof.buildin_max));
+		script_prof.buildin_max = size;
+	}
+	script_prof.buildin[func].calls++;
+	script_prof.buildin[func].usec += usec;
+	if( script_prof.current )
+		script_prof.current->buildins++;
+	if( script_prof.st == st )
+		script_prof.pos = st->pos;
+}
+
+static int script_prof_cmp_entry(const void* a, const void* b)
+{
+	const struct script_prof_entry* e1 = *(const struct script_prof_entry**)a;
+	const struct script_prof_entry* e2 = *(const struct script_prof_entry**)b;
+	return (e1->usec < e2->usec) - (e1->usec > e2->usec);
+}
+
+static int script_prof_cmp_buildin(const void* a, const void* b)
+{
+	const struct script_prof_buildin* b1 = &script_prof.buildin[*(const int*)a];
+	const struct script_prof_buildin* b2 = &script_prof.buildin[*(const int*)b];
+	return (b1->usec < b2->usec) - (b1->usec > b2->usec);
+}
+
+/// Writes the collected data to a file, most expensive labels and buildins first.
+/// @param filename File to write, NULL for script_profiler_file
+/// @return number of labels written, -1 if the file could not be opened
+int script_prof_dump(const char* filename)
+{
+	struct script_prof_entry** list;
+	struct script_prof_entry* e;
+	DBIterator* iter;
+	int* funcs;
+	int i, count = 0, fcount = 0;
+	char timestr[24];
+	FILE* fp;
+
+	if( filename == NULL || filename[0] == '\0' )
+		filename = script_config.profiler_file;
+	if( (fp = fopen(filename, "w")) == NULL ) {
+		ShowError("script_prof_dump: Could not open '%s' for writing.\n", filename);
+		return -1;
+	}
+
+	list = (struct script_prof_entry**)aMalloc(sizeof(list[0])*max(db_size(script_prof.entries), 1));
+	iter = db_iterator(script_prof.entries);
+	for( e = (struct script_prof_entry*)dbi_first(iter); dbi_exists(iter); e = (struct script_prof_entry*)dbi_next(iter) ) {
+		if( e->runs )
+			list[count++] = e;
+	}
+	dbi_destroy(iter);
+	qsort(list, count, sizeof(list[0]), script_prof_cmp_entry);
+
+	timestamp2string(timestr, sizeof(timestr), time(NULL), "%Y-%m-%d %H:%M:%S");
+	fprintf(fp, "// Script profiler dump, %s\n", timestr);
+	fprintf(fp, "// %u runs in %lu seconds, one of every %d runs sampled.\n", script_prof.runs,
+		script_prof.started ? (unsigned long)difftime(time(NULL), script_prof.started) : 0UL, script_prof.sample);
+	fprintf(fp, "// Only sampled runs are accounted. Times include events run from within the script.\n\n");
+
+	fprintf(fp, "%-24s %-24s %10s %14s %12s %12s %12s %10s %10s\n",
+		"npc", "label", "runs", "code bytes", "buildins", "allocs", "total ms", "avg us", "max us");
+	for( i = 0; i < count; i++ ) {
+		e = list[i];
+		fprintf(fp, "%-24s %-24s %10u %14"PRIu64" %12"PRIu64" %12"PRIu64" %12.1f %10"PRIu64" %10u\n",
+			e->npc, e->label, e->runs, e->code, e->buildins, e->allocs,
+			e->usec/1000.0, e->runs ? e->usec/e->runs : 0, e->max_usec);
+	}
+	aFree(list);
+
+	funcs = (int*)aMalloc(sizeof(funcs[0])*max(script_prof.buildin_max, 1));
+	for( i = 0; i < script_prof.buildin_max; i++ ) {
+		if( script_prof.buildin[i].calls )
+			funcs[fcount++] = i;
+	}
+	qsort(funcs, fcount, sizeof(funcs[0]), script_prof_cmp_buildin);
+
+	fprintf(fp, "\n%-32s %12s %12s %10s\n", "buildin", "calls", "total ms", "avg us");
+	for( i = 0; i < fcount; i++ ) {
+		const struct script_prof_buildin* b = &script_prof.buildin[funcs[i]];
+		fprintf(fp, "%-32s %12u %12.1f %10"PRIu64"\n", get_str(funcs[i]), b->calls, b->usec/1000.0, b->usec/b->calls);
+	}
+	aFree(funcs);
+
+	fclose(fp);
+	ShowInfo("Script profiler: Dumped %d labels and %d buildins to '"CL_WHITE"%s"CL_RESET"'.\n", count, fcount, filename);
+	return count;
+}
+
+static void script_prof_init(void)
+{
+	memset(&script_prof, 0, sizeof(script_prof));
+	script_prof.entries = i64db_alloc(DB_OPT_RELEASE_DATA);
+	if( script_config.profiler )
+		script_prof_start(0);
+}
+
+static void script_prof_final(void)
+{
+	db_destroy(script_prof.entries);
+	if( script_prof.buildin )
+		aFree(script_prof.buildin);
+	memset(&script_prof, 0, sizeof(script_prof));
+}
+
 //
 // Stack operations
 //
@@ -3273,6 +3519,8 @@ struct script_data* push_str(struct script_stack* stack, enum c_op type, char* s
 {
 	if( stack->sp >= stack->sp_max )
 		stack_expand(stack);
+	if( type == C_STR && script_prof.current )
+		script_prof.current->allocs++;
 	stack->stack_data[stack->sp].type  = type;
 	stack->stack_data[stack->sp].u.str = str;
 	stack->stack_data[stack->sp].ref   = NULL;
@@ -3424,6 +3672,7 @@ struct script_state* script_alloc_state(struct script_code* rootscript, int pos,
 	st->rid = rid;
 	st->oid = oid;
 	st->sleep.timer = INVALID_TIMER;
+	st->query = NULL;
 	st->npc_item_flag = battle_config.item_enabled_npc;
 	
 	if( st->script->instances != USHRT_MAX )
@@ -3434,9 +3683,6 @@ struct script_state* script_alloc_state(struct script_code* rootscript, int pos,
 		ShowError("Over 65k instances of '%s' script are being run!\n",nd ? nd->name : "unknown");
 	}
 
-	if (!st->script->local.vars)
-		st->script->local.vars = i64db_alloc(DB_OPT_RELEASE_DATA);
-
 	st->id = next_id++;
 	active_scripts++;
 
@@ -3467,6 +3713,10 @@ void script_free_state(struct script_state* st)
 
 		if (st->sleep.timer != INVALID_TIMER)
 			delete_timer(st->sleep.timer, run_script_timer);
+		if (st->query) {
+			script_query_cancel(st->query);
+			st->query = NULL;
+		}
 		if (st->stack) {
 			script_free_vars(st->stack->scope.vars);
 			if (st->stack->scope.arrays)
@@ -3895,8 +4145,17 @@ int run_func(struct script_state *st)
 	}
 
 	if(str_data[func].func) {
+		bool prof = (script_prof.current != NULL);
+		uint64 prof_start = 0;
+
+		if( prof ) {
+			script_prof_code(st);
+			prof_start = gettick_usec();
+		}
 		if (str_data[func].func(st) == SCRIPT_CMD_FAILURE) //Report error
 			script_reportsrc(st);
+		if( prof )
+			script_prof_buildin(st, func, prof_start);
 	} else {
 		ShowError("script:run_func: '%s' (id=%d type=%s) has no C function. please report this!!!\n", get_str(func), func, script_op2name(str_data[func].type));
 		script_reportsrc(st);
@@ -4073,9 +4332,19 @@ void run_script_main(struct script_state *st)
 	int gotocount = script_config.check_gotocount;
 	TBL_PC *sd;
 	struct script_stack *stack = st->stack;
+	struct script_prof_entry *prof = NULL, *prof_parent = script_prof.current;
+	struct script_state *prof_parent_st = script_prof.st;
+	uint64 prof_start = 0;
 
 	script_attach_state(st);
 
+	if( script_prof.enabled && (prof = script_prof_begin(st)) != NULL ) {
+		script_prof.current = prof;
+		script_prof.st = st;
+		script_prof.pos = st->pos;
+		prof_start = gettick_usec();
+	}
+
 	if(st->state == RERUNLINE) {
 		run_func(st);
 		if(st->state == GOTO)
@@ -4170,6 +4439,17 @@ void run_script_main(struct script_state *st)
 		}
 	}
 
+	if( prof ) {
+		unsigned int usec = (unsigned int)(gettick_usec() - prof_start);
+
+		script_prof_code(st);
+		prof->runs++;
+		prof->usec += usec;
+		prof->max_usec = max(prof->max_usec, usec);
+		script_prof.current = prof_parent;
+		script_prof.st = prof_parent_st;
+	}
+
 	if(st->sleep.tick > 0) {
 		//Restore previous script
 		script_detach_state(st, false);
@@ -4178,6 +4458,11 @@ void run_script_main(struct script_state *st)
 		st->sleep.charid = sd?sd->status.char_id:0;
 		st->sleep.timer  = add_timer(gettick()+st->sleep.tick,
 			run_script_timer, st->sleep.charid, (intptr_t)st);
+	} else if(st->query) {
+		//Restore previous script while the query is running
+		script_detach_state(st, false);
+		sd = map_id2sd(st->rid);
+		st->sleep.charid = sd?sd->status.char_id:0;
 	} else if(st->state != END && st->rid) {
 		//Resume later (st is already attached to player).
 		if(st->bk_st) {
@@ -4246,6 +4531,24 @@ int script_config_read(char *cfgName)
 		else if(strcmpi(w1,"warn_func_mismatch_argtypes")==0) {
 			script_config.warn_func_mismatch_argtypes = config_switch(w2);
 		}
+		else if(strcmpi(w1,"query_sql_async")==0) {
+			script_config.query_sql_async = config_switch(w2);
+		}
+		else if(strcmpi(w1,"query_sql_workers")==0) {
+			script_config.query_sql_workers = cap_value(config_switch(w2), 1, SCRIPT_QUERY_MAX_WORKERS);
+		}
+		else if(strcmpi(w1,"query_sql_timeout")==0) {
+			script_config.query_sql_timeout = max(config_switch(w2), 0);
+		}
+		else if(strcmpi(w1,"script_profiler")==0) {
+			script_config.profiler = config_switch(w2);
+		}
+		else if(strcmpi(w1,"script_profiler_sample")==0) {
+			script_config.profiler_sample = max(config_switch(w2), 1);
+		}
+		else if(strcmpi(w1,"script_profiler_file")==0) {
+			safestrncpy(script_config.profiler_file, w2, sizeof(script_config.profiler_file));
+		}
 		else if(strcmpi(w1,"import")==0){
 			script_config_read(w2);
 		}
@@ -4412,183 +4715,6 @@ void script_generic_ui_array_expand (unsigned int plus)
 
 int buildin_query_sql_sub(struct script_state *st, Sql *handle);
 
-#ifdef BETA_THREAD_TEST
-/* used to receive items the queryThread has already processed */
-int queryThread_timer(int tid, unsigned int tick, int id, intptr_t data) {
-	int i, cursor = 0;
-	bool allOk = true;
-
-	EnterSpinLock(&queryThreadLock);
-
-	for( i = 0; i < queryThreadData.count; i++ ) {
-		struct queryThreadEntry *entry = queryThreadData.entry[i];
-
-		if( !entry->ok ) {
-			allOk = false;
-			continue;
-		}
-
-		run_script_main(entry->st);
-
-		entry->st = NULL;/* empty entries */
-		aFree(entry);
-		queryThreadData.entry[i] = NULL;
-	}
-
-
-	if( allOk ) {
-		/* cancel the repeating timer -- it'll re-create itself when necessary, dont need to remain looping */
-		delete_timer(queryThreadData.timer, queryThread_timer);
-		queryThreadData.timer = INVALID_TIMER;
-	}
-
-	/* now lets clear the mess. */
-	for( i = 0; i < queryThreadData.count; i++ ) {
-		struct queryThreadEntry *entry = queryThreadData.entry[i];
-		if( entry == NULL )
-			continue;/* entry on hold */
-
-		/* move */
-		memmove(&queryThreadData.entry[cursor], &queryThreadData.entry[i], sizeof(struct queryThreadEntry*));
-
-		cursor++;
-	}
-
-	queryThreadData.count = cursor;
-
-	LeaveSpinLock(&queryThreadLock);
-
-	return 0;
-}
-
-void queryThread_add(struct script_state *st, bool type) {
-	int idx = 0;
-	struct queryThreadEntry* entry = NULL;
-
-	EnterSpinLock(&queryThreadLock);
-
-	if( queryThreadData.count++ != 0 )
-		RECREATE(queryThreadData.entry, struct queryThreadEntry* , queryThreadData.count);
-
-	idx = queryThreadData.count-1;
-
-	CREATE(queryThreadData.entry[idx],struct queryThreadEntry,1);
-
-	entry = queryThreadData.entry[idx];
-
-	entry->st = st;
-	entry->ok = false;
-	entry->type = type;
-	if( queryThreadData.timer == INVALID_TIMER ) { /* start the receiver timer */
-		queryThreadData.timer = add_timer_interval(gettick() + 100, queryThread_timer, 0, 0, 100);
-	}
-
-	LeaveSpinLock(&queryThreadLock);
-
-	/* unlock the queryThread */
-	racond_signal(queryThreadCond);
-}
-/* adds a new log to the queue */
-void queryThread_log(char * entry, int length) {
-	int idx = logThreadData.count;
-
-	EnterSpinLock(&queryThreadLock);
-
-	if( logThreadData.count++ != 0 )
-		RECREATE(logThreadData.entry, char* , logThreadData.count);
-
-	CREATE(logThreadData.entry[idx], char, length + 1 );
-	safestrncpy(logThreadData.entry[idx], entry, length + 1 );
-
-	LeaveSpinLock(&queryThreadLock);
-
-	/* unlock the queryThread */
-	racond_signal(queryThreadCond);
-}
-
-/* queryThread_main */
-static void *queryThread_main(void *x) {
-	Sql *queryThread_handle = Sql_Malloc();
-	int i;
-
-	if ( SQL_ERROR == Sql_Connect(queryThread_handle, map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db) ){
-		ShowError("Couldn't connect with uname='%s',passwd='%s',host='%s',port='%d',database='%s'\n",
-			map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db);
-		Sql_ShowDebug(queryThread_handle);
-		Sql_Free(queryThread_handle);
-		exit(EXIT_FAILURE);
-	}
-
-	if( strlen(default_codepage) > 0 )
-		if ( SQL_ERROR == Sql_SetEncoding(queryThread_handle, default_codepage) )
-			Sql_ShowDebug(queryThread_handle);
-
-	if( log_config.sql_logs ) {
-		logmysql_handle = Sql_Malloc();
-
-		if ( SQL_ERROR == Sql_Connect(logmysql_handle, log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db) ){
-			ShowError("Couldn't connect with uname='%s',passwd='%s',host='%s',port='%d',database='%s'\n",
-				log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db);
-			Sql_ShowDebug(logmysql_handle);
-			Sql_Free(logmysql_handle);
-			exit(EXIT_FAILURE);
-		}
-
-		if( strlen(default_codepage) > 0 )
-			if ( SQL_ERROR == Sql_SetEncoding(logmysql_handle, default_codepage) )
-				Sql_ShowDebug(logmysql_handle);
-	}
-
-	while( 1 ) {
-
-		if(queryThreadTerminate > 0)
-			break;
-
-		EnterSpinLock(&queryThreadLock);
-
-		/* mess with queryThreadData within the lock */
-		for( i = 0; i < queryThreadData.count; i++ ) {
-			struct queryThreadEntry *entry = queryThreadData.entry[i];
-
-			if( entry->ok )
-				continue;
-			else if ( !entry->st || !entry->st->stack ) {
-				entry->ok = true;/* dispose */
-				continue;
-			}
-
-			buildin_query_sql_sub(entry->st, entry->type ? logmysql_handle : queryThread_handle);
-
-			entry->ok = true;/* we're done with this */
-		}
-
-		/* also check for any logs in need to be sent */
-		if( log_config.sql_logs ) {
-			for( i = 0; i < logThreadData.count; i++ ) {
-				if( SQL_ERROR == Sql_Query(logmysql_handle, logThreadData.entry[i]) )
-					Sql_ShowDebug(logmysql_handle);
-				aFree(logThreadData.entry[i]);
-			}
-			logThreadData.count = 0;
-		}
-
-		LeaveSpinLock(&queryThreadLock);
-
-		ramutex_lock( queryThreadMutex );
-		racond_wait( queryThreadCond,	queryThreadMutex,  -1 );
-		ramutex_unlock( queryThreadMutex );
-
-	}
-
-	Sql_Free(queryThread_handle);
-
-	if( log_config.sql_logs ) {
-		Sql_Free(logmysql_handle);
-	}
-
-	return NULL;
-}
-#endif
 /*==========================================
  * Destructor
  *------------------------------------------*/
@@ -4667,6 +4793,9 @@ void do_final_script() {
 		script_free_state(st);
 	dbi_destroy(iter);
 
+	script_query_final();
+	script_prof_final();
+
 	if (str_data)
 		aFree(str_data);
 	if (str_buf)
@@ -4683,29 +4812,6 @@ void do_final_script() {
 	ers_destroy(stack_ers);
 	db_destroy(st_db);
 
-#ifdef BETA_THREAD_TEST
-	/* QueryThread */
-	InterlockedIncrement(&queryThreadTerminate);
-	racond_signal(queryThreadCond);
-	rathread_wait(queryThread, NULL);
-
-	// Destroy cond var and mutex.
-	racond_destroy( queryThreadCond );
-	ramutex_destroy( queryThreadMutex );
-
-	/* Clear missing vars */
-	for( i = 0; i < queryThreadData.count; i++ ) {
-		aFree(queryThreadData.entry[i]);
-	}
-
-	aFree(queryThreadData.entry);
-
-	for( i = 0; i < logThreadData.count; i++ ) {
-		aFree(logThreadData.entry[i]);
-	}
-
-	aFree(logThreadData.entry);
-#endif
 }
 /*==========================================
  * Initialization
@@ -4727,29 +4833,8 @@ void do_init_script(void) {
 	next_id = 0;
 
 	mapreg_init();
-#ifdef BETA_THREAD_TEST
-	CREATE(queryThreadData.entry, struct queryThreadEntry*, 1);
-	queryThreadData.count = 0;
-	CREATE(logThreadData.entry, char *, 1);
-	logThreadData.count = 0;
-	/* QueryThread Start */
-
-	InitializeSpinLock(&queryThreadLock);
-
-	queryThreadData.timer = INVALID_TIMER;
-	queryThreadTerminate = 0;
-	queryThreadMutex = ramutex_create();
-	queryThreadCond = racond_create();
-
-	queryThread = rathread_create(queryThread_main, NULL);
-
-	if(queryThread == NULL){
-		ShowFatalError("do_init_script: cannot spawn Query Thread.\n");
-		exit(EXIT_FAILURE);
-	}
-
-	add_timer_func_list(queryThread_timer, "queryThread_timer");
-#endif
+	script_query_init();
+	script_prof_init();
 }
 
 void script_reload(void) {
@@ -4757,22 +4842,6 @@ void script_reload(void) {
 	DBIterator *iter;
 	struct script_state *st;
 
-#ifdef BETA_THREAD_TEST
-	/* we're reloading so any queries undergoing should be...exterminated. */
-	EnterSpinLock(&queryThreadLock);
-
-	for( i = 0; i < queryThreadData.count; i++ ) {
-		aFree(queryThreadData.entry[i]);
-	}
-	queryThreadData.count = 0;
-
-	if( queryThreadData.timer != INVALID_TIMER ) {
-		delete_timer(queryThreadData.timer, queryThread_timer);
-		queryThreadData.timer = INVALID_TIMER;
-	}
-
-	LeaveSpinLock(&queryThreadLock);
-#endif
 
 	userfunc_db->clear(userfunc_db, db_script_free_code_sub);
 	db_clear(scriptlabel_db);
@@ -5287,6 +5356,8 @@ BUILDIN_FUNC(callfunc)
 	if (!st->stack->scope.arrays)
 		st->stack->scope.arrays = idb_alloc(DB_OPT_BASE); // TODO: Can this happen? when?
 	ref[0].arrays = st->stack->scope.arrays;
+	if (!st->script->local.vars) // references keep the pointer, so it must exist now
+		st->script->local.vars = i64db_alloc(DB_OPT_RELEASE_DATA);
 	ref[1].vars = st->script->local.vars;
 	if (!st->script->local.arrays)
 		st->script->local.arrays = idb_alloc(DB_OPT_BASE); // TODO: Can this happen? when?
@@ -5319,9 +5390,6 @@ BUILDIN_FUNC(callfunc)
 	st->stack->scope.vars = i64db_alloc(DB_OPT_RELEASE_DATA);
 	st->stack->scope.arrays = idb_alloc(DB_OPT_BASE);
 
-	if (!st->script->local.vars)
-		st->script->local.vars = i64db_alloc(DB_OPT_RELEASE_DATA);
-
 	return SCRIPT_CMD_SUCCESS;
 }
 
@@ -5430,6 +5498,8 @@ BUILDIN_FUNC(return)
 					data->ref = NULL; // Reference to the parent scope, remove reference pointer
 			} else if( name[0] == '.' && !data->ref ) { // script variable, link to current script
 				data->ref = (struct reg_db *)aCalloc(sizeof(struct reg_db), 1);
+				if (!st->script->local.vars)
+					st->script->local.vars = i64db_alloc(DB_OPT_RELEASE_DATA);
 				data->ref->vars = st->script->local.vars;
 
 				if (!st->script->local.arrays)
@@ -16146,38 +16216,71 @@ BUILDIN_FUNC(setd)
 	return SCRIPT_CMD_SUCCESS;
 }
 
-int buildin_query_sql_sub(struct script_state* st, Sql* handle)
+/// Checks the target variables of query_sql/query_logsql.
+/// Returns the number of variables, or -1 (and ends the script) if they are invalid.
+static int buildin_query_sql_vars(struct script_state* st, TBL_PC** sd)
 {
-	int i, j;
-	TBL_PC* sd = NULL;
-	const char* query;
-	struct script_data* data;
-	const char* name;
-	unsigned int max_rows = SCRIPT_MAX_ARRAYSIZE; // maximum number of rows
-	int num_vars;
-	int num_cols;
+	int i;
 
-	// check target variables
+	*sd = NULL;
 	for( i = 3; script_hasdata(st,i); ++i ) {
-		data = script_getdata(st, i);
+		struct script_data* data = script_getdata(st, i);
 		if( data_isreference(data) ) { // it's a variable
-			name = reference_getname(data);
-			if( not_server_variable(*name) && sd == NULL ) { // requires a player
-				sd = script_rid2sd(st);
-				if( sd == NULL ) { // no player attached
+			const char* name = reference_getname(data);
+			if( not_server_variable(*name) && *sd == NULL ) { // requires a player
+				*sd = script_rid2sd(st);
+				if( *sd == NULL ) { // no player attached
 					script_reportdata(data);
 					st->state = END;
-					return SCRIPT_CMD_FAILURE;
+					return -1;
 				}
 			}
 		} else {
 			ShowError("script:query_sql: not a variable\n");
 			script_reportdata(data);
 			st->state = END;
-			return SCRIPT_CMD_FAILURE;
+			return -1;
 		}
 	}
-	num_vars = i - 3;
+	return i - 3;
+}
+
+/// Stores a value of the result into the row'th element of the var'th target variable.
+static void buildin_query_sql_setvar(struct script_state* st, TBL_PC* sd, int var, int row, const char* str)
+{
+	struct script_data* data = script_getdata(st, var+3);
+	const char* name = reference_getname(data);
+
+	if( is_string_variable(name) )
+		setd_sub(st, sd, name, row, (void *)(str?str:""), reference_getref(data));
+	else
+		setd_sub(st, sd, name, row, (void *)__64BPRTSIZE((str?atoi(str):0)), reference_getref(data));
+}
+
+/// Warns about a mismatch between the number of target variables and result columns.
+static void buildin_query_sql_checkcols(struct script_state* st, int num_vars, int num_cols)
+{
+	if( num_vars < num_cols ) {
+		ShowWarning("script:query_sql: Too many columns, discarding last %u columns.\n", (unsigned int)(num_cols-num_vars));
+		script_reportsrc(st);
+	} else if( num_vars > num_cols ) {
+		ShowWarning("script:query_sql: Too many variables (%u extra).\n", (unsigned int)(num_vars-num_cols));
+		script_reportsrc(st);
+	}
+}
+
+int buildin_query_sql_sub(struct script_state* st, Sql* handle)
+{
+	int i, j;
+	TBL_PC* sd = NULL;
+	const char* query;
+	unsigned int max_rows = SCRIPT_MAX_ARRAYSIZE; // maximum number of rows
+	int num_vars;
+	int num_cols;
+
+	// check target variables
+	if( (num_vars = buildin_query_sql_vars(st, &sd)) < 0 )
+		return SCRIPT_CMD_FAILURE;
 
 	// Execute the query
 	query = script_getstr(st,2);
@@ -16196,13 +16299,7 @@ int buildin_query_sql_sub(struct script_state* st, Sql* handle)
 
 	// Count the number of columns to store
 	num_cols = Sql_NumColumns(handle);
-	if( num_vars < num_cols ) {
-		ShowWarning("script:query_sql: Too many columns, discarding last %u columns.\n", (unsigned int)(num_cols-num_vars));
-		script_reportsrc(st);
-	} else if( num_vars > num_cols ) {
-		ShowWarning("script:query_sql: Too many variables (%u extra).\n", (unsigned int)(num_vars-num_cols));
-		script_reportsrc(st);
-	}
+	buildin_query_sql_checkcols(st, num_vars, num_cols);
 
 	// Store data
 	for( i = 0; i < max_rows && SQL_SUCCESS == Sql_NextRow(handle); ++i ) {
@@ -16212,12 +16309,7 @@ int buildin_query_sql_sub(struct script_state* st, Sql* handle)
 			if( j < num_cols )
 				Sql_GetData(handle, j, &str, NULL);
 
-			data = script_getdata(st, j+3);
-			name = reference_getname(data);
-			if( is_string_variable(name) )
-				setd_sub(st, sd, name, i, (void *)(str?str:""), reference_getref(data));
-			else
-				setd_sub(st, sd, name, i, (void *)__64BPRTSIZE((str?atoi(str):0)), reference_getref(data));
+			buildin_query_sql_setvar(st, sd, j, i, str);
 		}
 	}
 	if( i == max_rows && max_rows < Sql_NumRows(handle) ) {
@@ -16231,19 +16323,437 @@ int buildin_query_sql_sub(struct script_state* st, Sql* handle)
 	return SCRIPT_CMD_SUCCESS;
 }
 
-BUILDIN_FUNC(query_sql) {
-#ifdef BETA_THREAD_TEST
-	if( st->state != RERUNLINE ) {
-		queryThread_add(st,false);
+/*==========================================
+ * Asynchronous query_sql/query_logsql (query_sql_async)
+ * The query runs on a worker thread while the script is parked like
+ * sleep2; script_query_timer resumes it once the result has arrived
+ * and the command is re-run to store the result in the variables.
+ *------------------------------------------*/
+#define SCRIPT_QUERY_POLL_INTERVAL 20 // how often finished queries are collected (ms)
+
+enum e_script_query_state {
+	SCRIPT_QUERY_PENDING,   ///< Waiting for a worker
+	SCRIPT_QUERY_RUNNING,   ///< Being executed by a worker
+	SCRIPT_QUERY_DONE,      ///< Result is ready
+	SCRIPT_QUERY_ABANDONED, ///< Script is gone or timed out, the worker frees it when done
+};
+
+struct script_query {
+	struct script_query* next;
+	enum e_script_query_state state;
+	struct script_state* st;
+	bool logdb;             ///< Run on the log database
+	char* query;
+	unsigned int deadline;  ///< Tick after which the script resumes without result
+	unsigned int max_rows;
+	int num_vars;
+	// result
+	int result;             ///< Number of fetched rows, -1 on error
+	char* error;            ///< Why the query failed, shown on the main thread
+	unsigned int num_rows;  ///< Number of rows returned by the server
+	int num_cols;           ///< Number of columns returned by the server
+	int stored_cols;        ///< Number of columns kept in data
+	char** data;            ///< result rows, stored_cols values per row
+};
+
+static struct {
+	ramutex mutex;
+	racond cond;            ///< Signalled when a query is queued or on termination
+	rAthread workers[SCRIPT_QUERY_MAX_WORKERS];
+	int worker_count;
+	struct script_query* head; ///< All outstanding queries, in submission order
+	struct script_query* failed; ///< Abandoned queries that failed, to be shown
+	int timer;
+	bool terminate;
+} script_query;
+
+static int script_query_timer(int tid, unsigned int tick, int id, intptr_t data);
 
-		st->state = RERUNLINE;/* will continue when the query is finished running. */
+static void script_query_free(struct script_query* q)
+{
+	if( q->data ) {
+		int i;
+		for( i = 0; i < q->result * q->stored_cols; i++ ) {
+			if( q->data[i] )
+				aFree(q->data[i]);
+		}
+		aFree(q->data);
+	}
+	if( q->error )
+		aFree(q->error);
+	aFree(q->query);
+	aFree(q);
+}
+
+/// Shows why a query failed. (main thread)
+static void script_query_report(struct script_query* q)
+{
+	ShowError("script:query_sql: %s\n", q->error);
+	ShowDebug("Query: %s\n", q->query);
+}
+
+/// Removes a query from the outstanding list, if it's there. (lock held)
+static void script_query_unlink(struct script_query* q)
+{
+	struct script_query** p;
+
+	for( p = &script_query.head; *p != NULL; p = &(*p)->next ) {
+		if( *p == q ) {
+			*p = q->next;
+			q->next = NULL;
+			return;
+		}
+	}
+}
+
+/// Detaches a query from its script, which is being freed.
+static void script_query_cancel(struct script_query* q)
+{
+	bool owned = true;
+
+	ramutex_lock(script_query.mutex);
+	if( q->state == SCRIPT_QUERY_RUNNING ) {
+		q->state = SCRIPT_QUERY_ABANDONED;
+		q->st = NULL;
+		owned = false;
 	} else
-		st->state = RUN;
+		script_query_unlink(q);
+	ramutex_unlock(script_query.mutex);
+
+	if( owned )
+		script_query_free(q);
+}
 
+/// Executes a query and copies its result. (worker thread)
+/// Nothing is shown here, a failure is kept in q->error.
+static void script_query_execute(Sql* handle, const char* connect_error, struct script_query* q)
+{
+	unsigned int rows;
+	int i, j;
+
+	if( handle == NULL ) {
+		q->error = aStrdup(connect_error);
+		q->result = -1;
+		return;
+	}
+	if( SQL_ERROR == Sql_QueryStr(handle, q->query) ) {
+		q->error = aStrdup(Sql_GetError(handle));
+		q->result = -1;
+		return;
+	}
+
+	q->num_rows = (unsigned int)Sql_NumRows(handle);
+	q->num_cols = (int)Sql_NumColumns(handle);
+	q->stored_cols = min(q->num_cols, q->num_vars);
+	rows = min(q->num_rows, q->max_rows);
+	if( rows > 0 && q->stored_cols > 0 )
+		CREATE(q->data, char*, rows * q->stored_cols);
+
+	for( i = 0; i < rows && SQL_SUCCESS == Sql_NextRow(handle); ++i ) {
+		for( j = 0; j < q->stored_cols; ++j ) {
+			char* str = NULL;
+
+			Sql_GetData(handle, j, &str, NULL);
+			q->data[i * q->stored_cols + j] = str ? aStrdup(str) : NULL;
+		}
+	}
+	q->result = i;
+	Sql_FreeResult(handle);
+}
+
+/// Opens a connection for a worker. (worker thread)
+/// On failure NULL is returned and the reason is written to error.
+static Sql* script_query_connect(const char* user, const char* passwd, const char* host, uint16 port, const char* db, char* error, size_t size)
+{
+	Sql* handle = Sql_Malloc();
+
+	Sql_SetThreaded(handle);
+	if( SQL_ERROR == Sql_Connect(handle, user, passwd, host, port, db) ) {
+		safesnprintf(error, size, "Couldn't connect with uname='%s',host='%s',port='%d',database='%s' (%s)", user, host, port, db, Sql_GetError(handle));
+		Sql_Free(handle);
+		return NULL;
+	}
+	if( default_codepage[0] != '\0' )
+		Sql_SetEncoding(handle, default_codepage); // same as the main connections, which report a failure
+	return handle;
+}
+
+/// Worker thread, runs queued queries on its own connections.
+static void* script_query_worker(void* param)
+{
+	char error[256] = "", logerror[256] = "";
+	Sql* handle = script_query_connect(map_server_id, map_server_pw, map_server_ip, map_server_port, map_server_db, error, sizeof(error));
+	Sql* loghandle = NULL;
+
+	if( log_config.sql_logs )
+		loghandle = script_query_connect(log_db_id, log_db_pw, log_db_ip, log_db_port, log_db_db, logerror, sizeof(logerror));
+
+	ramutex_lock(script_query.mutex);
+	while( !script_query.terminate ) {
+		struct script_query* q;
+
+		for( q = script_query.head; q != NULL && q->state != SCRIPT_QUERY_PENDING; q = q->next )
+			;
+		if( q == NULL ) {
+			racond_wait(script_query.cond, script_query.mutex, -1);
+			continue;
+		}
+
+		q->state = SCRIPT_QUERY_RUNNING;
+		ramutex_unlock(script_query.mutex);
+
+		if( q->logdb )
+			script_query_execute(loghandle, logerror, q);
+		else
+			script_query_execute(handle, error, q);
+
+		ramutex_lock(script_query.mutex);
+		if( q->state == SCRIPT_QUERY_ABANDONED ) {
+			script_query_unlink(q);
+			if( q->error ) {// still to be shown by script_query_timer
+				q->next = script_query.failed;
+				script_query.failed = q;
+			} else
+				script_query_free(q);
+		} else
+			q->state = SCRIPT_QUERY_DONE;
+	}
+	ramutex_unlock(script_query.mutex);
+
+	if( handle )
+		Sql_Free(handle);
+	if( loghandle )
+		Sql_Free(loghandle);
+	return NULL;
+}
+
+/// Queues a query for the workers.
+static void script_query_push(struct script_query* q)
+{
+	struct script_query** p;
+
+	ramutex_lock(script_query.mutex);
+	for( p = &script_query.head; *p != NULL; p = &(*p)->next )
+		;
+	*p = q;
+	ramutex_unlock(script_query.mutex);
+	racond_signal(script_query.cond);
+
+	if( script_query.timer == INVALID_TIMER )
+		script_query.timer = add_timer_interval(gettick() + SCRIPT_QUERY_POLL_INTERVAL, script_query_timer, 0, 0, SCRIPT_QUERY_POLL_INTERVAL);
+}
+
+/// Takes the next script that can be resumed: its query is done or timed out.
+/// Timed out scripts have their query detached (st->query is NULL).
+static struct script_state* script_query_next(unsigned int tick)
+{
+	struct script_query* q;
+	struct script_query* expired = NULL;
+	struct script_state* st = NULL;
+
+	ramutex_lock(script_query.mutex);
+	for( q = script_query.head; q != NULL; q = q->next ) {
+		if( q->state == SCRIPT_QUERY_DONE )
+			break;
+		if( q->state != SCRIPT_QUERY_ABANDONED && script_config.query_sql_timeout > 0 && DIFF_TICK(tick, q->deadline) >= 0 )
+			break;
+	}
+	if( q != NULL ) {
+		st = q->st;
+		if( q->state == SCRIPT_QUERY_DONE )
+			script_query_unlink(q);
+		else {// timed out
+			st->query = NULL;
+			q->st = NULL;
+			if( q->state == SCRIPT_QUERY_PENDING ) {
+				script_query_unlink(q);
+				expired = q;
+			} else
+				q->state = SCRIPT_QUERY_ABANDONED;
+		}
+	}
+	ramutex_unlock(script_query.mutex);
+
+	if( expired )
+		script_query_free(expired);
+	return st;
+}
+
+/// Shows and frees the abandoned queries that failed.
+static void script_query_report_failed(void)
+{
+	struct script_query* q;
+
+	ramutex_lock(script_query.mutex);
+	q = script_query.failed;
+	script_query.failed = NULL;
+	ramutex_unlock(script_query.mutex);
+
+	while( q != NULL ) {
+		struct script_query* next = q->next;
+
+		script_query_report(q);
+		script_query_free(q);
+		q = next;
+	}
+}
+
+/// Resumes the scripts whose queries have finished and shows the errors of
+/// the failed ones.
+static int script_query_timer(int tid, unsigned int tick, int id, intptr_t data)
+{
+	struct script_state* st;
+	bool empty;
+
+	script_query_report_failed();
+	while( (st = script_query_next(tick)) != NULL ) {
+		TBL_PC* sd = map_id2sd(st->rid);
+
+		if( st->query != NULL && st->query->error != NULL ) {
+			script_query_report(st->query);
+			script_reportsrc(st);
+		}
+
+		if( (sd && sd->status.char_id != st->sleep.charid) || (st->rid && !sd) ) { // Character mismatch. Cancel execution.
+			st->rid = 0;
+			st->state = END;
+		}
+		run_script_main(st);
+	}
+
+	ramutex_lock(script_query.mutex);
+	empty = ( script_query.head == NULL && script_query.failed == NULL );
+	ramutex_unlock(script_query.mutex);
+	if( empty ) {// stop polling until the next query
+		delete_timer(script_query.timer, script_query_timer);
+		script_query.timer = INVALID_TIMER;
+	}
+	return 0;
+}
+
+/// query_sql/query_logsql when query_sql_async is enabled.
+/// First run queues the query and parks the script, the re-run stores the result.
+static int buildin_query_sql_async(struct script_state* st, bool logdb)
+{
+	struct script_query* q;
+	TBL_PC* sd = NULL;
+	int num_vars;
+	int i, j;
+
+	if( (num_vars = buildin_query_sql_vars(st, &sd)) < 0 )
+		return SCRIPT_CMD_FAILURE;
+
+	if( st->state != RERUNLINE ) {// queue the query
+		CREATE(q, struct script_query, 1);
+		q->state = SCRIPT_QUERY_PENDING;
+		q->st = st;
+		q->logdb = logdb;
+		q->query = aStrdup(script_getstr(st,2));
+		q->deadline = gettick() + script_config.query_sql_timeout;
+		q->max_rows = SCRIPT_MAX_ARRAYSIZE;
+		q->num_vars = num_vars;
+		st->query = q;
+		st->state = RERUNLINE;
+		script_query_push(q);
+		return SCRIPT_CMD_SUCCESS;
+	}
+
+	// query finished
+	st->state = RUN;
+	q = st->query;
+	st->query = NULL;
+
+	if( q == NULL ) {
+		ShowWarning("script:query_sql: Query timed out after %d ms.\n", script_config.query_sql_timeout);
+		script_reportsrc(st);
+		script_pushint(st, -1);
+		return SCRIPT_CMD_FAILURE;
+	}
+	if( q->result < 0 ) {
+		script_query_free(q);
+		script_pushint(st, -1);
+		return SCRIPT_CMD_FAILURE;
+	}
+	if( q->num_rows > 0 )
+		buildin_query_sql_checkcols(st, num_vars, q->num_cols);
+
+	for( i = 0; i < q->result; ++i ) {
+		for( j = 0; j < num_vars; ++j )
+			buildin_query_sql_setvar(st, sd, j, i, j < q->stored_cols ? q->data[i * q->stored_cols + j] : NULL);
+	}
+	if( q->result == q->max_rows && q->max_rows < q->num_rows ) {
+		ShowWarning("script:query_sql: Only %d/%u rows have been stored.\n", q->max_rows, q->num_rows);
+		script_reportsrc(st);
+	}
+
+	script_pushint(st, q->result);
+	script_query_free(q);
 	return SCRIPT_CMD_SUCCESS;
-#else
+}
+
+static void script_query_init(void)
+{
+	int i;
+
+	memset(&script_query, 0, sizeof(script_query));
+	script_query.timer = INVALID_TIMER;
+	add_timer_func_list(script_query_timer, "script_query_timer");
+
+	if( !script_config.query_sql_async )
+		return;
+
+	script_query.mutex = ramutex_create();
+	script_query.cond = racond_create();
+	for( i = 0; i < script_config.query_sql_workers; i++ ) {
+		if( (script_query.workers[i] = rathread_create(script_query_worker, NULL)) == NULL ) {
+			ShowError("script_query_init: Cannot spawn query_sql worker %d.\n", i);
+			break;
+		}
+	}
+	script_query.worker_count = i;
+	if( script_query.worker_count == 0 ) {
+		ShowError("script_query_init: No query_sql worker, queries will run on the main thread.\n");
+		racond_destroy(script_query.cond);
+		ramutex_destroy(script_query.mutex);
+		script_config.query_sql_async = 0;
+		return;
+	}
+	ShowStatus("Started '"CL_WHITE"%d"CL_RESET"' query_sql worker(s).\n", script_query.worker_count);
+}
+
+static void script_query_final(void)
+{
+	int i;
+
+	if( script_query.worker_count == 0 )
+		return;
+
+	ramutex_lock(script_query.mutex);
+	script_query.terminate = true;
+	ramutex_unlock(script_query.mutex);
+	racond_broadcast(script_query.cond);
+	for( i = 0; i < script_query.worker_count; i++ )
+		rathread_wait(script_query.workers[i], NULL);
+	script_query_report_failed();
+
+	while( script_query.head ) {
+		struct script_query* q = script_query.head;
+		script_query.head = q->next;
+		script_query_free(q);
+	}
+	if( script_query.timer != INVALID_TIMER ) {
+		delete_timer(script_query.timer, script_query_timer);
+		script_query.timer = INVALID_TIMER;
+	}
+	racond_destroy(script_query.cond);
+	ramutex_destroy(script_query.mutex);
+	script_query.worker_count = 0;
+}
+
+BUILDIN_FUNC(query_sql) {
+	if( script_config.query_sql_async )
+		return buildin_query_sql_async(st, false);
 	return buildin_query_sql_sub(st, qsmysql_handle);
-#endif
 }
 
 BUILDIN_FUNC(query_logsql) {
@@ -16252,18 +16762,9 @@ BUILDIN_FUNC(query_logsql) {
 		script_pushint(st,-1);
 		return SCRIPT_CMD_FAILURE;
 	}
-#ifdef BETA_THREAD_TEST
-	if( st->state != RERUNLINE ) {
-		queryThread_add(st,true);
-
-		st->state = RERUNLINE;/* will continue when the query is finished running. */
-	} else
-		st->state = RUN;
-
-	return SCRIPT_CMD_SUCCESS;
-#else
+	if( script_config.query_sql_async )
+		return buildin_query_sql_async(st, true);
 	return buildin_query_sql_sub(st, logmysql_handle);
-#endif
 }
 
 //Allows escaping of a given string.
@@ -20238,14 +20739,14 @@ BUILDIN_FUNC(cleanmap)
 		return SCRIPT_CMD_FAILURE;
 
 	if ((script_lastdata(st) - 2) < 4) {
-		map_foreachinmap(atcommand_cleanfloor_sub, m, BL_ITEM);
+		map_foreachflooritem(atcommand_cleanfloor_sub, m, 0, 0, map[m].xs - 1, map[m].ys - 1);
 	} else {
 		int16 x0 = script_getnum(st, 3);
 		int16 y0 = script_getnum(st, 4);
 		int16 x1 = script_getnum(st, 5);
 		int16 y1 = script_getnum(st, 6);
 		if (x0 > 0 && y0 > 0 && x1 > 0 && y1 > 0) {
-			map_foreachinarea(atcommand_cleanfloor_sub, m, x0, y0, x1, y1, BL_ITEM);
+			map_foreachflooritem(atcommand_cleanfloor_sub, m, x0, y0, x1, y1);
 		} else {
 			ShowError("cleanarea: invalid coordinate defined!\n");
 			return SCRIPT_CMD_FAILURE;
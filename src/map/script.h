@@ -161,8 +161,18 @@ extern struct Script_Config {
 	const char* ontouch_name;
 	const char* ontouch2_name;
 	const char* onwhisper_event_name;
+
+	unsigned query_sql_async : 1; // run query_sql/query_logsql on worker threads
+	int query_sql_workers; // number of worker threads
+	int query_sql_timeout; // ms before a parked script resumes without result (0 = never)
+
+	unsigned profiler : 1; // start the script profiler on boot
+	int profiler_sample; // profile one of every <n> script runs
+	char profiler_file[256]; // default @scriptprof dump file
 } script_config;
 
+#define SCRIPT_QUERY_MAX_WORKERS 16
+
 typedef enum c_op {
 	C_NOP, // end of script/no value (nil)
 	C_POS,
@@ -267,6 +277,7 @@ struct script_state {
 	struct sleep_data {
 		int tick,timer,charid;
 	} sleep;
+	struct script_query* query; // asynchronous query_sql the script is waiting for
 	//For backing up purposes
 	struct script_state *bk_st;
 	int bk_npcid;
@@ -659,6 +670,12 @@ void script_warning(const char* src, const char* file, int start_line, const cha
 struct script_code* parse_script(const char* src,const char* file,int line,int options);
 void run_script(struct script_code *rootscript,int pos,int rid,int oid);
 
+void script_prof_start(int sample);
+void script_prof_stop(void);
+void script_prof_reset(void);
+bool script_prof_status(int* sample, unsigned int* runs);
+int script_prof_dump(const char* filename);
+
 int set_reg(struct script_state* st, TBL_PC* sd, int64 num, const char* name, const void* value, struct reg_db *ref);
 int set_var(struct map_session_data *sd, char *name, void *val);
 int conv_num(struct script_state *st,struct script_data *data);
@@ -713,8 +730,4 @@ int script_reg_destroy(DBKey key, DBData *data, va_list ap);
 void script_generic_ui_array_expand(unsigned int plus);
 unsigned int *script_array_cpy_list(struct script_array *sa);
 
-#ifdef BETA_THREAD_TEST
-void queryThread_log(char * entry, int length);
-#endif
-
 #endif /* _SCRIPT_H_ */
@@ -12463,6 +12463,35 @@ static bool skill_dance_switch(struct skill_unit* unit, int flag)
 	return true;
 }
 
+/**
+ * Checks with one region query whether all cells of a layout placed at x,y are reachable,
+ * so the units don't need a cell check each.
+ * @param m Map
+ * @param x Center x
+ * @param y Center y
+ * @param layout Unit layout
+ * @return true if every cell of the layout's bounding box is reachable, false if the cells must be checked one by one
+ */
+static bool skill_unit_layout_reachable(int16 m, int16 x, int16 y, struct s_skill_unit_layout *layout)
+{
+#ifdef CELL_NOSTACK
+	return false; // the stack limit of CELL_CHKREACH is per cell
+#else
+	int i, x0 = x, y0 = y, x1 = x, y1 = y;
+
+	for( i = 0; i < layout->count; i++ ) {
+		x0 = min(x0, x + layout->dx[i]);
+		y0 = min(y0, y + layout->dy[i]);
+		x1 = max(x1, x + layout->dx[i]);
+		y1 = max(y1, y + layout->dy[i]);
+	}
+	// cells outside the map are never reachable, let the per cell check skip them
+	if( x0 < 0 || y0 < 0 || x1 > map[m].xs-2 || y1 > map[m].ys-2 )
+		return false;
+	return !map_getcell_area(&map[m], x0, y0, x1, y1, CELL_CHKNOREACH);
+#endif
+}
+
 /**
  * Initializes and sets a ground skill / skill unit. Usually called after skill_casted_pos() or skill_castend_map()
  * @param src Object that triggers the skill
@@ -12486,7 +12515,7 @@ struct skill_unit_group *skill_unitsetting(struct block_list *src, uint16 skill_
 	struct status_change *sc;
 	int active_flag = 1;
 	int subunt = 0;
-	bool hidden = false;
+	bool hidden = false, reachable;
 
 	nullpo_retr(NULL, src);
 
@@ -12889,6 +12918,7 @@ struct skill_unit_group *skill_unitsetting(struct block_list *src, uint16 skill_
 
 	// Set skill unit
 	limit = group->limit;
+	reachable = group->state.song_dance || skill_unit_layout_reachable(src->m, x, y, layout);
 	for( i = 0; i < layout->count; i++ ) {
 		struct skill_unit *unit;
 		int ux = x + layout->dx[i];
@@ -12902,7 +12932,7 @@ struct skill_unit_group *skill_unitsetting(struct block_list *src, uint16 skill_
 			continue;
 		}
 
-		if( !group->state.song_dance && !map_getcell(src->m,ux,uy,CELL_CHKREACH) )
+		if( !reachable && !map_getcell(src->m,ux,uy,CELL_CHKREACH) )
 			continue; // don't place skill units on walls (except for songs/dances/encores)
 		if( battle_config.skill_wall_check && unit_flag&UF_PATHCHECK && !path_search_long(NULL,src->m,ux,uy,src->x,src->y,CELL_CHKWALL) )
 			continue; // no path between cell and caster
@@ -14986,15 +15016,10 @@ bool skill_check_condition_castbegin(struct map_session_data* sd, uint16 skill_i
 			break;
 		case CG_MOONLIT: //Check there's no wall in the range+1 area around the caster. [Skotlex]
 			{
-				int s,range = skill_get_splash(skill_id, skill_lv)+1;
-				int size = range*2+1;
-				for (s=0;s<size*size;s++) {
-					int x = sd->bl.x+(s%size-range);
-					int y = sd->bl.y+(s/size-range);
-					if (map_getcell(sd->bl.m,x,y,CELL_CHKWALL)) {
-						clif_skill_fail(sd,skill_id,USESKILL_FAIL_LEVEL,0);
-						return false;
-					}
+				int range = skill_get_splash(skill_id, skill_lv)+1;
+				if (map_getcell_area(&map[sd->bl.m],sd->bl.x-range,sd->bl.y-range,sd->bl.x+range,sd->bl.y+range,CELL_CHKWALL)) {
+					clif_skill_fail(sd,skill_id,USESKILL_FAIL_LEVEL,0);
+					return false;
 				}
 			}
 			break;
@@ -15020,15 +15045,10 @@ bool skill_check_condition_castbegin(struct map_session_data* sd, uint16 skill_i
 			if( !sc || (sc && !sc->data[SC_BASILICA])) {
 				if( sd ) {
 					// When castbegin, needs 7x7 clear area
-					int s,range = skill_get_unit_layout_type(skill_id,skill_lv)+1;
-					int size = range*2+1;
-					for( s=0;s<size*size;s++ ) {
-						int x = sd->bl.x+(s%size-range);
-						int y = sd->bl.y+(s/size-range);
-						if( map_getcell(sd->bl.m,x,y,CELL_CHKWALL) ) {
-							clif_skill_fail(sd,skill_id,USESKILL_FAIL,0);
-							return false;
-						}
+					int range = skill_get_unit_layout_type(skill_id,skill_lv)+1;
+					if( map_getcell_area(&map[sd->bl.m],sd->bl.x-range,sd->bl.y-range,sd->bl.x+range,sd->bl.y+range,CELL_CHKWALL) ) {
+						clif_skill_fail(sd,skill_id,USESKILL_FAIL,0);
+						return false;
 					}
 					if( map_foreachinrange(skill_count_wos, &sd->bl, range, BL_ALL, &sd->bl) ) {
 						clif_skill_fail(sd,skill_id,USESKILL_FAIL,0);
@@ -21399,6 +21419,8 @@ void do_init_skill(void)
 	add_timer_func_list(skill_unit_timer,"skill_unit_timer");
 	add_timer_func_list(skill_castend_id,"skill_castend_id");
 	add_timer_func_list(skill_castend_pos,"skill_castend_pos");
+	timer_set_critical(skill_castend_id);
+	timer_set_critical(skill_castend_pos);
 	add_timer_func_list(skill_timerskill,"skill_timerskill");
 	add_timer_func_list(skill_blockpc_end, "skill_blockpc_end");
 
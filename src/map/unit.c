@@ -1210,6 +1210,8 @@ int unit_warp(struct block_list *bl,short m,short x,short y,clr_type type)
 	if (!unit_remove_map(bl, type))
 		return 3;
 
+	ud->state.move_pending = 0; // Don't send the walk of the old position
+
 	if (bl->m != m && battle_config.clear_unit_onwarp &&
 		battle_config.clear_unit_onwarp&bl->type)
 		skill_clear_unitgroup(bl);
@@ -1269,6 +1271,8 @@ int unit_stop_walking(struct block_list *bl,int type)
 		unit_walktoxy_timer(INVALID_TIMER, tick, bl->id, ud->walkpath.path_pos);
 	}
 
+	ud->state.move_pending = 0; // The queued walk no longer matches the path
+
 	if(type&0x01)
 		clif_fixpos(bl);
 
@@ -3218,6 +3222,8 @@ int unit_free(struct block_list *bl, clr_type clrtype)
 			}
 			sd->qi_count = 0;
 
+			clif_item_cache_free(sd, ITEMCACHE_MAX);
+
 #if PACKETVER >= 20150513
 			if( sd->hatEffectCount > 0 ){
 				aFree(sd->hatEffectIDs);
@@ -3437,6 +3443,9 @@ void do_init_unit(void){
 	add_timer_func_list(unit_attack_timer,  "unit_attack_timer");
 	add_timer_func_list(unit_walktoxy_timer,"unit_walktoxy_timer");
 	add_timer_func_list(unit_walktobl_sub, "unit_walktobl_sub");
+	timer_set_critical(unit_attack_timer);
+	timer_set_critical(unit_walktoxy_timer);
+	timer_set_critical(unit_walktobl_sub);
 	add_timer_func_list(unit_delay_walktoxy_timer,"unit_delay_walktoxy_timer");
 	add_timer_func_list(unit_delay_walktobl_timer,"unit_delay_walktobl_timer");
 	add_timer_func_list(unit_teleport_timer,"unit_teleport_timer");
@@ -54,7 +54,9 @@ struct unit_data {
 		unsigned speed_changed : 1;
 		unsigned walk_script : 1;
 		unsigned blockedmove : 1;
+		unsigned move_pending : 1; // Movement is queued until the end of the tick (see clif_move_flush)
 	} state;
+	unsigned int move_tick; // Walk start of the queued movement (see clif_move_flush)
 	char walk_done_event[EVENT_NAME_LENGTH];
 };
 
@@ -14,6 +14,7 @@
 #include "../common/malloc.h"
 #include "../common/mmo.h"
 #include "../common/showmsg.h"
+#include "../common/strlib.h"
 #include "../common/utils.h"
 
 #include "../config/renewal.h"
@@ -24,23 +25,25 @@ char grf_list_file[256] = "conf/grf-files.txt";
 char map_list_file[256] = "db/map_index.txt";
 char map_cache_file[256];
 int rebuild = 0;
-
-FILE *map_cache_fp;
-
-unsigned long file_size;
+int format = 1;
 
 // Used internally, this structure contains the physical map cells
 struct map_data {
+	char name[MAP_NAME_LENGTH];
 	int16 xs;
 	int16 ys;
 	unsigned char *cells;
 };
 
+// Maps that will be written to the cache, the existing ones first
+struct map_data *maps;
+int map_count, map_max;
+
 // This is the main header found at the very beginning of the file
 struct main_header {
 	uint32 file_size;
 	uint16 map_count;
-} header;
+};
 
 // This is the header appended before every compressed map cells info
 struct map_info {
@@ -50,6 +53,25 @@ struct map_info {
 	int32 len;
 };
 
+// Format 2: sorted directory and uncompressed bit planes, see map.c
+#define V2_MAGIC "MCv2"
+#define V2_PLANES 3 // walkable, shootable, water
+
+struct v2_header {
+	char magic[4];
+	uint32 file_size;
+	uint32 map_count;
+	uint32 dir_offset;
+};
+
+struct v2_entry {
+	char name[MAP_NAME_LENGTH];
+	int16 xs;
+	int16 ys;
+	uint32 stride;
+	uint32 offset;
+};
+
 
 // Reads a map from GRF's GAT and RSW files
 int read_map(char *name, struct map_data *m)
@@ -107,57 +129,255 @@ int read_map(char *name, struct map_data *m)
 	return 1;
 }
 
+// Terrain bits of a gat type (same as map_gat2cell)
+static void gat2bits(unsigned char type, bool *walkable, bool *shootable, bool *water)
+{
+	*walkable = (type != 1 && type != 5);
+	*shootable = (type != 1);
+	*water = (type == 3);
+}
+
+// Gat type of terrain bits (same as map_cell2gat)
+static unsigned char bits2gat(bool walkable, bool shootable, bool water)
+{
+	if (water)
+		return 3;
+	if (walkable)
+		return 0;
+	return shootable ? 5 : 1;
+}
+
 // Adds a map to the cache
 void cache_map(char *name, struct map_data *m)
 {
-	struct map_info info;
-	unsigned long len;
-	unsigned char *write_buf;
-
-	// Create an output buffer twice as big as the uncompressed map... this way we're sure it fits
-	len = (unsigned long)m->xs*(unsigned long)m->ys*2;
-	write_buf = (unsigned char *)aMalloc(len);
-	// Compress the cells and get the compressed length
-	encode_zip(write_buf, &len, m->cells, m->xs*m->ys);
-
-	// Fill the map header
-	if (strlen(name) > MAP_NAME_LENGTH) // It does not hurt to warn that there are maps with name longer than allowed.
-		ShowWarning ("Map name '%s' size '%d' is too long. Truncating to '%d'.\n", name, strlen(name), MAP_NAME_LENGTH);
-	strncpy(info.name, name, MAP_NAME_LENGTH);
-	info.xs = MakeShortLE(m->xs);
-	info.ys = MakeShortLE(m->ys);
-	info.len = MakeLongLE(len);
-
-	// Append map header then compressed cells at the end of the file
-	fseek(map_cache_fp, header.file_size, SEEK_SET);
-	fwrite(&info, sizeof(struct map_info), 1, map_cache_fp);
-	fwrite(write_buf, 1, len, map_cache_fp);
-	header.file_size += sizeof(struct map_info) + len;
-	header.map_count++;
-
-	aFree(write_buf);
-	aFree(m->cells);
-
-	return;
+	if (strlen(name) >= MAP_NAME_LENGTH) // It does not hurt to warn that there are maps with name longer than allowed.
+		ShowWarning ("Map name '%s' size '%d' is too long. Truncating to '%d'.\n", name, strlen(name), MAP_NAME_LENGTH-1);
+	safestrncpy(m->name, name, MAP_NAME_LENGTH);
+
+	if (map_count == map_max) {
+		map_max += 256;
+		RECREATE(maps, struct map_data, map_max);
+	}
+	maps[map_count++] = *m;
 }
 
 // Checks whether a map is already is the cache
 int find_map(char *name)
 {
 	int i;
-	struct map_info info;
-
-	fseek(map_cache_fp, sizeof(struct main_header), SEEK_SET);
 
-	for(i = 0; i < header.map_count; i++) {
-		if(fread(&info, sizeof(info), 1, map_cache_fp) != 1) printf("An error as occured in fread while reading map_cache\n");
-		if(strcmp(name, info.name) == 0) // Map found
+	for (i = 0; i < map_count; i++)
+		if (strncmp(name, maps[i].name, MAP_NAME_LENGTH) == 0)
 			return 1;
-		else // Map not found, jump to the beginning of the next map info header
-			fseek(map_cache_fp, GetLong((unsigned char *)&(info.len)), SEEK_CUR);
+	return 0;
+}
+
+// Loads the maps of an existing cache of either format
+int load_cache(FILE *fp)
+{
+	unsigned char *buf;
+	long size;
+	struct map_data m;
+	char name[MAP_NAME_LENGTH];
+
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (size < (long)sizeof(struct main_header))
+		return 0;
+	buf = (unsigned char *)aMalloc(size);
+	if (fread(buf, 1, size, fp) != (size_t)size) {
+		aFree(buf);
+		return 0;
 	}
 
-	return 0;
+	if (size >= (long)sizeof(struct v2_header) && memcmp(buf, V2_MAGIC, 4) == 0) {
+		uint32 i, count = GetULong(buf+8), dir = GetULong(buf+12);
+
+		for (i = 0; i < count && dir + (i+1)*sizeof(struct v2_entry) <= (uint32)size; i++) {
+			unsigned char *e = buf + dir + i*sizeof(struct v2_entry);
+			uint32 stride = GetULong(e+16), offset = GetULong(e+20);
+			size_t plane, x, y;
+
+			safestrncpy(name, (char *)e, MAP_NAME_LENGTH);
+			m.xs = (int16)GetUShort(e+12);
+			m.ys = (int16)GetUShort(e+14);
+			plane = (size_t)stride*m.ys;
+			if (m.xs <= 0 || m.ys <= 0 || offset + V2_PLANES*plane > (size_t)size) {
+				ShowError("Map '%s' in the existing cache is corrupted, skipping.\n", name);
+				continue;
+			}
+			m.cells = (unsigned char *)aMalloc((size_t)m.xs*m.ys);
+			for (y = 0; y < (size_t)m.ys; y++) {
+				for (x = 0; x < (size_t)m.xs; x++) {
+					size_t i2 = offset + y*stride + x/8;
+					unsigned char bit = 1<<(x&7);
+					m.cells[x + y*m.xs] = bits2gat((buf[i2]&bit) != 0, (buf[i2+plane]&bit) != 0, (buf[i2+2*plane]&bit) != 0);
+				}
+			}
+			cache_map(name, &m);
+		}
+	} else {
+		uint16 i, count = GetUShort(buf+4);
+		long off = sizeof(struct main_header);
+
+		for (i = 0; i < count && off + (long)sizeof(struct map_info) <= size; i++) {
+			unsigned char *info = buf + off;
+			int32 len = GetLong(info+16);
+			unsigned long cells;
+
+			safestrncpy(name, (char *)info, MAP_NAME_LENGTH);
+			m.xs = (int16)GetUShort(info+12);
+			m.ys = (int16)GetUShort(info+14);
+			off += sizeof(struct map_info) + len;
+			if (len < 0 || off > size || m.xs <= 0 || m.ys <= 0) {
+				ShowError("Map '%s' in the existing cache is corrupted, skipping the rest.\n", name);
+				break;
+			}
+			cells = (unsigned long)m.xs*m.ys;
+			m.cells = (unsigned char *)aMalloc(cells);
+			decode_zip(m.cells, &cells, info + sizeof(struct map_info), len);
+			if (find_map(name)) { // the server only ever used the first one
+				aFree(m.cells);
+				continue;
+			}
+			cache_map(name, &m);
+		}
+	}
+
+	aFree(buf);
+	return 1;
+}
+
+// Writes the maps as a format 1 cache: a chain of zlib compressed gat types
+int write_cache_v1(FILE *fp)
+{
+	struct main_header header;
+	int i;
+
+	header.file_size = sizeof(struct main_header);
+	header.map_count = 0;
+	fseek(fp, sizeof(struct main_header), SEEK_SET);
+
+	for (i = 0; i < map_count; i++) {
+		struct map_data *m = &maps[i];
+		struct map_info info;
+		unsigned long len;
+		unsigned char *write_buf;
+
+		// Create an output buffer twice as big as the uncompressed map... this way we're sure it fits
+		len = (unsigned long)m->xs*(unsigned long)m->ys*2;
+		write_buf = (unsigned char *)aMalloc(len);
+		// Compress the cells and get the compressed length
+		encode_zip(write_buf, &len, m->cells, m->xs*m->ys);
+
+		// Fill the map header
+		strncpy(info.name, m->name, MAP_NAME_LENGTH);
+		info.xs = MakeShortLE(m->xs);
+		info.ys = MakeShortLE(m->ys);
+		info.len = MakeLongLE(len);
+
+		// Append map header then compressed cells at the end of the file
+		fwrite(&info, sizeof(struct map_info), 1, fp);
+		fwrite(write_buf, 1, len, fp);
+		header.file_size += sizeof(struct map_info) + len;
+		header.map_count++;
+
+		aFree(write_buf);
+	}
+
+	// Write the main header
+	header.file_size = MakeLongLE(header.file_size);
+	header.map_count = MakeShortLE(header.map_count);
+	fseek(fp, 0, SEEK_SET);
+	fwrite(&header, sizeof(struct main_header), 1, fp);
+	return map_count;
+}
+
+static int cmp_map_name(const void *a, const void *b)
+{
+	return strncmp(((const struct map_data *)a)->name, ((const struct map_data *)b)->name, MAP_NAME_LENGTH);
+}
+
+// Writes the maps as a format 2 cache: a sorted directory then the bit planes
+// of each map, 8-byte aligned so the server can use the file in place.
+int write_cache_v2(FILE *fp)
+{
+	struct v2_header header;
+	uint32 offset;
+	unsigned char *plane = NULL;
+	size_t plane_max = 0;
+	int i, n;
+
+	// Sort by name and drop duplicates, the directory is binary searched
+	qsort(maps, map_count, sizeof(maps[0]), cmp_map_name);
+	for (i = 1, n = 1; i < map_count; i++) {
+		if (cmp_map_name(&maps[n-1], &maps[i]) == 0) {
+			ShowWarning("Map '%s' is in the cache twice, keeping one.\n", maps[i].name);
+			aFree(maps[i].cells);
+			continue;
+		}
+		maps[n++] = maps[i];
+	}
+	if (map_count > 0)
+		map_count = n;
+
+	memcpy(header.magic, V2_MAGIC, 4);
+	header.map_count = MakeLongLE(map_count);
+	header.dir_offset = MakeLongLE(sizeof(struct v2_header));
+	offset = sizeof(struct v2_header) + map_count*sizeof(struct v2_entry);
+	offset = (offset + 7) & ~7;
+
+	fseek(fp, sizeof(struct v2_header), SEEK_SET);
+	for (i = 0; i < map_count; i++) {
+		struct v2_entry e;
+		uint32 stride = ((maps[i].xs + 63) / 64) * 8;
+
+		memset(&e, 0, sizeof(e));
+		strncpy(e.name, maps[i].name, MAP_NAME_LENGTH);
+		e.xs = MakeShortLE(maps[i].xs);
+		e.ys = MakeShortLE(maps[i].ys);
+		e.stride = MakeLongLE(stride);
+		e.offset = MakeLongLE(offset);
+		fwrite(&e, sizeof(e), 1, fp);
+		offset += V2_PLANES * stride * maps[i].ys;
+	}
+
+	for (i = 0; i < map_count; i++) {
+		struct map_data *m = &maps[i];
+		uint32 stride = ((m->xs + 63) / 64) * 8;
+		size_t size = (size_t)stride * m->ys, x, y;
+		int k;
+
+		if (size > plane_max) {
+			plane_max = size;
+			RECREATE(plane, unsigned char, plane_max);
+		}
+		if (i == 0) { // align the first plane
+			long pos = ftell(fp);
+			while (pos++ & 7)
+				fputc(0, fp);
+		}
+		for (k = 0; k < V2_PLANES; k++) {
+			memset(plane, 0, size);
+			for (y = 0; y < (size_t)m->ys; y++) {
+				for (x = 0; x < (size_t)m->xs; x++) {
+					bool bits[V2_PLANES];
+					gat2bits(m->cells[x + y*m->xs], &bits[0], &bits[1], &bits[2]);
+					if (bits[k])
+						plane[y*stride + x/8] |= 1<<(x&7);
+				}
+			}
+			fwrite(plane, 1, size, fp);
+		}
+	}
+	if (plane)
+		aFree(plane);
+
+	header.file_size = MakeLongLE((uint32)ftell(fp));
+	fseek(fp, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, fp);
+	return map_count;
 }
 
 // Cuts the extension from a map name
@@ -189,6 +409,9 @@ void process_args(int argc, char *argv[])
 		} else if(strcmp(argv[i], "-cache") == 0) {
 			if(++i < argc)
 				strcpy(map_cache_file, argv[i]);
+		} else if(strcmp(argv[i], "-format") == 0) {
+			if(++i < argc)
+				format = atoi(argv[i]);
 		} else if(strcmp(argv[i], "-rebuild") == 0)
 			rebuild = 1;
 	}
@@ -198,9 +421,11 @@ void process_args(int argc, char *argv[])
 int do_init(int argc, char** argv)
 {
 	FILE *list;
+	FILE *map_cache_fp;
 	char line[1024];
 	struct map_data map;
 	char name[MAP_NAME_LENGTH_EXT];
+	int count;
 
 	/* setup pre-defined, #define-dependant */
 	sprintf(map_cache_file,"db/%s/map_cache.dat",
@@ -217,23 +442,21 @@ int do_init(int argc, char** argv)
 	ShowStatus("Initializing grfio with %s\n", grf_list_file);
 	grfio_init(grf_list_file);
 
-	// Attempt to open the map cache file and force rebuild if not found
+	if (format != 1 && format != 2) {
+		ShowError("Unknown map cache format %d, use 1 or 2.\n", format);
+		exit(EXIT_FAILURE);
+	}
+
+	// Load the existing map cache, unless rebuilding
 	ShowStatus("Opening map cache: %s\n", map_cache_file);
 	if(!rebuild) {
-		map_cache_fp = fopen(map_cache_file, "rb");
-		if(map_cache_fp == NULL) {
+		FILE *fp = fopen(map_cache_file, "rb");
+		if(fp == NULL || !load_cache(fp)) {
 			ShowNotice("Existing map cache not found, forcing rebuild mode\n");
 			rebuild = 1;
-		} else
-			fclose(map_cache_fp);
-	}
-	if(rebuild)
-		map_cache_fp = fopen(map_cache_file, "w+b");
-	else
-		map_cache_fp = fopen(map_cache_file, "r+b");
-	if(map_cache_fp == NULL) {
-		ShowError("Failure when opening map cache file %s\n", map_cache_file);
-		exit(EXIT_FAILURE);
+		}
+		if(fp != NULL)
+			fclose(fp);
 	}
 
 	// Open the map list
@@ -244,16 +467,6 @@ int do_init(int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 
-	// Initialize the main header
-	if(rebuild) {
-		header.file_size = sizeof(struct main_header);
-		header.map_count = 0;
-	} else {
-		if(fread(&header, sizeof(struct main_header), 1, map_cache_fp) != 1){ printf("An error as occured while reading map_cache_fp \n"); }
-		header.file_size = GetULong((unsigned char *)&(header.file_size));
-		header.map_count = GetUShort((unsigned char *)&(header.map_count));
-	}
-
 	// Read and process the map list
 	while(fgets(line, sizeof(line), list))
 	{
@@ -281,20 +494,30 @@ int do_init(int argc, char** argv)
 	ShowStatus("Closing map list: %s\n", map_list_file);
 	fclose(list);
 
-	// Write the main header and close the map cache
-	ShowStatus("Closing map cache: %s\n", map_cache_file);
-	fseek(map_cache_fp, 0, SEEK_SET);
-	fwrite(&header, sizeof(struct main_header), 1, map_cache_fp);
+	// Write the whole map cache
+	ShowStatus("Writing map cache (format %d): %s\n", format, map_cache_file);
+	map_cache_fp = fopen(map_cache_file, "wb");
+	if(map_cache_fp == NULL) {
+		ShowError("Failure when opening map cache file %s\n", map_cache_file);
+		exit(EXIT_FAILURE);
+	}
+	count = (format == 2) ? write_cache_v2(map_cache_fp) : write_cache_v1(map_cache_fp);
 	fclose(map_cache_fp);
 
 	ShowStatus("Finalizing grfio\n");
 	grfio_final();
 
-	ShowInfo("%d maps now in cache\n", header.map_count);
+	ShowInfo("%d maps now in cache\n", count);
 
 	return 0;
 }
 
 void do_final(void)
 {
+	int i;
+
+	for (i = 0; i < map_count; i++)
+		aFree(maps[i].cells);
+	if (maps)
+		aFree(maps);
 }
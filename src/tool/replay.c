@@ -0,0 +1,958 @@
+// Copyright (c) rAthena Dev Teams - Licensed under GNU GPL
+// For more information, see LICENCE in the main folder
+
+// Packet replay tool
+// Plays back a packet trace written by the map-server ('packet_capture' in
+// map_athena.conf) against a local map-server, with any number of copies of
+// every captured session, and reports what the clients observe.
+// The tool stands in for the char-server, so the map-server authenticates the
+// simulated players with the character data stored in the trace.
+// See doc/packet_replay.txt for the setup.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+typedef int socklen_t;
+#else
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#define closesocket close
+#endif
+
+#include "../common/cbasetypes.h"
+#include "../common/interpacket.h"
+#include "../common/malloc.h"
+#include "../common/mmo.h"
+#include "../common/packettrace.h"
+#include "../common/showmsg.h"
+#include "../common/strlib.h"
+#include "../common/timer.h" // DIFF_TICK
+
+#define RBUFP(p,pos) (((uint8*)(p)) + (pos))
+#define RBUFB(p,pos) (*(uint8*)RBUFP((p),(pos)))
+#define RBUFW(p,pos) (*(uint16*)RBUFP((p),(pos)))
+#define RBUFL(p,pos) (*(uint32*)RBUFP((p),(pos)))
+#define WBUFP(p,pos) (((uint8*)(p)) + (pos))
+#define WBUFB(p,pos) (*(uint8*)WBUFP((p),(pos)))
+#define WBUFW(p,pos) (*(uint16*)WBUFP((p),(pos)))
+#define WBUFL(p,pos) (*(uint32*)WBUFP((p),(pos)))
+
+char trace_file[1024] = "log/packets.trace";
+char map_ip[64] = "127.0.0.1";
+uint16 map_port = 5121;
+uint16 char_port = 6121;
+int copies = 1;
+double speed = 1.0;
+int spread = 10; // ms between the logins of the copies of a session
+uint32 id_stride = 100000; // added to account and char ids for every copy
+int report_interval = 10; // seconds
+
+/// Client packet of a captured session
+struct trace_packet {
+	unsigned int tick;
+	uint16 len;
+	uint16 id_pos[PTRACE_ID_FIELDS]; // offsets of the fields that can hold the ids of the player, 0 if unused
+	uint8* data;
+};
+
+/// Captured session
+struct trace_session {
+	uint32 account_id, char_id;
+	int group_id;
+	struct mmo_charstatus* status; // NULL if the session never logged in
+	struct s_storage* storage[TABLE_STORAGE+1]; // inventory, cart and storage, indexed by enum storage_type
+	struct trace_packet* packets;
+	int count, max;
+	unsigned int start, end;
+};
+
+struct trace_session* trace_sessions = NULL;
+int trace_session_count = 0;
+unsigned int trace_first = UINT_MAX, trace_last = 0;
+uint32 trace_sent_packets = 0, trace_sent_bytes = 0; // server output in the capture
+
+/// Simulated client
+struct replay_client {
+	struct trace_session* ts;
+	uint32 account_id, char_id;
+	int fd; // -1 if not connected
+	int next; // next packet to send
+	unsigned int start; // when the session starts, in replay ticks
+	unsigned int wait_tick; // when the last unanswered packet was sent, 0 if none
+	bool done;
+};
+
+struct replay_client* clients = NULL;
+int client_count = 0;
+
+/// Time histograms, in ms
+static const unsigned int histogram_limit[] = { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, UINT_MAX };
+#define HISTOGRAM_SIZE ARRAYLENGTH(histogram_limit)
+
+struct histogram {
+	uint32 count[HISTOGRAM_SIZE];
+	uint32 total;
+	unsigned int max;
+};
+
+struct {
+	uint32 packets, bytes_out, bytes_in;
+	uint32 logins, kicked;
+	struct histogram response; // time from a client packet to the next server data
+	struct histogram lag; // how late packets were sent, if high the tool is the bottleneck
+} stats, interval_stats;
+
+/// Char-server stub connection
+int char_listen = -1;
+int char_fd = -1;
+uint8* char_rbuf = NULL;
+size_t char_rsize = 0, char_rmax = 0;
+bool map_ready = false;
+
+/// Returns a millisecond tick.
+static unsigned int replay_tick(void)
+{
+#ifdef _WIN32
+	return GetTickCount();
+#else
+	struct timespec tval;
+	clock_gettime(CLOCK_MONOTONIC, &tval);
+	return (unsigned int)(tval.tv_sec * 1000 + tval.tv_nsec / 1000000);
+#endif
+}
+
+static void histogram_add(struct histogram* h, unsigned int value)
+{
+	int i;
+
+	ARR_FIND(0, HISTOGRAM_SIZE, i, value < histogram_limit[i]);
+	h->count[i]++;
+	h->total++;
+	if( value > h->max )
+		h->max = value;
+}
+
+/// Returns the upper limit of the bucket holding the given percentile.
+static unsigned int histogram_percentile(struct histogram* h, int percent)
+{
+	uint32 n = 0, target = (uint32)((uint64)h->total * percent / 100);
+	int i;
+
+	for( i = 0; i < HISTOGRAM_SIZE - 1; i++ ) {
+		n += h->count[i];
+		if( n > target )
+			break;
+	}
+	return ( i == HISTOGRAM_SIZE - 1 ) ? h->max : min(histogram_limit[i], h->max);
+}
+
+static void histogram_show(const char* name, struct histogram* h)
+{
+	int i;
+
+	ShowMessage("%s (%u samples, max %ums):\n", name, h->total, h->max);
+	for( i = 0; i < HISTOGRAM_SIZE; i++ ) {
+		if( !h->count[i] )
+			continue;
+		if( histogram_limit[i] == UINT_MAX )
+			ShowMessage("  >= %5ums: %u\n", histogram_limit[i-1], h->count[i]);
+		else
+			ShowMessage("  <  %5ums: %u\n", histogram_limit[i], h->count[i]);
+	}
+}
+
+/*==========================================
+ * Trace loading
+ *------------------------------------------*/
+static struct trace_session* trace_session_get(uint32 id)
+{
+	if( id == 0 )
+		return NULL;
+	if( (int)id > trace_session_count ) {
+		RECREATE(trace_sessions, struct trace_session, id);
+		memset(trace_sessions + trace_session_count, 0, (id - trace_session_count) * sizeof(struct trace_session));
+		trace_session_count = id;
+	}
+	return &trace_sessions[id-1];
+}
+
+static bool trace_load(const char* file)
+{
+	uint8 header[PTRACE_HEADER_SIZE], record[PTRACE_RECORD_SIZE];
+	FILE* fp;
+	int i, count = 0;
+
+	if( (fp = fopen(file, "rb")) == NULL ) {
+		ShowError("Failed to open packet trace '%s'.\n", file);
+		return false;
+	}
+	if( fread(header, 1, PTRACE_HEADER_SIZE, fp) != PTRACE_HEADER_SIZE || memcmp(header, PTRACE_MAGIC, sizeof(PTRACE_MAGIC)) != 0 ) {
+		ShowError("'%s' is not a packet trace.\n", file);
+		fclose(fp);
+		return false;
+	}
+	if( RBUFL(header,8) != PTRACE_VERSION ) {
+		ShowError("Packet trace '%s' has version %u, expected %u.\n", file, RBUFL(header,8), PTRACE_VERSION);
+		fclose(fp);
+		return false;
+	}
+	if( RBUFL(header,16) != sizeof(struct mmo_charstatus) || RBUFL(header,20) != sizeof(struct s_storage) ) {
+		ShowError("Packet trace '%s' was written by a map-server built with different settings (struct sizes %u/%u, expected %u/%u).\n",
+			file, RBUFL(header,16), RBUFL(header,20), (uint32)sizeof(struct mmo_charstatus), (uint32)sizeof(struct s_storage));
+		fclose(fp);
+		return false;
+	}
+
+	while( fread(record, 1, PTRACE_RECORD_SIZE, fp) == PTRACE_RECORD_SIZE ) {
+		unsigned int tick = RBUFL(record,0);
+		struct trace_session* ts = trace_session_get(RBUFL(record,4));
+		uint8 type = RBUFB(record,8);
+		uint32 len = RBUFL(record,9);
+		uint8* data = NULL;
+
+		if( len ) {
+			data = (uint8*)aMalloc(len);
+			if( fread(data, 1, len, fp) != len ) {
+				ShowWarning("Packet trace '%s' is truncated.\n", file);
+				aFree(data);
+				break;
+			}
+		}
+		if( ts == NULL ) {
+			if( data )
+				aFree(data);
+			continue;
+		}
+
+		switch( type ) {
+			case PTRACE_OPEN:
+				ts->start = ts->end = tick;
+				break;
+			case PTRACE_AUTH:
+				if( len == 4 + sizeof(struct mmo_charstatus) ) {
+					ts->group_id = RBUFL(data,0);
+					if( ts->status == NULL )
+						CREATE(ts->status, struct mmo_charstatus, 1);
+					memcpy(ts->status, RBUFP(data,4), sizeof(struct mmo_charstatus));
+					ts->account_id = ts->status->account_id;
+					ts->char_id = ts->status->char_id;
+				}
+				break;
+			case PTRACE_STORAGE:
+				if( len == 1 + sizeof(struct s_storage) && RBUFB(data,0) <= TABLE_STORAGE && ((struct s_storage*)RBUFP(data,1))->stor_id == 0 ) {
+					struct s_storage** stor = &ts->storage[RBUFB(data,0)];
+
+					if( *stor == NULL )
+						CREATE(*stor, struct s_storage, 1);
+					memcpy(*stor, RBUFP(data,1), sizeof(struct s_storage));
+				}
+				break;
+			case PTRACE_RECV:
+				if( len >= 2*PTRACE_ID_FIELDS + 2 && len - 2*PTRACE_ID_FIELDS <= UINT16_MAX ) {
+					struct trace_packet* p;
+					int j;
+
+					if( ts->count == ts->max ) {
+						ts->max += 64;
+						RECREATE(ts->packets, struct trace_packet, ts->max);
+					}
+					p = &ts->packets[ts->count];
+					p->tick = tick;
+					p->len = (uint16)(len - 2*PTRACE_ID_FIELDS);
+					for( j = 0; j < PTRACE_ID_FIELDS; j++ )
+						p->id_pos[j] = RBUFW(data,2*j);
+					memmove(data, data + 2*PTRACE_ID_FIELDS, p->len);
+					p->data = data;
+					ts->count++;
+					data = NULL; // kept
+					count++;
+				}
+				break;
+			case PTRACE_SEND:
+				trace_sent_packets++;
+				if( len >= 6 )
+					trace_sent_bytes += RBUFL(data,2);
+				break;
+		}
+		ts->end = tick;
+		trace_first = min(trace_first, tick);
+		trace_last = max(trace_last, tick);
+		if( data )
+			aFree(data);
+	}
+	fclose(fp);
+
+	for( i = 0, client_count = 0; i < trace_session_count; i++ )
+		if( trace_sessions[i].status && trace_sessions[i].count )
+			client_count++;
+	if( client_count == 0 ) {
+		ShowError("Packet trace '%s' holds no session that logged in.\n", file);
+		return false;
+	}
+
+	ShowStatus("Loaded '"CL_WHITE"%s"CL_RESET"': "CL_WHITE"%d"CL_RESET" sessions ("CL_WHITE"%d"CL_RESET" replayable), "CL_WHITE"%d"CL_RESET" client packets, %.1f seconds.\n",
+		file, trace_session_count, client_count, count, (trace_last - trace_first) / 1000.);
+	return true;
+}
+
+/*==========================================
+ * Sockets
+ *------------------------------------------*/
+static void socket_nodelay(int fd)
+{
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&yes, sizeof(yes));
+}
+
+/// Sends all of data, the sockets are blocking.
+static bool socket_sendall(int fd, const uint8* data, size_t len)
+{
+	while( len > 0 ) {
+		int n = send(fd, (const char*)data, (int)len, 0);
+
+		if( n <= 0 )
+			return false;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/*==========================================
+ * Char-server stub
+ *------------------------------------------*/
+static struct replay_client* client_find(uint32 account_id, uint32 char_id)
+{
+	int i;
+
+	ARR_FIND(0, client_count, i, clients[i].account_id == account_id && clients[i].char_id == char_id);
+	return ( i < client_count ) ? &clients[i] : NULL;
+}
+
+static void char_send(const uint8* data, size_t len)
+{
+	if( char_fd != -1 && !socket_sendall(char_fd, data, len) ) {
+		ShowError("Lost the connection to the map-server.\n");
+		closesocket(char_fd);
+		char_fd = -1;
+		char_rsize = 0;
+	}
+}
+
+/// Answers a registry request with empty registries of every type.
+static void char_registry(uint32 account_id, uint32 char_id)
+{
+	uint8 buf[16];
+	int type;
+
+	for( type = 1; type <= 3; type++ ) {
+		WBUFW(buf,0) = 0x3804;
+		WBUFW(buf,2) = 16;
+		WBUFL(buf,4) = account_id;
+		WBUFL(buf,8) = char_id;
+		WBUFB(buf,12) = type;
+		WBUFB(buf,13) = 0;
+		WBUFW(buf,14) = 0;
+		char_send(buf, 16);
+	}
+}
+
+/// Answers an inventory/cart/storage request with the captured one, or an empty one.
+static void char_storage(uint8 type, uint32 account_id, uint32 char_id, uint8 stor_id, uint8 mode)
+{
+	static uint8 buf[10 + sizeof(struct s_storage)];
+	struct replay_client* c = client_find(account_id, char_id);
+	struct s_storage* stor = (struct s_storage*)WBUFP(buf,10);
+
+	memset(stor, 0, sizeof(struct s_storage));
+	if( c && stor_id == 0 && type <= TABLE_STORAGE && c->ts->storage[type] )
+		memcpy(stor, c->ts->storage[type], sizeof(struct s_storage));
+	else {
+		stor->type = (enum storage_type)type;
+		stor->max_amount = ( type == TABLE_INVENTORY ) ? MAX_INVENTORY : ( type == TABLE_CART ) ? MAX_CART : MAX_STORAGE;
+	}
+	stor->id = ( type == TABLE_STORAGE ) ? account_id : char_id;
+	stor->stor_id = stor_id;
+	stor->state.put = (mode&STOR_MODE_PUT) ? 1 : 0;
+	stor->state.get = (mode&STOR_MODE_GET) ? 1 : 0;
+
+	WBUFW(buf,0) = 0x388a;
+	WBUFW(buf,2) = sizeof(buf);
+	WBUFB(buf,4) = type;
+	WBUFL(buf,5) = account_id;
+	WBUFB(buf,9) = 1;
+	char_send(buf, sizeof(buf));
+}
+
+/// Answers an authentication request with the captured character.
+static void char_auth(uint32 account_id, uint32 char_id, uint32 login_id1, uint8 sex)
+{
+	static uint8 buf[25 + sizeof(struct mmo_charstatus)];
+	struct replay_client* c = client_find(account_id, char_id);
+
+	if( c == NULL ) {
+		ShowWarning("Authentication request for unknown character %u:%u.\n", account_id, char_id);
+		WBUFW(buf,0) = 0x2b27;
+		WBUFL(buf,2) = account_id;
+		WBUFL(buf,6) = char_id;
+		WBUFL(buf,10) = login_id1;
+		WBUFB(buf,14) = sex;
+		WBUFL(buf,15) = 0;
+		char_send(buf, 19);
+		return;
+	}
+
+	WBUFW(buf,0) = 0x2afd;
+	WBUFW(buf,2) = sizeof(buf);
+	WBUFL(buf,4) = account_id;
+	WBUFL(buf,8) = login_id1;
+	WBUFL(buf,12) = 0; // login_id2
+	WBUFL(buf,16) = 0; // expiration time
+	WBUFL(buf,20) = c->ts->group_id;
+	WBUFB(buf,24) = 0; // changing map-servers
+	memcpy(WBUFP(buf,25), c->ts->status, sizeof(struct mmo_charstatus));
+	((struct mmo_charstatus*)WBUFP(buf,25))->account_id = account_id;
+	((struct mmo_charstatus*)WBUFP(buf,25))->char_id = char_id;
+	char_send(buf, sizeof(buf));
+	stats.logins++;
+	interval_stats.logins++;
+}
+
+/// Handles one packet from the map-server.
+static void char_parse_packet(const uint8* p)
+{
+	uint8 buf[64];
+
+	switch( RBUFW(p,0) ) {
+		case 0x2af8: // login
+			WBUFW(buf,0) = 0x2af9;
+			WBUFB(buf,2) = 0;
+			char_send(buf, 3);
+			break;
+		case 0x2afa: // map list
+			WBUFW(buf,0) = 0x2afb;
+			WBUFW(buf,2) = 5 + NAME_LENGTH + MAP_NAME_LENGTH + 4;
+			WBUFB(buf,4) = 0;
+			safestrncpy((char*)WBUFP(buf,5), "Server", NAME_LENGTH);
+			safestrncpy((char*)WBUFP(buf,5+NAME_LENGTH), "prontera", MAP_NAME_LENGTH);
+			WBUFW(buf,5+NAME_LENGTH+MAP_NAME_LENGTH) = 156;
+			WBUFW(buf,7+NAME_LENGTH+MAP_NAME_LENGTH) = 191;
+			char_send(buf, WBUFW(buf,2));
+			if( !map_ready )
+				ShowStatus("Map-server connected.\n");
+			map_ready = true;
+			break;
+		case 0x2afc: // status changes
+			WBUFW(buf,0) = 0x2b1d;
+			WBUFW(buf,2) = 14;
+			WBUFL(buf,4) = RBUFL(p,2);
+			WBUFL(buf,8) = RBUFL(p,6);
+			WBUFW(buf,12) = 0;
+			char_send(buf, 14);
+			break;
+		case 0x2b01: // save character
+			if( RBUFB(p,12) ) { // quitting
+				WBUFW(buf,0) = 0x2b21;
+				WBUFL(buf,2) = RBUFL(p,4);
+				WBUFL(buf,6) = RBUFL(p,8);
+				char_send(buf, 10);
+			}
+			break;
+		case 0x2b23: // keepalive
+			WBUFW(buf,0) = 0x2b24;
+			char_send(buf, 2);
+			break;
+		case 0x2b26: // authentication
+			char_auth(RBUFL(p,2), RBUFL(p,6), RBUFL(p,10), RBUFB(p,14));
+			break;
+		case 0x3005: // registries
+			char_registry(RBUFL(p,2), RBUFL(p,6));
+			break;
+		case 0x308a: // storage load
+			char_storage(RBUFB(p,2), RBUFL(p,3), RBUFL(p,7), RBUFB(p,11), RBUFB(p,12));
+			break;
+		case 0x308b: // storage save
+			WBUFW(buf,0) = 0x388b;
+			WBUFL(buf,2) = RBUFL(p,5);
+			WBUFB(buf,6) = 1;
+			WBUFB(buf,7) = RBUFB(p,4);
+			WBUFB(buf,8) = RBUFB(p,13 + offsetof(struct s_storage, stor_id));
+			char_send(buf, 9);
+			break;
+		default: // everything else is not needed by the replayed players
+			break;
+	}
+}
+
+/// Splits the data received from the map-server into packets.
+static void char_parse(void)
+{
+	size_t pos = 0;
+
+	while( char_rsize - pos >= 2 ) {
+		const uint8* p = char_rbuf + pos;
+		uint16 cmd = RBUFW(p,0);
+		int len = 0;
+
+		if( cmd >= 0x2af8 && cmd < 0x2af8 + ARRAYLENGTH(chmapif_recv_packet_length) )
+			len = chmapif_recv_packet_length[cmd - 0x2af8];
+		else if( cmd >= 0x3000 && cmd < 0x3000 + ARRAYLENGTH(inter_recv_packet_length) )
+			len = inter_recv_packet_length[cmd - 0x3000];
+		if( len == 0 ) {
+			ShowError("Unknown packet 0x%04x from the map-server (is Gepard Shield disabled?).\n", cmd);
+			exit(EXIT_FAILURE);
+		}
+		if( len == -1 ) {
+			if( char_rsize - pos < 4 )
+				break;
+			len = RBUFW(p,2);
+			if( len < 4 ) {
+				ShowError("Invalid length %d of packet 0x%04x from the map-server.\n", len, cmd);
+				exit(EXIT_FAILURE);
+			}
+		}
+		if( char_rsize - pos < (size_t)len )
+			break;
+
+		char_parse_packet(p);
+		if( char_fd == -1 )
+			return;
+		pos += len;
+	}
+
+	char_rsize -= pos;
+	memmove(char_rbuf, char_rbuf + pos, char_rsize);
+}
+
+static void char_recv(void)
+{
+	int n;
+
+	if( char_rmax - char_rsize < 0x10000 ) {
+		char_rmax += 0x10000;
+		RECREATE(char_rbuf, uint8, char_rmax);
+	}
+	n = recv(char_fd, (char*)char_rbuf + char_rsize, (int)(char_rmax - char_rsize), 0);
+	if( n <= 0 ) {
+		ShowWarning("Map-server disconnected.\n");
+		closesocket(char_fd);
+		char_fd = -1;
+		char_rsize = 0;
+		return;
+	}
+	char_rsize += n;
+	char_parse();
+}
+
+static bool char_listen_start(void)
+{
+	struct sockaddr_in addr;
+	int yes = 1;
+
+	char_listen = (int)socket(AF_INET, SOCK_STREAM, 0);
+	if( char_listen < 0 ) {
+		ShowError("Failed to create the char-server socket.\n");
+		return false;
+	}
+	setsockopt(char_listen, SOL_SOCKET, SO_REUSEADDR, (char*)&yes, sizeof(yes));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(char_port);
+	if( bind(char_listen, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(char_listen, 4) < 0 ) {
+		ShowError("Failed to listen on port %d for the map-server.\n", char_port);
+		return false;
+	}
+	ShowStatus("Waiting for the map-server on port "CL_WHITE"%d"CL_RESET" (set char_ip/char_port in its map_athena.conf).\n", char_port);
+	return true;
+}
+
+static void char_accept(void)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int fd = (int)accept(char_listen, (struct sockaddr*)&addr, &len);
+
+	if( fd < 0 )
+		return;
+	if( char_fd != -1 ) {
+		ShowWarning("Refused a second map-server connection.\n");
+		closesocket(fd);
+		return;
+	}
+	socket_nodelay(fd);
+	char_fd = fd;
+	char_rsize = 0;
+}
+
+/*==========================================
+ * Simulated clients
+ *------------------------------------------*/
+static void clients_create(unsigned int start)
+{
+	int i, k, n = 0;
+
+	client_count *= copies;
+	CREATE(clients, struct replay_client, client_count);
+	for( k = 0; k < copies; k++ ) {
+		for( i = 0; i < trace_session_count; i++ ) {
+			struct trace_session* ts = &trace_sessions[i];
+			struct replay_client* c;
+
+			if( ts->status == NULL || ts->count == 0 )
+				continue;
+			c = &clients[n++];
+			c->ts = ts;
+			c->account_id = ts->account_id + k * id_stride;
+			c->char_id = ts->char_id + k * id_stride;
+			c->fd = -1;
+			c->start = start + (unsigned int)((ts->start - trace_first) / speed) + k * spread;
+		}
+	}
+}
+
+/// Returns when packet i of c is due, in replay ticks.
+static unsigned int client_due(struct replay_client* c, int i)
+{
+	return c->start + (unsigned int)((c->ts->packets[i].tick - c->ts->start) / speed);
+}
+
+static void client_close(struct replay_client* c)
+{
+	if( c->fd != -1 )
+		closesocket(c->fd);
+	c->fd = -1;
+	c->done = true;
+}
+
+static bool client_connect(struct replay_client* c)
+{
+	struct sockaddr_in addr;
+	int fd = (int)socket(AF_INET, SOCK_STREAM, 0);
+
+	if( fd < 0 ) {
+		ShowError("Failed to create a client socket (too many sessions for the file descriptor limit?).\n");
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = inet_addr(map_ip);
+	addr.sin_port = htons(map_port);
+	if( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ) {
+		ShowError("Failed to connect to the map-server at %s:%d.\n", map_ip, map_port);
+		closesocket(fd);
+		return false;
+	}
+	socket_nodelay(fd);
+	c->fd = fd;
+	return true;
+}
+
+/// Sends packet i of c, with the ids of the copy.
+static void client_send(struct replay_client* c, int i, unsigned int tick)
+{
+	static uint8 buf[UINT16_MAX];
+	struct trace_packet* p = &c->ts->packets[i];
+	int j;
+
+	memcpy(buf, p->data, p->len);
+	if( c->account_id != c->ts->account_id ) {
+		for( j = 0; j < PTRACE_ID_FIELDS; j++ ) {
+			uint16 pos = p->id_pos[j];
+
+			if( pos < 2 || pos + 4 > p->len )
+				continue;
+			if( RBUFL(buf,pos) == c->ts->account_id )
+				WBUFL(buf,pos) = c->account_id;
+			else if( RBUFL(buf,pos) == c->ts->char_id )
+				WBUFL(buf,pos) = c->char_id;
+		}
+	}
+
+	if( !socket_sendall(c->fd, buf, p->len) ) {
+		stats.kicked++;
+		interval_stats.kicked++;
+		client_close(c);
+		return;
+	}
+	histogram_add(&stats.lag, tick - client_due(c, i));
+	histogram_add(&interval_stats.lag, tick - client_due(c, i));
+	stats.packets++;
+	interval_stats.packets++;
+	stats.bytes_out += p->len;
+	interval_stats.bytes_out += p->len;
+	if( c->wait_tick == 0 )
+		c->wait_tick = tick;
+}
+
+static void client_recv(struct replay_client* c, unsigned int tick)
+{
+	static uint8 buf[0x10000];
+	int n = recv(c->fd, (char*)buf, sizeof(buf), 0);
+
+	if( n <= 0 ) {
+		stats.kicked++;
+		interval_stats.kicked++;
+		client_close(c);
+		return;
+	}
+	stats.bytes_in += n;
+	interval_stats.bytes_in += n;
+	if( c->wait_tick ) {
+		histogram_add(&stats.response, tick - c->wait_tick);
+		histogram_add(&interval_stats.response, tick - c->wait_tick);
+		c->wait_tick = 0;
+	}
+}
+
+/// Connects, sends and closes whatever is due. Returns the time until the next event.
+static unsigned int clients_update(unsigned int tick)
+{
+	unsigned int next = 100;
+	int i;
+
+	for( i = 0; i < client_count; i++ ) {
+		struct replay_client* c = &clients[i];
+
+		if( c->done )
+			continue;
+		if( c->fd == -1 ) {
+			if( DIFF_TICK(c->start, tick) > 0 ) {
+				next = min(next, c->start - tick);
+				continue;
+			}
+			if( !client_connect(c) ) {
+				c->done = true;
+				continue;
+			}
+		}
+		while( c->fd != -1 && c->next < c->ts->count && DIFF_TICK(client_due(c, c->next), tick) <= 0 )
+			client_send(c, c->next++, tick);
+		if( c->fd == -1 )
+			continue;
+		if( c->next < c->ts->count )
+			next = min(next, client_due(c, c->next) - tick);
+		else if( DIFF_TICK(c->start + (unsigned int)((c->ts->end - c->ts->start) / speed), tick) <= 0 )
+			client_close(c); // end of the captured session
+	}
+	return next;
+}
+
+/*==========================================
+ * Reports
+ *------------------------------------------*/
+static void report_interval_show(unsigned int elapsed)
+{
+	int i, online = 0;
+
+	for( i = 0; i < client_count; i++ )
+		if( clients[i].fd != -1 )
+			online++;
+	ShowInfo("%d online, %u logins, %u kicked | %.0f packets/s, out %.1f kB/s, in %.1f kB/s | response p50 %ums p99 %ums max %ums | send lag max %ums\n",
+		online, interval_stats.logins, interval_stats.kicked,
+		interval_stats.packets * 1000. / elapsed, interval_stats.bytes_out / 1.024 / elapsed, interval_stats.bytes_in / 1.024 / elapsed,
+		histogram_percentile(&interval_stats.response, 50), histogram_percentile(&interval_stats.response, 99), interval_stats.response.max,
+		interval_stats.lag.max);
+	memset(&interval_stats, 0, sizeof(interval_stats));
+}
+
+static void report_show(unsigned int elapsed)
+{
+	double trace_seconds = (trace_last - trace_first) / 1000. / speed;
+
+	ShowMessage("\n");
+	ShowStatus("Replayed %d sessions in %.1f seconds.\n", client_count, elapsed / 1000.);
+	ShowMessage("Client packets: %u (%.0f/s), %.1f kB out\n", stats.packets, stats.packets * 1000. / elapsed, stats.bytes_out / 1024.);
+	ShowMessage("Server data: %.1f kB (%.1f kB/s)", stats.bytes_in / 1024., stats.bytes_in / 1.024 / elapsed);
+	if( trace_seconds > 0 )
+		ShowMessage(", captured %.1f kB/s for one copy of the trace", trace_sent_bytes / 1024. / trace_seconds);
+	ShowMessage("\n");
+	ShowMessage("Logins: %u, disconnected by the server: %u\n", stats.logins, stats.kicked);
+	histogram_show("Response time (client packet to next server data)", &stats.response);
+	histogram_show("Send lag (if high, the replay tool itself is overloaded)", &stats.lag);
+}
+
+/*==========================================
+ * Main
+ *------------------------------------------*/
+void process_args(int argc, char *argv[])
+{
+	int i;
+
+	for(i = 0; i < argc; i++) {
+		if(strcmp(argv[i], "-trace") == 0) {
+			if(++i < argc)
+				safestrncpy(trace_file, argv[i], sizeof(trace_file));
+		} else if(strcmp(argv[i], "-map_ip") == 0) {
+			if(++i < argc)
+				safestrncpy(map_ip, argv[i], sizeof(map_ip));
+		} else if(strcmp(argv[i], "-map_port") == 0) {
+			if(++i < argc)
+				map_port = (uint16)atoi(argv[i]);
+		} else if(strcmp(argv[i], "-char_port") == 0) {
+			if(++i < argc)
+				char_port = (uint16)atoi(argv[i]);
+		} else if(strcmp(argv[i], "-copies") == 0) {
+			if(++i < argc)
+				copies = max(1, atoi(argv[i]));
+		} else if(strcmp(argv[i], "-speed") == 0) {
+			if(++i < argc)
+				speed = atof(argv[i]);
+		} else if(strcmp(argv[i], "-spread") == 0) {
+			if(++i < argc)
+				spread = max(0, atoi(argv[i]));
+		} else if(strcmp(argv[i], "-stride") == 0) {
+			if(++i < argc)
+				id_stride = (uint32)atoi(argv[i]);
+		} else if(strcmp(argv[i], "-report") == 0) {
+			if(++i < argc)
+				report_interval = max(1, atoi(argv[i]));
+		}
+	}
+	if( speed <= 0 )
+		speed = 1.0;
+}
+
+int do_init(int argc, char** argv)
+{
+	struct pollfd* fds;
+	int* fds_client; // client index of each entry of fds, -1 for the char-server sockets
+	unsigned int start, tick, last_report, done_tick = 0;
+	int i;
+#ifdef _WIN32
+	WSADATA wsa;
+
+	WSAStartup(MAKEWORD(2,2), &wsa);
+#endif
+
+	process_args(argc, argv);
+
+	if( !trace_load(trace_file) || !char_listen_start() )
+		exit(EXIT_FAILURE);
+
+	// Wait for the map-server to log in
+	while( !map_ready ) {
+		struct pollfd pfd[2];
+		int n = 1;
+
+		pfd[0].fd = char_listen;
+		pfd[0].events = POLLIN;
+		if( char_fd != -1 ) {
+			pfd[n].fd = char_fd;
+			pfd[n++].events = POLLIN;
+		}
+		if( poll(pfd, n, 1000) <= 0 )
+			continue;
+		if( pfd[0].revents & POLLIN )
+			char_accept();
+		else if( n > 1 && pfd[1].revents )
+			char_recv();
+	}
+
+	start = replay_tick() + 1000;
+	clients_create(start);
+	ShowStatus("Replaying "CL_WHITE"%d"CL_RESET" sessions (%d copies) at %.2fx speed.\n", client_count, copies, speed);
+
+	CREATE(fds, struct pollfd, client_count + 2);
+	CREATE(fds_client, int, client_count + 2);
+	last_report = start;
+	for(;;) {
+		unsigned int timeout;
+		int n = 0, active = 0;
+
+		tick = replay_tick();
+		timeout = clients_update(tick);
+
+		for( i = 0; i < client_count; i++ ) {
+			if( !clients[i].done )
+				active++;
+		}
+		if( active == 0 ) {
+			if( done_tick == 0 )
+				done_tick = tick;
+			else if( DIFF_TICK(tick, done_tick) > 2000 ) // let the map-server save the characters
+				break;
+		}
+
+		if( DIFF_TICK(tick, last_report) >= report_interval * 1000 ) {
+			report_interval_show(tick - last_report);
+			last_report = tick;
+		}
+
+		fds_client[n] = -1;
+		fds[n].fd = char_listen;
+		fds[n++].events = POLLIN;
+		if( char_fd != -1 ) {
+			fds_client[n] = -1;
+			fds[n].fd = char_fd;
+			fds[n++].events = POLLIN;
+		}
+		for( i = 0; i < client_count; i++ ) {
+			if( clients[i].fd == -1 )
+				continue;
+			fds_client[n] = i;
+			fds[n].fd = clients[i].fd;
+			fds[n++].events = POLLIN;
+		}
+		if( poll(fds, n, (int)timeout) <= 0 )
+			continue;
+
+		tick = replay_tick();
+		for( i = 0; i < n; i++ ) {
+			if( !fds[i].revents )
+				continue;
+			if( fds_client[i] != -1 ) {
+				if( clients[fds_client[i]].fd == fds[i].fd )
+					client_recv(&clients[fds_client[i]], tick);
+			} else if( fds[i].fd == char_listen )
+				char_accept();
+			else if( fds[i].fd == char_fd )
+				char_recv();
+		}
+	}
+	aFree(fds);
+	aFree(fds_client);
+
+	report_show(tick - start);
+	return 0;
+}
+
+void do_final(void)
+{
+	int i, j;
+
+	for( i = 0; i < trace_session_count; i++ ) {
+		struct trace_session* ts = &trace_sessions[i];
+
+		for( j = 0; j < ts->count; j++ )
+			aFree(ts->packets[j].data);
+		if( ts->packets )
+			aFree(ts->packets);
+		if( ts->status )
+			aFree(ts->status);
+		for( j = 0; j < ARRAYLENGTH(ts->storage); j++ )
+			if( ts->storage[j] )
+				aFree(ts->storage[j]);
+	}
+	if( trace_sessions )
+		aFree(trace_sessions);
+	if( clients )
+		aFree(clients);
+	if( char_rbuf )
+		aFree(char_rbuf);
+	if( char_fd != -1 )
+		closesocket(char_fd);
+	if( char_listen != -1 )
+		closesocket(char_listen);
+}